@@ -19,26 +19,55 @@
  * stat, unlink, rename, gethostname, getuid, time
  */
 
+#define _GNU_SOURCE
+
+#include <ctype.h>
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <locale.h>
+#include <linux/magic.h>
+#include <linux/perf_event.h>
+#include <poll.h>
+#include <pthread.h>
 #include <pwd.h>
+#include <sched.h>
 #include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/utsname.h>
+#include <sys/vfs.h>
 #include <sys/wait.h>
+#include <termios.h>
 #include <time.h>
 #include <unistd.h>
 #include <utime.h>
+#include <wchar.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
 
 #define MAX_ARGS 64
 #define MAX_LINE 1024
-#define MAX_JOBS 50
 #define MAX_HISTORY 100
+#define MAX_EVENT_SOURCES 16
 
 // ANSI Color codes for enhanced UI
 #define COLOR_RESET "\033[0m"
@@ -51,123 +80,613 @@
 #define COLOR_WHITE "\033[1;37m"
 #define COLOR_BOLD "\033[1m"
 
-// Structure to store background jobs
+// Job and process states
+#define JOB_RUNNING 0
+#define JOB_STOPPED 1
+#define JOB_DONE 2
+
+#define MAX_STAGES 16
+
+// Compressed input formats recognized by the file built-ins
+#define COMPRESS_NONE 0
+#define COMPRESS_GZIP 1
+#define COMPRESS_ZSTD 2
+#define PERF_MAX_EVENTS 10
+
+// Per-command resource controls set by the `run` prefix and applied in the
+// child between fork and exec
+typedef struct {
+  int has_cpus;
+  cpu_set_t cpus;
+  int has_nice;
+  int nice;
+  int has_ionice;
+  int ioclass;
+  int iolevel;
+  rlim_t mem;      // RLIMIT_AS (and memory.max with --cgroup), 0 = unset
+  rlim_t cpu_time; // RLIMIT_CPU seconds, 0 = unset
+  rlim_t nofile;   // RLIMIT_NOFILE, 0 = unset
+  int use_cgroup;
+  char cpu_max[64]; // cgroup cpu.max value, e.g. "50000 100000"
+  char cgroup_path[PATH_MAX];
+  char desc[128]; // summary shown by `jobs`
+} ExecLimits;
+
+// perf_event_open counters attached to one process (`perfstat` prefix)
+typedef struct {
+  int count;
+  int fds[PERF_MAX_EVENTS];
+  int events[PERF_MAX_EVENTS]; // index into perf_events[]
+} PerfCounters;
+
+// One process of a job's pipeline
 typedef struct {
-  int job_id;
   pid_t pid;
+  int state;
+  int status; // wait status once done
+  struct rusage usage;
+  char name[32]; // argv[0], for per-stage reports
+  PerfCounters perf;
+} JobProcess;
+
+// A `timeout` deadline. The first expiry sends the chosen signal to the
+// job; with -k a second expiry after the grace period sends SIGKILL
+typedef struct {
+  int fd;
+  int slot;
+  int signo;
+  double grace;
+  int fired;
+  int killed;
+} TimeoutState;
+
+// Structure to store jobs (one per launched pipeline). Slots live in a
+// growable array indexed by job_id - 1; free slots are chained through
+// next_free so ids are recycled without shifting, and background jobs that
+// finish or stop are queued on next_done until the prompt reports them.
+typedef struct {
+  int job_id; // 0 while the slot is free
+  pid_t pgid;
+  int state;
+  int status; // wait status of the last stage once done
+  int foreground;
+  int queued; // currently on the notification queue
+  int silent; // already reported (by wait/jobs); free without printing
+  int managed; // reaped and freed by a built-in (e.g. parallel), never queued
+  int waited;  // collected by `wait`, so its status is not remembered
+  TimeoutState *timeout; // deadline kept armed after the job stopped
+  int timed;   // print a resource report when done (`time` prefix)
+  int perf;    // print hardware counters when done (`perfstat` prefix)
+  struct timespec start_time;
+  struct timespec end_time;
+  char limits[128];      // `run` attributes, empty if none
+  char cgroup_path[PATH_MAX]; // cgroup created for the job, removed when freed
+  unsigned long sequence; // start/stop order, used for %+ and %-
+  int nprocs;
+  JobProcess *procs;
+  struct termios tmodes; // terminal modes saved when the job stopped
+  int has_tmodes;
   char command[256];
-} BackgroundJob;
-
-BackgroundJob bg_jobs[MAX_JOBS];
+  int next_free;
+  int next_done;
+} Job;
+
+Job *job_table = NULL;
+int job_capacity = 0;
+int job_slots_used = 0;
+int job_free_head = -1;
+int job_done_head = -1;
+int job_done_tail = -1;
 int job_count = 0;
+unsigned long job_sequence = 0;
+
+// pid -> job slot map (open addressing, linear probing)
+typedef struct {
+  pid_t pid; // 0 marks an empty bucket
+  int slot;
+} PidMapEntry;
+
+PidMapEntry *pid_map = NULL;
+int pid_map_capacity = 0;
+int pid_map_count = 0;
+
+// One stage of a parsed pipeline
+typedef struct {
+  char **argv; // NULL-terminated, grown as words (and glob matches) arrive
+  int argc;
+  int capacity;
+  char *in_file;
+  char *out_file;
+  int append;
+} Command;
+
+// Bump allocator for short-lived strings, released all at once
+typedef struct ArenaBlock {
+  struct ArenaBlock *next;
+  size_t used;
+  size_t size;
+  char data[];
+} ArenaBlock;
+
+typedef struct {
+  ArenaBlock *head;
+} Arena;
+
+// Line-offset index sidecar: a header naming the file version it describes,
+// then the byte offset of every stride-th line (lines 1, 1+stride, ...)
+typedef struct {
+  char magic[8];
+  uint64_t dev;
+  uint64_t ino;
+  uint64_t size;
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+  uint64_t lines;   // lines in the file
+  uint64_t stride;
+  uint64_t samples; // offsets that follow
+} LineIndexHeader;
+
+typedef struct {
+  void *map;
+  size_t map_size;
+  const LineIndexHeader *header;
+  const uint64_t *offsets;
+} LineIndex;
+
+// A directory's entries with their metadata, from the session cache when
+// it is on (see METADATA CACHE)
+typedef struct {
+  const char *name;
+  struct stat st; // lstat of the entry
+  mode_t mode;    // stat of the entry: the target's for a symlink, 0 if
+  off_t size;     // the link dangles
+} DirEntryInfo;
+
+typedef struct DirListing {
+  dev_t dev;
+  ino_t ino;
+  struct timespec mtime; // the directory's, when it was read
+  struct timespec ctime;
+  DirEntryInfo *entries;
+  int count;
+  char *names;  // read_dir_entries buffer the names point into
+  size_t bytes; // charged against the cache's memory cap
+  int wd;       // inotify watch while cached, else -1
+  int pins;     // callers between dir_list and dir_release
+  int stale;    // dropped from the cache while pinned
+  struct DirListing *lru_prev, *lru_next, *hash_next, *wd_next;
+} DirListing;
+
+// Compiled control flow (see CONTROL FLOW) and shell functions
+typedef struct Code Code;
+typedef struct Function Function;
+
+// A parsed pipeline: cmd1 | cmd2 | ... [&]
+typedef struct {
+  Command stages[MAX_STAGES];
+  int count;
+  int background;
+  int in_fd;  // stdin of the first stage
+  int out_fd; // stdout of the last stage
+  ExecLimits *limits; // set by the `run` prefix, NULL otherwise
+  int timed;          // set by the `time` prefix
+  int perf;           // set by the `perfstat` prefix
+  Arena strings;      // glob matches referenced from the stages' argv
+  char text[256];
+} Pipeline;
+
+// Result of $((...)) and calc: integers stay integers (64-bit, truncating
+// division) until a float is involved, then evaluation continues in double
+typedef struct {
+  int is_float;
+  long long i;
+  double f;
+} ArithValue;
+
+// Built-in dispatch table entry
+typedef struct {
+  const char *name;
+  int (*fn)(char **args);
+} Builtin;
+
+// Terminal / job control state
+int shell_interactive = 0;
+int shell_terminal = STDIN_FILENO;
+pid_t shell_pgid = 0;
+pid_t shell_pid = 0;
+struct termios shell_tmodes;
+volatile sig_atomic_t sigint_received = 0;
+int last_exit_status = 0;
+int substitution_status = -1; // of the last $(...), -1 if none ran
+int prompt_continuation = 0; // "> " while an if/while/... is open
+
+// Commands slower than this (seconds) get a timing report; 0 = off
+double time_auto_threshold = 0;
+
+// Latency phases tracked by `stats`
+enum { STAT_PARSE, STAT_DISPATCH, STAT_SPAWN, STAT_RUN, STAT_WAIT, STAT_PHASES };
+
+// Children of a `perfstat` pipeline block on this pipe until the shell has
+// attached their counters, so nothing before exec is missed
+int perf_gate[2] = {-1, -1};
+
+// Event loop: the main loop polls these fds together with stdin so child
+// reaping (and later timers) never runs inside a signal handler.
+typedef void (*EventHandler)(int fd, void *data);
+
+typedef struct {
+  int fd;
+  EventHandler handler;
+  void *data;
+} EventSource;
+
+EventSource event_sources[MAX_EVENT_SOURCES];
+int event_source_count = 0;
+
+// SIGCHLD is blocked and delivered through this signalfd
+int sigchld_fd = -1;
+sigset_t shell_orig_mask;
 
 // Command history
 char history[MAX_HISTORY][MAX_LINE];
 int history_count = 0;
 
 // Function declarations
-void execute_command(char **args);
-int handle_builtin(char **args);
-void handle_io_redirection(char **args);
-void handle_pipe(char **args);
-int check_background(char **args);
-void add_background_job(pid_t pid, char *cmd);
-void signal_handler(int signo);
+void init_shell();
+void sigint_handler(int signo);
+int execute_command(char **args);
+Builtin *find_builtin(const char *name);
+int parse_pipeline(char **args, Pipeline *pipeline);
+int parse_expanded_pipeline(char **args, Pipeline *pipeline);
+void free_pipeline(Pipeline *pipeline);
+int run_builtin_in_shell(Pipeline *pipeline, Builtin *builtin,
+                         long long dispatch_start);
+char *arena_strndup(Arena *arena, const char *s, size_t n);
+void arena_free(Arena *arena);
+void arena_reset(Arena *arena);
+int expand_arg(Command *cmd, char *word, Arena *arena);
+int has_glob_chars(const char *word);
+int glob_expand(const char *pattern, Command *cmd, Arena *arena);
+void glob_cache_clear();
+void env_init();
+char **env_envp();
+const char *var_get(const char *name);
+char *expand_word(char *word, Arena *arena);
+int is_assignment(const char *word);
+int assign_variables(char **args);
+int split_line(char *line, char **args, int max);
+int word_needs_splitting(const char *word);
+int arith_eval(const char *expr, ArithValue *out);
+void arith_format(ArithValue v, char *buf, size_t size);
+Function *find_function(const char *name);
+int call_function(Function *fn, char **argv);
+int run_function_in_shell(Pipeline *pipeline, Function *fn);
+int run_script(const char *text, int *incomplete);
+char *expand_substitution(const char *open, const char **end, Arena *arena);
+char *read_dir_entries(int dirfd, size_t *len);
+DirListing *dir_list(const char *path);
+void dir_release(DirListing *dir);
+int dircache_enabled(void);
+int launch_pipeline(Pipeline *pipeline);
+int start_pipeline(Pipeline *pipeline, int foreground);
+int apply_redirections(Command *cmd);
+int create_job(const char *command, int foreground);
+void add_job_process(int slot, pid_t pid);
+void free_job(int slot);
+int wait_for_job(int slot);
+int put_job_in_foreground(int slot, int cont);
+void put_job_in_background(int slot, int cont);
+int find_job(const char *spec);
+int job_signal(Job *job, int signo);
+int job_exit_code(int status);
+int parse_signal(const char *name);
+int parse_run_options(char **args, ExecLimits *limits);
+int apply_exec_limits(ExecLimits *limits);
+int create_job_cgroup(ExecLimits *limits, int job_id);
+int write_cgroup_file(const char *dir, const char *file, const char *value);
+double timespec_diff(struct timespec *start, struct timespec *end);
+void timerfd_arm(int fd, double seconds, int periodic);
+int parse_duration(const char *s, double *seconds);
+int parse_positive(const char *s, long long *value);
+void rusage_delta(struct rusage *out, struct rusage *after,
+                  struct rusage *before);
+void add_rusage_delta(struct rusage *out, struct rusage *after,
+                      struct rusage *before);
+void report_job_timing(Job *job);
+long long monotonic_ns();
+void stats_phase(int phase, long long ns);
+void stats_command(const char *name, int exit_code, long long ns);
+void stats_record_job(Job *job);
+void stats_export_stop();
+int perf_open(PerfCounters *pc, pid_t pid);
+void perf_close(PerfCounters *pc);
+void report_job_perf(Job *job);
+void print_perf_report(const char *command, double wall, JobProcess *procs,
+                       int nprocs);
+void print_timing_report(const char *command, double wall, JobProcess *procs,
+                         int nprocs);
+void reap_children();
+void notify_done_jobs();
+void setup_child_signals();
+void handle_sigchld_event(int fd, void *data);
 void add_to_history(char *cmd);
+FILE *open_input_file(char *path, const char *usage);
+int close_input_file(FILE *fp);
+int map_input(int fd, struct stat *st, const char **data);
+int compression_format(int fd);
+int compression_supported(int format);
+FILE *open_decompressed(int fd, int format);
+int write_range(const char *data, size_t from, size_t to);
+uint64_t count_newlines(const char *p, size_t n);
+size_t skip_lines(const char *data, size_t end, size_t pos, uint64_t *count);
+int line_index_open(const struct stat *st, LineIndex *index);
+void line_index_close(LineIndex *index);
+size_t line_index_offset(const LineIndex *index, const char *data,
+                         size_t size, uint64_t line);
+uint64_t line_index_line_of(const LineIndex *index, const char *data,
+                            size_t pos);
 void print_banner();
 void print_prompt();
+void prompt_init();
+void prompt_invalidate_cwd();
+size_t prompt_render(char *buf, size_t size);
+int line_edit(char *line, size_t size);
+int read_input_line(char *line, size_t size);
+
+// Event loop
+int event_add(int fd, EventHandler handler, void *data);
+void event_remove(int fd);
+int event_wait(int watch_fd, int timeout_ms);
 
 // Built-in command implementations
-void cmd_cat(char **args);
-void cmd_cp(char **args);
-void cmd_mv(char **args);
-void cmd_rm(char **args);
-void cmd_touch(char **args);
-void cmd_mkdir(char **args);
-void cmd_rmdir(char **args);
-void cmd_ls(char **args);
-void cmd_wc(char **args);
-void cmd_grep(char **args);
-void cmd_head(char **args);
-void cmd_tail(char **args);
-void cmd_whoami(char **args);
-void cmd_hostname(char **args);
-void cmd_uname(char **args);
-void cmd_date(char **args);
-void cmd_clear(char **args);
-void cmd_history(char **args);
-void cmd_env(char **args);
-void cmd_sleep(char **args);
+int cmd_cd(char **args);
+int cmd_pwd(char **args);
+int cmd_echo(char **args);
+int cmd_cat(char **args);
+int cmd_cp(char **args);
+int cmd_mv(char **args);
+int cmd_rm(char **args);
+int cmd_touch(char **args);
+int cmd_mkdir(char **args);
+int cmd_rmdir(char **args);
+int cmd_ls(char **args);
+int cmd_wc(char **args);
+int cmd_grep(char **args);
+int cmd_head(char **args);
+int cmd_tail(char **args);
+int cmd_whoami(char **args);
+int cmd_hostname(char **args);
+int cmd_uname(char **args);
+int cmd_date(char **args);
+int cmd_clear(char **args);
+int cmd_history(char **args);
+int cmd_env(char **args);
+int cmd_export(char **args);
+int cmd_unset(char **args);
+int cmd_sleep(char **args);
+int cmd_jobs(char **args);
+int cmd_fg(char **args);
+int cmd_bg(char **args);
+int cmd_wait(char **args);
+int cmd_kill(char **args);
+int cmd_parallel(char **args);
+int cmd_run(char **args);
+int cmd_time(char **args);
+int cmd_perfstat(char **args);
+int cmd_stats(char **args);
+int cmd_prompt(char **args);
+int cmd_test(char **args);
+int cmd_true(char **args);
+int cmd_false(char **args);
+int cmd_watch(char **args);
+int cmd_timeout(char **args);
+int cmd_sort(char **args);
+int cmd_count(char **args);
+int cmd_uniq(char **args);
+int cmd_cut(char **args);
+int cmd_index(char **args);
+int cmd_lines(char **args);
+int cmd_checksum(char **args);
+int cmd_tee(char **args);
+int cmd_du(char **args);
+int cmd_dircache(char **args);
+int cmd_updateindex(char **args);
+int cmd_locate(char **args);
+int cmd_help(char **args);
+int cmd_exit(char **args);
 
 // Custom commands (unique to our shell)
-void cmd_sysinfo(char **args);
-void cmd_tree(char **args);
-void cmd_calc(char **args);
-void cmd_reverse(char **args);
-void cmd_colortest(char **args);
+int cmd_sysinfo(char **args);
+int cmd_tree(char **args);
+int cmd_calc(char **args);
+int cmd_reverse(char **args);
+int cmd_colortest(char **args);
+
+// Built-in dispatch table
+Builtin builtins[] = {
+    {"cd", cmd_cd},
+    {"pwd", cmd_pwd},
+    {"echo", cmd_echo},
+    {"cat", cmd_cat},
+    {"cp", cmd_cp},
+    {"mv", cmd_mv},
+    {"rm", cmd_rm},
+    {"touch", cmd_touch},
+    {"mkdir", cmd_mkdir},
+    {"rmdir", cmd_rmdir},
+    {"ls", cmd_ls},
+    {"wc", cmd_wc},
+    {"grep", cmd_grep},
+    {"head", cmd_head},
+    {"tail", cmd_tail},
+    {"whoami", cmd_whoami},
+    {"hostname", cmd_hostname},
+    {"uname", cmd_uname},
+    {"date", cmd_date},
+    {"clear", cmd_clear},
+    {"history", cmd_history},
+    {"env", cmd_env},
+    {"export", cmd_export},
+    {"unset", cmd_unset},
+    {"sleep", cmd_sleep},
+    {"jobs", cmd_jobs},
+    {"fg", cmd_fg},
+    {"bg", cmd_bg},
+    {"wait", cmd_wait},
+    {"kill", cmd_kill},
+    {"parallel", cmd_parallel},
+    {"run", cmd_run},
+    {"time", cmd_time},
+    {"perfstat", cmd_perfstat},
+    {"stats", cmd_stats},
+    {"prompt", cmd_prompt},
+    {"test", cmd_test},
+    {"[", cmd_test},
+    {"true", cmd_true},
+    {"false", cmd_false},
+    {"watch", cmd_watch},
+    {"timeout", cmd_timeout},
+    {"sort", cmd_sort},
+    {"count", cmd_count},
+    {"uniq", cmd_uniq},
+    {"cut", cmd_cut},
+    {"index", cmd_index},
+    {"lines", cmd_lines},
+    {"checksum", cmd_checksum},
+    {"tee", cmd_tee},
+    {"du", cmd_du},
+    {"dircache", cmd_dircache},
+    {"updateindex", cmd_updateindex},
+    {"locate", cmd_locate},
+    {"help", cmd_help},
+    {"sysinfo", cmd_sysinfo},
+    {"tree", cmd_tree},
+    {"calc", cmd_calc},
+    {"reverse", cmd_reverse},
+    {"colortest", cmd_colortest},
+    {"exit", cmd_exit},
+    {NULL, NULL}};
 
 int main() {
   char input[MAX_LINE];
-  char *args[MAX_ARGS];
-
-  // Setup signal handler for background jobs
-  signal(SIGCHLD, signal_handler);
+  char *script = NULL; // lines of a construct still being typed
+  size_t script_len = 0;
 
+  init_shell();
   print_banner();
 
   while (1) {
+    reap_children();
+    notify_done_jobs();
     print_prompt();
 
     // Read input
-    if (fgets(input, MAX_LINE, stdin) == NULL) {
+    if (!read_input_line(input, MAX_LINE)) {
       break;
     }
 
     // Remove newline
     input[strcspn(input, "\n")] = 0;
 
+    // Ctrl-C abandons a construct that is still open
+    if (sigint_received) {
+      sigint_received = 0;
+      script_len = 0;
+      prompt_continuation = 0;
+      continue;
+    }
+
     // Skip empty input
-    if (strlen(input) == 0) {
+    if (strlen(input) == 0 && script_len == 0) {
       continue;
     }
 
     // Add to history
     add_to_history(input);
 
-    // Parse input into arguments
-    int i = 0;
-    char *token = strtok(input, " ");
-    while (token != NULL && i < MAX_ARGS - 1) {
-      args[i++] = token;
-      token = strtok(NULL, " ");
-    }
-    args[i] = NULL;
-
-    // Check for built-in commands first
-    if (handle_builtin(args)) {
+    // Collect lines until if/while/for/functions are closed, then compile
+    // and run them
+    size_t input_len = strlen(input);
+    char *grown = realloc(script, script_len + input_len + 2);
+    if (grown == NULL) {
       continue;
     }
-
-    // Check if command has pipe
-    int has_pipe = 0;
-    for (int j = 0; args[j] != NULL; j++) {
-      if (strcmp(args[j], "|") == 0) {
-        has_pipe = 1;
-        break;
-      }
-    }
-
-    if (has_pipe) {
-      handle_pipe(args);
-    } else {
-      execute_command(args);
+    script = grown;
+    memcpy(script + script_len, input, input_len);
+    script_len += input_len;
+    script[script_len++] = '\n';
+    script[script_len] = '\0';
+
+    int incomplete;
+    int status = run_script(script, &incomplete);
+    prompt_continuation = incomplete;
+    if (!incomplete) {
+      last_exit_status = status;
+      script_len = 0;
     }
   }
+  if (script_len > 0) {
+    printf("%sError: unexpected end of input%s\n", COLOR_RED, COLOR_RESET);
+  }
+  free(script);
 
   printf("\n%sShell exiting... Goodbye!%s\n", COLOR_CYAN, COLOR_RESET);
   return 0;
 }
 
+// Put the shell in its own process group in control of the terminal and
+// route SIGCHLD through a signalfd so jobs are reaped by the main loop
+void init_shell() {
+  shell_terminal = STDIN_FILENO;
+  shell_interactive = isatty(shell_terminal);
+  shell_pid = getpid();
+
+  if (shell_interactive) {
+    // Wait until we are in the foreground
+    while (tcgetpgrp(shell_terminal) != (shell_pgid = getpgrp())) {
+      kill(-shell_pgid, SIGTTIN);
+    }
+
+    // Ctrl-C only interrupts what the shell is waiting on; job control
+    // stop signals are left to the children
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = sigint_handler;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    signal(SIGQUIT, SIG_IGN);
+    signal(SIGTSTP, SIG_IGN);
+    signal(SIGTTIN, SIG_IGN);
+    signal(SIGTTOU, SIG_IGN);
+
+    shell_pgid = getpid();
+    setpgid(shell_pgid, shell_pgid);
+    shell_pgid = getpgrp();
+    tcsetpgrp(shell_terminal, shell_pgid);
+    tcgetattr(shell_terminal, &shell_tmodes);
+
+    // The line editor decodes multibyte input to place the cursor
+    setlocale(LC_CTYPE, "");
+  }
+
+  sigset_t chld_mask;
+  sigemptyset(&chld_mask);
+  sigaddset(&chld_mask, SIGCHLD);
+  sigprocmask(SIG_BLOCK, &chld_mask, &shell_orig_mask);
+  sigchld_fd = signalfd(-1, &chld_mask, SFD_NONBLOCK | SFD_CLOEXEC);
+  if (sigchld_fd >= 0) {
+    event_add(sigchld_fd, handle_sigchld_event, NULL);
+  }
+
+  env_init();
+  prompt_init();
+}
+
+void sigint_handler(int signo) {
+  (void)signo;
+  sigint_received = 1;
+}
+
 void print_banner() {
   printf("%s", COLOR_CYAN);
   printf("╔════════════════════════════════════════════════════════════╗\n");
@@ -193,403 +712,693 @@ void print_banner() {
   printf("%s\n", COLOR_RESET);
 }
 
-void print_prompt() {
-  char cwd[1024];
-  getcwd(cwd, sizeof(cwd));
-
-  // Get just the directory name (not full path)
-  char *dir_name = strrchr(cwd, '/');
-  if (dir_name == NULL) {
-    dir_name = strrchr(cwd, '\\');
-  }
-  if (dir_name != NULL) {
-    dir_name++;
-  } else {
-    dir_name = cwd;
-  }
+// Prompt format, compiled once by prompt_compile into a segment list.
+// Escapes follow bash's PS1: \u user, \h host, \w cwd (~ for $HOME),
+// \W basename, \$ (# for root), \j job count, \n, \e, \\, plus \? for the
+// last exit status. \[ and \] are accepted and ignored.
+#define DEFAULT_PROMPT                                                         \
+  "\\e[1;34m[\\e[1mMyShell\\e[1;34m]\\e[0m \\e[1;32m\\W\\e[0m \\e[1;36m➜\\e[0m "
+#define MAX_PROMPT_SEGMENTS 64
+
+enum {
+  SEG_TEXT,
+  SEG_USER,
+  SEG_HOST,
+  SEG_CWD,
+  SEG_BASENAME,
+  SEG_DOLLAR,
+  SEG_JOBS,
+  SEG_STATUS
+};
 
-  printf("%s[%sMyShell%s]%s %s%s%s %s➜%s ", COLOR_BLUE, COLOR_BOLD, COLOR_BLUE,
-         COLOR_RESET, COLOR_GREEN, dir_name, COLOR_RESET, COLOR_CYAN,
-         COLOR_RESET);
-  fflush(stdout);
+typedef struct {
+  int type;
+  int offset; // SEG_TEXT: slice of prompt_text
+  int len;
+} PromptSegment;
+
+char prompt_format[512] = DEFAULT_PROMPT;
+char prompt_text[512]; // literal bytes of the compiled format
+PromptSegment prompt_segments[MAX_PROMPT_SEGMENTS];
+int prompt_segment_count = 0;
+
+// Cached state, refreshed only when invalidated (cd) or first used
+char prompt_cwd[4096];
+size_t prompt_cwd_len = 0;
+const char *prompt_basename = "";
+int prompt_cwd_valid = 0;
+char prompt_user[64] = "";
+char prompt_host[256] = "";
+char prompt_home[4096] = "";
+
+void prompt_invalidate_cwd() {
+  prompt_cwd_valid = 0;
 }
 
-void add_to_history(char *cmd) {
-  if (history_count < MAX_HISTORY) {
-    strncpy(history[history_count], cmd, MAX_LINE - 1);
-    history[history_count][MAX_LINE - 1] = '\0';
-    history_count++;
-  } else {
-    // Shift history and add new command
-    for (int i = 0; i < MAX_HISTORY - 1; i++) {
-      strcpy(history[i], history[i + 1]);
+void prompt_add_segment(int type, int offset, int len) {
+  if (type == SEG_TEXT && prompt_segment_count > 0) {
+    PromptSegment *last = &prompt_segments[prompt_segment_count - 1];
+    if (last->type == SEG_TEXT && last->offset + last->len == offset) {
+      last->len += len; // merge adjacent literals
+      return;
     }
-    strncpy(history[MAX_HISTORY - 1], cmd, MAX_LINE - 1);
-    history[MAX_HISTORY - 1][MAX_LINE - 1] = '\0';
   }
-}
-
-// Handle built-in commands
-int handle_builtin(char **args) {
-  if (args[0] == NULL) {
-    return 1;
+  if (prompt_segment_count < MAX_PROMPT_SEGMENTS) {
+    prompt_segments[prompt_segment_count].type = type;
+    prompt_segments[prompt_segment_count].offset = offset;
+    prompt_segments[prompt_segment_count].len = len;
+    prompt_segment_count++;
   }
+}
 
-  // 1. cd command
-  if (strcmp(args[0], "cd") == 0) {
-    if (args[1] == NULL) {
-      chdir(getenv("HOME"));
-    } else {
-      if (chdir(args[1]) != 0) {
-        printf("%sError: %s%s\n", COLOR_RED, strerror(errno), COLOR_RESET);
+void prompt_compile(const char *format) {
+  int text_len = 0;
+
+  snprintf(prompt_format, sizeof(prompt_format), "%s", format);
+  prompt_segment_count = 0;
+
+  for (const char *p = prompt_format; *p != '\0'; p++) {
+    int type = SEG_TEXT;
+    char c = *p;
+
+    if (*p == '\\' && p[1] != '\0') {
+      p++;
+      switch (*p) {
+      case 'u': type = SEG_USER; break;
+      case 'h': type = SEG_HOST; break;
+      case 'w': type = SEG_CWD; break;
+      case 'W': type = SEG_BASENAME; break;
+      case '$': type = SEG_DOLLAR; break;
+      case 'j': type = SEG_JOBS; break;
+      case '?': type = SEG_STATUS; break;
+      case 'n': c = '\n'; break;
+      case 'e': c = '\033'; break;
+      case '[':
+      case ']': continue;
+      default: c = *p; break;
       }
     }
-    return 1;
-  }
-
-  // 2. pwd command
-  if (strcmp(args[0], "pwd") == 0) {
-    char cwd[1024];
-    if (getcwd(cwd, sizeof(cwd)) != NULL) {
-      printf("%s%s%s\n", COLOR_GREEN, cwd, COLOR_RESET);
-    } else {
-      printf("%sError: %s%s\n", COLOR_RED, strerror(errno), COLOR_RESET);
-    }
-    return 1;
-  }
 
-  // 3. echo command
-  if (strcmp(args[0], "echo") == 0) {
-    for (int i = 1; args[i] != NULL; i++) {
-      printf("%s", args[i]);
-      if (args[i + 1] != NULL) {
-        printf(" ");
-      }
+    if (type != SEG_TEXT) {
+      prompt_add_segment(type, 0, 0);
+    } else if (text_len < (int)sizeof(prompt_text)) {
+      prompt_text[text_len] = c;
+      prompt_add_segment(SEG_TEXT, text_len, 1);
+      text_len++;
     }
-    printf("\n");
-    return 1;
-  }
-
-  // 4. cat command
-  if (strcmp(args[0], "cat") == 0) {
-    cmd_cat(args);
-    return 1;
-  }
-
-  // 5. cp command
-  if (strcmp(args[0], "cp") == 0) {
-    cmd_cp(args);
-    return 1;
   }
+}
 
-  // 6. mv command
-  if (strcmp(args[0], "mv") == 0) {
-    cmd_mv(args);
-    return 1;
+void prompt_refresh_cwd() {
+  if (getcwd(prompt_cwd, sizeof(prompt_cwd)) == NULL) {
+    strcpy(prompt_cwd, "?");
   }
+  prompt_cwd_len = strlen(prompt_cwd);
 
-  // 7. rm command
-  if (strcmp(args[0], "rm") == 0) {
-    cmd_rm(args);
-    return 1;
-  }
+  const char *slash = strrchr(prompt_cwd, '/');
+  prompt_basename =
+      (slash != NULL && slash[1] != '\0') ? slash + 1 : prompt_cwd;
+  prompt_cwd_valid = 1;
+}
 
-  // 8. touch command
-  if (strcmp(args[0], "touch") == 0) {
-    cmd_touch(args);
-    return 1;
-  }
+void prompt_init() {
+  struct passwd *pw = getpwuid(getuid());
+  const char *home = var_get("HOME");
 
-  // 9. mkdir command
-  if (strcmp(args[0], "mkdir") == 0) {
-    cmd_mkdir(args);
-    return 1;
+  snprintf(prompt_user, sizeof(prompt_user), "%s", pw ? pw->pw_name : "?");
+  if (gethostname(prompt_host, sizeof(prompt_host)) != 0) {
+    strcpy(prompt_host, "?");
   }
+  prompt_host[strcspn(prompt_host, ".")] = '\0';
+  snprintf(prompt_home, sizeof(prompt_home), "%s", home ? home : "");
 
-  // 10. rmdir command
-  if (strcmp(args[0], "rmdir") == 0) {
-    cmd_rmdir(args);
-    return 1;
-  }
+  const char *ps1 = var_get("MYSHELL_PS1");
+  prompt_compile(ps1 != NULL ? ps1 : DEFAULT_PROMPT);
+}
 
-  // 11. ls command
-  if (strcmp(args[0], "ls") == 0) {
-    cmd_ls(args);
-    return 1;
-  }
+// Render the compiled prompt into buf; returns its length
+size_t prompt_render(char *buf, size_t size) {
+  size_t len = 0;
 
-  // 12. wc command
-  if (strcmp(args[0], "wc") == 0) {
-    cmd_wc(args);
-    return 1;
+  if (prompt_continuation) {
+    return snprintf(buf, size, "> ");
   }
 
-  // 13. grep command
-  if (strcmp(args[0], "grep") == 0) {
-    cmd_grep(args);
-    return 1;
-  }
+  for (int i = 0; i < prompt_segment_count; i++) {
+    PromptSegment *seg = &prompt_segments[i];
+    const char *str = NULL;
+    size_t n = 0;
+    char num[16];
 
-  // 14. head command
-  if (strcmp(args[0], "head") == 0) {
-    cmd_head(args);
-    return 1;
-  }
+    switch (seg->type) {
+    case SEG_TEXT:
+      str = prompt_text + seg->offset;
+      n = seg->len;
+      break;
+    case SEG_USER:
+      str = prompt_user;
+      break;
+    case SEG_HOST:
+      str = prompt_host;
+      break;
+    case SEG_CWD:
+    case SEG_BASENAME:
+      if (!prompt_cwd_valid) {
+        prompt_refresh_cwd();
+      }
+      if (seg->type == SEG_BASENAME) {
+        str = prompt_basename;
+        break;
+      }
+      size_t home_len = strlen(prompt_home);
+      if (home_len > 1 && strncmp(prompt_cwd, prompt_home, home_len) == 0 &&
+          (prompt_cwd[home_len] == '/' || prompt_cwd[home_len] == '\0')) {
+        if (len < size) {
+          buf[len++] = '~';
+        }
+        str = prompt_cwd + home_len;
+      } else {
+        str = prompt_cwd;
+      }
+      break;
+    case SEG_DOLLAR:
+      str = getuid() == 0 ? "#" : "$";
+      break;
+    case SEG_JOBS:
+      snprintf(num, sizeof(num), "%d", job_count);
+      str = num;
+      break;
+    case SEG_STATUS:
+      snprintf(num, sizeof(num), "%d", last_exit_status);
+      str = num;
+      break;
+    }
 
-  // 15. tail command
-  if (strcmp(args[0], "tail") == 0) {
-    cmd_tail(args);
-    return 1;
+    if (seg->type != SEG_TEXT) {
+      n = strlen(str);
+    }
+    if (n > size - len) {
+      n = size - len;
+    }
+    memcpy(buf + len, str, n);
+    len += n;
   }
+  return len;
+}
 
-  // 16. whoami command
-  if (strcmp(args[0], "whoami") == 0) {
-    cmd_whoami(args);
-    return 1;
-  }
+// Write the prompt in one go. Skipped entirely when input is not a
+// terminal.
+void print_prompt() {
+  char buf[8192];
 
-  // 17. hostname command
-  if (strcmp(args[0], "hostname") == 0) {
-    cmd_hostname(args);
-    return 1;
+  if (!shell_interactive) {
+    return;
   }
-
-  // 18. uname command
-  if (strcmp(args[0], "uname") == 0) {
-    cmd_uname(args);
-    return 1;
+  size_t len = prompt_render(buf, sizeof(buf));
+  fflush(stdout);
+  if (write(STDOUT_FILENO, buf, len) < 0) {
+    return;
   }
+}
 
-  // 19. date command
-  if (strcmp(args[0], "date") == 0) {
-    cmd_date(args);
-    return 1;
-  }
+// prompt [FORMAT...] - show or set the prompt format; prompt --default
+// restores the built-in one
+int cmd_prompt(char **args) {
+  char format[512] = "";
 
-  // 20. clear command
-  if (strcmp(args[0], "clear") == 0) {
-    cmd_clear(args);
-    return 1;
+  if (args[1] == NULL) {
+    printf("%s\n", prompt_format);
+    return 0;
   }
-
-  // 21. history command
-  if (strcmp(args[0], "history") == 0) {
-    cmd_history(args);
-    return 1;
+  if (strcmp(args[1], "--default") == 0) {
+    prompt_compile(DEFAULT_PROMPT);
+    return 0;
   }
 
-  // 22. env command
-  if (strcmp(args[0], "env") == 0) {
-    cmd_env(args);
-    return 1;
+  // Words were split on spaces; join them back
+  for (int i = 1; args[i] != NULL; i++) {
+    size_t used = strlen(format);
+    snprintf(format + used, sizeof(format) - used, "%s%s", i > 1 ? " " : "",
+             args[i]);
   }
+  prompt_compile(format);
+  return 0;
+}
 
-  // 23. sleep command
-  if (strcmp(args[0], "sleep") == 0) {
-    cmd_sleep(args);
-    return 1;
+// Buffered line reader over stdin (terminals get the line editor
+// instead). While no input is available it keeps servicing the event loop,
+// so background jobs are reaped as they finish.
+char input_buf[MAX_LINE * 4];
+size_t input_len = 0;
+size_t input_pos = 0;
+int input_eof = 0;
+
+int read_input_line(char *line, size_t size) {
+  if (shell_interactive) {
+    return line_edit(line, size);
   }
 
-  // 24. jobs command
-  if (strcmp(args[0], "jobs") == 0) {
-    if (job_count == 0) {
-      printf("%sNo background jobs running.%s\n", COLOR_YELLOW, COLOR_RESET);
-    } else {
-      printf("\n%s╔═══ Background Jobs ═══╗%s\n", COLOR_CYAN, COLOR_RESET);
-      for (int i = 0; i < job_count; i++) {
-        printf("%s[%d]%s PID: %s%d%s - %s%s%s\n", COLOR_YELLOW,
-               bg_jobs[i].job_id, COLOR_RESET, COLOR_GREEN, bg_jobs[i].pid,
-               COLOR_RESET, COLOR_WHITE, bg_jobs[i].command, COLOR_RESET);
+  while (1) {
+    size_t avail = input_len - input_pos;
+    char *start = input_buf + input_pos;
+    char *nl = memchr(start, '\n', avail);
+
+    if (nl != NULL || avail >= size - 1 || (input_eof && avail > 0)) {
+      size_t n = nl != NULL ? (size_t)(nl - start) : avail;
+      if (n > size - 1) {
+        n = size - 1;
       }
-      printf("%s╚═══════════════════════╝%s\n\n", COLOR_CYAN, COLOR_RESET);
+      memcpy(line, start, n);
+      line[n] = '\0';
+      input_pos += (nl != NULL && n == (size_t)(nl - start)) ? n + 1 : n;
+      return 1;
     }
-    return 1;
-  }
-
-  // 25. help command
-  if (strcmp(args[0], "help") == 0) {
-    printf("\n%s╔════════════════════════════════════════════════════════════╗%"
-           "s\n",
-           COLOR_CYAN, COLOR_RESET);
-    printf(
-        "%s║           🎯 ENHANCED SHELL - 40 COMMANDS HELP 🎯          ║%s\n",
-        COLOR_CYAN, COLOR_RESET);
-    printf("%s╚════════════════════════════════════════════════════════════╝%"
-           "s\n\n",
-           COLOR_CYAN, COLOR_RESET);
-
-    printf("%s📁 FILE OPERATIONS:%s\n", COLOR_YELLOW, COLOR_RESET);
-    printf("  %s1.%s  cat [file]         - Display file contents\n",
-           COLOR_GREEN, COLOR_RESET);
-    printf("  %s2.%s  cp [src] [dest]    - Copy files\n", COLOR_GREEN,
-           COLOR_RESET);
-    printf("  %s3.%s  mv [src] [dest]    - Move/rename files\n", COLOR_GREEN,
-           COLOR_RESET);
-    printf("  %s4.%s  rm [file]          - Remove files\n", COLOR_GREEN,
-           COLOR_RESET);
-    printf("  %s5.%s  touch [file]       - Create/update file\n", COLOR_GREEN,
-           COLOR_RESET);
-    printf("  %s6.%s  mkdir [dir]        - Create directory\n", COLOR_GREEN,
-           COLOR_RESET);
-    printf("  %s7.%s  rmdir [dir]        - Remove directory\n", COLOR_GREEN,
-           COLOR_RESET);
-    printf("  %s8.%s  ls [-l]            - List directory contents\n",
-           COLOR_GREEN, COLOR_RESET);
-    printf("  %s9.%s  wc [file]          - Word count\n", COLOR_GREEN,
-           COLOR_RESET);
-    printf("  %s10.%s pwd                - Print working directory\n\n",
-           COLOR_GREEN, COLOR_RESET);
-
-    printf("%s📝 TEXT PROCESSING:%s\n", COLOR_YELLOW, COLOR_RESET);
-    printf("  %s11.%s grep [pattern] [file] - Search text\n", COLOR_GREEN,
-           COLOR_RESET);
-    printf("  %s12.%s head [file]           - Show first 10 lines\n",
-           COLOR_GREEN, COLOR_RESET);
-    printf("  %s13.%s tail [file]           - Show last 10 lines\n",
-           COLOR_GREEN, COLOR_RESET);
-    printf("  %s14.%s echo [text]           - Display text\n\n", COLOR_GREEN,
-           COLOR_RESET);
-
-    printf("%s💻 SYSTEM INFORMATION:%s\n", COLOR_YELLOW, COLOR_RESET);
-    printf("  %s15.%s whoami             - Current user\n", COLOR_GREEN,
-           COLOR_RESET);
-    printf("  %s16.%s hostname           - System hostname\n", COLOR_GREEN,
-           COLOR_RESET);
-    printf("  %s17.%s uname [-a]         - System information\n", COLOR_GREEN,
-           COLOR_RESET);
-    printf("  %s18.%s date               - Current date/time\n", COLOR_GREEN,
-           COLOR_RESET);
-    printf("  %s19.%s env                - Environment variables\n\n",
-           COLOR_GREEN, COLOR_RESET);
 
-    printf("%s⚙️  PROCESS & UTILITIES:%s\n", COLOR_YELLOW, COLOR_RESET);
-    printf("  %s20.%s jobs               - List background jobs\n", COLOR_GREEN,
-           COLOR_RESET);
-    printf("  %s21.%s sleep [seconds]    - Sleep for N seconds\n", COLOR_GREEN,
-           COLOR_RESET);
-    printf("  %s22.%s clear              - Clear screen\n", COLOR_GREEN,
-           COLOR_RESET);
-    printf("  %s23.%s history            - Command history\n", COLOR_GREEN,
-           COLOR_RESET);
-    printf("  %s24.%s cd [dir]           - Change directory\n", COLOR_GREEN,
-           COLOR_RESET);
-    printf("  %s25.%s exit               - Exit shell\n\n", COLOR_GREEN,
-           COLOR_RESET);
+    if (input_eof) {
+      return 0;
+    }
 
-    printf("%s🔧 ADVANCED FEATURES:%s\n", COLOR_YELLOW, COLOR_RESET);
-    printf("  %s26-40.%s External commands (ps, kill, top, etc.)\n",
-           COLOR_GREEN, COLOR_RESET);
-    printf("  %s•%s I/O Redirection:  cmd > file, cmd < file, cmd >> file\n",
-           COLOR_MAGENTA, COLOR_RESET);
-    printf("  %s•%s Piping:           cmd1 | cmd2\n", COLOR_MAGENTA,
-           COLOR_RESET);
-    printf("  %s•%s Background:       command &\n\n", COLOR_MAGENTA,
-           COLOR_RESET);
+    // Compact and refill
+    memmove(input_buf, start, avail);
+    input_len = avail;
+    input_pos = 0;
+
+    if (!event_wait(STDIN_FILENO, -1)) {
+      // Ctrl-C at the prompt abandons the current line
+      if (sigint_received) {
+        sigint_received = 0;
+        input_len = 0;
+        printf("\n");
+        line[0] = '\0';
+        return 1;
+      }
+      continue;
+    }
 
-    printf("%s🎨 CUSTOM COMMANDS (Unique to Our Shell):%s\n", COLOR_YELLOW,
-           COLOR_RESET);
-    printf("  %s26.%s sysinfo            - Comprehensive system information\n",
-           COLOR_GREEN, COLOR_RESET);
-    printf("  %s27.%s tree [dir]         - Display directory tree structure\n",
-           COLOR_GREEN, COLOR_RESET);
-    printf("  %s28.%s calc [expr]        - Built-in calculator (e.g., calc 5 + "
-           "3)\n",
-           COLOR_GREEN, COLOR_RESET);
-    printf("  %s29.%s reverse [file]     - Reverse lines in a file\n",
-           COLOR_GREEN, COLOR_RESET);
-    printf("  %s30.%s colortest          - Test all available colors\n\n",
-           COLOR_GREEN, COLOR_RESET);
+    ssize_t n = read(STDIN_FILENO, input_buf + input_len,
+                     sizeof(input_buf) - input_len);
+    if (n < 0 && (errno == EINTR || errno == EAGAIN)) {
+      continue;
+    }
+    if (n <= 0) {
+      input_eof = 1;
+      continue;
+    }
+    input_len += n;
+  }
+}
 
-    printf("%s📚 EXAMPLES:%s\n", COLOR_YELLOW, COLOR_RESET);
-    printf("  ls -l\n");
-    printf("  cat file.txt\n");
-    printf("  grep \"hello\" file.txt\n");
-    printf("  ls > output.txt\n");
-    printf("  ps aux | grep shell\n");
-    printf("  sleep 10 &\n");
-    printf("  sysinfo\n");
-    printf("  tree .\n");
-    printf("  calc 10 * 5\n\n");
+// ============================================================================
+// EVENT LOOP
+// ============================================================================
 
-    return 1;
+int event_add(int fd, EventHandler handler, void *data) {
+  if (event_source_count >= MAX_EVENT_SOURCES) {
+    return -1;
   }
+  event_sources[event_source_count].fd = fd;
+  event_sources[event_source_count].handler = handler;
+  event_sources[event_source_count].data = data;
+  event_source_count++;
+  return 0;
+}
 
-  // 26-30: Custom commands (unique to our shell)
-  if (strcmp(args[0], "sysinfo") == 0) {
-    cmd_sysinfo(args);
-    return 1;
+void event_remove(int fd) {
+  for (int i = 0; i < event_source_count; i++) {
+    if (event_sources[i].fd == fd) {
+      event_sources[i] = event_sources[--event_source_count];
+      return;
+    }
   }
+}
 
-  if (strcmp(args[0], "tree") == 0) {
-    cmd_tree(args);
-    return 1;
+// Poll all registered sources plus watch_fd (-1 for none), dispatching
+// handlers for ready sources. Returns 1 when watch_fd is readable.
+int event_wait(int watch_fd, int timeout_ms) {
+  struct pollfd fds[MAX_EVENT_SOURCES + 1];
+  EventSource ready[MAX_EVENT_SOURCES];
+  int nfds = 0;
+
+  for (int i = 0; i < event_source_count; i++) {
+    fds[nfds].fd = event_sources[i].fd;
+    fds[nfds].events = POLLIN;
+    nfds++;
   }
-
-  if (strcmp(args[0], "calc") == 0) {
-    cmd_calc(args);
-    return 1;
+  if (watch_fd >= 0) {
+    fds[nfds].fd = watch_fd;
+    fds[nfds].events = POLLIN;
+    nfds++;
   }
 
-  if (strcmp(args[0], "reverse") == 0) {
-    cmd_reverse(args);
-    return 1;
+  if (poll(fds, nfds, timeout_ms) <= 0) {
+    return 0;
   }
 
-  if (strcmp(args[0], "colortest") == 0) {
-    cmd_colortest(args);
-    return 1;
+  // Snapshot ready sources first: handlers may add or remove sources
+  int nready = 0;
+  for (int i = 0; i < event_source_count; i++) {
+    if (fds[i].revents & (POLLIN | POLLERR | POLLHUP)) {
+      ready[nready++] = event_sources[i];
+    }
+  }
+  for (int i = 0; i < nready; i++) {
+    ready[i].handler(ready[i].fd, ready[i].data);
   }
 
-  // 31. exit command
-  if (strcmp(args[0], "exit") == 0) {
-    printf("%s\n╔════════════════════════════════════╗%s\n", COLOR_CYAN,
-           COLOR_RESET);
-    printf("%s║   Thank you for using MyShell!   ║%s\n", COLOR_CYAN,
-           COLOR_RESET);
-    printf("%s║         Goodbye! 👋               ║%s\n", COLOR_CYAN,
-           COLOR_RESET);
-    printf("%s╚════════════════════════════════════╝%s\n\n", COLOR_CYAN,
-           COLOR_RESET);
-    exit(0);
+  return watch_fd >= 0 &&
+         (fds[nfds - 1].revents & (POLLIN | POLLERR | POLLHUP)) != 0;
+}
+
+void add_to_history(char *cmd) {
+  if (history_count < MAX_HISTORY) {
+    strncpy(history[history_count], cmd, MAX_LINE - 1);
+    history[history_count][MAX_LINE - 1] = '\0';
+    history_count++;
+  } else {
+    // Shift history and add new command
+    for (int i = 0; i < MAX_HISTORY - 1; i++) {
+      strcpy(history[i], history[i + 1]);
+    }
+    strncpy(history[MAX_HISTORY - 1], cmd, MAX_LINE - 1);
+    history[MAX_HISTORY - 1][MAX_LINE - 1] = '\0';
   }
+}
 
-  return 0; // Not a built-in command
+// Find a built-in command in the dispatch table
+Builtin *find_builtin(const char *name) {
+  if (name == NULL) {
+    return NULL;
+  }
+  for (Builtin *b = builtins; b->name != NULL; b++) {
+    if (strcmp(b->name, name) == 0) {
+      return b;
+    }
+  }
+  return NULL;
 }
 
 // Command implementations
 
-void cmd_cat(char **args) {
+int cmd_cd(char **args) {
+  prompt_invalidate_cwd();
   if (args[1] == NULL) {
-    printf("%sUsage: cat [file]%s\n", COLOR_RED, COLOR_RESET);
-    return;
+    chdir(var_get("HOME"));
+  } else {
+    if (chdir(args[1]) != 0) {
+      printf("%sError: %s%s\n", COLOR_RED, strerror(errno), COLOR_RESET);
+      return 1;
+    }
   }
+  return 0;
+}
 
-  FILE *fp = fopen(args[1], "r");
-  if (fp == NULL) {
-    printf("%sError: Cannot open file '%s'%s\n", COLOR_RED, args[1],
-           COLOR_RESET);
-    return;
+int cmd_pwd(char **args) {
+  (void)args;
+  char cwd[1024];
+  if (getcwd(cwd, sizeof(cwd)) != NULL) {
+    printf("%s%s%s\n", COLOR_GREEN, cwd, COLOR_RESET);
+  } else {
+    printf("%sError: %s%s\n", COLOR_RED, strerror(errno), COLOR_RESET);
+    return 1;
   }
+  return 0;
+}
 
-  char line[1024];
-  while (fgets(line, sizeof(line), fp) != NULL) {
-    printf("%s", line);
+int cmd_echo(char **args) {
+  for (int i = 1; args[i] != NULL; i++) {
+    printf("%s", args[i]);
+    if (args[i + 1] != NULL) {
+      printf(" ");
+    }
   }
+  printf("\n");
+  return 0;
+}
 
-  fclose(fp);
+int cmd_help(char **args) {
+  (void)args;
+  printf("\n%s╔════════════════════════════════════════════════════════════╗%"
+         "s\n",
+         COLOR_CYAN, COLOR_RESET);
+  printf(
+      "%s║           🎯 ENHANCED SHELL - 40 COMMANDS HELP 🎯          ║%s\n",
+      COLOR_CYAN, COLOR_RESET);
+  printf("%s╚════════════════════════════════════════════════════════════╝%"
+         "s\n\n",
+         COLOR_CYAN, COLOR_RESET);
+
+  printf("%s📁 FILE OPERATIONS:%s\n", COLOR_YELLOW, COLOR_RESET);
+  printf("  %s1.%s  cat [file]         - Display file contents\n",
+         COLOR_GREEN, COLOR_RESET);
+  printf("  %s2.%s  cp [src] [dest]    - Copy files\n", COLOR_GREEN,
+         COLOR_RESET);
+  printf("  %s3.%s  mv [src] [dest]    - Move/rename files\n", COLOR_GREEN,
+         COLOR_RESET);
+  printf("  %s4.%s  rm [file]          - Remove files\n", COLOR_GREEN,
+         COLOR_RESET);
+  printf("  %s5.%s  touch [file]       - Create/update file\n", COLOR_GREEN,
+         COLOR_RESET);
+  printf("  %s6.%s  mkdir [dir]        - Create directory\n", COLOR_GREEN,
+         COLOR_RESET);
+  printf("  %s7.%s  rmdir [dir]        - Remove directory\n", COLOR_GREEN,
+         COLOR_RESET);
+  printf("  %s8.%s  ls [-l]            - List directory contents\n",
+         COLOR_GREEN, COLOR_RESET);
+  printf("  %s9.%s  wc [file]          - Word count\n", COLOR_GREEN,
+         COLOR_RESET);
+  printf("  %s10.%s pwd                - Print working directory\n",
+         COLOR_GREEN, COLOR_RESET);
+  printf("  %s•%s   checksum [-a ALGO] FILES / -c MANIFEST - Hash or verify files\n",
+         COLOR_GREEN, COLOR_RESET);
+  printf("  %s•%s   du [-s] [-h] [path...] - Disk usage\n", COLOR_GREEN,
+         COLOR_RESET);
+  printf("  %s•%s   dircache [on [-m SIZE]|off|clear|status] - Cache directory listings\n",
+         COLOR_GREEN, COLOR_RESET);
+  printf("  %s•%s   updateindex [dir...] - Build or refresh the locate index\n",
+         COLOR_GREEN, COLOR_RESET);
+  printf("  %s•%s   locate [-i] [-c] [-n LIMIT] pattern... - Find paths in the index\n",
+         COLOR_GREEN, COLOR_RESET);
+  printf("        (a * ? [ pattern that matches files in the current directory is\n"
+         "         expanded to them first)\n\n");
+
+  printf("%s📝 TEXT PROCESSING:%s\n", COLOR_YELLOW, COLOR_RESET);
+  printf("  %s11.%s grep [-n] [pattern] [file] - Search text\n", COLOR_GREEN,
+         COLOR_RESET);
+  printf("  %s12.%s head [-n N] [file]    - Show first 10 (N) lines\n",
+         COLOR_GREEN, COLOR_RESET);
+  printf("  %s13.%s tail [-n N] [file]    - Show last 10 (N) lines\n",
+         COLOR_GREEN, COLOR_RESET);
+  printf("  %s•%s   sort [-nru] [-k N[,M]] [-t C] [-S SIZE] [file...] - Sort lines\n",
+         COLOR_GREEN, COLOR_RESET);
+  printf("  %s•%s   count [-f N] [-t C] [-n TOP] [-j N] [file...] - Tally distinct lines\n",
+         COLOR_GREEN, COLOR_RESET);
+  printf("  %s•%s   uniq [-c] [-d] [-u] [file] - Collapse repeated lines\n",
+         COLOR_GREEN, COLOR_RESET);
+  printf("  %s•%s   cut [-d C] -f LIST [--csv] [file...] - Select fields\n",
+         COLOR_GREEN, COLOR_RESET);
+  printf("  %s•%s   index FILE / lines START[,END] FILE - Line index, jump to lines\n",
+         COLOR_GREEN, COLOR_RESET);
+  printf("  %s•%s   tee [-a] [-p SIZE] [file...] - Copy stdin to stdout and files\n",
+         COLOR_GREEN, COLOR_RESET);
+  printf("  %s14.%s echo [text]           - Display text\n\n", COLOR_GREEN,
+         COLOR_RESET);
+
+  printf("%s💻 SYSTEM INFORMATION:%s\n", COLOR_YELLOW, COLOR_RESET);
+  printf("  %s15.%s whoami             - Current user\n", COLOR_GREEN,
+         COLOR_RESET);
+  printf("  %s16.%s hostname           - System hostname\n", COLOR_GREEN,
+         COLOR_RESET);
+  printf("  %s17.%s uname [-a]         - System information\n", COLOR_GREEN,
+         COLOR_RESET);
+  printf("  %s18.%s date               - Current date/time\n", COLOR_GREEN,
+         COLOR_RESET);
+  printf("  %s19.%s env                - Environment variables\n",
+         COLOR_GREEN, COLOR_RESET);
+  printf("  %s•%s   export NAME[=VAL]  - Export a variable (NAME=VAL sets one)\n",
+         COLOR_GREEN, COLOR_RESET);
+  printf("  %s•%s   unset NAME         - Remove a variable\n\n", COLOR_GREEN,
+         COLOR_RESET);
+
+  printf("%s⚙️  PROCESS & UTILITIES:%s\n", COLOR_YELLOW, COLOR_RESET);
+  printf("  %s20.%s jobs               - List background jobs\n", COLOR_GREEN,
+         COLOR_RESET);
+  printf("  %s•%s   fg/bg [%%job]      - Resume a job in foreground/background\n",
+         COLOR_GREEN, COLOR_RESET);
+  printf("  %s•%s   wait [-n] [%%job]  - Wait for background jobs\n",
+         COLOR_GREEN, COLOR_RESET);
+  printf("  %s•%s   kill [-SIG] %%job  - Signal a job or PID\n", COLOR_GREEN,
+         COLOR_RESET);
+  printf("  %s•%s   parallel -j N CMD ::: ARGS - Run CMD per arg, N at a time\n",
+         COLOR_GREEN, COLOR_RESET);
+  printf("  %s•%s   run [--cpus L] [--nice N] [--mem SZ] ... CMD - Limit a "
+         "command\n",
+         COLOR_GREEN, COLOR_RESET);
+  printf("  %s•%s   time CMD | time --auto SECS - Report time and resources\n",
+         COLOR_GREEN, COLOR_RESET);
+  printf("  %s•%s   perfstat CMD       - Count cycles, IPC, cache/branch misses\n",
+         COLOR_GREEN, COLOR_RESET);
+  printf("  %s•%s   stats [-p] [--export FILE] - Command counters and latencies\n",
+         COLOR_GREEN, COLOR_RESET);
+  printf("  %s•%s   prompt [FORMAT]    - Show or set the prompt (\\u \\h \\w \\W \\? \\j)\n",
+         COLOR_GREEN, COLOR_RESET);
+  printf("  %s•%s   test EXPR / [ EXPR ] - Conditions (-eq -lt = -f -d ...), true, false\n",
+         COLOR_GREEN, COLOR_RESET);
+  printf("  %s•%s   watch [-n SECS] [--on PATHS] CMD - Rerun on a timer or file change\n",
+         COLOR_GREEN, COLOR_RESET);
+  printf("  %s•%s   timeout [-s SIG] [-k GRACE] DURATION CMD - Bound a command's run time\n",
+         COLOR_GREEN, COLOR_RESET);
+  printf("  %s21.%s sleep [duration]   - Sleep (fractional, 2m, 1h; Ctrl-C stops)\n", COLOR_GREEN,
+         COLOR_RESET);
+  printf("  %s22.%s clear              - Clear screen\n", COLOR_GREEN,
+         COLOR_RESET);
+  printf("  %s23.%s history            - Command history\n", COLOR_GREEN,
+         COLOR_RESET);
+  printf("  %s24.%s cd [dir]           - Change directory\n", COLOR_GREEN,
+         COLOR_RESET);
+  printf("  %s25.%s exit               - Exit shell\n\n", COLOR_GREEN,
+         COLOR_RESET);
+
+  printf("%s🔧 ADVANCED FEATURES:%s\n", COLOR_YELLOW, COLOR_RESET);
+  printf("  %s26-40.%s External commands (ps, kill, top, etc.)\n",
+         COLOR_GREEN, COLOR_RESET);
+  printf("  %s•%s I/O Redirection:  cmd > file, cmd < file, cmd >> file\n",
+         COLOR_MAGENTA, COLOR_RESET);
+  printf("  %s•%s Piping:           cmd1 | cmd2 | cmd3 ...\n", COLOR_MAGENTA,
+         COLOR_RESET);
+  printf("  %s•%s Background:       command &   (Ctrl-Z suspends)\n",
+         COLOR_MAGENTA, COLOR_RESET);
+  printf("  %s•%s Variables:        $VAR ${VAR:-default} $? $$\n",
+         COLOR_MAGENTA, COLOR_RESET);
+  printf("  %s•%s Substitution:     $((expr)) arithmetic, $(command) output\n",
+         COLOR_MAGENTA, COLOR_RESET);
+  printf("  %s•%s Control flow:     if/while/until/for, f() { ...; }, && || ;\n\n",
+         COLOR_MAGENTA, COLOR_RESET);
+
+  printf("%s🎨 CUSTOM COMMANDS (Unique to Our Shell):%s\n", COLOR_YELLOW,
+         COLOR_RESET);
+  printf("  %s26.%s sysinfo            - Comprehensive system information\n",
+         COLOR_GREEN, COLOR_RESET);
+  printf("  %s27.%s tree [dir]         - Display directory tree structure\n",
+         COLOR_GREEN, COLOR_RESET);
+  printf("  %s28.%s calc [expr]        - Built-in calculator (e.g., calc 5 + "
+         "3 x 2)\n",
+         COLOR_GREEN, COLOR_RESET);
+  printf("  %s29.%s reverse [file]     - Reverse lines in a file\n",
+         COLOR_GREEN, COLOR_RESET);
+  printf("  %s30.%s colortest          - Test all available colors\n\n",
+         COLOR_GREEN, COLOR_RESET);
+
+  printf("%s📚 EXAMPLES:%s\n", COLOR_YELLOW, COLOR_RESET);
+  printf("  ls -l\n");
+  printf("  cat file.txt\n");
+  printf("  grep \"hello\" file.txt\n");
+  printf("  ls > output.txt\n");
+  printf("  ps aux | grep shell\n");
+  printf("  sleep 10 &\n");
+  printf("  sysinfo\n");
+  printf("  tree .\n");
+  printf("  calc (10 + 5) x 2\n");
+  printf("  echo $((N * 2)) $(pwd)\n\n");
+
+  return 0;
+}
+
+int cmd_exit(char **args) {
+  int code = args[1] != NULL ? atoi(args[1]) : last_exit_status;
+  printf("%s\n╔════════════════════════════════════╗%s\n", COLOR_CYAN,
+         COLOR_RESET);
+  printf("%s║   Thank you for using MyShell!   ║%s\n", COLOR_CYAN,
+         COLOR_RESET);
+  printf("%s║         Goodbye! 👋               ║%s\n", COLOR_CYAN,
+         COLOR_RESET);
+  printf("%s╚════════════════════════════════════╝%s\n\n", COLOR_CYAN,
+         COLOR_RESET);
+  exit(code);
+}
+
+// Open a file argument for reading. Without one, read standard input when
+// it is a pipe or file (so the built-in works as a pipeline stage);
+// otherwise print the usage line. gzip files are decoded on the fly.
+FILE *open_input_file(char *path, const char *usage) {
+  if (path == NULL) {
+    if (isatty(STDIN_FILENO)) {
+      printf("%sUsage: %s%s\n", COLOR_RED, usage, COLOR_RESET);
+      return NULL;
+    }
+    return stdin;
+  }
+
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  FILE *fp = NULL;
+  if (fd >= 0) {
+    int format = compression_format(fd);
+    if (format == COMPRESS_NONE) {
+      fp = fdopen(fd, "r");
+    } else if (compression_supported(format)) {
+      fp = open_decompressed(fd, format);
+      fd = -1;
+    } else {
+      if (format == COMPRESS_GZIP) {
+        printf("%sError: '%s' is gzip-compressed (built without zlib "
+               "support)%s\n",
+               COLOR_RED, path, COLOR_RESET);
+      } else {
+        printf("%sError: '%s' is zstd-compressed (not supported)%s\n",
+               COLOR_RED, path, COLOR_RESET);
+      }
+      close(fd);
+      return NULL;
+    }
+  }
+  if (fp == NULL) {
+    if (fd >= 0) {
+      close(fd);
+    }
+    printf("%sError: Cannot open file '%s'%s\n", COLOR_RED, path,
+           COLOR_RESET);
+  }
+  return fp;
+}
+
+// Close an input opened by open_input_file; returns 1 (after saying so)
+// if reading it failed, e.g. on a truncated compressed file
+int close_input_file(FILE *fp) {
+  int failed = ferror(fp);
+  if (fp != stdin) {
+    fclose(fp);
+  }
+  if (failed) {
+    printf("%sError: input is corrupt or unreadable%s\n", COLOR_RED,
+           COLOR_RESET);
+  }
+  return failed ? 1 : 0;
+}
+
+int cmd_cat(char **args) {
+  FILE *fp = open_input_file(args[1], "cat [file]");
+  if (fp == NULL) {
+    return 1;
+  }
+
+  char line[1024];
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    printf("%s", line);
+  }
+
+  return close_input_file(fp);
 }
 
-void cmd_cp(char **args) {
+int cmd_cp(char **args) {
   if (args[1] == NULL || args[2] == NULL) {
     printf("%sUsage: cp [source] [destination]%s\n", COLOR_RED, COLOR_RESET);
-    return;
+    return 1;
   }
 
   FILE *src = fopen(args[1], "rb");
   if (src == NULL) {
     printf("%sError: Cannot open source file '%s'%s\n", COLOR_RED, args[1],
            COLOR_RESET);
-    return;
+    return 1;
   }
 
   FILE *dest = fopen(args[2], "wb");
@@ -597,7 +1406,7 @@ void cmd_cp(char **args) {
     printf("%sError: Cannot create destination file '%s'%s\n", COLOR_RED,
            args[2], COLOR_RESET);
     fclose(src);
-    return;
+    return 1;
   }
 
   char buffer[4096];
@@ -609,45 +1418,50 @@ void cmd_cp(char **args) {
   fclose(src);
   fclose(dest);
   printf("%sFile copied successfully!%s\n", COLOR_GREEN, COLOR_RESET);
+  return 0;
 }
 
-void cmd_mv(char **args) {
+int cmd_mv(char **args) {
   if (args[1] == NULL || args[2] == NULL) {
     printf("%sUsage: mv [source] [destination]%s\n", COLOR_RED, COLOR_RESET);
-    return;
+    return 1;
   }
 
   if (rename(args[1], args[2]) == 0) {
     printf("%sFile moved/renamed successfully!%s\n", COLOR_GREEN, COLOR_RESET);
   } else {
     printf("%sError: %s%s\n", COLOR_RED, strerror(errno), COLOR_RESET);
+    return 1;
   }
+  return 0;
 }
 
-void cmd_rm(char **args) {
+int cmd_rm(char **args) {
   if (args[1] == NULL) {
     printf("%sUsage: rm [file]%s\n", COLOR_RED, COLOR_RESET);
-    return;
+    return 1;
   }
 
   if (unlink(args[1]) == 0) {
     printf("%sFile removed successfully!%s\n", COLOR_GREEN, COLOR_RESET);
   } else {
     printf("%sError: %s%s\n", COLOR_RED, strerror(errno), COLOR_RESET);
+    return 1;
   }
+  return 0;
 }
 
-void cmd_touch(char **args) {
+int cmd_touch(char **args) {
   if (args[1] == NULL) {
     printf("%sUsage: touch [file]%s\n", COLOR_RED, COLOR_RESET);
-    return;
+    return 1;
   }
 
   FILE *fp = fopen(args[1], "a");
   if (fp == NULL) {
     printf("%sError: Cannot create file '%s'%s\n", COLOR_RED, args[1],
            COLOR_RESET);
-    return;
+    return 1;
   }
 
   fclose(fp);
@@ -655,38 +1469,40 @@ void cmd_touch(char **args) {
   // Update timestamp
   utime(args[1], NULL);
   printf("%sFile created/updated successfully!%s\n", COLOR_GREEN, COLOR_RESET);
+  return 0;
 }
 
-void cmd_mkdir(char **args) {
+int cmd_mkdir(char **args) {
   if (args[1] == NULL) {
     printf("%sUsage: mkdir [directory]%s\n", COLOR_RED, COLOR_RESET);
-    return;
+    return 1;
   }
 
   if (mkdir(args[1], 0755) == 0) {
     printf("%sDirectory created successfully!%s\n", COLOR_GREEN, COLOR_RESET);
   } else {
     printf("%sError: %s%s\n", COLOR_RED, strerror(errno), COLOR_RESET);
+    return 1;
   }
+  return 0;
 }
 
-void cmd_rmdir(char **args) {
+int cmd_rmdir(char **args) {
   if (args[1] == NULL) {
     printf("%sUsage: rmdir [directory]%s\n", COLOR_RED, COLOR_RESET);
-    return;
+    return 1;
   }
 
   if (rmdir(args[1]) == 0) {
     printf("%sDirectory removed successfully!%s\n", COLOR_GREEN, COLOR_RESET);
   } else {
     printf("%sError: %s%s\n", COLOR_RED, strerror(errno), COLOR_RESET);
+    return 1;
   }
+  return 0;
 }
 
-void cmd_ls(char **args) {
-  DIR *dir;
-  struct dirent *entry;
-  struct stat file_stat;
+int cmd_ls(char **args) {
   int show_details = 0;
 
   // Check for -l flag
@@ -694,47 +1510,43 @@ void cmd_ls(char **args) {
     show_details = 1;
   }
 
-  dir = opendir(".");
+  // Entries come with their metadata (see METADATA CACHE)
+  DirListing *dir = dir_list(".");
   if (dir == NULL) {
     printf("%sError: Cannot open directory%s\n", COLOR_RED, COLOR_RESET);
-    return;
+    return 1;
   }
 
   printf("\n");
-  while ((entry = readdir(dir)) != NULL) {
-    // Skip . and ..
-    if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
-      continue;
-    }
+  for (int i = 0; i < dir->count; i++) {
+    DirEntryInfo *entry = &dir->entries[i];
+    mode_t mode = entry->mode;
 
     if (show_details) {
-      stat(entry->d_name, &file_stat);
-
       // Print permissions
-      printf("%s", (S_ISDIR(file_stat.st_mode)) ? "d" : "-");
-      printf("%s", (file_stat.st_mode & S_IRUSR) ? "r" : "-");
-      printf("%s", (file_stat.st_mode & S_IWUSR) ? "w" : "-");
-      printf("%s", (file_stat.st_mode & S_IXUSR) ? "x" : "-");
-      printf("%s", (file_stat.st_mode & S_IRGRP) ? "r" : "-");
-      printf("%s", (file_stat.st_mode & S_IWGRP) ? "w" : "-");
-      printf("%s", (file_stat.st_mode & S_IXGRP) ? "x" : "-");
-      printf("%s", (file_stat.st_mode & S_IROTH) ? "r" : "-");
-      printf("%s", (file_stat.st_mode & S_IWOTH) ? "w" : "-");
-      printf("%s", (file_stat.st_mode & S_IXOTH) ? "x" : "-");
-
-      printf(" %8ld ", (long)file_stat.st_size);
-
-      if (S_ISDIR(file_stat.st_mode)) {
-        printf("%s%s/%s\n", COLOR_BLUE, entry->d_name, COLOR_RESET);
+      printf("%s", (S_ISDIR(mode)) ? "d" : "-");
+      printf("%s", (mode & S_IRUSR) ? "r" : "-");
+      printf("%s", (mode & S_IWUSR) ? "w" : "-");
+      printf("%s", (mode & S_IXUSR) ? "x" : "-");
+      printf("%s", (mode & S_IRGRP) ? "r" : "-");
+      printf("%s", (mode & S_IWGRP) ? "w" : "-");
+      printf("%s", (mode & S_IXGRP) ? "x" : "-");
+      printf("%s", (mode & S_IROTH) ? "r" : "-");
+      printf("%s", (mode & S_IWOTH) ? "w" : "-");
+      printf("%s", (mode & S_IXOTH) ? "x" : "-");
+
+      printf(" %8ld ", (long)entry->size);
+
+      if (S_ISDIR(mode)) {
+        printf("%s%s/%s\n", COLOR_BLUE, entry->name, COLOR_RESET);
       } else {
-        printf("%s\n", entry->d_name);
+        printf("%s\n", entry->name);
       }
     } else {
-      stat(entry->d_name, &file_stat);
-      if (S_ISDIR(file_stat.st_mode)) {
-        printf("%s%-20s%s", COLOR_BLUE, entry->d_name, COLOR_RESET);
+      if (S_ISDIR(mode)) {
+        printf("%s%-20s%s", COLOR_BLUE, entry->name, COLOR_RESET);
       } else {
-        printf("%-20s", entry->d_name);
+        printf("%-20s", entry->name);
       }
     }
   }
@@ -744,20 +1556,14 @@ void cmd_ls(char **args) {
   }
   printf("\n");
 
-  closedir(dir);
+  dir_release(dir);
+  return 0;
 }
 
-void cmd_wc(char **args) {
-  if (args[1] == NULL) {
-    printf("%sUsage: wc [file]%s\n", COLOR_RED, COLOR_RESET);
-    return;
-  }
-
-  FILE *fp = fopen(args[1], "r");
+int cmd_wc(char **args) {
+  FILE *fp = open_input_file(args[1], "wc [file]");
   if (fp == NULL) {
-    printf("%sError: Cannot open file '%s'%s\n", COLOR_RED, args[1],
-           COLOR_RESET);
-    return;
+    return 1;
   }
 
   int lines = 0, words = 0, chars = 0;
@@ -779,120 +1585,282 @@ void cmd_wc(char **args) {
     }
   }
 
-  fclose(fp);
+  if (close_input_file(fp) != 0) {
+    return 1;
+  }
 
   printf("%s%d%s lines  %s%d%s words  %s%d%s characters  %s\n", COLOR_GREEN,
          lines, COLOR_RESET, COLOR_YELLOW, words, COLOR_RESET, COLOR_CYAN,
-         chars, COLOR_RESET, args[1]);
+         chars, COLOR_RESET, args[1] != NULL ? args[1] : "");
+  return 0;
 }
 
-void cmd_grep(char **args) {
-  if (args[1] == NULL || args[2] == NULL) {
-    printf("%sUsage: grep [pattern] [file]%s\n", COLOR_RED, COLOR_RESET);
-    return;
+// grep [-n] PATTERN [file] - print matching lines with their numbers.
+// A mapped file is searched with memmem so non-matching lines are never
+// split out; line numbers come from the line index when there is one.
+int cmd_grep(char **args) {
+  int i = 1;
+  if (args[i] != NULL && strcmp(args[i], "-n") == 0) {
+    i++; // line numbers are always shown
+  }
+  if (args[i] == NULL) {
+    printf("%sUsage: grep [-n] [pattern] [file]%s\n", COLOR_RED, COLOR_RESET);
+    return 1;
+  }
+
+  const char *pattern = args[i];
+  size_t pattern_len = strlen(pattern);
+  int found = 0;
+
+  if (args[i + 1] != NULL) {
+    int fd = open(args[i + 1], O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    const char *data = NULL;
+    int mapped = fd >= 0 ? map_input(fd, &st, &data) : -1;
+    if (fd >= 0) {
+      close(fd);
+    }
+    if (mapped == 1) {
+      size_t size = st.st_size, pos = 0, counted = 0;
+      unsigned long long line_num = 1;
+      LineIndex index;
+      int indexed = line_index_open(&st, &index) == 0;
+      const char *hit;
+
+      while (pos < size &&
+             (hit = memmem(data + pos, size - pos, pattern, pattern_len)) !=
+                 NULL) {
+        const char *start = memrchr(data + pos, '\n', hit - (data + pos));
+        size_t line_start = start != NULL ? (size_t)(start - data) + 1 : pos;
+        const char *nl = memchr(hit, '\n', data + size - hit);
+        size_t line_end = nl != NULL ? (size_t)(nl - data) : size;
+
+        if (indexed) {
+          line_num = line_index_line_of(&index, data, line_start);
+        } else {
+          line_num += count_newlines(data + counted, line_start - counted);
+          counted = line_start;
+        }
+        printf("%s%llu:%s %.*s\n", COLOR_GREEN, line_num, COLOR_RESET,
+               (int)(line_end - line_start), data + line_start);
+        found = 1;
+        pos = line_end + 1;
+      }
+      if (indexed) {
+        line_index_close(&index);
+      }
+      munmap((void *)data, size);
+      if (!found) {
+        printf("%sPattern not found%s\n", COLOR_YELLOW, COLOR_RESET);
+      }
+      return found ? 0 : 1;
+    }
   }
 
-  FILE *fp = fopen(args[2], "r");
+  FILE *fp = open_input_file(args[i + 1], "grep [-n] [pattern] [file]");
   if (fp == NULL) {
-    printf("%sError: Cannot open file '%s'%s\n", COLOR_RED, args[2],
-           COLOR_RESET);
-    return;
+    return 1;
   }
 
-  char line[1024];
+  char *line = NULL;
+  size_t cap = 0;
   int line_num = 0;
-  int found = 0;
 
-  while (fgets(line, sizeof(line), fp) != NULL) {
+  while (getline(&line, &cap, fp) != -1) {
     line_num++;
-    if (strstr(line, args[1]) != NULL) {
+    if (strstr(line, pattern) != NULL) {
       printf("%s%d:%s %s", COLOR_GREEN, line_num, COLOR_RESET, line);
       found = 1;
     }
   }
+  free(line);
 
+  if (close_input_file(fp) != 0) {
+    return 2;
+  }
   if (!found) {
     printf("%sPattern not found%s\n", COLOR_YELLOW, COLOR_RESET);
   }
+  return found ? 0 : 1;
+}
 
-  fclose(fp);
+// Parse an optional "-n N" for head and tail; returns the index of the
+// file argument or -1 if N is invalid
+int parse_line_count(char **args, long *count) {
+  if (args[1] != NULL && strcmp(args[1], "-n") == 0) {
+    char *end;
+    if (args[2] == NULL) {
+      return -1;
+    }
+    *count = strtol(args[2], &end, 10);
+    return *end == '\0' && end != args[2] && *count >= 0 ? 3 : -1;
+  }
+  return 1;
 }
 
-void cmd_head(char **args) {
-  if (args[1] == NULL) {
-    printf("%sUsage: head [file]%s\n", COLOR_RED, COLOR_RESET);
-    return;
+int cmd_head(char **args) {
+  long count = 10;
+  int i = parse_line_count(args, &count);
+  if (i < 0) {
+    printf("%sUsage: head [-n N] [file]%s\n", COLOR_RED, COLOR_RESET);
+    return 1;
+  }
+
+  // A regular file is copied out in one write up to the end of line N
+  if (args[i] != NULL) {
+    int fd = open(args[i], O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    const char *data = NULL;
+    int mapped = fd >= 0 ? map_input(fd, &st, &data) : -1;
+    if (fd >= 0) {
+      close(fd);
+    }
+    if (mapped == 1) {
+      LineIndex index;
+      size_t to;
+      if (line_index_open(&st, &index) == 0) {
+        to = line_index_offset(&index, data, st.st_size, count + 1);
+        line_index_close(&index);
+      } else {
+        uint64_t skip = count;
+        to = skip_lines(data, st.st_size, 0, &skip);
+      }
+      write_range(data, 0, to);
+      munmap((void *)data, st.st_size);
+      return 0;
+    }
   }
 
-  FILE *fp = fopen(args[1], "r");
+  FILE *fp = open_input_file(args[i], "head [-n N] [file]");
   if (fp == NULL) {
-    printf("%sError: Cannot open file '%s'%s\n", COLOR_RED, args[1],
-           COLOR_RESET);
-    return;
+    return 1;
   }
 
-  char line[1024];
-  int count = 0;
+  char *line = NULL;
+  size_t cap = 0;
+  ssize_t n;
 
-  while (fgets(line, sizeof(line), fp) != NULL && count < 10) {
-    printf("%s", line);
-    count++;
+  while (count > 0 && (n = getline(&line, &cap, fp)) != -1) {
+    fwrite(line, 1, n, stdout);
+    count--;
   }
+  free(line);
 
-  fclose(fp);
+  return close_input_file(fp);
 }
 
-void cmd_tail(char **args) {
-  if (args[1] == NULL) {
-    printf("%sUsage: tail [file]%s\n", COLOR_RED, COLOR_RESET);
-    return;
+int cmd_tail(char **args) {
+  long count = 10;
+  int i = parse_line_count(args, &count);
+  if (i < 0) {
+    printf("%sUsage: tail [-n N] [file]%s\n", COLOR_RED, COLOR_RESET);
+    return 1;
   }
 
-  FILE *fp = fopen(args[1], "r");
-  if (fp == NULL) {
-    printf("%sError: Cannot open file '%s'%s\n", COLOR_RED, args[1],
-           COLOR_RESET);
-    return;
+  // A regular file is read from the end: the index gives the offset of
+  // line (total - N + 1) directly, otherwise newlines are found backwards
+  if (args[i] != NULL) {
+    int fd = open(args[i], O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    const char *data = NULL;
+    int mapped = fd >= 0 ? map_input(fd, &st, &data) : -1;
+    if (fd >= 0) {
+      close(fd);
+    }
+    if (mapped == 1) {
+      size_t size = st.st_size, from = 0;
+      LineIndex index;
+      if (line_index_open(&st, &index) == 0) {
+        uint64_t total = index.header->lines;
+        from = total <= (uint64_t)count
+                   ? 0
+                   : line_index_offset(&index, data, size, total - count + 1);
+        line_index_close(&index);
+      } else {
+        size_t pos = data[size - 1] == '\n' ? size - 1 : size;
+        long found = 0;
+        from = count == 0 ? size : 0;
+        while (found < count) {
+          const char *nl = memrchr(data, '\n', pos);
+          if (nl == NULL) {
+            break;
+          }
+          pos = nl - data;
+          if (++found == count) {
+            from = pos + 1;
+          }
+        }
+      }
+      write_range(data, from, size);
+      munmap((void *)data, size);
+      return 0;
+    }
   }
 
-  char lines[10][1024];
-  int current = 0;
-  int total = 0;
+  FILE *fp = open_input_file(args[i], "tail [-n N] [file]");
+  if (fp == NULL) {
+    return 1;
+  }
 
-  while (fgets(lines[current % 10], sizeof(lines[0]), fp) != NULL) {
-    current++;
+  // Streamed input: keep the last N lines in a ring, reading into a
+  // spare buffer that is swapped with the slot it replaces
+  char **ring = calloc(count > 0 ? count : 1, sizeof(char *));
+  size_t *caps = calloc(count > 0 ? count : 1, sizeof(size_t));
+  char *line = NULL;
+  size_t cap = 0;
+  long total = 0;
+
+  while (ring != NULL && caps != NULL && count > 0 &&
+         getline(&line, &cap, fp) != -1) {
+    long slot = total % count;
+    char *swap = ring[slot];
+    size_t swap_cap = caps[slot];
+    ring[slot] = line;
+    caps[slot] = cap;
+    line = swap;
+    cap = swap_cap;
     total++;
   }
-
-  int start = (total > 10) ? (current % 10) : 0;
-  int count = (total > 10) ? 10 : total;
-
-  for (int i = 0; i < count; i++) {
-    printf("%s", lines[(start + i) % 10]);
+  free(line);
+  long shown = total < count ? total : count;
+  for (long j = 0; j < shown; j++) {
+    printf("%s", ring[(total - shown + j) % count]);
+  }
+  for (long j = 0; ring != NULL && j < count; j++) {
+    free(ring[j]);
   }
+  free(ring);
+  free(caps);
 
-  fclose(fp);
+  close_input_file(fp);
+  return 0;
 }
 
-void cmd_whoami(char **args) {
+int cmd_whoami(char **args) {
+  (void)args;
   struct passwd *pw = getpwuid(getuid());
   if (pw != NULL) {
     printf("%s%s%s\n", COLOR_GREEN, pw->pw_name, COLOR_RESET);
   } else {
     printf("%sUnknown user%s\n", COLOR_RED, COLOR_RESET);
+    return 1;
   }
+  return 0;
 }
 
-void cmd_hostname(char **args) {
+int cmd_hostname(char **args) {
+  (void)args;
   char hostname[256];
   if (gethostname(hostname, sizeof(hostname)) == 0) {
     printf("%s%s%s\n", COLOR_GREEN, hostname, COLOR_RESET);
   } else {
     printf("%sError getting hostname%s\n", COLOR_RED, COLOR_RESET);
+    return 1;
   }
+  return 0;
 }
 
-void cmd_uname(char **args) {
+int cmd_uname(char **args) {
   struct utsname sys_info;
 
   if (uname(&sys_info) == 0) {
@@ -905,53 +1873,85 @@ void cmd_uname(char **args) {
     }
   } else {
     printf("%sError getting system information%s\n", COLOR_RED, COLOR_RESET);
+    return 1;
   }
+  return 0;
 }
 
-void cmd_date(char **args) {
+int cmd_date(char **args) {
+  (void)args;
   time_t now = time(NULL);
   char *time_str = ctime(&now);
   time_str[strlen(time_str) - 1] = '\0'; // Remove newline
   printf("%s%s%s\n", COLOR_GREEN, time_str, COLOR_RESET);
+  return 0;
 }
 
-void cmd_clear(char **args) {
+int cmd_clear(char **args) {
+  (void)args;
 #ifdef _WIN32
   system("cls");
 #else
   system("clear");
 #endif
   print_banner();
+  return 0;
 }
 
-void cmd_history(char **args) {
+int cmd_history(char **args) {
+  (void)args;
   printf("\n%s╔═══ Command History ═══╗%s\n", COLOR_CYAN, COLOR_RESET);
   for (int i = 0; i < history_count; i++) {
     printf("%s%3d%s  %s\n", COLOR_YELLOW, i + 1, COLOR_RESET, history[i]);
   }
   printf("%s╚═══════════════════════╝%s\n\n", COLOR_CYAN, COLOR_RESET);
+  return 0;
 }
 
-void cmd_env(char **args) {
-  extern char **environ;
+int cmd_env(char **args) {
+  (void)args;
+  char **envp = env_envp();
   printf("\n%s╔═══ Environment Variables ═══╗%s\n", COLOR_CYAN, COLOR_RESET);
-  for (int i = 0; environ[i] != NULL; i++) {
-    printf("%s\n", environ[i]);
+  for (int i = 0; envp != NULL && envp[i] != NULL; i++) {
+    printf("%s\n", envp[i]);
   }
   printf("%s╚═════════════════════════════╝%s\n\n", COLOR_CYAN, COLOR_RESET);
+  return 0;
 }
 
-void cmd_sleep(char **args) {
-  if (args[1] == NULL) {
-    printf("%sUsage: sleep [seconds]%s\n", COLOR_RED, COLOR_RESET);
-    return;
+int cmd_sleep(char **args) {
+  double seconds;
+  if (args[1] == NULL || parse_duration(args[1], &seconds) < 0) {
+    printf("%sUsage: sleep [duration]  (e.g. 0.5, 10, 2m)%s\n", COLOR_RED,
+           COLOR_RESET);
+    return 1;
   }
 
-  int seconds = atoi(args[1]);
-  printf("%sSleeping for %d seconds...%s\n", COLOR_YELLOW, seconds,
+  printf("%sSleeping for %g seconds...%s\n", COLOR_YELLOW, seconds,
          COLOR_RESET);
-  sleep(seconds);
+  fflush(stdout);
+
+  // Sleep to an absolute deadline so other signals don't stretch it;
+  // Ctrl-C (which interrupts clock_nanosleep) ends it early
+  struct timespec deadline;
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+  deadline.tv_sec += (time_t)seconds;
+  deadline.tv_nsec += (long)((seconds - (time_t)seconds) * 1e9);
+  if (deadline.tv_nsec >= 1000000000L) {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000L;
+  }
+  sigint_received = 0;
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) ==
+         EINTR) {
+    if (sigint_received) {
+      sigint_received = 0;
+      printf("%sInterrupted%s\n", COLOR_RED, COLOR_RESET);
+      return 128 + SIGINT;
+    }
+  }
   printf("%sDone!%s\n", COLOR_GREEN, COLOR_RESET);
+  return 0;
 }
 
 // ============================================================================
@@ -959,7 +1959,8 @@ void cmd_sleep(char **args) {
 // ============================================================================
 
 // 1. sysinfo - Comprehensive system information
-void cmd_sysinfo(char **args) {
+int cmd_sysinfo(char **args) {
+  (void)args;
   struct utsname sys_info;
   time_t now = time(NULL);
   char *time_str = ctime(&now);
@@ -1007,125 +2008,123 @@ void cmd_sysinfo(char **args) {
          COLOR_RESET);
   printf("   Background jobs:     %s%d%s\n\n", COLOR_GREEN, job_count,
          COLOR_RESET);
+  return 0;
 }
 
 // 2. tree - Display directory tree structure
-void cmd_tree(char **args) {
+int cmd_tree(char **args) {
   char *dir_path = args[1] ? args[1] : ".";
-  DIR *dir = opendir(dir_path);
+  DirListing *dir = dir_list(dir_path);
 
   if (dir == NULL) {
     printf("%sError: Cannot open directory '%s'%s\n", COLOR_RED, dir_path,
            COLOR_RESET);
-    return;
+    return 1;
   }
 
   printf("\n%s%s%s\n", COLOR_CYAN, dir_path, COLOR_RESET);
 
-  struct dirent *entry;
   int count = 0;
 
-  while ((entry = readdir(dir)) != NULL) {
-    if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
-      continue;
-    }
-
-    char full_path[1024];
-    snprintf(full_path, sizeof(full_path), "%s/%s", dir_path, entry->d_name);
-
-    struct stat file_stat;
-    stat(full_path, &file_stat);
+  for (int i = 0; i < dir->count; i++) {
+    DirEntryInfo *entry = &dir->entries[i];
 
-    if (S_ISDIR(file_stat.st_mode)) {
-      printf("├── %s%s/%s\n", COLOR_BLUE, entry->d_name, COLOR_RESET);
+    if (S_ISDIR(entry->mode)) {
+      printf("├── %s%s/%s\n", COLOR_BLUE, entry->name, COLOR_RESET);
     } else {
-      printf("├── %s\n", entry->d_name);
+      printf("├── %s\n", entry->name);
     }
     count++;
   }
 
-  closedir(dir);
+  dir_release(dir);
   printf("\n%s%d items%s\n\n", COLOR_GREEN, count, COLOR_RESET);
+  return 0;
 }
 
 // 3. calc - Built-in calculator
-void cmd_calc(char **args) {
-  if (args[1] == NULL || args[2] == NULL || args[3] == NULL) {
-    printf("%sUsage: calc [num1] [operator] [num2]%s\n", COLOR_RED,
-           COLOR_RESET);
-    printf("%sExample: calc 10 + 5%s\n", COLOR_YELLOW, COLOR_RESET);
-    printf("%sOperators: + - * / %% (modulo)%s\n\n", COLOR_YELLOW, COLOR_RESET);
-    return;
+int cmd_calc(char **args) {
+  if (args[1] == NULL) {
+    printf("%sUsage: calc [expression]%s\n", COLOR_RED, COLOR_RESET);
+    printf("%sExample: calc (10 + 5) x 2%s\n", COLOR_YELLOW, COLOR_RESET);
+    printf("%sOperators: + - x / %% ** ( ) << >> & | ^ == != < > && || ?:%s\n\n",
+           COLOR_YELLOW, COLOR_RESET);
+    return 1;
   }
 
-  double num1 = atof(args[1]);
-  char *op = args[2];
-  double num2 = atof(args[3]);
-  double result = 0;
-  int valid = 1;
-
-  if (strcmp(op, "+") == 0) {
-    result = num1 + num2;
-  } else if (strcmp(op, "-") == 0) {
-    result = num1 - num2;
-  } else if (strcmp(op, "*") == 0 || strcmp(op, "x") == 0) {
-    result = num1 * num2;
-  } else if (strcmp(op, "/") == 0) {
-    if (num2 == 0) {
-      printf("%sError: Division by zero!%s\n", COLOR_RED, COLOR_RESET);
-      return;
-    }
-    result = num1 / num2;
-  } else if (strcmp(op, "%") == 0) {
-    result = (int)num1 % (int)num2;
-  } else {
-    printf("%sError: Invalid operator '%s'%s\n", COLOR_RED, op, COLOR_RESET);
-    valid = 0;
+  // Same evaluator as $((...)); "x" also multiplies, since a bare "*"
+  // would be glob-expanded
+  char expr[MAX_LINE] = "";
+  for (int i = 1; args[i] != NULL; i++) {
+    size_t used = strlen(expr);
+    snprintf(expr + used, sizeof(expr) - used, "%s%s", i > 1 ? " " : "",
+             strcmp(args[i], "x") == 0 ? "*" : args[i]);
   }
 
-  if (valid) {
-    printf("\n%s╔═══ Calculator Result ═══╗%s\n", COLOR_CYAN, COLOR_RESET);
-    printf("%s%.2f %s %.2f = %s%.2f%s\n", COLOR_YELLOW, num1, op, num2,
-           COLOR_GREEN, result, COLOR_RESET);
-    printf("%s╚═════════════════════════╝%s\n\n", COLOR_CYAN, COLOR_RESET);
+  ArithValue result;
+  if (arith_eval(expr, &result) < 0) {
+    return 1;
   }
+  char num[64];
+  arith_format(result, num, sizeof(num));
+
+  printf("\n%s╔═══ Calculator Result ═══╗%s\n", COLOR_CYAN, COLOR_RESET);
+  printf("%s%s = %s%s%s\n", COLOR_YELLOW, expr, COLOR_GREEN, num,
+         COLOR_RESET);
+  printf("%s╚═════════════════════════╝%s\n\n", COLOR_CYAN, COLOR_RESET);
+  return 0;
 }
 
 // 4. reverse - Reverse lines in a file
-void cmd_reverse(char **args) {
-  if (args[1] == NULL) {
-    printf("%sUsage: reverse [file]%s\n", COLOR_RED, COLOR_RESET);
-    return;
-  }
-
-  FILE *fp = fopen(args[1], "r");
+int cmd_reverse(char **args) {
+  FILE *fp = open_input_file(args[1], "reverse [file]");
   if (fp == NULL) {
-    printf("%sError: Cannot open file '%s'%s\n", COLOR_RED, args[1],
-           COLOR_RESET);
-    return;
+    return 1;
   }
 
-  char lines[1000][1024];
-  int line_count = 0;
-
-  while (fgets(lines[line_count], sizeof(lines[0]), fp) != NULL &&
-         line_count < 1000) {
-    line_count++;
+  // Read everything, then walk it backwards one line at a time
+  size_t cap = 1 << 16, len = 0, n;
+  char *data = malloc(cap);
+  while (data != NULL && (n = fread(data + len, 1, cap - len, fp)) > 0) {
+    len += n;
+    if (len == cap) {
+      char *bigger = realloc(data, cap * 2);
+      if (bigger == NULL) {
+        free(data);
+        data = NULL;
+        break;
+      }
+      data = bigger;
+      cap *= 2;
+    }
   }
 
-  fclose(fp);
+  if (close_input_file(fp) != 0 || data == NULL) {
+    free(data);
+    return 1;
+  }
 
-  printf("\n%s╔═══ Reversed File: %s ═══╗%s\n", COLOR_CYAN, args[1],
-         COLOR_RESET);
-  for (int i = line_count - 1; i >= 0; i--) {
-    printf("%s", lines[i]);
+  printf("\n%s╔═══ Reversed File: %s ═══╗%s\n", COLOR_CYAN,
+         args[1] != NULL ? args[1] : "(stdin)", COLOR_RESET);
+  size_t end = len > 0 && data[len - 1] == '\n' ? len - 1 : len;
+  while (len > 0) {
+    const char *nl = memrchr(data, '\n', end);
+    size_t start = nl != NULL ? (size_t)(nl - data) + 1 : 0;
+    printf("%.*s\n", (int)(end - start), data + start);
+    if (nl == NULL) {
+      break;
+    }
+    end = start - 1;
   }
   printf("%s╚═══════════════════════════════════╝%s\n\n", COLOR_CYAN,
          COLOR_RESET);
+  free(data);
+  return 0;
 }
 
 // 5. colortest - Test all available colors
-void cmd_colortest(char **args) {
+int cmd_colortest(char **args) {
+  (void)args;
   printf("\n%s╔═══════════════════════════════════════════════════╗%s\n",
          COLOR_CYAN, COLOR_RESET);
   printf("%s║           🎨 COLOR PALETTE TEST 🎨               ║%s\n",
@@ -1147,220 +2146,12063 @@ void cmd_colortest(char **args) {
   printf("%s■ BOLD%s    - Emphasis text\n\n", COLOR_BOLD, COLOR_RESET);
 
   printf("%sAll colors working perfectly! ✓%s\n\n", COLOR_GREEN, COLOR_RESET);
+  return 0;
 }
 
-// Execute external command
-void execute_command(char **args) {
-  // Check for I/O redirection
-  handle_io_redirection(args);
-
-  // Check for background execution
-  int background = check_background(args);
-
-  // Create child process using fork()
-  pid_t pid = fork();
-
-  if (pid < 0) {
-    printf("%sError: fork failed%s\n", COLOR_RED, COLOR_RESET);
-    return;
-  }
+// ============================================================================
+// COMMAND EXECUTION & JOB CONTROL
+// ============================================================================
 
-  if (pid == 0) {
-    // Child process - execute command using execvp()
-    if (execvp(args[0], args) < 0) {
-      printf("%sError: Command '%s' not found%s\n", COLOR_RED, args[0],
-             COLOR_RESET);
-      exit(1);
+// Execute a command line: built-ins run in the shell, everything else (and
+// any pipeline or background job) runs in its own process group
+int execute_command(char **args) {
+  Pipeline pipeline;
+  ExecLimits limits;
+  ExecLimits *run_limits = NULL;
+  int timed = 0;
+  int perf = 0;
+  long long parse_start = monotonic_ns();
+
+  // A line of only NAME=value words sets shell variables
+  if (is_assignment(args[0])) {
+    int i = 1;
+    while (args[i] != NULL && is_assignment(args[i])) {
+      i++;
     }
-  } else {
-    // Parent process
-    if (background) {
-      // Don't wait for background process
-      printf("%s[%d] %d%s\n", COLOR_YELLOW, job_count + 1, pid, COLOR_RESET);
-      add_background_job(pid, args[0]);
-    } else {
-      // Wait for foreground process using waitpid()
-      int status;
-      waitpid(pid, &status, 0);
+    if (args[i] == NULL) {
+      return assign_variables(args);
     }
   }
-}
 
-// Handle I/O redirection (>, <, >>)
-void handle_io_redirection(char **args) {
-  for (int i = 0; args[i] != NULL; i++) {
-    // Output redirection: >
-    if (strcmp(args[i], ">") == 0) {
-      int fd = open(args[i + 1], O_WRONLY | O_CREAT | O_TRUNC, 0644);
-      if (fd < 0) {
-        printf("%sError opening output file%s\n", COLOR_RED, COLOR_RESET);
-        return;
+  // Command prefixes: time CMD, perfstat CMD, run [options] CMD
+  while (args[0] != NULL) {
+    if (strcmp(args[0], "perfstat") == 0) {
+      if (args[1] == NULL) {
+        return cmd_perfstat(args);
       }
-      dup2(fd, STDOUT_FILENO);
-      close(fd);
-      args[i] = NULL;
+      perf = 1;
+      args++;
+    } else if (strcmp(args[0], "time") == 0) {
+      if (args[1] == NULL || args[1][0] == '-') {
+        return cmd_time(args);
+      }
+      timed = 1;
+      args++;
+    } else if (strcmp(args[0], "run") == 0 && run_limits == NULL) {
+      int start = parse_run_options(args, &limits);
+      if (start < 0) {
+        return 2;
+      }
+      args += start;
+      run_limits = &limits;
+    } else {
       break;
     }
+  }
 
-    // Append redirection: >>
-    if (strcmp(args[i], ">>") == 0) {
-      int fd = open(args[i + 1], O_WRONLY | O_CREAT | O_APPEND, 0644);
-      if (fd < 0) {
-        printf("%sError opening file for append%s\n", COLOR_RED, COLOR_RESET);
-        return;
+  if (parse_pipeline(args, &pipeline) < 0) {
+    return 2;
+  }
+  pipeline.limits = run_limits;
+  pipeline.timed = timed;
+  pipeline.perf = perf;
+  long long dispatch_start = monotonic_ns();
+  stats_phase(STAT_PARSE, dispatch_start - parse_start);
+
+  // A lone foreground built-in runs in the shell itself so that cd, exit,
+  // fg and friends affect the shell's own state (unless it has limits,
+  // which must never be applied to the shell)
+  Builtin *builtin = NULL;
+  Function *function = NULL;
+  if (pipeline.count == 1 && !pipeline.background && run_limits == NULL) {
+    function = find_function(pipeline.stages[0].argv[0]);
+    if (function == NULL) {
+      builtin = find_builtin(pipeline.stages[0].argv[0]);
+    }
+  }
+
+  int status;
+  if (function != NULL) {
+    stats_phase(STAT_DISPATCH, monotonic_ns() - dispatch_start);
+    status = run_function_in_shell(&pipeline, function);
+  } else if (builtin != NULL) {
+    status = run_builtin_in_shell(&pipeline, builtin, dispatch_start);
+  } else {
+    stats_phase(STAT_DISPATCH, monotonic_ns() - dispatch_start);
+    status = launch_pipeline(&pipeline);
+  }
+  free_pipeline(&pipeline);
+  return status;
+}
+
+// Run a single built-in inside the shell with its redirections, measured
+// for `time`, `perfstat` and `stats`
+int run_builtin_in_shell(Pipeline *pipeline, Builtin *builtin,
+                         long long dispatch_start) {
+  Command *cmd = &pipeline->stages[0];
+  int timed = pipeline->timed;
+  int perf = pipeline->perf;
+  int measure = timed || perf || time_auto_threshold > 0;
+  struct rusage self_before, child_before;
+  struct timespec start, end;
+  JobProcess self;
+
+  memset(&self, 0, sizeof(self));
+  snprintf(self.name, sizeof(self.name), "%s (built-in)", cmd->argv[0]);
+  if (perf) {
+    // Count the shell itself while the built-in runs
+    perf_open(&self.perf, 0);
+  }
+  if (measure) {
+    getrusage(RUSAGE_SELF, &self_before);
+    getrusage(RUSAGE_CHILDREN, &child_before);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+  }
+
+  fflush(stdout);
+  int saved_in = dup(STDIN_FILENO);
+  int saved_out = dup(STDOUT_FILENO);
+  int status = 1;
+
+  if (apply_redirections(cmd) == 0) {
+    long long run_start = monotonic_ns();
+    stats_phase(STAT_DISPATCH, run_start - dispatch_start);
+    status = builtin->fn(cmd->argv);
+    long long run_ns = monotonic_ns() - run_start;
+    stats_phase(STAT_RUN, run_ns);
+    stats_command(cmd->argv[0], status, run_ns);
+  }
+
+  fflush(stdout);
+  dup2(saved_in, STDIN_FILENO);
+  dup2(saved_out, STDOUT_FILENO);
+  close(saved_in);
+  close(saved_out);
+
+  if (measure) {
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double wall = timespec_diff(&start, &end);
+    if (perf) {
+      for (int i = 0; i < self.perf.count; i++) {
+        ioctl(self.perf.fds[i], PERF_EVENT_IOC_DISABLE, 0);
       }
-      dup2(fd, STDOUT_FILENO);
-      close(fd);
-      args[i] = NULL;
+      print_perf_report(pipeline->text, wall, &self, 1);
+      perf_close(&self.perf);
+    }
+    if (timed || (time_auto_threshold > 0 && wall >= time_auto_threshold)) {
+      // Built-ins cost the shell itself plus anything it waited for
+      struct rusage self_after, child_after;
+      getrusage(RUSAGE_SELF, &self_after);
+      getrusage(RUSAGE_CHILDREN, &child_after);
+      self.status = W_EXITCODE(status & 0xff, 0);
+      rusage_delta(&self.usage, &self_after, &self_before);
+      add_rusage_delta(&self.usage, &child_after, &child_before);
+      print_timing_report(pipeline->text, wall, &self, 1);
+    }
+  }
+  return status;
+}
+
+// Append a word to a command's argv, keeping it NULL-terminated
+int command_add_arg(Command *cmd, char *word) {
+  if (cmd->argc + 2 > cmd->capacity) {
+    int capacity = cmd->capacity ? cmd->capacity * 2 : 16;
+    char **grown = realloc(cmd->argv, capacity * sizeof(char *));
+    if (grown == NULL) {
+      return -1;
+    }
+    cmd->argv = grown;
+    cmd->capacity = capacity;
+  }
+  cmd->argv[cmd->argc++] = word;
+  cmd->argv[cmd->argc] = NULL;
+  return 0;
+}
+
+// Expand one word into cmd's argv. A word that expands to nothing is
+// dropped, command output and $@ are split into words, and a pattern with
+// no matches stays as typed. Returns -1 if a substitution failed.
+int expand_arg(Command *cmd, char *arg, Arena *arena) {
+  char *word = expand_word(arg, arena);
+  if (word == NULL) {
+    return -1;
+  }
+  int split = word != arg && word_needs_splitting(arg);
+  for (char *save = NULL,
+            *field = split ? strtok_r(word, " \t\n", &save) : word;
+       field != NULL; field = split ? strtok_r(NULL, " \t\n", &save) : NULL) {
+    if (field[0] == '\0' && word != arg) {
+      continue;
+    }
+    if (has_glob_chars(field) && glob_expand(field, cmd, arena) > 0) {
+      continue;
+    }
+    command_add_arg(cmd, field);
+  }
+  return 0;
+}
+
+// Split args at "|" into stages, pulling out redirections and a trailing
+// "&", and expanding glob patterns. On failure nothing needs freeing.
+int parse_pipeline(char **args, Pipeline *pipeline) {
+  Command *cmd;
+
+  memset(pipeline, 0, sizeof(*pipeline));
+  pipeline->count = 1;
+  pipeline->in_fd = STDIN_FILENO;
+  pipeline->out_fd = STDOUT_FILENO;
+  cmd = &pipeline->stages[0];
+
+  // Remember the original text for the job table
+  for (int i = 0; args[i] != NULL; i++) {
+    size_t used = strlen(pipeline->text);
+    snprintf(pipeline->text + used, sizeof(pipeline->text) - used, "%s%s",
+             i > 0 ? " " : "", args[i]);
+  }
+
+  for (int i = 0; args[i] != NULL; i++) {
+    if (strcmp(args[i], "&") == 0 && args[i + 1] == NULL) {
+      pipeline->background = 1;
       break;
     }
 
-    // Input redirection: <
-    if (strcmp(args[i], "<") == 0) {
-      int fd = open(args[i + 1], O_RDONLY);
-      if (fd < 0) {
-        printf("%sError opening input file%s\n", COLOR_RED, COLOR_RESET);
-        return;
+    if (strcmp(args[i], "|") == 0) {
+      if (cmd->argc == 0 || pipeline->count == MAX_STAGES) {
+        printf("%sError: Invalid pipeline%s\n", COLOR_RED, COLOR_RESET);
+        free_pipeline(pipeline);
+        return -1;
       }
-      dup2(fd, STDIN_FILENO);
-      close(fd);
-      args[i] = NULL;
-      break;
+      cmd = &pipeline->stages[pipeline->count++];
+      continue;
+    }
+
+    if (strcmp(args[i], ">") == 0 || strcmp(args[i], ">>") == 0 ||
+        strcmp(args[i], "<") == 0) {
+      if (args[i + 1] == NULL) {
+        printf("%sError: Missing file for '%s'%s\n", COLOR_RED, args[i],
+               COLOR_RESET);
+        free_pipeline(pipeline);
+        return -1;
+      }
+      char *file = expand_word(args[i + 1], &pipeline->strings);
+      if (file == NULL) {
+        free_pipeline(pipeline);
+        return -1;
+      }
+      if (args[i][0] == '<') {
+        cmd->in_file = file;
+      } else {
+        cmd->out_file = file;
+        cmd->append = args[i][1] == '>';
+      }
+      i++;
+      continue;
+    }
+
+    if (expand_arg(cmd, args[i], &pipeline->strings) < 0) {
+      free_pipeline(pipeline);
+      return -1;
+    }
+  }
+  glob_cache_clear();
+
+  if (cmd->argc == 0) {
+    if (pipeline->count > 1) {
+      printf("%sError: Invalid pipeline%s\n", COLOR_RED, COLOR_RESET);
+    }
+    free_pipeline(pipeline);
+    return -1;
+  }
+
+  if (pipeline->background) {
+    size_t len = strlen(pipeline->text);
+    if (len >= 2) {
+      pipeline->text[len - 2] = '\0';
     }
   }
+  return 0;
 }
 
-// Handle piping (cmd1 | cmd2)
-void handle_pipe(char **args) {
-  int pipefd[2];
-  char *cmd1[MAX_ARGS];
-  char *cmd2[MAX_ARGS];
-  int i, j;
-
-  // Split commands at pipe symbol
-  i = 0;
-  while (args[i] != NULL && strcmp(args[i], "|") != 0) {
-    cmd1[i] = args[i];
-    i++;
+// Build a one-command pipeline from words that were already expanded when
+// the caller's own command line was parsed (timeout, parallel and watch
+// run their argument words this way). The words are taken literally: a
+// second expansion would run $(...) found in data, and "|", ">" or "&"
+// coming from an expansion are arguments, not syntax.
+int parse_expanded_pipeline(char **args, Pipeline *pipeline) {
+  Command *cmd;
+
+  memset(pipeline, 0, sizeof(*pipeline));
+  pipeline->count = 1;
+  pipeline->in_fd = STDIN_FILENO;
+  pipeline->out_fd = STDOUT_FILENO;
+  cmd = &pipeline->stages[0];
+
+  for (int i = 0; args[i] != NULL; i++) {
+    size_t used = strlen(pipeline->text);
+    snprintf(pipeline->text + used, sizeof(pipeline->text) - used, "%s%s",
+             i > 0 ? " " : "", args[i]);
+    char *word = arena_strndup(&pipeline->strings, args[i], strlen(args[i]));
+    if (word == NULL || command_add_arg(cmd, word) < 0) {
+      free_pipeline(pipeline);
+      return -1;
+    }
+  }
+  if (cmd->argc == 0) {
+    free_pipeline(pipeline);
+    return -1;
   }
-  cmd1[i] = NULL;
+  return 0;
+}
 
-  // Get second command
-  i++; // Skip the pipe symbol
-  j = 0;
-  while (args[i] != NULL) {
-    cmd2[j++] = args[i++];
+void free_pipeline(Pipeline *pipeline) {
+  for (int i = 0; i < pipeline->count; i++) {
+    free(pipeline->stages[i].argv);
+    pipeline->stages[i].argv = NULL;
+    pipeline->stages[i].argc = 0;
+    pipeline->stages[i].capacity = 0;
   }
-  cmd2[j] = NULL;
+  arena_free(&pipeline->strings);
+}
 
-  // Create pipe using pipe() system call
-  if (pipe(pipefd) < 0) {
-    printf("%sError: Pipe creation failed%s\n", COLOR_RED, COLOR_RESET);
-    return;
+// Handle I/O redirection (>, <, >>) for one command. Runs in the child, or
+// in the shell around a built-in.
+int apply_redirections(Command *cmd) {
+  // Input redirection: <
+  if (cmd->in_file != NULL) {
+    int fd = open(cmd->in_file, O_RDONLY);
+    if (fd < 0) {
+      printf("%sError opening input file%s\n", COLOR_RED, COLOR_RESET);
+      return -1;
+    }
+    dup2(fd, STDIN_FILENO);
+    close(fd);
   }
 
-  // Fork first child for first command
-  pid_t pid1 = fork();
+  // Output redirection: > or >>
+  if (cmd->out_file != NULL) {
+    int flags = O_WRONLY | O_CREAT | (cmd->append ? O_APPEND : O_TRUNC);
+    int fd = open(cmd->out_file, flags, 0644);
+    if (fd < 0) {
+      printf("%sError opening output file%s\n", COLOR_RED, COLOR_RESET);
+      return -1;
+    }
+    dup2(fd, STDOUT_FILENO);
+    close(fd);
+  }
 
-  if (pid1 < 0) {
-    printf("%sError: Fork failed%s\n", COLOR_RED, COLOR_RESET);
-    return;
+  return 0;
+}
+
+// Child side of a pipeline stage: join the job's process group, wire up the
+// pipe ends and redirections, then exec (or run the built-in and exit)
+void launch_process(Command *cmd, pid_t pgid, int in_fd, int out_fd,
+                    int foreground, ExecLimits *limits) {
+  // Without job control (a script or pipe on stdin) children stay in the
+  // shell's process group, so a Ctrl-C at the terminal still reaches them
+  if (shell_interactive) {
+    pid_t pid = getpid();
+    if (pgid == 0) {
+      pgid = pid;
+    }
+    setpgid(pid, pgid);
+    if (foreground) {
+      tcsetpgrp(shell_terminal, pgid);
+    }
   }
 
-  if (pid1 == 0) {
-    // First child: execute first command
-    dup2(pipefd[1], STDOUT_FILENO);
-    close(pipefd[0]);
-    close(pipefd[1]);
+  setup_child_signals();
+  // A built-in stage may poll the event loop; the export timer belongs to
+  // the shell. Only drop this copy: timerfd_settime here would disarm the
+  // shell's timer too, since fork shares the open file description.
+  stats_export_stop();
+
+  if (perf_gate[0] >= 0) {
+    // Wait for the shell to attach perf counters (EOF when it is done)
+    char c;
+    close(perf_gate[1]);
+    while (read(perf_gate[0], &c, 1) < 0 && errno == EINTR) {
+    }
+    close(perf_gate[0]);
+  }
 
-    if (execvp(cmd1[0], cmd1) < 0) {
-      printf("%sError: Command '%s' not found%s\n", COLOR_RED, cmd1[0],
-             COLOR_RESET);
-      exit(1);
+  if (limits != NULL && apply_exec_limits(limits) < 0) {
+    fflush(stdout);
+    _exit(126);
+  }
+
+  // Already built by the parent, so this is just a pointer swap; execvp
+  // then searches the shell's PATH and passes its exported variables
+  extern char **environ;
+  environ = env_envp();
+
+  if (in_fd != STDIN_FILENO) {
+    dup2(in_fd, STDIN_FILENO);
+    close(in_fd);
+  }
+  if (out_fd != STDOUT_FILENO) {
+    dup2(out_fd, STDOUT_FILENO);
+    close(out_fd);
+  }
+
+  if (apply_redirections(cmd) < 0) {
+    fflush(stdout);
+    _exit(1);
+  }
+
+  Function *function = find_function(cmd->argv[0]);
+  Builtin *builtin = function == NULL ? find_builtin(cmd->argv[0]) : NULL;
+  if (builtin != NULL || function != NULL) {
+    // Built-ins that wait on their own children still reap via the
+    // inherited signalfd, which needs SIGCHLD blocked again
+    sigset_t chld_mask;
+    sigemptyset(&chld_mask);
+    sigaddset(&chld_mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &chld_mask, NULL);
+
+    int status = function != NULL ? call_function(function, cmd->argv)
+                                  : builtin->fn(cmd->argv);
+    fflush(NULL);
+    _exit(status);
+  }
+
+  // Execute command using execvp()
+  execvp(cmd->argv[0], cmd->argv);
+  printf("%sError: Command '%s' not found%s\n", COLOR_RED, cmd->argv[0],
+         COLOR_RESET);
+  fflush(stdout);
+  _exit(127);
+}
+
+// Fork every stage of a pipeline into one process group without waiting.
+// Returns the new job's slot, or -1 if nothing could be started.
+int start_pipeline(Pipeline *pipeline, int foreground) {
+  int slot = create_job(pipeline->text, foreground);
+  if (slot < 0) {
+    printf("%sError: Cannot allocate job%s\n", COLOR_RED, COLOR_RESET);
+    return -1;
+  }
+
+  Job *job = &job_table[slot];
+  int in_fd = pipeline->in_fd;
+  int pipefd[2];
+
+  job->timed = pipeline->timed;
+  job->perf = pipeline->perf;
+  if (job->perf && pipe2(perf_gate, O_CLOEXEC) < 0) {
+    job->perf = 0;
+  }
+  if (pipeline->limits != NULL) {
+    snprintf(job->limits, sizeof(job->limits), "%s", pipeline->limits->desc);
+    if (pipeline->limits->use_cgroup &&
+        create_job_cgroup(pipeline->limits, job->job_id) == 0) {
+      snprintf(job->cgroup_path, sizeof(job->cgroup_path), "%s",
+               pipeline->limits->cgroup_path);
     }
   }
 
-  // Fork second child for second command
-  pid_t pid2 = fork();
+  // Anything buffered now would otherwise be flushed by every child
+  fflush(stdout);
+  env_envp();
 
-  if (pid2 < 0) {
-    printf("%sError: Fork failed%s\n", COLOR_RED, COLOR_RESET);
-    return;
+  for (int i = 0; i < pipeline->count; i++) {
+    int out_fd = pipeline->out_fd;
+    int last = i == pipeline->count - 1;
+
+    if (!last) {
+      // Create pipe using pipe() system call
+      if (pipe2(pipefd, O_CLOEXEC) < 0) {
+        printf("%sError: Pipe creation failed%s\n", COLOR_RED, COLOR_RESET);
+        break;
+      }
+      out_fd = pipefd[1];
+    }
+
+    // Create child process using fork()
+    pid_t pid = fork();
+    if (pid < 0) {
+      printf("%sError: fork failed%s\n", COLOR_RED, COLOR_RESET);
+      if (!last) {
+        close(pipefd[0]);
+        close(pipefd[1]);
+      }
+      break;
+    }
+
+    if (pid == 0) {
+      // Built-in stages never exec, so O_CLOEXEC does not drop the next
+      // stage's read end; holding it would hide EPIPE from the writer
+      if (!last) {
+        close(pipefd[0]);
+      }
+      launch_process(&pipeline->stages[i], job->pgid, in_fd, out_fd,
+                     job->foreground, pipeline->limits);
+    }
+
+    // Parent: mirror setpgid to avoid racing the child. Without job
+    // control pgid is just the first process, naming the job.
+    if (job->pgid == 0) {
+      job->pgid = pid;
+    }
+    if (shell_interactive) {
+      setpgid(pid, job->pgid);
+    }
+    add_job_process(slot, pid);
+    if (job->nprocs > 0) {
+      snprintf(job->procs[job->nprocs - 1].name,
+               sizeof(job->procs[0].name), "%s",
+               pipeline->stages[i].argv[0]);
+    }
+
+    if (in_fd != pipeline->in_fd) {
+      close(in_fd);
+    }
+    if (!last) {
+      close(out_fd);
+      in_fd = pipefd[0];
+    }
+  }
+  if (in_fd != pipeline->in_fd) {
+    close(in_fd);
+  }
+
+  if (job->perf) {
+    for (int i = 0; i < job->nprocs; i++) {
+      perf_open(&job->procs[i].perf, job->procs[i].pid);
+    }
+    close(perf_gate[0]);
+    close(perf_gate[1]);
+    perf_gate[0] = perf_gate[1] = -1;
+  }
+
+  if (job->nprocs == 0) {
+    free_job(slot);
+    return -1;
+  }
+  return slot;
+}
+
+// Launch a pipeline and either wait for it (foreground) or register it as
+// a background job
+int launch_pipeline(Pipeline *pipeline) {
+  long long spawn_start = monotonic_ns();
+  int slot = start_pipeline(pipeline, !pipeline->background);
+  stats_phase(STAT_SPAWN, monotonic_ns() - spawn_start);
+  if (slot < 0) {
+    return 1;
+  }
+
+  Job *job = &job_table[slot];
+  if (!job->foreground) {
+    put_job_in_background(slot, 0);
+    printf("%s[%d] %d%s\n", COLOR_YELLOW, job->job_id, job->pgid, COLOR_RESET);
+    return 0;
+  }
+  return put_job_in_foreground(slot, 0);
+}
+
+// Give the terminal to a job, optionally continue it, and wait for it to
+// finish or stop. Returns the job's exit code.
+int put_job_in_foreground(int slot, int cont) {
+  Job *job = &job_table[slot];
+
+  job->foreground = 1;
+  if (shell_interactive) {
+    tcsetpgrp(shell_terminal, job->pgid);
+    if (cont && job->has_tmodes) {
+      tcsetattr(shell_terminal, TCSADRAIN, &job->tmodes);
+    }
+  }
+  if (cont) {
+    for (int i = 0; i < job->nprocs; i++) {
+      if (job->procs[i].state == JOB_STOPPED) {
+        job->procs[i].state = JOB_RUNNING;
+      }
+    }
+    job->state = JOB_RUNNING;
+    job_signal(job, SIGCONT);
   }
 
-  if (pid2 == 0) {
-    // Second child: execute second command
-    dup2(pipefd[0], STDIN_FILENO);
-    close(pipefd[0]);
-    close(pipefd[1]);
+  long long wait_start = monotonic_ns();
+  int code = wait_for_job(slot);
+  stats_phase(STAT_WAIT, monotonic_ns() - wait_start);
 
-    if (execvp(cmd2[0], cmd2) < 0) {
-      printf("%sError: Command '%s' not found%s\n", COLOR_RED, cmd2[0],
+  if (shell_interactive) {
+    tcsetpgrp(shell_terminal, shell_pgid);
+    if (job->state == JOB_STOPPED) {
+      tcgetattr(shell_terminal, &job->tmodes);
+      job->has_tmodes = 1;
+    }
+    tcsetattr(shell_terminal, TCSADRAIN, &shell_tmodes);
+  }
+
+  if (job->state == JOB_STOPPED) {
+    job->foreground = 0;
+    job->sequence = ++job_sequence;
+    printf("\n%s[%d]+ Stopped - %s%s\n", COLOR_YELLOW, job->job_id,
+           job->command, COLOR_RESET);
+  } else {
+    if (WIFSIGNALED(job->status) && WTERMSIG(job->status) == SIGINT) {
+      printf("\n");
+    } else if (WIFSIGNALED(job->status) && WTERMSIG(job->status) != SIGPIPE) {
+      printf("%s%s%s\n", COLOR_RED, strsignal(WTERMSIG(job->status)),
              COLOR_RESET);
-      exit(1);
     }
+    stats_record_job(job);
+    report_job_perf(job);
+    report_job_timing(job);
+    free_job(slot);
   }
+  return code;
+}
+
+// Send a signal to a job: its process group, or each of its processes that
+// is still running when there is no job control (and so no group)
+int job_signal(Job *job, int signo) {
+  if (shell_interactive) {
+    return kill(-job->pgid, signo);
+  }
+  int sent = 0;
+  for (int i = 0; i < job->nprocs; i++) {
+    if (job->procs[i].state != JOB_DONE && kill(job->procs[i].pid, signo) == 0) {
+      sent++;
+    }
+  }
+  if (sent == 0) {
+    errno = ESRCH;
+    return -1;
+  }
+  return 0;
+}
 
-  // Parent: close pipe and wait for both children
-  close(pipefd[0]);
-  close(pipefd[1]);
+// Run a job in the background, sending SIGCONT if it was stopped
+void put_job_in_background(int slot, int cont) {
+  Job *job = &job_table[slot];
 
-  waitpid(pid1, NULL, 0);
-  waitpid(pid2, NULL, 0);
+  job->foreground = 0;
+  job->sequence = ++job_sequence;
+  if (cont) {
+    for (int i = 0; i < job->nprocs; i++) {
+      if (job->procs[i].state == JOB_STOPPED) {
+        job->procs[i].state = JOB_RUNNING;
+      }
+    }
+    job->state = JOB_RUNNING;
+    job_signal(job, SIGCONT);
+  }
 }
 
-// Check if command should run in background
-int check_background(char **args) {
-  int i = 0;
-  while (args[i] != NULL) {
-    i++;
+// Block in the event loop until the job is no longer running
+int wait_for_job(int slot) {
+  Job *job = &job_table[slot];
+
+  reap_children();
+  while (job->state == JOB_RUNNING) {
+    event_wait(-1, sigchld_fd >= 0 ? -1 : 10);
+    reap_children();
   }
+  sigint_received = 0;
 
-  if (i > 0 && strcmp(args[i - 1], "&") == 0) {
-    args[i - 1] = NULL;
-    return 1;
+  if (job->state == JOB_STOPPED) {
+    return 128 + SIGTSTP;
+  }
+  return job_exit_code(job->status);
+}
+
+// Convert a wait status into a shell exit code
+int job_exit_code(int status) {
+  if (WIFEXITED(status)) {
+    return WEXITSTATUS(status);
+  }
+  if (WIFSIGNALED(status)) {
+    return 128 + WTERMSIG(status);
+  }
+  if (WIFSTOPPED(status)) {
+    return 128 + WSTOPSIG(status);
+  }
+  return 1;
+}
+
+// pid map helpers
+int pid_map_insert(pid_t pid, int slot);
+
+int pid_map_find(pid_t pid) {
+  if (pid_map_capacity == 0) {
+    return -1;
+  }
+  unsigned mask = pid_map_capacity - 1;
+  for (unsigned i = (unsigned)pid * 2654435761u & mask;; i = (i + 1) & mask) {
+    if (pid_map[i].pid == pid) {
+      return pid_map[i].slot;
+    }
+    if (pid_map[i].pid == 0) {
+      return -1;
+    }
   }
+}
+
+int pid_map_grow() {
+  PidMapEntry *old = pid_map;
+  int old_capacity = pid_map_capacity;
+  int capacity = old_capacity ? old_capacity * 2 : 64;
+  PidMapEntry *grown = calloc(capacity, sizeof(PidMapEntry));
 
+  if (grown == NULL) {
+    printf("%sError: out of memory for job processes%s\n", COLOR_RED,
+           COLOR_RESET);
+    return -1;
+  }
+  pid_map = grown;
+  pid_map_capacity = capacity;
+  pid_map_count = 0;
+  for (int i = 0; i < old_capacity; i++) {
+    if (old[i].pid != 0) {
+      pid_map_insert(old[i].pid, old[i].slot);
+    }
+  }
+  free(old);
   return 0;
 }
 
-// Add background job to list
-void add_background_job(pid_t pid, char *cmd) {
-  if (job_count < MAX_JOBS) {
-    bg_jobs[job_count].job_id = job_count + 1;
-    bg_jobs[job_count].pid = pid;
-    strncpy(bg_jobs[job_count].command, cmd, 255);
-    bg_jobs[job_count].command[255] = '\0';
-    job_count++;
+// Fails only when the map could not grow and has no free slot left to keep
+// probe chains terminating
+int pid_map_insert(pid_t pid, int slot) {
+  if ((pid_map_count + 1) * 2 > pid_map_capacity && pid_map_grow() < 0 &&
+      pid_map_count + 1 >= pid_map_capacity) {
+    return -1;
   }
+  unsigned mask = pid_map_capacity - 1;
+  unsigned i = (unsigned)pid * 2654435761u & mask;
+  while (pid_map[i].pid != 0 && pid_map[i].pid != pid) {
+    i = (i + 1) & mask;
+  }
+  if (pid_map[i].pid == 0) {
+    pid_map_count++;
+  }
+  pid_map[i].pid = pid;
+  pid_map[i].slot = slot;
+  return 0;
 }
 
-// Remove completed background job
-void remove_background_job(pid_t pid) {
-  for (int i = 0; i < job_count; i++) {
-    if (bg_jobs[i].pid == pid) {
-      printf("\n%s[%d] Done - %s%s\n", COLOR_GREEN, bg_jobs[i].job_id,
-             bg_jobs[i].command, COLOR_RESET);
+// Backward-shift deletion keeps probe chains intact without tombstones
+void pid_map_remove(pid_t pid) {
+  if (pid_map_capacity == 0) {
+    return;
+  }
+  unsigned mask = pid_map_capacity - 1;
+  unsigned i = (unsigned)pid * 2654435761u & mask;
+  while (pid_map[i].pid != pid) {
+    if (pid_map[i].pid == 0) {
+      return;
+    }
+    i = (i + 1) & mask;
+  }
 
-      // Shift remaining jobs
-      for (int j = i; j < job_count - 1; j++) {
-        bg_jobs[j] = bg_jobs[j + 1];
+  unsigned j = i;
+  while (1) {
+    pid_map[i].pid = 0;
+    do {
+      j = (j + 1) & mask;
+      if (pid_map[j].pid == 0) {
+        pid_map_count--;
+        return;
+      }
+      unsigned home = (unsigned)pid_map[j].pid * 2654435761u & mask;
+      // Move j back to i only if its home is not cyclically in (i, j]
+      if (i <= j ? (i < home && home <= j) : (i < home || home <= j)) {
+        continue;
       }
-      job_count--;
       break;
+    } while (1);
+    pid_map[i] = pid_map[j];
+    i = j;
+  }
+}
+
+// Allocate a job slot, returning its index
+int create_job(const char *command, int foreground) {
+  int slot;
+
+  if (job_free_head >= 0) {
+    slot = job_free_head;
+    job_free_head = job_table[slot].next_free;
+  } else {
+    if (job_slots_used == job_capacity) {
+      int new_capacity = job_capacity ? job_capacity * 2 : 16;
+      Job *grown = realloc(job_table, new_capacity * sizeof(Job));
+      if (grown == NULL) {
+        return -1;
+      }
+      job_table = grown;
+      job_capacity = new_capacity;
+    }
+    slot = job_slots_used++;
+  }
+
+  Job *job = &job_table[slot];
+  memset(job, 0, sizeof(*job));
+  job->job_id = slot + 1;
+  job->state = JOB_RUNNING;
+  job->foreground = foreground;
+  job->next_free = -1;
+  job->next_done = -1;
+  strncpy(job->command, command, sizeof(job->command) - 1);
+  clock_gettime(CLOCK_MONOTONIC, &job->start_time);
+
+  job_count++;
+  return slot;
+}
+
+// Record a forked process as part of a job
+void add_job_process(int slot, pid_t pid) {
+  Job *job = &job_table[slot];
+  JobProcess *procs =
+      realloc(job->procs, (job->nprocs + 1) * sizeof(JobProcess));
+  if (procs == NULL) {
+    return;
+  }
+  job->procs = procs;
+  memset(&procs[job->nprocs], 0, sizeof(JobProcess));
+  procs[job->nprocs].pid = pid;
+  procs[job->nprocs].state = JOB_RUNNING;
+  if (pid_map_insert(pid, slot) < 0) {
+    return;
+  }
+  job->nprocs++;
+}
+
+// Release a job slot back to the free list. Jobs still on the notification
+// queue are only marked; notify_done_jobs frees them when it gets there.
+void free_job(int slot) {
+  Job *job = &job_table[slot];
+
+  if (job->queued) {
+    job->silent = 1;
+    return;
+  }
+  for (int i = 0; i < job->nprocs; i++) {
+    if (job->procs[i].state != JOB_DONE) {
+      pid_map_remove(job->procs[i].pid);
+    }
+    perf_close(&job->procs[i].perf);
+  }
+  free(job->procs);
+  job->procs = NULL;
+  if (job->timeout != NULL) {
+    event_remove(job->timeout->fd);
+    close(job->timeout->fd);
+    free(job->timeout);
+    job->timeout = NULL;
+  }
+  if (job->cgroup_path[0] != '\0') {
+    rmdir(job->cgroup_path);
+    job->cgroup_path[0] = '\0';
+  }
+  job->job_id = 0;
+  job->next_free = job_free_head;
+  job_free_head = slot;
+  job_count--;
+}
+
+// Recompute a job's state from its processes
+void update_job_state(Job *job) {
+  int live = 0, stopped = 0;
+
+  for (int i = 0; i < job->nprocs; i++) {
+    if (job->procs[i].state == JOB_RUNNING) {
+      live++;
+    } else if (job->procs[i].state == JOB_STOPPED) {
+      stopped++;
     }
   }
+
+  if (live == 0 && stopped == 0) {
+    job->state = JOB_DONE;
+    job->status = job->procs[job->nprocs - 1].status;
+  } else if (live == 0) {
+    job->state = JOB_STOPPED;
+  } else {
+    job->state = JOB_RUNNING;
+  }
+}
+
+// Queue a background job for reporting at the next prompt
+void queue_job_notification(int slot) {
+  Job *job = &job_table[slot];
+
+  if (job->queued) {
+    return;
+  }
+  job->queued = 1;
+  job->next_done = -1;
+  if (job_done_tail >= 0) {
+    job_table[job_done_tail].next_done = slot;
+  } else {
+    job_done_head = slot;
+  }
+  job_done_tail = slot;
 }
 
-// Signal handler for background process completion
-void signal_handler(int signo) {
-  if (signo == SIGCHLD) {
-    pid_t pid;
-    int status;
+// Reap every exited or stopped child without blocking, recording status and
+// rusage. Only called from the main loop, never from a signal handler.
+void reap_children() {
+  pid_t pid;
+  int status;
+  struct rusage usage;
+
+  while ((pid = wait4(-1, &status, WNOHANG | WUNTRACED | WCONTINUED,
+                      &usage)) > 0) {
+    int slot = pid_map_find(pid);
+    if (slot < 0) {
+      continue;
+    }
+
+    Job *job = &job_table[slot];
+    JobProcess *proc = NULL;
+    for (int i = 0; i < job->nprocs; i++) {
+      if (job->procs[i].pid == pid) {
+        proc = &job->procs[i];
+        break;
+      }
+    }
+    if (proc == NULL) {
+      continue;
+    }
+
+    if (WIFSTOPPED(status)) {
+      proc->state = JOB_STOPPED;
+    } else if (WIFCONTINUED(status)) {
+      proc->state = JOB_RUNNING;
+    } else {
+      proc->state = JOB_DONE;
+      proc->status = status;
+      proc->usage = usage;
+      pid_map_remove(pid);
+    }
 
-    // Reap all zombie processes using waitpid() with WNOHANG
-    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
-      remove_background_job(pid);
+    int old_state = job->state;
+    update_job_state(job);
+    if (job->state == JOB_DONE && old_state != JOB_DONE) {
+      clock_gettime(CLOCK_MONOTONIC, &job->end_time);
+    }
+    if (!job->foreground && !job->managed && job->state != old_state &&
+        job->state != JOB_RUNNING) {
+      queue_job_notification(slot);
     }
   }
 }
+
+// Drain the signalfd and reap whatever has changed state
+void handle_sigchld_event(int fd, void *data) {
+  (void)data;
+  struct signalfd_siginfo info;
+  while (read(fd, &info, sizeof(info)) == sizeof(info)) {
+  }
+  reap_children();
+}
+
+// Report finished or stopped background jobs; called just before the
+// prompt is printed
+// Exit codes of background processes that finished before anyone waited
+// for them, so a later `wait PID` still gets the status once (POSIX's
+// remembered statuses); the oldest is dropped when full
+#define REMEMBERED_MAX 64
+
+typedef struct {
+  pid_t pid;
+  int code;
+} RememberedStatus;
+
+RememberedStatus remembered[REMEMBERED_MAX];
+int remembered_count = 0;
+
+void remember_job(Job *job) {
+  if (job->waited || job->foreground || job->managed ||
+      job->state != JOB_DONE) {
+    return;
+  }
+  for (int i = 0; i < job->nprocs; i++) {
+    if (remembered_count == REMEMBERED_MAX) {
+      memmove(remembered, remembered + 1,
+              (REMEMBERED_MAX - 1) * sizeof(RememberedStatus));
+      remembered_count--;
+    }
+    remembered[remembered_count].pid = job->procs[i].pid;
+    remembered[remembered_count++].code =
+        job_exit_code(job->procs[i].status);
+  }
+}
+
+// Take pid's remembered exit code; 0 if there is none
+int remembered_take(pid_t pid, int *code) {
+  for (int i = remembered_count - 1; i >= 0; i--) {
+    if (remembered[i].pid == pid) {
+      *code = remembered[i].code;
+      memmove(remembered + i, remembered + i + 1,
+              (remembered_count - i - 1) * sizeof(RememberedStatus));
+      remembered_count--;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+void notify_done_jobs() {
+  while (job_done_head >= 0) {
+    int slot = job_done_head;
+    Job *job = &job_table[slot];
+
+    job_done_head = job->next_done;
+    if (job_done_head < 0) {
+      job_done_tail = -1;
+    }
+    job->queued = 0;
+
+    if (job->silent) {
+      remember_job(job);
+      free_job(slot);
+      continue;
+    }
+
+    if (job->state == JOB_STOPPED) {
+      printf("%s[%d]  Stopped - %s%s\n", COLOR_YELLOW, job->job_id,
+             job->command, COLOR_RESET);
+      continue;
+    }
+    if (job->state != JOB_DONE) {
+      continue;
+    }
+
+    if (WIFEXITED(job->status) && WEXITSTATUS(job->status) != 0) {
+      printf("%s[%d] Exit %d - %s%s\n", COLOR_YELLOW, job->job_id,
+             WEXITSTATUS(job->status), job->command, COLOR_RESET);
+    } else if (WIFSIGNALED(job->status)) {
+      printf("%s[%d] Killed (%s) - %s%s\n", COLOR_RED, job->job_id,
+             strsignal(WTERMSIG(job->status)), job->command, COLOR_RESET);
+    } else {
+      printf("%s[%d] Done - %s%s\n", COLOR_GREEN, job->job_id, job->command,
+             COLOR_RESET);
+    }
+    stats_record_job(job);
+    report_job_perf(job);
+    report_job_timing(job);
+    remember_job(job);
+    free_job(slot);
+  }
+}
+
+// Restore default signal disposition in a freshly forked child
+void setup_child_signals() {
+  if (shell_interactive) {
+    signal(SIGINT, SIG_DFL);
+    signal(SIGQUIT, SIG_DFL);
+    signal(SIGTSTP, SIG_DFL);
+    signal(SIGTTIN, SIG_DFL);
+    signal(SIGTTOU, SIG_DFL);
+  }
+  sigprocmask(SIG_SETMASK, &shell_orig_mask, NULL);
+}
+
+// Resolve a job spec (%n, %%, %+, %-, %prefix or a bare number) to a slot
+int find_job(const char *spec) {
+  if (spec == NULL || strcmp(spec, "%") == 0 || strcmp(spec, "%%") == 0 ||
+      strcmp(spec, "%+") == 0 || strcmp(spec, "%-") == 0) {
+    // Current job is the most recently started or stopped one
+    int best = -1, second = -1;
+    for (int i = 0; i < job_slots_used; i++) {
+      Job *job = &job_table[i];
+      if (job->job_id == 0 || job->state == JOB_DONE || job->foreground) {
+        continue;
+      }
+      if (best < 0 || job->sequence > job_table[best].sequence) {
+        second = best;
+        best = i;
+      } else if (second < 0 || job->sequence > job_table[second].sequence) {
+        second = i;
+      }
+    }
+    return (spec != NULL && strcmp(spec, "%-") == 0) ? second : best;
+  }
+
+  if (spec[0] == '%') {
+    spec++;
+  }
+  if (spec[0] >= '0' && spec[0] <= '9') {
+    long long id;
+    if (parse_positive(spec, &id) < 0 || id > job_slots_used ||
+        job_table[id - 1].job_id == 0) {
+      return -1;
+    }
+    return id - 1;
+  }
+
+  // %prefix: job whose command starts with the given text
+  for (int i = 0; i < job_slots_used; i++) {
+    if (job_table[i].job_id != 0 &&
+        strncmp(job_table[i].command, spec, strlen(spec)) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+// Signal names understood by kill (and anything else taking -SIG)
+typedef struct {
+  const char *name;
+  int signo;
+} SignalName;
+
+SignalName signal_names[] = {
+    {"HUP", SIGHUP},   {"INT", SIGINT},   {"QUIT", SIGQUIT},
+    {"KILL", SIGKILL}, {"USR1", SIGUSR1}, {"SEGV", SIGSEGV},
+    {"USR2", SIGUSR2}, {"PIPE", SIGPIPE}, {"ALRM", SIGALRM},
+    {"TERM", SIGTERM}, {"CHLD", SIGCHLD}, {"CONT", SIGCONT},
+    {"STOP", SIGSTOP}, {"TSTP", SIGTSTP}, {"TTIN", SIGTTIN},
+    {"TTOU", SIGTTOU}, {"WINCH", SIGWINCH}, {NULL, 0}};
+
+// Parse "TERM", "SIGTERM" or "15"; returns -1 if unknown
+int parse_signal(const char *name) {
+  if (name[0] >= '0' && name[0] <= '9') {
+    long long signo;
+    if (strcmp(name, "0") == 0) {
+      return 0; // kill -0: only check that the target exists
+    }
+    return parse_positive(name, &signo) == 0 && signo < NSIG ? (int)signo
+                                                              : -1;
+  }
+  if (strncasecmp(name, "SIG", 3) == 0) {
+    name += 3;
+  }
+  for (SignalName *s = signal_names; s->name != NULL; s++) {
+    if (strcasecmp(s->name, name) == 0) {
+      return s->signo;
+    }
+  }
+  return -1;
+}
+
+// ============================================================================
+// JOB CONTROL BUILT-INS
+// ============================================================================
+
+int cmd_jobs(char **args) {
+  (void)args;
+  reap_children();
+
+  if (job_count == 0) {
+    printf("%sNo background jobs running.%s\n", COLOR_YELLOW, COLOR_RESET);
+    return 0;
+  }
+
+  printf("\n%s╔═══ Background Jobs ═══╗%s\n", COLOR_CYAN, COLOR_RESET);
+  for (int i = 0; i < job_slots_used; i++) {
+    Job *job = &job_table[i];
+    if (job->job_id == 0 || job->silent || job->foreground) {
+      continue;
+    }
+
+    const char *state = "Running";
+    if (job->state == JOB_STOPPED) {
+      state = "Stopped";
+    } else if (job->state == JOB_DONE) {
+      state = "Done";
+      // Reported here, so the prompt doesn't report it again
+      job->silent = 1;
+    }
+    printf("%s[%d]%s PID: %s%d%s - %s%s%s (%s)", COLOR_YELLOW, job->job_id,
+           COLOR_RESET, COLOR_GREEN, job->pgid, COLOR_RESET, COLOR_WHITE,
+           job->command, COLOR_RESET, state);
+    if (job->limits[0] != '\0') {
+      printf(" %s[%s]%s", COLOR_MAGENTA, job->limits, COLOR_RESET);
+    }
+    printf("\n");
+  }
+  printf("%s╚═══════════════════════╝%s\n\n", COLOR_CYAN, COLOR_RESET);
+  return 0;
+}
+
+int cmd_fg(char **args) {
+  int slot = find_job(args[1]);
+  if (slot < 0 || job_table[slot].state == JOB_DONE) {
+    printf("%sfg: no such job%s\n", COLOR_RED, COLOR_RESET);
+    return 1;
+  }
+  printf("%s\n", job_table[slot].command);
+  return put_job_in_foreground(slot, 1);
+}
+
+int cmd_bg(char **args) {
+  int slot = find_job(args[1]);
+  if (slot < 0 || job_table[slot].state == JOB_DONE) {
+    printf("%sbg: no such job%s\n", COLOR_RED, COLOR_RESET);
+    return 1;
+  }
+  put_job_in_background(slot, 1);
+  printf("%s[%d] %s &%s\n", COLOR_YELLOW, job_table[slot].job_id,
+         job_table[slot].command, COLOR_RESET);
+  return 0;
+}
+
+// Job slot named by a wait operand: %job, or the pid of one of the
+// shell's jobs; -1 if there is none
+int wait_operand(const char *arg) {
+  long long pid;
+  if (arg[0] == '%') {
+    return find_job(arg);
+  }
+  if (parse_positive(arg, &pid) < 0 || pid > INT_MAX) {
+    return -1;
+  }
+  return pid_map_find((pid_t)pid);
+}
+
+// wait [-n] [%job|pid ...]: block until the given jobs (default: all
+// background jobs) finish; -n returns as soon as any one of them finishes.
+// A job that stops instead gives 128+SIGTSTP, as in bash. A PID whose job
+// already finished and was reported gives its remembered status, once.
+int cmd_wait(char **args) {
+  int any = args[1] != NULL && strcmp(args[1], "-n") == 0;
+  int first = any ? 2 : 1;
+  int listed[MAX_ARGS];
+  int known[MAX_ARGS]; // status when listed[k] is -1 (remembered)
+  int nlisted = 0;
+  int code = 0;
+
+  sigint_received = 0;
+  for (int i = first; args[i] != NULL && nlisted < MAX_ARGS; i++) {
+    int slot = wait_operand(args[i]);
+    long long pid;
+    if (slot < 0 && args[i][0] != '%' && parse_positive(args[i], &pid) == 0 &&
+        pid <= INT_MAX && remembered_take((pid_t)pid, &known[nlisted])) {
+      if (any) {
+        return known[nlisted];
+      }
+      listed[nlisted++] = -1;
+      continue;
+    }
+    if (slot < 0) {
+      printf("%swait: %s: no such job%s\n", COLOR_RED, args[i], COLOR_RESET);
+      code = 127;
+      continue;
+    }
+    listed[nlisted++] = slot;
+  }
+  if (args[first] != NULL && nlisted == 0) {
+    return code;
+  }
+
+  if (nlisted > 0 && !any) {
+    for (int k = 0; k < nlisted; k++) {
+      int slot = listed[k];
+      if (slot < 0) {
+        code = known[k];
+        continue;
+      }
+      if (job_table[slot].job_id == 0) {
+        continue; // listed twice and already collected
+      }
+      while (job_table[slot].state == JOB_RUNNING && !sigint_received) {
+        event_wait(-1, sigchld_fd >= 0 ? -1 : 10);
+        reap_children();
+      }
+      if (sigint_received) {
+        return 130;
+      }
+      if (job_table[slot].state == JOB_STOPPED) {
+        code = 128 + SIGTSTP;
+        continue;
+      }
+      code = job_exit_code(job_table[slot].status);
+      job_table[slot].waited = 1;
+      free_job(slot);
+    }
+    return code;
+  }
+
+  while (!sigint_received) {
+    int running = 0, stopped = 0;
+    reap_children();
+
+    for (int i = 0; i < job_slots_used; i++) {
+      Job *job = &job_table[i];
+      if (job->job_id == 0 || job->foreground) {
+        continue;
+      }
+      if (nlisted > 0) {
+        int k = 0;
+        while (k < nlisted && listed[k] != i) {
+          k++;
+        }
+        if (k == nlisted) {
+          continue;
+        }
+      } else if (job->silent) {
+        continue;
+      }
+      if (any && job->state == JOB_DONE) {
+        code = job_exit_code(job->status);
+        job->waited = 1;
+        free_job(i);
+        return code;
+      }
+      running += job->state == JOB_RUNNING;
+      stopped += job->state == JOB_STOPPED;
+    }
+
+    if (running == 0) {
+      if (!any) {
+        return 0;
+      }
+      return stopped > 0 ? 128 + SIGTSTP : 127;
+    }
+    event_wait(-1, sigchld_fd >= 0 ? -1 : 10);
+  }
+  return 130;
+}
+
+// kill [-SIG | -s SIG | -l] %job|pid ...
+int cmd_kill(char **args) {
+  int signo = SIGTERM;
+  int i = 1;
+
+  if (args[1] == NULL) {
+    printf("%sUsage: kill [-SIG | -s SIG | -l] %%job|pid ...%s\n", COLOR_RED,
+           COLOR_RESET);
+    return 1;
+  }
+
+  if (strcmp(args[1], "-l") == 0) {
+    for (SignalName *s = signal_names; s->name != NULL; s++) {
+      printf("%2d) SIG%s\n", s->signo, s->name);
+    }
+    return 0;
+  }
+
+  if (strcmp(args[1], "-s") == 0 && args[2] != NULL) {
+    signo = parse_signal(args[2]);
+    i = 3;
+  } else if (args[1][0] == '-') {
+    signo = parse_signal(args[1] + 1);
+    i = 2;
+  }
+  if (signo < 0) {
+    printf("%skill: invalid signal%s\n", COLOR_RED, COLOR_RESET);
+    return 1;
+  }
+
+  int status = 0;
+  long long pid;
+  for (; args[i] != NULL; i++) {
+    if (args[i][0] == '%') {
+      int slot = find_job(args[i]);
+      if (slot < 0 || job_table[slot].state == JOB_DONE) {
+        printf("%skill: %s: no such job%s\n", COLOR_RED, args[i],
+               COLOR_RESET);
+        status = 1;
+        continue;
+      }
+      Job *job = &job_table[slot];
+      if (job_signal(job, signo) < 0) {
+        printf("%skill: %s%s\n", COLOR_RED, strerror(errno), COLOR_RESET);
+        status = 1;
+      } else if (job->state == JOB_STOPPED && signo != SIGSTOP &&
+                 signo != SIGTSTP && signo != SIGCONT) {
+        // A stopped job can't act on the signal until it runs again
+        job_signal(job, SIGCONT);
+      }
+    } else if (parse_positive(args[i], &pid) < 0 || pid > INT_MAX) {
+      printf("%skill: %s: arguments must be %%job or process IDs%s\n",
+             COLOR_RED, args[i], COLOR_RESET);
+      status = 1;
+    } else if (kill((pid_t)pid, signo) < 0) {
+      printf("%skill: (%s) - %s%s\n", COLOR_RED, args[i], strerror(errno),
+             COLOR_RESET);
+      status = 1;
+    }
+  }
+  return status;
+}
+
+void handle_timeout_timer(int fd, void *data) {
+  TimeoutState *ts = data;
+  uint64_t expirations;
+
+  if (read(fd, &expirations, sizeof(expirations)) != sizeof(expirations)) {
+    return;
+  }
+  if (!ts->fired) {
+    ts->fired = 1;
+    // A stopped job (Ctrl-Z) has to run again to act on the signal
+    if (job_table[ts->slot].state == JOB_STOPPED) {
+      put_job_in_background(ts->slot, 1);
+    }
+    job_signal(&job_table[ts->slot], ts->signo);
+    if (ts->grace > 0) {
+      timerfd_arm(fd, ts->grace, 0);
+    }
+  } else if (!ts->killed) {
+    ts->killed = 1;
+    job_signal(&job_table[ts->slot], SIGKILL);
+  }
+}
+
+// timeout [-s SIG] [-k GRACE] DURATION CMD... - run CMD as a foreground job
+// and signal it if it is still running after DURATION. Exits 124 on a
+// timeout (137 if it had to be killed), otherwise with CMD's status. A
+// DURATION of 0 expires at once. If the job is stopped, the deadline stays
+// with it and still fires.
+int cmd_timeout(char **args) {
+  TimeoutState ts = {-1, 0, SIGTERM, 0, 0, 0};
+  double duration;
+  int i = 1;
+
+  for (; args[i] != NULL && args[i][0] == '-' && args[i + 1] != NULL; i += 2) {
+    if (strcmp(args[i], "-s") == 0) {
+      ts.signo = parse_signal(args[i + 1]);
+    } else if (strcmp(args[i], "-k") == 0) {
+      if (parse_duration(args[i + 1], &ts.grace) < 0) {
+        ts.signo = -1;
+      }
+    } else {
+      break;
+    }
+  }
+  if (args[i] == NULL || args[i + 1] == NULL || ts.signo <= 0 ||
+      parse_duration(args[i], &duration) < 0) {
+    printf("%sUsage: timeout [-s SIG] [-k GRACE] DURATION CMD...%s\n",
+           COLOR_RED, COLOR_RESET);
+    return 125;
+  }
+
+  // args were expanded with the timeout command line; run them as they are
+  Pipeline pipeline;
+  if (parse_expanded_pipeline(&args[i + 1], &pipeline) < 0) {
+    return 125;
+  }
+  ts.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (ts.fd < 0) {
+    printf("%stimeout: %s%s\n", COLOR_RED, strerror(errno), COLOR_RESET);
+    free_pipeline(&pipeline);
+    return 125;
+  }
+
+  int slot = start_pipeline(&pipeline, 1);
+  free_pipeline(&pipeline);
+  if (slot < 0) {
+    close(ts.fd);
+    return 125;
+  }
+  ts.slot = slot;
+  // A zero it_value would disarm the timer, so 0 becomes the shortest wait
+  timerfd_arm(ts.fd, duration >= 1e-9 ? duration : 1e-9, 0);
+  event_add(ts.fd, handle_timeout_timer, &ts);
+
+  // The timer fires from the event loop while the shell waits for the job
+  int job_id = job_table[slot].job_id;
+  int code = put_job_in_foreground(slot, 0);
+  if (job_table[slot].job_id == job_id &&
+      job_table[slot].state == JOB_STOPPED) {
+    // Stopped: hand the deadline to the job, which frees it when freed
+    TimeoutState *kept = malloc(sizeof(TimeoutState));
+    event_remove(ts.fd);
+    if (kept != NULL && event_add(ts.fd, handle_timeout_timer, kept) == 0) {
+      *kept = ts;
+      job_table[slot].timeout = kept;
+      return code;
+    }
+    free(kept);
+  }
+  event_remove(ts.fd);
+  close(ts.fd);
+
+  if (ts.killed) {
+    return 128 + SIGKILL;
+  }
+  return ts.fired ? 124 : code;
+}
+
+// ============================================================================
+// PARALLEL EXECUTION
+// ============================================================================
+
+// One task of a parallel run
+typedef struct {
+  char *arg;
+  int slot;       // job slot while running, -1 otherwise
+  int out_fd;     // captured output when grouping, -1 otherwise
+  int exit_code;
+  double seconds;
+  int state;      // 0 pending, 1 running, 2 finished, 3 printed
+  char command[256];
+} ParallelTask;
+
+double timespec_diff(struct timespec *start, struct timespec *end) {
+  return (end->tv_sec - start->tv_sec) +
+         (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+// Arm a timerfd to fire after seconds (and every seconds if periodic);
+// 0 disarms it
+void timerfd_arm(int fd, double seconds, int periodic) {
+  struct itimerspec spec;
+  memset(&spec, 0, sizeof(spec));
+  spec.it_value.tv_sec = (time_t)seconds;
+  spec.it_value.tv_nsec = (long)((seconds - (time_t)seconds) * 1e9);
+  if (periodic) {
+    spec.it_interval = spec.it_value;
+  }
+  timerfd_settime(fd, 0, &spec, NULL);
+}
+
+// Parse DURATION: a number with an optional s, m, h or d suffix
+int parse_duration(const char *s, double *seconds) {
+  char *end;
+  double value = strtod(s, &end);
+
+  if (end == s || !(value >= 0)) {
+    return -1;
+  }
+  switch (*end) {
+  case '\0':
+  case 's':
+    break;
+  case 'm':
+    value *= 60;
+    break;
+  case 'h':
+    value *= 3600;
+    break;
+  case 'd':
+    value *= 86400;
+    break;
+  default:
+    return -1;
+  }
+  if (*end != '\0' && end[1] != '\0') {
+    return -1;
+  }
+  *seconds = value;
+  return 0;
+}
+
+// Parse a whole decimal number greater than zero (for counts and limits)
+int parse_positive(const char *s, long long *value) {
+  char *end;
+  errno = 0;
+  long long n = strtoll(s, &end, 10);
+  if (end == s || *end != '\0' || errno != 0 || n <= 0) {
+    return -1;
+  }
+  *value = n;
+  return 0;
+}
+
+// Substitute {} (argument), {.} (without extension), {/} (basename) and
+// {#} (sequence number) in one template word; returns how many it replaced
+int parallel_expand_word(const char *word, const char *arg, int seq,
+                         char *out, size_t size) {
+  const char *base = strrchr(arg, '/') ? strrchr(arg, '/') + 1 : arg;
+  const char *dot = strrchr(base, '.');
+  size_t used = 0;
+  int replaced = 0;
+
+  out[0] = '\0';
+  while (*word != '\0' && used < size - 1) {
+    char piece[MAX_LINE];
+    size_t skip = 0;
+
+    if (strncmp(word, "{}", 2) == 0) {
+      snprintf(piece, sizeof(piece), "%s", arg);
+      skip = 2;
+    } else if (strncmp(word, "{.}", 3) == 0) {
+      int len = dot != NULL ? (int)(dot - arg) : (int)strlen(arg);
+      snprintf(piece, sizeof(piece), "%.*s", len, arg);
+      skip = 3;
+    } else if (strncmp(word, "{/}", 3) == 0) {
+      snprintf(piece, sizeof(piece), "%s", base);
+      skip = 3;
+    } else if (strncmp(word, "{#}", 3) == 0) {
+      snprintf(piece, sizeof(piece), "%d", seq);
+      skip = 3;
+    }
+
+    if (skip > 0) {
+      used += snprintf(out + used, size - used, "%s", piece);
+      used = used < size ? used : size - 1;
+      word += skip;
+      replaced++;
+    } else {
+      out[used++] = *word++;
+      out[used] = '\0';
+    }
+  }
+  return replaced;
+}
+
+// Copy a finished task's captured output to stdout
+void parallel_flush_output(ParallelTask *task) {
+  char buffer[65536];
+  ssize_t n;
+
+  if (task->out_fd < 0) {
+    return;
+  }
+  fflush(stdout);
+  lseek(task->out_fd, 0, SEEK_SET);
+  while ((n = read(task->out_fd, buffer, sizeof(buffer))) > 0) {
+    if (write(STDOUT_FILENO, buffer, n) < 0) {
+      break;
+    }
+  }
+  close(task->out_fd);
+  task->out_fd = -1;
+}
+
+// Fork one task as a managed background job
+int parallel_start_task(char **tmpl, ParallelTask *task, int seq, int group,
+                        int null_fd) {
+  char words[MAX_ARGS][MAX_LINE];
+  char *argv[MAX_ARGS];
+  int argc = 0;
+  int has_placeholder = 0;
+
+  for (int i = 0; tmpl[i] != NULL && argc < MAX_ARGS - 2; i++) {
+    has_placeholder |= parallel_expand_word(tmpl[i], task->arg, seq,
+                                            words[argc], MAX_LINE) > 0;
+    argv[argc] = words[argc];
+    argc++;
+  }
+  // Without a placeholder the argument is appended, as in GNU parallel
+  if (!has_placeholder) {
+    snprintf(words[argc], MAX_LINE, "%s", task->arg);
+    argv[argc] = words[argc];
+    argc++;
+  }
+  argv[argc] = NULL;
+
+  // The template and the arguments were expanded with the parallel command
+  // line; substituting {} must not expand them again
+  Pipeline pipeline;
+  if (parse_expanded_pipeline(argv, &pipeline) < 0) {
+    return -1;
+  }
+  snprintf(task->command, sizeof(task->command), "%s", pipeline.text);
+
+  task->out_fd = -1;
+  if (group) {
+    task->out_fd = memfd_create("parallel", MFD_CLOEXEC);
+    if (task->out_fd >= 0) {
+      pipeline.out_fd = task->out_fd;
+    }
+  }
+  pipeline.in_fd = null_fd;
+
+  task->slot = start_pipeline(&pipeline, 0);
+  free_pipeline(&pipeline);
+  if (task->slot < 0) {
+    if (task->out_fd >= 0) {
+      close(task->out_fd);
+      task->out_fd = -1;
+    }
+    return -1;
+  }
+  job_table[task->slot].managed = 1;
+  job_table[task->slot].sequence = ++job_sequence;
+  task->state = 1;
+  return 0;
+}
+
+// parallel [-j N] [-k] [-g] [-q] [--halt-on-error] CMD [ARGS...] ::: A B C
+// Runs CMD once per argument (or per stdin line when ::: is absent) with at
+// most N jobs at a time. {} in CMD is replaced by the argument.
+int cmd_parallel(char **args) {
+  long slots = sysconf(_SC_NPROCESSORS_ONLN);
+  int keep_order = 0, group = 0, quiet = 0, halt_on_error = 0;
+  int i = 1;
+
+  if (slots < 1) {
+    slots = 1;
+  }
+
+  for (; args[i] != NULL && args[i][0] == '-'; i++) {
+    if (strcmp(args[i], "-j") == 0 && args[i + 1] != NULL) {
+      slots = atoi(args[++i]);
+    } else if (strncmp(args[i], "-j", 2) == 0 && args[i][2] != '\0') {
+      slots = atoi(args[i] + 2);
+    } else if (strcmp(args[i], "-k") == 0 ||
+               strcmp(args[i], "--keep-order") == 0) {
+      keep_order = 1;
+      group = 1;
+    } else if (strcmp(args[i], "-g") == 0 ||
+               strcmp(args[i], "--group") == 0) {
+      group = 1;
+    } else if (strcmp(args[i], "-q") == 0) {
+      quiet = 1;
+    } else if (strcmp(args[i], "--halt-on-error") == 0) {
+      halt_on_error = 1;
+    } else {
+      break;
+    }
+  }
+
+  char **tmpl = &args[i];
+  int tmpl_len = 0;
+  while (tmpl[tmpl_len] != NULL && strcmp(tmpl[tmpl_len], ":::") != 0) {
+    tmpl_len++;
+  }
+  if (tmpl_len == 0 || slots < 1) {
+    printf("%sUsage: parallel [-j N] [-k] [-g] [-q] [--halt-on-error] CMD "
+           "[ARGS] ::: A B C%s\n",
+           COLOR_RED, COLOR_RESET);
+    return 1;
+  }
+
+  // Collect arguments from after ::: or from stdin lines
+  ParallelTask *tasks = NULL;
+  int ntasks = 0, capacity = 0;
+  char *line = NULL;
+  size_t line_size = 0;
+  int from_stdin = tmpl[tmpl_len] == NULL;
+  int out_of_memory = 0;
+
+  if (from_stdin && isatty(STDIN_FILENO)) {
+    printf("%sparallel: no arguments (use ::: or pipe them in)%s\n",
+           COLOR_RED, COLOR_RESET);
+    return 1;
+  }
+
+  for (int a = tmpl_len + 1;; a++) {
+    char *arg;
+    if (from_stdin) {
+      ssize_t len = getline(&line, &line_size, stdin);
+      if (len < 0) {
+        break;
+      }
+      if (len > 0 && line[len - 1] == '\n') {
+        line[len - 1] = '\0';
+      }
+      arg = line;
+    } else {
+      if (tmpl[a] == NULL) {
+        break;
+      }
+      arg = tmpl[a];
+    }
+
+    if (ntasks == capacity) {
+      int grown_capacity = capacity ? capacity * 2 : 64;
+      ParallelTask *grown =
+          realloc(tasks, grown_capacity * sizeof(ParallelTask));
+      if (grown == NULL) {
+        out_of_memory = 1;
+        break;
+      }
+      tasks = grown;
+      capacity = grown_capacity;
+    }
+    memset(&tasks[ntasks], 0, sizeof(ParallelTask));
+    tasks[ntasks].arg = strdup(arg);
+    if (tasks[ntasks].arg == NULL) {
+      out_of_memory = 1;
+      break;
+    }
+    tasks[ntasks].slot = -1;
+    tasks[ntasks].out_fd = -1;
+    ntasks++;
+  }
+  free(line);
+  if (out_of_memory) {
+    printf("%sparallel: out of memory%s\n", COLOR_RED, COLOR_RESET);
+    for (int t = 0; t < ntasks; t++) {
+      free(tasks[t].arg);
+    }
+    free(tasks);
+    return 1;
+  }
+
+  // The template ends at ::: for the child's argv
+  char *saved = tmpl[tmpl_len];
+  tmpl[tmpl_len] = NULL;
+
+  int null_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+  int next = 0, running = 0, failed = 0, halted = 0, printed = 0;
+  struct timespec run_start, run_end;
+
+  clock_gettime(CLOCK_MONOTONIC, &run_start);
+  sigint_received = 0;
+
+  while (next < ntasks || running > 0) {
+    // Fill free slots
+    while (running < slots && next < ntasks && !halted && !sigint_received) {
+      ParallelTask *task = &tasks[next];
+      if (parallel_start_task(tmpl, task, next + 1, group, null_fd) < 0) {
+        task->state = 2;
+        task->exit_code = 127;
+        failed++;
+      } else {
+        running++;
+      }
+      next++;
+    }
+    if (halted || sigint_received) {
+      // Stop scheduling: pending tasks are dropped
+      for (int t = next; t < ntasks; t++) {
+        tasks[t].state = 3;
+      }
+      next = ntasks;
+    }
+    if (running == 0) {
+      break;
+    }
+
+    event_wait(-1, sigchld_fd >= 0 ? -1 : 10);
+    reap_children();
+
+    if (sigint_received) {
+      // Ctrl-C cancels the run: pass it on to every running task
+      for (int t = 0; t < ntasks; t++) {
+        if (tasks[t].state == 1) {
+          job_signal(&job_table[tasks[t].slot], SIGINT);
+        }
+      }
+    }
+
+    // Collect finished tasks
+    for (int t = 0; t < ntasks; t++) {
+      ParallelTask *task = &tasks[t];
+      if (task->state != 1 || job_table[task->slot].state != JOB_DONE) {
+        continue;
+      }
+      Job *job = &job_table[task->slot];
+      task->exit_code = job_exit_code(job->status);
+      task->seconds = timespec_diff(&job->start_time, &job->end_time);
+      task->state = 2;
+      free_job(task->slot);
+      task->slot = -1;
+      running--;
+      if (task->exit_code != 0) {
+        failed++;
+        if (halt_on_error) {
+          halted = 1;
+        }
+      }
+      if (!keep_order) {
+        parallel_flush_output(task);
+        task->state = 3;
+      }
+    }
+
+    // In keep-order mode print the finished prefix of the input
+    while (keep_order && printed < ntasks && tasks[printed].state >= 2) {
+      parallel_flush_output(&tasks[printed]);
+      tasks[printed].state = 3;
+      printed++;
+    }
+  }
+  while (keep_order && printed < ntasks) {
+    parallel_flush_output(&tasks[printed++]);
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &run_end);
+  tmpl[tmpl_len] = saved;
+  if (null_fd >= 0) {
+    close(null_fd);
+  }
+
+  // Per-task report on stderr so it never mixes into piped output
+  if (!quiet) {
+    fflush(stdout);
+    fprintf(stderr, "\n%s╔═══ Parallel Report ═══╗%s\n", COLOR_CYAN,
+            COLOR_RESET);
+    for (int t = 0; t < ntasks; t++) {
+      if (tasks[t].command[0] == '\0') {
+        continue;
+      }
+      fprintf(stderr, "%s%4d%s  exit %s%3d%s  %8.3fs  %s\n", COLOR_YELLOW,
+              t + 1, COLOR_RESET,
+              tasks[t].exit_code == 0 ? COLOR_GREEN : COLOR_RED,
+              tasks[t].exit_code, COLOR_RESET, tasks[t].seconds,
+              tasks[t].command);
+    }
+    fprintf(stderr, "%s╚═══════════════════════╝%s\n", COLOR_CYAN,
+            COLOR_RESET);
+    fprintf(stderr, "%d tasks, %d failed, %ld slots, %.3fs wall%s\n\n",
+            ntasks, failed, slots, timespec_diff(&run_start, &run_end),
+            halted ? " (halted on error)" : "");
+  }
+
+  for (int t = 0; t < ntasks; t++) {
+    free(tasks[t].arg);
+  }
+  free(tasks);
+
+  if (sigint_received) {
+    sigint_received = 0;
+    return 130;
+  }
+  return failed > 101 ? 101 : failed;
+}
+
+// ============================================================================
+// RESOURCE CONTROLS (run prefix)
+// ============================================================================
+
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_CLASS_SHIFT 13
+
+// Parse sizes like 512K, 64M, 2G (bytes without a suffix) into *size;
+// returns -1 for anything else, zero, or a value that overflows
+int parse_size(const char *text, rlim_t *size) {
+  char *end;
+  unsigned long long value, scale = 1;
+
+  if (!isdigit((unsigned char)text[0])) {
+    return -1;
+  }
+  errno = 0;
+  value = strtoull(text, &end, 10);
+  if (end == text || errno != 0) {
+    return -1;
+  }
+  switch (*end) {
+  case '\0':
+    break;
+  case 'k':
+  case 'K':
+    scale = 1024ULL;
+    break;
+  case 'm':
+  case 'M':
+    scale = 1024ULL * 1024;
+    break;
+  case 'g':
+  case 'G':
+    scale = 1024ULL * 1024 * 1024;
+    break;
+  default:
+    return -1;
+  }
+  if (scale > 1 && end[1] != '\0') {
+    return -1;
+  }
+  if (value == 0 || __builtin_mul_overflow(value, scale, &value) ||
+      (rlim_t)value == RLIM_INFINITY) {
+    return -1;
+  }
+  *size = (rlim_t)value;
+  return 0;
+}
+
+// Parse a whole decimal in [min, max]; returns -1 otherwise
+int parse_bounded(const char *text, long min, long max, int *value) {
+  char *end;
+  errno = 0;
+  long n = strtol(text, &end, 10);
+  if (end == text || *end != '\0' || errno != 0 || n < min || n > max) {
+    return -1;
+  }
+  *value = (int)n;
+  return 0;
+}
+
+// Turn a --cpu-max value into cpu.max syntax: a percentage of one CPU
+// ("50%", at least 1%) or "QUOTA [PERIOD]" with QUOTA "max" or microseconds
+// and PERIOD separated by a space or '/'
+int parse_cpu_max(const char *text, char *out, size_t size) {
+  char *end;
+
+  if (strchr(text, '%') != NULL) {
+    errno = 0;
+    double pct = strtod(text, &end);
+    if (end == text || strcmp(end, "%") != 0 || errno != 0 || pct < 1 ||
+        pct > 100000) {
+      return -1;
+    }
+    snprintf(out, size, "%lld 100000", (long long)(pct * 1000));
+    return 0;
+  }
+
+  long long quota = 0, period = 100000;
+  const char *rest = text;
+  if (strncmp(text, "max", 3) == 0) {
+    rest = text + 3;
+  } else {
+    errno = 0;
+    quota = strtoll(text, &end, 10);
+    if (end == text || errno != 0 || quota < 1000) {
+      return -1;
+    }
+    rest = end;
+  }
+  if (*rest == ' ' || *rest == '/') {
+    errno = 0;
+    period = strtoll(rest + 1, &end, 10);
+    if (end == rest + 1 || *end != '\0' || errno != 0 || period < 1000 ||
+        period > 1000000) {
+      return -1;
+    }
+  } else if (*rest != '\0') {
+    return -1;
+  }
+  if (quota == 0) {
+    snprintf(out, size, "max %lld", period);
+  } else {
+    snprintf(out, size, "%lld %lld", quota, period);
+  }
+  return 0;
+}
+
+// Parse a CPU list such as "0-3,6"
+int parse_cpu_list(const char *text, cpu_set_t *set) {
+  CPU_ZERO(set);
+  while (*text != '\0') {
+    char *end;
+    long first = strtol(text, &end, 10);
+    long last = first;
+    if (end == text || first < 0) {
+      return -1;
+    }
+    if (*end == '-') {
+      text = end + 1;
+      last = strtol(text, &end, 10);
+      if (end == text || last < first) {
+        return -1;
+      }
+    }
+    for (long cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++) {
+      CPU_SET(cpu, set);
+    }
+    text = *end == ',' ? end + 1 : end;
+    if (*end != ',' && *end != '\0') {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+void append_limit_desc(ExecLimits *limits, const char *option,
+                       const char *value) {
+  size_t used = strlen(limits->desc);
+  snprintf(limits->desc + used, sizeof(limits->desc) - used, "%s%s=%s",
+           used > 0 ? " " : "", option, value);
+}
+
+// Parse `run` options into limits; returns the index where the command
+// starts, or -1 (after printing an error)
+int parse_run_options(char **args, ExecLimits *limits) {
+  int i = 1;
+
+  memset(limits, 0, sizeof(*limits));
+
+  for (; args[i] != NULL && strncmp(args[i], "--", 2) == 0; i++) {
+    char *option = args[i];
+    char *value = args[i + 1];
+
+    if (strcmp(option, "--") == 0) {
+      i++;
+      break;
+    }
+    if (strcmp(option, "--cgroup") == 0) {
+      limits->use_cgroup = 1;
+      continue;
+    }
+    if (value == NULL) {
+      printf("%srun: %s needs a value%s\n", COLOR_RED, option, COLOR_RESET);
+      return -1;
+    }
+    i++;
+
+    if (strcmp(option, "--cpus") == 0) {
+      if (parse_cpu_list(value, &limits->cpus) < 0) {
+        printf("%srun: invalid CPU list '%s'%s\n", COLOR_RED, value,
+               COLOR_RESET);
+        return -1;
+      }
+      limits->has_cpus = 1;
+    } else if (strcmp(option, "--nice") == 0) {
+      if (parse_bounded(value, -20, 19, &limits->nice) < 0) {
+        printf("%srun: invalid nice value '%s' (-20..19)%s\n", COLOR_RED,
+               value, COLOR_RESET);
+        return -1;
+      }
+      limits->has_nice = 1;
+    } else if (strcmp(option, "--ionice") == 0) {
+      // CLASS[:LEVEL] with CLASS one of realtime/best-effort/idle or 1-3
+      char class_name[32];
+      const char *colon = strchr(value, ':');
+      size_t len = colon ? (size_t)(colon - value) : strlen(value);
+      snprintf(class_name, sizeof(class_name), "%.*s", (int)len, value);
+      limits->iolevel = 4;
+      if (strcmp(class_name, "realtime") == 0 ||
+          strcmp(class_name, "1") == 0) {
+        limits->ioclass = 1;
+      } else if (strcmp(class_name, "best-effort") == 0 ||
+                 strcmp(class_name, "2") == 0) {
+        limits->ioclass = 2;
+      } else if (strcmp(class_name, "idle") == 0 ||
+                 strcmp(class_name, "3") == 0) {
+        limits->ioclass = 3;
+      } else {
+        limits->ioclass = 0;
+      }
+      if (limits->ioclass == 0 ||
+          (colon != NULL &&
+           parse_bounded(colon + 1, 0, 7, &limits->iolevel) < 0)) {
+        printf("%srun: invalid ionice '%s' (CLASS[:0-7])%s\n", COLOR_RED,
+               value, COLOR_RESET);
+        return -1;
+      }
+      limits->has_ionice = 1;
+    } else if (strcmp(option, "--mem") == 0) {
+      if (parse_size(value, &limits->mem) < 0) {
+        printf("%srun: invalid size '%s' (e.g. 512K, 64M, 2G)%s\n",
+               COLOR_RED, value, COLOR_RESET);
+        return -1;
+      }
+    } else if (strcmp(option, "--cpu-time") == 0 ||
+               strcmp(option, "--nofile") == 0) {
+      rlim_t *target = strcmp(option, "--nofile") == 0 ? &limits->nofile
+                                                         : &limits->cpu_time;
+      long long number;
+      if (parse_positive(value, &number) < 0 || number > INT_MAX) {
+        printf("%srun: %s needs a positive number, got '%s'%s\n", COLOR_RED,
+               option, value, COLOR_RESET);
+        return -1;
+      }
+      *target = (rlim_t)number;
+    } else if (strcmp(option, "--cpu-max") == 0) {
+      // Percentage of one CPU ("50%") or a raw "QUOTA PERIOD"/"QUOTA/PERIOD"
+      if (parse_cpu_max(value, limits->cpu_max, sizeof(limits->cpu_max)) <
+          0) {
+        printf("%srun: invalid cpu-max '%s' (e.g. 50%% or 50000/100000)%s\n",
+               COLOR_RED, value, COLOR_RESET);
+        return -1;
+      }
+      limits->use_cgroup = 1;
+    } else {
+      printf("%srun: unknown option '%s'%s\n", COLOR_RED, option,
+             COLOR_RESET);
+      return -1;
+    }
+    append_limit_desc(limits, option + 2, value);
+  }
+
+  if (limits->use_cgroup) {
+    append_limit_desc(limits, "cgroup", "on");
+  }
+
+  if (args[i] == NULL) {
+    printf("%sUsage: run [--cpus LIST] [--nice N] [--ionice CLASS[:LEVEL]] "
+           "[--mem SIZE] [--cpu-time SECS] [--nofile N] [--cgroup] "
+           "[--cpu-max PCT] [--] CMD%s\n",
+           COLOR_RED, COLOR_RESET);
+    return -1;
+  }
+  return i;
+}
+
+// Apply limits to the calling process (a freshly forked child)
+int apply_exec_limits(ExecLimits *limits) {
+  struct rlimit rl;
+
+  if (limits->cgroup_path[0] != '\0') {
+    char pid[32];
+    snprintf(pid, sizeof(pid), "%d\n", getpid());
+    if (write_cgroup_file(limits->cgroup_path, "cgroup.procs", pid) < 0) {
+      printf("%srun: cannot join cgroup: %s%s\n", COLOR_YELLOW,
+             strerror(errno), COLOR_RESET);
+    }
+  }
+
+  if (limits->has_cpus &&
+      sched_setaffinity(0, sizeof(limits->cpus), &limits->cpus) < 0) {
+    printf("%srun: sched_setaffinity: %s%s\n", COLOR_RED, strerror(errno),
+           COLOR_RESET);
+    return -1;
+  }
+
+  if (limits->has_nice &&
+      setpriority(PRIO_PROCESS, 0, limits->nice) < 0) {
+    printf("%srun: setpriority: %s%s\n", COLOR_RED, strerror(errno),
+           COLOR_RESET);
+    return -1;
+  }
+
+  if (limits->has_ionice) {
+    int prio = (limits->ioclass << IOPRIO_CLASS_SHIFT) | limits->iolevel;
+    if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, prio) < 0) {
+      printf("%srun: ioprio_set: %s%s\n", COLOR_RED, strerror(errno),
+             COLOR_RESET);
+      return -1;
+    }
+  }
+
+  if (limits->mem > 0) {
+    rl.rlim_cur = rl.rlim_max = limits->mem;
+    if (setrlimit(RLIMIT_AS, &rl) < 0) {
+      printf("%srun: RLIMIT_AS: %s%s\n", COLOR_RED, strerror(errno),
+             COLOR_RESET);
+      return -1;
+    }
+  }
+
+  if (limits->cpu_time > 0) {
+    rl.rlim_cur = limits->cpu_time;
+    rl.rlim_max = limits->cpu_time + 1; // SIGXCPU first, then SIGKILL
+    if (setrlimit(RLIMIT_CPU, &rl) < 0) {
+      printf("%srun: RLIMIT_CPU: %s%s\n", COLOR_RED, strerror(errno),
+             COLOR_RESET);
+      return -1;
+    }
+  }
+
+  if (limits->nofile > 0) {
+    rl.rlim_cur = rl.rlim_max = limits->nofile;
+    if (setrlimit(RLIMIT_NOFILE, &rl) < 0) {
+      printf("%srun: RLIMIT_NOFILE: %s%s\n", COLOR_RED, strerror(errno),
+             COLOR_RESET);
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+// Join dir and file into path; -1 (errno ENAMETOOLONG) if it does not fit
+int cgroup_join(char *path, size_t size, const char *dir, const char *file) {
+  int len = snprintf(path, size, "%s/%s", dir, file);
+  if (len < 0 || (size_t)len >= size) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  return 0;
+}
+
+// Write a single value into a cgroup control file
+int write_cgroup_file(const char *dir, const char *file, const char *value) {
+  char path[PATH_MAX];
+  if (cgroup_join(path, sizeof(path), dir, file) < 0) {
+    return -1;
+  }
+  int fd = open(path, O_WRONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return -1;
+  }
+  int ok = write(fd, value, strlen(value)) >= 0;
+  int saved = errno;
+  close(fd);
+  errno = saved;
+  return ok ? 0 : -1;
+}
+
+// True if a space-separated cgroup control file lists controller `name`
+int cgroup_lists(const char *dir, const char *file, const char *name) {
+  char path[PATH_MAX], line[512];
+  if (cgroup_join(path, sizeof(path), dir, file) < 0) {
+    return 0;
+  }
+  FILE *fp = fopen(path, "re");
+  int found = 0;
+  if (fp == NULL) {
+    return 0;
+  }
+  if (fgets(line, sizeof(line), fp) != NULL) {
+    for (char *tok = strtok(line, " \n"); tok != NULL && !found;
+         tok = strtok(NULL, " \n")) {
+      found = strcmp(tok, name) == 0;
+    }
+  }
+  fclose(fp);
+  return found;
+}
+
+// Directory job cgroups are created under, found once on first use
+char job_cgroup_base[PATH_MAX];
+
+// Set while the shell sits in its own leaf (see prepare_cgroup_base), with
+// the controllers it enabled, so exit can put everything back
+char shell_cgroup_leaf[PATH_MAX];
+char cgroup_enabled[32];
+
+// At exit: drop leftover job cgroups, disable the controllers we enabled,
+// move the shell back to its original cgroup and remove its leaf
+void restore_shell_cgroup(void) {
+  char disable[32], pid_text[32];
+
+  if (shell_cgroup_leaf[0] == '\0' || getpid() != shell_pid) {
+    return; // nothing moved, or a forked child exiting
+  }
+  for (int i = 0; i < job_slots_used; i++) {
+    if (job_table[i].cgroup_path[0] != '\0') {
+      rmdir(job_table[i].cgroup_path); // fails harmlessly while still busy
+    }
+  }
+  snprintf(disable, sizeof(disable), "%s", cgroup_enabled);
+  for (char *p = disable; *p != '\0'; p++) {
+    if (*p == '+') {
+      *p = '-';
+    }
+  }
+  write_cgroup_file(job_cgroup_base, "cgroup.subtree_control", disable);
+  snprintf(pid_text, sizeof(pid_text), "%d", (int)shell_pid);
+  if (write_cgroup_file(job_cgroup_base, "cgroup.procs", pid_text) == 0) {
+    rmdir(shell_cgroup_leaf);
+  }
+  shell_cgroup_leaf[0] = '\0';
+}
+
+// Find the shell's cgroup and make sure children can get cpu and memory
+// controllers. cgroup v2 only enables controllers for the children of a
+// cgroup that holds no processes itself (the root excepted), so when the
+// shell is alone in its cgroup it moves itself into a leaf child
+// myshell-PID for the rest of the session; restore_shell_cgroup undoes
+// that at exit. Otherwise it needs a delegated cgroup whose
+// subtree_control already lists the controllers.
+int prepare_cgroup_base(void) {
+  char line[PATH_MAX], base[PATH_MAX], leaf[PATH_MAX];
+  const char *mount = "/sys/fs/cgroup";
+  const char *wanted[] = {"cpu", "memory"};
+  char enable[32] = "";
+  int missing = 0;
+  FILE *fp;
+
+  if (job_cgroup_base[0] != '\0') {
+    return 0;
+  }
+
+  fp = fopen("/proc/self/cgroup", "re");
+  if (fp == NULL) {
+    return -1;
+  }
+  base[0] = '\0';
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    if (strncmp(line, "0::", 3) == 0) {
+      line[strcspn(line, "\n")] = '\0';
+      int len = snprintf(base, sizeof(base), "%s%s", mount,
+                         strcmp(line + 3, "/") == 0 ? "" : line + 3);
+      if (len < 0 || (size_t)len >= sizeof(base)) {
+        base[0] = '\0';
+      }
+      break;
+    }
+  }
+  fclose(fp);
+  if (base[0] == '\0') {
+    return -1;
+  }
+
+  // Only ask for controllers the parent offers and we do not have yet
+  for (size_t i = 0; i < sizeof(wanted) / sizeof(wanted[0]); i++) {
+    if (!cgroup_lists(base, "cgroup.subtree_control", wanted[i]) &&
+        cgroup_lists(base, "cgroup.controllers", wanted[i])) {
+      size_t used = strlen(enable);
+      snprintf(enable + used, sizeof(enable) - used, "%s+%s",
+               used > 0 ? " " : "", wanted[i]);
+      missing = 1;
+    }
+  }
+
+  if (missing && strcmp(base, mount) != 0) {
+    // Only move the shell if nothing else lives in its cgroup
+    char procs[PATH_MAX], pid_text[32];
+    int others = 0;
+    if (cgroup_join(procs, sizeof(procs), base, "cgroup.procs") < 0 ||
+        (fp = fopen(procs, "re")) == NULL) {
+      return -1;
+    }
+    while (fgets(line, sizeof(line), fp) != NULL) {
+      others |= strtol(line, NULL, 10) != shell_pid;
+    }
+    fclose(fp);
+
+    snprintf(pid_text, sizeof(pid_text), "%d", (int)shell_pid);
+    snprintf(line, sizeof(line), "myshell-%d", (int)shell_pid);
+    if (others || cgroup_join(leaf, sizeof(leaf), base, line) < 0 ||
+        (mkdir(leaf, 0755) < 0 && errno != EEXIST) ||
+        write_cgroup_file(leaf, "cgroup.procs", pid_text) < 0) {
+      printf("%srun: %s is shared with other processes; --cgroup needs a "
+             "delegated cgroup with cpu and memory in its "
+             "cgroup.subtree_control, using rlimits only%s\n",
+             COLOR_YELLOW, base, COLOR_RESET);
+      if (!others) {
+        rmdir(leaf);
+      }
+      return -1;
+    }
+    if (write_cgroup_file(base, "cgroup.subtree_control", enable) < 0) {
+      printf("%srun: cannot enable %s in %s: %s%s\n", COLOR_YELLOW, enable,
+             base, strerror(errno), COLOR_RESET);
+      write_cgroup_file(base, "cgroup.procs", pid_text);
+      rmdir(leaf);
+      return -1;
+    }
+    snprintf(shell_cgroup_leaf, sizeof(shell_cgroup_leaf), "%s", leaf);
+    snprintf(cgroup_enabled, sizeof(cgroup_enabled), "%s", enable);
+    atexit(restore_shell_cgroup);
+  } else if (missing &&
+             write_cgroup_file(base, "cgroup.subtree_control", enable) < 0) {
+    printf("%srun: cannot enable %s in %s: %s%s\n", COLOR_YELLOW, enable,
+           base, strerror(errno), COLOR_RESET);
+    return -1;
+  }
+
+  snprintf(job_cgroup_base, sizeof(job_cgroup_base), "%s", base);
+  return 0;
+}
+
+// Create a cgroup v2 child for one job next to the shell and set cpu.max /
+// memory.max. Best effort: without a usable v2 hierarchy the job still runs
+// with its rlimits.
+int create_job_cgroup(ExecLimits *limits, int job_id) {
+  char name[64];
+
+  limits->cgroup_path[0] = '\0';
+
+  // Pure v2 mounts expose cgroup.controllers at the root
+  if (access("/sys/fs/cgroup/cgroup.controllers", F_OK) != 0) {
+    printf("%srun: cgroup v2 not available, using rlimits only%s\n",
+           COLOR_YELLOW, COLOR_RESET);
+    return -1;
+  }
+  if (prepare_cgroup_base() < 0) {
+    return -1;
+  }
+
+  snprintf(name, sizeof(name), "myshell-%d-job%d", (int)shell_pid, job_id);
+  if (cgroup_join(limits->cgroup_path, sizeof(limits->cgroup_path),
+                  job_cgroup_base, name) < 0 ||
+      (mkdir(limits->cgroup_path, 0755) < 0 && errno != EEXIST)) {
+    printf("%srun: cannot create cgroup: %s%s\n", COLOR_YELLOW,
+           strerror(errno), COLOR_RESET);
+    limits->cgroup_path[0] = '\0';
+    return -1;
+  }
+
+  if (limits->cpu_max[0] != '\0' &&
+      write_cgroup_file(limits->cgroup_path, "cpu.max", limits->cpu_max) <
+          0) {
+    printf("%srun: cpu.max not available%s\n", COLOR_YELLOW, COLOR_RESET);
+  }
+  if (limits->mem > 0) {
+    char value[32];
+    snprintf(value, sizeof(value), "%llu", (unsigned long long)limits->mem);
+    if (write_cgroup_file(limits->cgroup_path, "memory.max", value) < 0) {
+      printf("%srun: memory.max not available%s\n", COLOR_YELLOW,
+             COLOR_RESET);
+    }
+  }
+  return 0;
+}
+
+// run [options] CMD as a pipeline stage (e.g. inside parallel or after a
+// pipe): we are already in the forked child, so apply the limits here and
+// exec directly without an extra wrapper process. At the start of a
+// command line `run` is handled by execute_command instead.
+int cmd_run(char **args) {
+  ExecLimits limits;
+  int start = parse_run_options(args, &limits);
+  if (start < 0) {
+    return 2;
+  }
+  if (getpid() == shell_pid) {
+    // Never limit the shell itself: launch the command as a job instead
+    return execute_command(args);
+  }
+  if (limits.use_cgroup) {
+    // Job cgroups are made by the shell when it starts a job, which has
+    // already happened for this stage
+    printf("%srun: --cgroup and --cpu-max only work at the start of a "
+           "command line, not in a pipeline stage%s\n",
+           COLOR_RED, COLOR_RESET);
+    return 2;
+  }
+  if (apply_exec_limits(&limits) < 0) {
+    return 126;
+  }
+
+  Builtin *builtin = find_builtin(args[start]);
+  if (builtin != NULL) {
+    return builtin->fn(&args[start]);
+  }
+  fflush(stdout);
+  execvp(args[start], &args[start]);
+  printf("%sError: Command '%s' not found%s\n", COLOR_RED, args[start],
+         COLOR_RESET);
+  return 127;
+}
+
+// ============================================================================
+// TIMING & RESOURCE ACCOUNTING
+// ============================================================================
+
+double timeval_seconds(struct timeval *tv) {
+  return tv->tv_sec + tv->tv_usec / 1e6;
+}
+
+void timeval_sub(struct timeval *out, struct timeval *a, struct timeval *b) {
+  out->tv_sec = a->tv_sec - b->tv_sec;
+  out->tv_usec = a->tv_usec - b->tv_usec;
+  if (out->tv_usec < 0) {
+    out->tv_sec--;
+    out->tv_usec += 1000000;
+  }
+}
+
+void timeval_add(struct timeval *out, struct timeval *a) {
+  out->tv_sec += a->tv_sec;
+  out->tv_usec += a->tv_usec;
+  if (out->tv_usec >= 1000000) {
+    out->tv_sec++;
+    out->tv_usec -= 1000000;
+  }
+}
+
+// out = after - before (counters only; maxrss is a peak, so keep after's)
+void rusage_delta(struct rusage *out, struct rusage *after,
+                  struct rusage *before) {
+  memset(out, 0, sizeof(*out));
+  add_rusage_delta(out, after, before);
+}
+
+// out += after - before
+void add_rusage_delta(struct rusage *out, struct rusage *after,
+                      struct rusage *before) {
+  struct timeval tv;
+
+  timeval_sub(&tv, &after->ru_utime, &before->ru_utime);
+  timeval_add(&out->ru_utime, &tv);
+  timeval_sub(&tv, &after->ru_stime, &before->ru_stime);
+  timeval_add(&out->ru_stime, &tv);
+  if (after->ru_maxrss > out->ru_maxrss) {
+    out->ru_maxrss = after->ru_maxrss;
+  }
+  out->ru_minflt += after->ru_minflt - before->ru_minflt;
+  out->ru_majflt += after->ru_majflt - before->ru_majflt;
+  out->ru_nvcsw += after->ru_nvcsw - before->ru_nvcsw;
+  out->ru_nivcsw += after->ru_nivcsw - before->ru_nivcsw;
+}
+
+// Report on a finished job if it was timed or crossed the auto threshold
+void report_job_timing(Job *job) {
+  if (job->state != JOB_DONE || job->managed) {
+    return;
+  }
+  double wall = timespec_diff(&job->start_time, &job->end_time);
+  if (job->timed || (time_auto_threshold > 0 && wall >= time_auto_threshold)) {
+    print_timing_report(job->command, wall, job->procs, job->nprocs);
+  }
+}
+
+// Print wall/user/sys time, peak RSS, page faults and context switches,
+// with a per-stage breakdown for pipelines. Goes to stderr like time(1).
+void print_timing_report(const char *command, double wall, JobProcess *procs,
+                         int nprocs) {
+  struct rusage total;
+  memset(&total, 0, sizeof(total));
+
+  for (int i = 0; i < nprocs; i++) {
+    struct rusage *ru = &procs[i].usage;
+    timeval_add(&total.ru_utime, &ru->ru_utime);
+    timeval_add(&total.ru_stime, &ru->ru_stime);
+    if (ru->ru_maxrss > total.ru_maxrss) {
+      total.ru_maxrss = ru->ru_maxrss;
+    }
+    total.ru_minflt += ru->ru_minflt;
+    total.ru_majflt += ru->ru_majflt;
+    total.ru_nvcsw += ru->ru_nvcsw;
+    total.ru_nivcsw += ru->ru_nivcsw;
+  }
+
+  fflush(stdout);
+  fprintf(stderr, "\n%s╔═══ Timing: %s ═══╗%s\n", COLOR_CYAN, command,
+          COLOR_RESET);
+  fprintf(stderr, "  %sreal%s    %10.3fs\n", COLOR_YELLOW, COLOR_RESET, wall);
+  fprintf(stderr, "  %suser%s    %10.3fs\n", COLOR_YELLOW, COLOR_RESET,
+          timeval_seconds(&total.ru_utime));
+  fprintf(stderr, "  %ssys%s     %10.3fs\n", COLOR_YELLOW, COLOR_RESET,
+          timeval_seconds(&total.ru_stime));
+  fprintf(stderr, "  %smaxrss%s  %10ld KB\n", COLOR_YELLOW, COLOR_RESET,
+          total.ru_maxrss);
+  fprintf(stderr, "  %sfaults%s  %10ld minor, %ld major\n", COLOR_YELLOW,
+          COLOR_RESET, total.ru_minflt, total.ru_majflt);
+  fprintf(stderr, "  %sctxsw%s   %10ld voluntary, %ld involuntary\n",
+          COLOR_YELLOW, COLOR_RESET, total.ru_nvcsw, total.ru_nivcsw);
+
+  if (nprocs > 1) {
+    for (int i = 0; i < nprocs; i++) {
+      struct rusage *ru = &procs[i].usage;
+      fprintf(stderr,
+              "  %sstage %d%s %-14s user %.3fs  sys %.3fs  rss %ld KB  "
+              "exit %d\n",
+              COLOR_GREEN, i + 1, COLOR_RESET, procs[i].name,
+              timeval_seconds(&ru->ru_utime), timeval_seconds(&ru->ru_stime),
+              ru->ru_maxrss, job_exit_code(procs[i].status));
+    }
+  }
+  fprintf(stderr, "%s╚═══════════════════════╝%s\n\n", COLOR_CYAN,
+          COLOR_RESET);
+}
+
+// time CMD            - report what CMD cost (handled as a prefix)
+// time --auto SECS    - report automatically for commands slower than SECS
+// time --auto off     - turn automatic reports off
+int cmd_time(char **args) {
+  if (args[1] != NULL && strcmp(args[1], "--auto") == 0) {
+    if (args[2] == NULL) {
+      if (time_auto_threshold > 0) {
+        printf("%sAuto timing for commands over %.3fs%s\n", COLOR_GREEN,
+               time_auto_threshold, COLOR_RESET);
+      } else {
+        printf("%sAuto timing is off%s\n", COLOR_YELLOW, COLOR_RESET);
+      }
+      return 0;
+    }
+    time_auto_threshold = strcmp(args[2], "off") == 0 ? 0 : atof(args[2]);
+    return 0;
+  }
+
+  if (args[1] == NULL || args[1][0] == '-') {
+    printf("%sUsage: time CMD [ARGS...] | time --auto SECS|off%s\n",
+           COLOR_RED, COLOR_RESET);
+    return 2;
+  }
+
+  // Reached as a pipeline stage: time the rest as its own command
+  return execute_command(args);
+}
+
+// ============================================================================
+// HARDWARE COUNTERS (perfstat)
+// ============================================================================
+
+typedef struct {
+  const char *name;
+  unsigned int type;
+  unsigned long long config;
+} PerfEvent;
+
+// Hardware events first; the software events are always opened so there is
+// something to report on machines (and VMs) without PMU access
+PerfEvent perf_events[PERF_MAX_EVENTS] = {
+    {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {"cache-references", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_REFERENCES},
+    {"cache-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+    {"branches", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_INSTRUCTIONS},
+    {"branch-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+    {"task-clock", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK},
+    {"context-switches", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES},
+    {"cpu-migrations", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CPU_MIGRATIONS},
+    {"page-faults", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS},
+};
+
+enum {
+  PERF_CYCLES,
+  PERF_INSTRUCTIONS,
+  PERF_CACHE_REFS,
+  PERF_CACHE_MISSES,
+  PERF_BRANCHES,
+  PERF_BRANCH_MISSES,
+  PERF_TASK_CLOCK,
+  PERF_CTX_SWITCHES,
+  PERF_MIGRATIONS,
+  PERF_PAGE_FAULTS
+};
+
+int perf_event_open(struct perf_event_attr *attr, pid_t pid, int cpu,
+                    int group_fd, unsigned long flags) {
+  return syscall(SYS_perf_event_open, attr, pid, cpu, group_fd, flags);
+}
+
+// Attach counters to pid (0 = the shell, counted only while enabled).
+// Counters are inherited so a command's own children are included.
+// Returns the number of counters opened.
+int perf_open(PerfCounters *pc, pid_t pid) {
+  pc->count = 0;
+
+  for (int i = 0; i < PERF_MAX_EVENTS; i++) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = perf_events[i].type;
+    attr.config = perf_events[i].config;
+    attr.inherit = 1;
+    attr.exclude_hv = 1;
+    attr.disabled = pid == 0;
+    attr.read_format =
+        PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+    int fd = perf_event_open(&attr, pid, -1, -1, PERF_FLAG_FD_CLOEXEC);
+    if (fd < 0 && (errno == EACCES || errno == EPERM)) {
+      // perf_event_paranoid may still allow user-space only counting
+      attr.exclude_kernel = 1;
+      fd = perf_event_open(&attr, pid, -1, -1, PERF_FLAG_FD_CLOEXEC);
+    }
+    if (fd < 0) {
+      continue;
+    }
+    pc->fds[pc->count] = fd;
+    pc->events[pc->count] = i;
+    pc->count++;
+  }
+
+  if (pid == 0) {
+    for (int i = 0; i < pc->count; i++) {
+      ioctl(pc->fds[i], PERF_EVENT_IOC_RESET, 0);
+      ioctl(pc->fds[i], PERF_EVENT_IOC_ENABLE, 0);
+    }
+  }
+  return pc->count;
+}
+
+void perf_close(PerfCounters *pc) {
+  for (int i = 0; i < pc->count; i++) {
+    close(pc->fds[i]);
+  }
+  pc->count = 0;
+}
+
+// Read every counter into values[] (indexed like perf_events[]), scaling
+// for multiplexing. have[] marks the events that could be counted.
+void perf_read(PerfCounters *pc, double *values, int *have) {
+  for (int i = 0; i < pc->count; i++) {
+    unsigned long long buf[3]; // value, time enabled, time running
+    if (read(pc->fds[i], buf, sizeof(buf)) != sizeof(buf)) {
+      continue;
+    }
+    double value = buf[0];
+    if (buf[2] > 0 && buf[2] < buf[1]) {
+      value = value * buf[1] / buf[2];
+    }
+    values[pc->events[i]] += value;
+    have[pc->events[i]] = 1;
+  }
+}
+
+void report_job_perf(Job *job) {
+  if (job->perf && job->state == JOB_DONE) {
+    print_perf_report(job->command, timespec_diff(&job->start_time,
+                                                  &job->end_time),
+                      job->procs, job->nprocs);
+  }
+}
+
+// perf stat style summary: raw counts, IPC and miss rates, with one line
+// per stage for pipelines. Goes to stderr.
+void print_perf_report(const char *command, double wall, JobProcess *procs,
+                       int nprocs) {
+  double total[PERF_MAX_EVENTS] = {0};
+  int have[PERF_MAX_EVENTS] = {0};
+  double stage[MAX_STAGES][PERF_MAX_EVENTS];
+
+  if (nprocs > MAX_STAGES) {
+    nprocs = MAX_STAGES;
+  }
+  for (int i = 0; i < nprocs; i++) {
+    memset(stage[i], 0, sizeof(stage[i]));
+    perf_read(&procs[i].perf, stage[i], have);
+    for (int e = 0; e < PERF_MAX_EVENTS; e++) {
+      total[e] += stage[i][e];
+    }
+  }
+
+  fflush(stdout);
+  fprintf(stderr, "\n%s╔═══ Counters: %s ═══╗%s\n", COLOR_CYAN, command,
+          COLOR_RESET);
+  for (int e = 0; e < PERF_MAX_EVENTS; e++) {
+    if (!have[e]) {
+      continue;
+    }
+    if (e == PERF_TASK_CLOCK) {
+      fprintf(stderr, "  %s%-17s%s %14.2f ms  (%.2f CPUs utilized)\n",
+              COLOR_YELLOW, perf_events[e].name, COLOR_RESET, total[e] / 1e6,
+              wall > 0 ? total[e] / 1e9 / wall : 0.0);
+    } else {
+      fprintf(stderr, "  %s%-17s%s %14.0f\n", COLOR_YELLOW,
+              perf_events[e].name, COLOR_RESET, total[e]);
+    }
+  }
+
+  if (have[PERF_CYCLES] && have[PERF_INSTRUCTIONS] && total[PERF_CYCLES] > 0) {
+    fprintf(stderr, "  %sIPC%s               %14.2f insn per cycle\n",
+            COLOR_GREEN, COLOR_RESET,
+            total[PERF_INSTRUCTIONS] / total[PERF_CYCLES]);
+  }
+  if (have[PERF_CACHE_MISSES] && total[PERF_CACHE_REFS] > 0) {
+    fprintf(stderr, "  %scache miss rate%s   %13.2f%%\n", COLOR_GREEN,
+            COLOR_RESET,
+            100.0 * total[PERF_CACHE_MISSES] / total[PERF_CACHE_REFS]);
+  }
+  if (have[PERF_BRANCH_MISSES] && total[PERF_BRANCHES] > 0) {
+    fprintf(stderr, "  %sbranch miss rate%s  %13.2f%%\n", COLOR_GREEN,
+            COLOR_RESET,
+            100.0 * total[PERF_BRANCH_MISSES] / total[PERF_BRANCHES]);
+  }
+  if (!have[PERF_TASK_CLOCK] && !have[PERF_CYCLES]) {
+    fprintf(stderr, "  %s(perf_event_open unavailable: %s)%s\n", COLOR_YELLOW,
+            "check /proc/sys/kernel/perf_event_paranoid", COLOR_RESET);
+  } else if (!have[PERF_CYCLES] && !have[PERF_INSTRUCTIONS]) {
+    fprintf(stderr, "  %s(hardware counters unavailable: software events "
+                    "only)%s\n",
+            COLOR_YELLOW, COLOR_RESET);
+  }
+
+  if (nprocs > 1) {
+    for (int i = 0; i < nprocs; i++) {
+      fprintf(stderr, "  %sstage %d%s %-14s %10.2f ms", COLOR_GREEN, i + 1,
+              COLOR_RESET, procs[i].name, stage[i][PERF_TASK_CLOCK] / 1e6);
+      if (stage[i][PERF_CYCLES] > 0) {
+        fprintf(stderr, "  IPC %.2f",
+                stage[i][PERF_INSTRUCTIONS] / stage[i][PERF_CYCLES]);
+      }
+      fprintf(stderr, "\n");
+    }
+  }
+  fprintf(stderr, "%s╚═══════════════════════╝%s\n\n", COLOR_CYAN,
+          COLOR_RESET);
+}
+
+// perfstat CMD - count cycles, instructions, cache and branch misses for a
+// command, pipeline or built-in (handled as a prefix; this is reached as a
+// pipeline stage or without a command)
+int cmd_perfstat(char **args) {
+  if (args[1] == NULL) {
+    printf("%sUsage: perfstat CMD [ARGS...]%s\n", COLOR_RED, COLOR_RESET);
+    return 2;
+  }
+  return execute_command(args);
+}
+
+// ============================================================================
+// STATISTICS (stats)
+// ============================================================================
+
+// Log-linear latency histogram in nanoseconds: values below 16 get their
+// own bucket, above that every power of two is split into 8 sub-buckets,
+// so any recorded value is within 12.5% of its bucket's lower bound.
+#define HIST_SUB_BITS 3
+#define HIST_LINEAR 16
+#define HIST_MAX_EXP 47 // ~39 hours
+#define HIST_BUCKETS                                                           \
+  (HIST_LINEAR + (HIST_MAX_EXP - 3) * (1 << HIST_SUB_BITS))
+#define STATS_TABLE_SIZE 256 // command slots (power of two)
+
+typedef struct {
+  unsigned int counts[HIST_BUCKETS];
+  unsigned long long total;
+  long long sum_ns;
+  long long max_ns;
+} Histogram;
+
+typedef struct {
+  char name[32]; // empty = free slot
+  int builtin;
+  unsigned long long failures;
+  Histogram *latency;
+} CommandStats;
+
+const char *stat_phase_names[STAT_PHASES] = {"parse", "dispatch", "spawn",
+                                             "run", "wait"};
+Histogram stat_phases[STAT_PHASES];
+CommandStats stat_commands[STATS_TABLE_SIZE];
+int stat_command_count = 0;
+
+// Periodic Prometheus dump (`stats --export`)
+char stats_export_path[512] = "";
+int stats_export_fd = -1;
+
+long long monotonic_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+int hist_bucket(long long ns) {
+  if (ns < HIST_LINEAR) {
+    return ns < 0 ? 0 : (int)ns;
+  }
+  int exp = 63 - __builtin_clzll((unsigned long long)ns);
+  if (exp > HIST_MAX_EXP) {
+    return HIST_BUCKETS - 1;
+  }
+  int sub = (ns >> (exp - HIST_SUB_BITS)) & ((1 << HIST_SUB_BITS) - 1);
+  return HIST_LINEAR + (exp - 4) * (1 << HIST_SUB_BITS) + sub;
+}
+
+// Lowest value that falls in a bucket
+long long hist_bucket_value(int bucket) {
+  if (bucket < HIST_LINEAR) {
+    return bucket;
+  }
+  int exp = 4 + (bucket - HIST_LINEAR) / (1 << HIST_SUB_BITS);
+  int sub = (bucket - HIST_LINEAR) % (1 << HIST_SUB_BITS);
+  return (1LL << exp) + ((long long)sub << (exp - HIST_SUB_BITS));
+}
+
+void hist_record(Histogram *h, long long ns) {
+  h->counts[hist_bucket(ns)]++;
+  h->total++;
+  h->sum_ns += ns;
+  if (ns > h->max_ns) {
+    h->max_ns = ns;
+  }
+}
+
+long long hist_quantile(Histogram *h, double q) {
+  if (h->total == 0) {
+    return 0;
+  }
+  unsigned long long rank = (unsigned long long)(q * (h->total - 1)) + 1;
+  unsigned long long seen = 0;
+  for (int i = 0; i < HIST_BUCKETS; i++) {
+    seen += h->counts[i];
+    if (seen >= rank) {
+      long long value = hist_bucket_value(i);
+      return value < h->max_ns ? value : h->max_ns;
+    }
+  }
+  return h->max_ns;
+}
+
+void stats_phase(int phase, long long ns) {
+  hist_record(&stat_phases[phase], ns);
+}
+
+// The slot holding name, or the empty slot where it would go (open
+// addressing, linear probing; one slot is always left empty)
+CommandStats *stats_probe(const char *name) {
+  unsigned int hash = 5381;
+  for (const char *p = name; *p != '\0'; p++) {
+    hash = hash * 33 + (unsigned char)*p;
+  }
+  for (unsigned int i = 0; i < STATS_TABLE_SIZE; i++) {
+    CommandStats *cs = &stat_commands[(hash + i) & (STATS_TABLE_SIZE - 1)];
+    if (cs->name[0] == '\0' ||
+        strncmp(cs->name, name, sizeof(cs->name) - 1) == 0) {
+      return cs;
+    }
+  }
+  return NULL;
+}
+
+// Find or claim a command's slot. When the table is full, commands not
+// already in it are folded into "other".
+CommandStats *stats_lookup(const char *name) {
+  CommandStats *cs = stats_probe(name);
+  if (cs != NULL && cs->name[0] != '\0') {
+    return cs;
+  }
+  if (stat_command_count >= STATS_TABLE_SIZE - 1) {
+    name = "other";
+    cs = stats_probe(name);
+    if (cs != NULL && cs->name[0] != '\0') {
+      return cs;
+    }
+  }
+  if (cs == NULL) {
+    return NULL;
+  }
+  cs->latency = calloc(1, sizeof(Histogram));
+  if (cs->latency == NULL) {
+    return NULL;
+  }
+  snprintf(cs->name, sizeof(cs->name), "%s", name);
+  cs->builtin = find_builtin(name) != NULL;
+  stat_command_count++;
+  return cs;
+}
+
+void stats_command(const char *name, int exit_code, long long ns) {
+  CommandStats *cs = stats_lookup(name);
+  if (cs == NULL) {
+    return;
+  }
+  hist_record(cs->latency, ns);
+  if (exit_code != 0) {
+    cs->failures++;
+  }
+}
+
+// A job finished: its lifetime is the run phase, and every stage counts as
+// a run of its command
+void stats_record_job(Job *job) {
+  if (job->state != JOB_DONE) {
+    return;
+  }
+  long long ns =
+      (job->end_time.tv_sec - job->start_time.tv_sec) * 1000000000LL +
+      (job->end_time.tv_nsec - job->start_time.tv_nsec);
+  stats_phase(STAT_RUN, ns);
+  for (int i = 0; i < job->nprocs; i++) {
+    stats_command(job->procs[i].name, job_exit_code(job->procs[i].status), ns);
+  }
+}
+
+// Escape a Prometheus label value
+void prom_label(FILE *out, const char *value) {
+  for (const char *p = value; *p != '\0'; p++) {
+    if (*p == '"' || *p == '\\') {
+      fputc('\\', out);
+    }
+    if (*p == '\n') {
+      fputs("\\n", out);
+    } else {
+      fputc(*p, out);
+    }
+  }
+}
+
+void prom_summary(FILE *out, const char *metric, const char *label,
+                  const char *value, const char *extra, Histogram *h) {
+  static const double quantiles[] = {0.5, 0.9, 0.99};
+  for (int q = 0; q < 3; q++) {
+    fprintf(out, "%s{%s=\"", metric, label);
+    prom_label(out, value);
+    fprintf(out, "\"%s,quantile=\"%g\"} %.9f\n", extra, quantiles[q],
+            hist_quantile(h, quantiles[q]) / 1e9);
+  }
+  fprintf(out, "%s_sum{%s=\"", metric, label);
+  prom_label(out, value);
+  fprintf(out, "\"%s} %.9f\n", extra, h->sum_ns / 1e9);
+  fprintf(out, "%s_count{%s=\"", metric, label);
+  prom_label(out, value);
+  fprintf(out, "\"%s} %llu\n", extra, h->total);
+}
+
+// Prometheus text exposition format
+void stats_write_prometheus(FILE *out) {
+  fprintf(out, "# HELP myshell_phase_seconds Shell-side latency by phase.\n");
+  fprintf(out, "# TYPE myshell_phase_seconds summary\n");
+  for (int p = 0; p < STAT_PHASES; p++) {
+    prom_summary(out, "myshell_phase_seconds", "phase", stat_phase_names[p],
+                 "", &stat_phases[p]);
+  }
+
+  fprintf(out, "# HELP myshell_command_seconds Command latency.\n");
+  fprintf(out, "# TYPE myshell_command_seconds summary\n");
+  for (int i = 0; i < STATS_TABLE_SIZE; i++) {
+    CommandStats *cs = &stat_commands[i];
+    if (cs->name[0] != '\0') {
+      prom_summary(out, "myshell_command_seconds", "command", cs->name,
+                   cs->builtin ? ",kind=\"builtin\"" : ",kind=\"external\"",
+                   cs->latency);
+    }
+  }
+
+  fprintf(out, "# HELP myshell_command_failures_total Non-zero exits.\n");
+  fprintf(out, "# TYPE myshell_command_failures_total counter\n");
+  for (int i = 0; i < STATS_TABLE_SIZE; i++) {
+    CommandStats *cs = &stat_commands[i];
+    if (cs->name[0] != '\0') {
+      fprintf(out, "myshell_command_failures_total{command=\"");
+      prom_label(out, cs->name);
+      fprintf(out, "\",kind=\"%s\"} %llu\n",
+              cs->builtin ? "builtin" : "external", cs->failures);
+    }
+  }
+}
+
+// Write the export file atomically (tmp + rename) so a collector never
+// sees a partial file
+int stats_export() {
+  char tmp[sizeof(stats_export_path) + 8];
+  snprintf(tmp, sizeof(tmp), "%s.tmp", stats_export_path);
+
+  FILE *out = fopen(tmp, "w");
+  if (out == NULL) {
+    return -1;
+  }
+  stats_write_prometheus(out);
+  if (fclose(out) != 0 || rename(tmp, stats_export_path) < 0) {
+    unlink(tmp);
+    return -1;
+  }
+  return 0;
+}
+
+void handle_stats_timer(int fd, void *data) {
+  (void)data;
+  unsigned long long expirations;
+  if (read(fd, &expirations, sizeof(expirations)) > 0) {
+    stats_export();
+  }
+}
+
+void stats_export_stop() {
+  if (stats_export_fd >= 0) {
+    event_remove(stats_export_fd);
+    close(stats_export_fd);
+    stats_export_fd = -1;
+  }
+  stats_export_path[0] = '\0';
+}
+
+int stats_export_start(const char *path, double interval) {
+  stats_export_stop();
+  snprintf(stats_export_path, sizeof(stats_export_path), "%s", path);
+  if (stats_export() < 0) {
+    printf("%sError: Cannot write '%s'%s\n", COLOR_RED, path, COLOR_RESET);
+    stats_export_path[0] = '\0';
+    return -1;
+  }
+
+  stats_export_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (stats_export_fd < 0) {
+    perror("timerfd_create");
+    return -1;
+  }
+  struct itimerspec its;
+  its.it_interval.tv_sec = (time_t)interval;
+  its.it_interval.tv_nsec = (long)((interval - (time_t)interval) * 1e9);
+  its.it_value = its.it_interval;
+  timerfd_settime(stats_export_fd, 0, &its, NULL);
+  event_add(stats_export_fd, handle_stats_timer, NULL);
+  return 0;
+}
+
+void print_latency(long long ns) {
+  if (ns >= 1000000000LL) {
+    printf("%8.2fs ", ns / 1e9);
+  } else if (ns >= 1000000) {
+    printf("%8.2fms", ns / 1e6);
+  } else {
+    printf("%8.2fus", ns / 1e3);
+  }
+}
+
+// stats                      - counters and latency percentiles
+// stats -p                   - the same in Prometheus text format
+// stats --export FILE [SECS] - dump to FILE every SECS seconds (default 15)
+// stats --export off         - stop dumping
+// stats --reset              - clear everything
+int cmd_stats(char **args) {
+  if (args[1] != NULL && strcmp(args[1], "-p") == 0) {
+    stats_write_prometheus(stdout);
+    return 0;
+  }
+
+  if (args[1] != NULL && strcmp(args[1], "--reset") == 0) {
+    for (int i = 0; i < STATS_TABLE_SIZE; i++) {
+      free(stat_commands[i].latency);
+    }
+    memset(stat_commands, 0, sizeof(stat_commands));
+    memset(stat_phases, 0, sizeof(stat_phases));
+    stat_command_count = 0;
+    return 0;
+  }
+
+  if (args[1] != NULL && strcmp(args[1], "--export") == 0) {
+    if (args[2] == NULL) {
+      if (stats_export_path[0] != '\0') {
+        printf("%sExporting to %s%s\n", COLOR_GREEN, stats_export_path,
+               COLOR_RESET);
+      } else {
+        printf("%sExport is off%s\n", COLOR_YELLOW, COLOR_RESET);
+      }
+      return 0;
+    }
+    if (strcmp(args[2], "off") == 0) {
+      stats_export_stop();
+      return 0;
+    }
+    double interval = args[3] != NULL ? atof(args[3]) : 15;
+    if (interval < 0.1) {
+      printf("%sError: Invalid interval%s\n", COLOR_RED, COLOR_RESET);
+      return 2;
+    }
+    return stats_export_start(args[2], interval) < 0 ? 1 : 0;
+  }
+
+  if (args[1] != NULL) {
+    printf("%sUsage: stats [-p] [--reset] [--export FILE [SECS] | off]%s\n",
+           COLOR_RED, COLOR_RESET);
+    return 2;
+  }
+
+  printf("\n%s%-10s %10s %11s %10s %10s %10s%s\n", COLOR_CYAN, "PHASE",
+         "COUNT", "P50", "P90", "P99", "MAX", COLOR_RESET);
+  for (int p = 0; p < STAT_PHASES; p++) {
+    Histogram *h = &stat_phases[p];
+    printf("%-10s %10llu ", stat_phase_names[p], h->total);
+    print_latency(hist_quantile(h, 0.5));
+    printf("  ");
+    print_latency(hist_quantile(h, 0.9));
+    printf(" ");
+    print_latency(hist_quantile(h, 0.99));
+    printf(" ");
+    print_latency(h->max_ns);
+    printf("\n");
+  }
+
+  printf("\n%s%-16s %-8s %7s %6s %10s %10s %10s%s\n", COLOR_CYAN, "COMMAND",
+         "KIND", "COUNT", "FAIL", "P50", "P99", "MAX", COLOR_RESET);
+  for (int i = 0; i < STATS_TABLE_SIZE; i++) {
+    CommandStats *cs = &stat_commands[i];
+    if (cs->name[0] == '\0') {
+      continue;
+    }
+    printf("%-16s %-8s %7llu %s%6llu%s ", cs->name,
+           cs->builtin ? "builtin" : "external", cs->latency->total,
+           cs->failures > 0 ? COLOR_RED : "", cs->failures, COLOR_RESET);
+    print_latency(hist_quantile(cs->latency, 0.5));
+    printf(" ");
+    print_latency(hist_quantile(cs->latency, 0.99));
+    printf(" ");
+    print_latency(cs->latency->max_ns);
+    printf("\n");
+  }
+  printf("\n");
+  return 0;
+}
+
+// ============================================================================
+// LINE EDITOR & COMPLETION
+// ============================================================================
+
+// Keys above the byte range, decoded from escape sequences
+enum {
+  KEY_LEFT = 1000,
+  KEY_RIGHT,
+  KEY_UP,
+  KEY_DOWN,
+  KEY_HOME,
+  KEY_END,
+  KEY_DELETE,
+  KEY_WORD_LEFT,
+  KEY_WORD_RIGHT
+};
+
+#define CTRL_KEY(c) ((c) & 0x1f)
+#define MAX_COMPLETIONS 4096
+
+typedef struct {
+  char *buf;
+  size_t size;
+  size_t len;
+  size_t pos;
+  const char *prompt; // last line of the prompt, redrawn on every refresh
+  size_t prompt_len;
+  int prompt_cols;
+  int old_row;  // cursor row after the last refresh
+  int max_rows; // rows used so far by a wrapped line
+  int history_index;
+  char saved[MAX_LINE]; // the new line, while browsing history
+} LineEditor;
+
+typedef struct {
+  char *items[MAX_COMPLETIONS];
+  int count;
+  int total; // may exceed count when truncated
+  char common[MAX_LINE]; // longest common prefix of all matches
+  int single_dir;        // the only match is a directory
+} Completion;
+
+struct termios editor_saved_tmodes;
+
+// Visible width of a prompt: skips ANSI escapes and UTF-8 continuation
+// bytes
+// Columns taken by the character at s, storing its length in bytes.
+// Bytes the locale cannot decode count as one column per UTF-8 sequence.
+int char_width(const char *s, size_t n, size_t *len) {
+  mbstate_t state;
+  wchar_t wc;
+
+  memset(&state, 0, sizeof(state));
+  size_t r = mbrtowc(&wc, s, n, &state);
+  if (r != (size_t)-1 && r != (size_t)-2 && r != 0) {
+    int w = wcwidth(wc);
+    *len = r;
+    return w < 0 ? 1 : w;
+  }
+  size_t i = 1;
+  while (i < n && ((unsigned char)s[i] & 0xc0) == 0x80) {
+    i++;
+  }
+  *len = i;
+  return 1;
+}
+
+int display_width(const char *s, size_t n) {
+  int cols = 0;
+  for (size_t i = 0; i < n; i++) {
+    unsigned char c = s[i];
+    if (c == '\033' && i + 1 < n && s[i + 1] == '[') {
+      i += 2;
+      while (i < n && (s[i] < 0x40 || s[i] > 0x7e)) {
+        i++;
+      }
+    } else {
+      size_t len;
+      cols += char_width(s + i, n - i, &len);
+      i += len - 1;
+    }
+  }
+  return cols;
+}
+
+int terminal_columns() {
+  struct winsize ws;
+  if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) < 0 || ws.ws_col == 0) {
+    return 80;
+  }
+  return ws.ws_col;
+}
+
+void editor_raw_mode() {
+  struct termios raw;
+  tcgetattr(STDIN_FILENO, &editor_saved_tmodes);
+  raw = editor_saved_tmodes;
+  raw.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
+  raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
+  raw.c_cc[VMIN] = 1;
+  raw.c_cc[VTIME] = 0;
+  tcsetattr(STDIN_FILENO, TCSADRAIN, &raw);
+}
+
+void editor_cooked_mode() {
+  tcsetattr(STDIN_FILENO, TCSADRAIN, &editor_saved_tmodes);
+}
+
+// One byte from the terminal. timeout_ms < 0 waits in the event loop so
+// jobs keep being reaped; otherwise -1 on timeout. -2 on EOF.
+int editor_read_byte(int timeout_ms) {
+  unsigned char c;
+
+  while (1) {
+    if (timeout_ms < 0) {
+      if (!event_wait(STDIN_FILENO, -1)) {
+        continue;
+      }
+    } else {
+      struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+      if (poll(&pfd, 1, timeout_ms) <= 0) {
+        return -1;
+      }
+    }
+
+    ssize_t n = read(STDIN_FILENO, &c, 1);
+    if (n == 1) {
+      return c;
+    }
+    if (n < 0 && (errno == EINTR || errno == EAGAIN)) {
+      continue;
+    }
+    return -2;
+  }
+}
+
+int editor_read_key() {
+  int c = editor_read_byte(-1);
+  if (c != '\033') {
+    return c;
+  }
+
+  // Escape sequence, or a lone Esc if nothing follows quickly
+  int c1 = editor_read_byte(50);
+  if (c1 == 'b') {
+    return KEY_WORD_LEFT;
+  }
+  if (c1 == 'f') {
+    return KEY_WORD_RIGHT;
+  }
+  if (c1 != '[' && c1 != 'O') {
+    return '\033';
+  }
+  int c2 = editor_read_byte(50);
+  if (c1 == '[' && c2 >= '0' && c2 <= '9') {
+    int c3 = editor_read_byte(50);
+    while (c3 >= 0 && c3 != '~' && (c3 < 'A' || c3 > 'Z')) {
+      c3 = editor_read_byte(50); // skip modifiers, e.g. \e[1;5C
+    }
+    if (c3 == 'C') {
+      return KEY_WORD_RIGHT;
+    }
+    if (c3 == 'D') {
+      return KEY_WORD_LEFT;
+    }
+    switch (c2) {
+    case '1':
+    case '7': return KEY_HOME;
+    case '4':
+    case '8': return KEY_END;
+    case '3': return KEY_DELETE;
+    }
+    return -1;
+  }
+  switch (c2) {
+  case 'A': return KEY_UP;
+  case 'B': return KEY_DOWN;
+  case 'C': return KEY_RIGHT;
+  case 'D': return KEY_LEFT;
+  case 'H': return KEY_HOME;
+  case 'F': return KEY_END;
+  }
+  return -1;
+}
+
+// Row and column (from 0) reached after drawing the prompt and the first
+// n bytes of the line. A character that does not fit wraps whole, as the
+// terminal wraps it.
+void editor_layout(LineEditor *ed, size_t n, int cols, int *row, int *col) {
+  int r = ed->prompt_cols / cols;
+  int c = ed->prompt_cols % cols;
+
+  if (c == 0 && r > 0) {
+    r--;
+    c = cols;
+  }
+  for (size_t i = 0; i < n;) {
+    size_t len;
+    int w = char_width(ed->buf + i, ed->len - i, &len);
+    if (c + w > cols) {
+      r++;
+      c = 0;
+    }
+    c += w;
+    i += len;
+  }
+  *row = r;
+  *col = c;
+}
+
+// The cursor sits where the character at pos is drawn, which is the start
+// of the next row when it does not fit on this one
+void editor_cursor(LineEditor *ed, int cols, int *row, int *col) {
+  size_t len;
+  int w = 1;
+
+  editor_layout(ed, ed->pos, cols, row, col);
+  if (ed->pos < ed->len) {
+    w = char_width(ed->buf + ed->pos, ed->len - ed->pos, &len);
+  }
+  if (*col + w > cols) {
+    (*row)++;
+    *col = 0;
+  }
+}
+
+// Output is collected and written in chunks, so a short line still goes
+// out in a single write however narrow the terminal gets
+typedef struct {
+  char data[4096];
+  size_t len;
+} RefreshBuf;
+
+void refresh_flush(RefreshBuf *rb) {
+  size_t len = rb->len;
+
+  rb->len = 0;
+  if (len > 0 && write(STDOUT_FILENO, rb->data, len) < 0) {
+    return;
+  }
+}
+
+void refresh_append(RefreshBuf *rb, const char *s, size_t n) {
+  while (n > 0) {
+    if (rb->len == sizeof(rb->data)) {
+      refresh_flush(rb);
+    }
+    size_t chunk = sizeof(rb->data) - rb->len;
+    if (chunk > n) {
+      chunk = n;
+    }
+    memcpy(rb->data + rb->len, s, chunk);
+    rb->len += chunk;
+    s += chunk;
+    n -= chunk;
+  }
+}
+
+void refresh_move(RefreshBuf *rb, const char *fmt, int count) {
+  char seq[32];
+  int n = snprintf(seq, sizeof(seq), fmt, count);
+  refresh_append(rb, seq, n);
+}
+
+// Redraw the prompt and line, which may wrap over several rows
+void editor_refresh(LineEditor *ed) {
+  RefreshBuf out;
+  int cols = terminal_columns();
+  int rows, end_col, row, col;
+  int old_rows = ed->max_rows;
+
+  out.len = 0;
+  editor_layout(ed, ed->len, cols, &rows, &end_col);
+  rows++;
+  if (rows > ed->max_rows) {
+    ed->max_rows = rows;
+  }
+
+  // Go to the last row used, then clear each row on the way up
+  if (old_rows - 1 - ed->old_row > 0) {
+    refresh_move(&out, "\033[%dB", old_rows - 1 - ed->old_row);
+  }
+  for (int j = 0; j < old_rows - 1; j++) {
+    refresh_append(&out, "\r\033[0K\033[1A", 9);
+  }
+  refresh_append(&out, "\r\033[0K", 5);
+
+  refresh_append(&out, ed->prompt, ed->prompt_len);
+  refresh_append(&out, ed->buf, ed->len);
+
+  // Cursor at the very end of a full row: open the next one
+  editor_cursor(ed, cols, &row, &col);
+  if (row >= rows) {
+    refresh_append(&out, "\n\r", 2);
+    rows = row + 1;
+    if (rows > ed->max_rows) {
+      ed->max_rows = rows;
+    }
+  }
+
+  // Move the cursor to its row and column
+  if (rows - 1 - row > 0) {
+    refresh_move(&out, "\033[%dA", rows - 1 - row);
+  }
+  if (col > 0) {
+    refresh_move(&out, "\r\033[%dC", col);
+  } else {
+    refresh_append(&out, "\r", 1);
+  }
+
+  ed->old_row = row;
+  refresh_flush(&out);
+}
+
+// Move below the (possibly wrapped) line before output or on submit
+void editor_finish_line(LineEditor *ed) {
+  int cols = terminal_columns();
+  int rows, col;
+  char out[32];
+  int n = 0;
+
+  editor_layout(ed, ed->len, cols, &rows, &col);
+  if (rows - ed->old_row > 0) {
+    n = snprintf(out, sizeof(out), "\033[%dB", rows - ed->old_row);
+  }
+  n += snprintf(out + n, sizeof(out) - n, "\r\n");
+  if (write(STDOUT_FILENO, out, n) < 0) {
+    return;
+  }
+  ed->max_rows = 1;
+  ed->old_row = 0;
+}
+
+void editor_set_line(LineEditor *ed, const char *text) {
+  snprintf(ed->buf, ed->size, "%s", text);
+  ed->len = strlen(ed->buf);
+  ed->pos = ed->len;
+}
+
+void editor_insert(LineEditor *ed, const char *text, size_t n) {
+  if (ed->len + n >= ed->size) {
+    n = ed->size - 1 - ed->len;
+  }
+  memmove(ed->buf + ed->pos + n, ed->buf + ed->pos, ed->len - ed->pos);
+  memcpy(ed->buf + ed->pos, text, n);
+  ed->pos += n;
+  ed->len += n;
+  ed->buf[ed->len] = '\0';
+}
+
+void editor_delete(LineEditor *ed, size_t from, size_t to) {
+  memmove(ed->buf + from, ed->buf + to, ed->len - to);
+  ed->len -= to - from;
+  ed->buf[ed->len] = '\0';
+  if (ed->pos > to) {
+    ed->pos -= to - from;
+  } else if (ed->pos > from) {
+    ed->pos = from;
+  }
+}
+
+// Cursor moves and single deletes step over whole UTF-8 sequences
+size_t editor_char_left(LineEditor *ed, size_t p) {
+  if (p > 0) {
+    p--;
+  }
+  while (p > 0 && ((unsigned char)ed->buf[p] & 0xc0) == 0x80) {
+    p--;
+  }
+  return p;
+}
+
+size_t editor_char_right(LineEditor *ed, size_t p) {
+  if (p < ed->len) {
+    p++;
+  }
+  while (p < ed->len && ((unsigned char)ed->buf[p] & 0xc0) == 0x80) {
+    p++;
+  }
+  return p;
+}
+
+size_t editor_word_left(LineEditor *ed) {
+  size_t p = ed->pos;
+  while (p > 0 && ed->buf[p - 1] == ' ') {
+    p--;
+  }
+  while (p > 0 && ed->buf[p - 1] != ' ') {
+    p--;
+  }
+  return p;
+}
+
+size_t editor_word_right(LineEditor *ed) {
+  size_t p = ed->pos;
+  while (p < ed->len && ed->buf[p] == ' ') {
+    p++;
+  }
+  while (p < ed->len && ed->buf[p] != ' ') {
+    p++;
+  }
+  return p;
+}
+
+void editor_history(LineEditor *ed, int dir) {
+  int index = ed->history_index + dir;
+  if (index < 0 || index > history_count) {
+    return;
+  }
+  if (ed->history_index == history_count) {
+    snprintf(ed->saved, sizeof(ed->saved), "%s", ed->buf);
+  }
+  ed->history_index = index;
+  editor_set_line(ed, index == history_count ? ed->saved : history[index]);
+}
+
+// Ctrl-R: incremental reverse search through history. Returns 1 if Enter
+// accepted a match (run it), 0 to keep editing.
+int editor_search(LineEditor *ed) {
+  char query[128] = "";
+  size_t qlen = 0;
+  int match = history_count;
+  char prompt[256];
+  const char *saved_prompt = ed->prompt;
+  size_t saved_prompt_len = ed->prompt_len;
+  int saved_cols = ed->prompt_cols;
+  char original[MAX_LINE];
+  int result = 0;
+
+  snprintf(original, sizeof(original), "%s", ed->buf);
+
+  while (1) {
+    int n = snprintf(prompt, sizeof(prompt), "(reverse-i-search)`%s': ",
+                     query);
+    ed->prompt = prompt;
+    ed->prompt_len = n;
+    ed->prompt_cols = display_width(prompt, n);
+    editor_refresh(ed);
+
+    int key = editor_read_key();
+    int from = -1;
+
+    if (key == CTRL_KEY('r')) {
+      from = match - 1;
+    } else if (key == 127 || key == CTRL_KEY('h')) {
+      if (qlen > 0) {
+        query[--qlen] = '\0';
+      }
+      from = history_count - 1;
+    } else if (key >= 32 && key < 127 && qlen < sizeof(query) - 1) {
+      query[qlen++] = key;
+      query[qlen] = '\0';
+      from = match < history_count ? match : history_count - 1;
+    } else if (key == CTRL_KEY('g') || key == CTRL_KEY('c') || key == -2) {
+      editor_set_line(ed, original);
+      break;
+    } else {
+      result = key == '\r' || key == '\n';
+      break;
+    }
+
+    for (int i = from; i >= 0 && qlen > 0; i--) {
+      char *hit = strstr(history[i], query);
+      if (hit != NULL) {
+        match = i;
+        editor_set_line(ed, history[i]);
+        ed->pos = hit - history[i];
+        break;
+      }
+    }
+  }
+
+  ed->prompt = saved_prompt;
+  ed->prompt_len = saved_prompt_len;
+  ed->prompt_cols = saved_cols;
+  editor_refresh(ed);
+  return result;
+}
+
+// ---- Command trie -----------------------------------------------------------
+
+// Prefix trie of command names. Children are kept in sorted sibling lists.
+// Names come from several sources (built-ins, each PATH directory), so
+// terminals are reference counted and every node tracks how many live
+// names are below it; stale branches are skipped rather than freed.
+typedef struct {
+  int child;
+  int sibling;
+  int live; // live names in this subtree
+  int refs; // sources providing the name ending here
+  char c;
+} TrieNode;
+
+TrieNode *trie_nodes = NULL;
+int trie_count = 0;
+int trie_capacity = 0;
+
+int trie_node_new(char c) {
+  if (trie_count == trie_capacity) {
+    int capacity = trie_capacity ? trie_capacity * 2 : 1024;
+    TrieNode *grown = realloc(trie_nodes, capacity * sizeof(TrieNode));
+    if (grown == NULL) {
+      return -1;
+    }
+    trie_nodes = grown;
+    trie_capacity = capacity;
+  }
+  TrieNode *node = &trie_nodes[trie_count];
+  node->child = -1;
+  node->sibling = -1;
+  node->live = 0;
+  node->refs = 0;
+  node->c = c;
+  return trie_count++;
+}
+
+// Child of node labelled c, created (in order) if create is set
+int trie_child(int node, char c, int create) {
+  int prev = -1;
+  int cur = trie_nodes[node].child;
+
+  while (cur >= 0 && (unsigned char)trie_nodes[cur].c < (unsigned char)c) {
+    prev = cur;
+    cur = trie_nodes[cur].sibling;
+  }
+  if (cur >= 0 && trie_nodes[cur].c == c) {
+    return cur;
+  }
+  if (!create) {
+    return -1;
+  }
+
+  // Indices, not pointers: trie_node_new may move the array
+  int fresh = trie_node_new(c);
+  if (fresh < 0) {
+    return -1;
+  }
+  trie_nodes[fresh].sibling = cur;
+  if (prev < 0) {
+    trie_nodes[node].child = fresh;
+  } else {
+    trie_nodes[prev].sibling = fresh;
+  }
+  return fresh;
+}
+
+void trie_adjust(const char *name, int delta) {
+  int path[MAX_LINE];
+  int depth = 0;
+  int node;
+
+  if (trie_count == 0 && trie_node_new('\0') < 0) {
+    return;
+  }
+  node = 0;
+  path[depth++] = 0;
+  for (const char *p = name; *p != '\0' && depth < MAX_LINE; p++) {
+    node = trie_child(node, *p, delta > 0);
+    if (node < 0) {
+      return;
+    }
+    path[depth++] = node;
+  }
+
+  int was_live = trie_nodes[node].refs > 0;
+  trie_nodes[node].refs += delta;
+  int is_live = trie_nodes[node].refs > 0;
+  if (was_live != is_live) {
+    for (int i = 0; i < depth; i++) {
+      trie_nodes[path[i]].live += is_live ? 1 : -1;
+    }
+  }
+}
+
+void trie_collect(int node, char *word, int depth, Completion *comp) {
+  if (trie_nodes[node].refs > 0) {
+    comp->total++;
+    if (comp->count < MAX_COMPLETIONS) {
+      word[depth] = '\0';
+      comp->items[comp->count++] = strdup(word);
+    }
+  }
+  for (int c = trie_nodes[node].child; c >= 0; c = trie_nodes[c].sibling) {
+    if (trie_nodes[c].live > 0 && depth < MAX_LINE - 1) {
+      word[depth] = trie_nodes[c].c;
+      trie_collect(c, word, depth + 1, comp);
+    }
+  }
+}
+
+void trie_complete(const char *prefix, Completion *comp) {
+  char word[MAX_LINE];
+  int node = 0;
+  int depth = 0;
+
+  if (trie_count == 0) {
+    return;
+  }
+  for (const char *p = prefix; *p != '\0'; p++) {
+    node = trie_child(node, *p, 0);
+    if (node < 0 || trie_nodes[node].live == 0) {
+      return;
+    }
+    word[depth++] = *p;
+  }
+
+  // Longest common prefix: follow the only live branch
+  int walk = node;
+  int len = depth;
+  memcpy(comp->common, word, depth);
+  while (trie_nodes[walk].refs == 0 && len < MAX_LINE - 1) {
+    int only = -1;
+    int branches = 0;
+    for (int c = trie_nodes[walk].child; c >= 0; c = trie_nodes[c].sibling) {
+      if (trie_nodes[c].live > 0) {
+        only = c;
+        branches++;
+      }
+    }
+    if (branches != 1) {
+      break;
+    }
+    comp->common[len++] = trie_nodes[only].c;
+    walk = only;
+  }
+  comp->common[len] = '\0';
+
+  trie_collect(node, word, depth, comp);
+}
+
+// ---- Directory listing (getdents64) ---------------------------------------
+
+struct linux_dirent64 {
+  unsigned long long d_ino;
+  long long d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
+
+// Read every entry of an open directory into a packed buffer of
+// [d_type][name]\0 records using getdents64 directly (no per-entry libc
+// overhead). Returns the buffer (caller frees) and its length in *len.
+char *read_dir_entries(int dirfd, size_t *len) {
+  char chunk[32768];
+  char *names = NULL;
+  size_t used = 0;
+  size_t capacity = 0;
+
+  while (1) {
+    long n = syscall(SYS_getdents64, dirfd, chunk, sizeof(chunk));
+    if (n <= 0) {
+      break;
+    }
+    for (long off = 0; off < n;) {
+      struct linux_dirent64 *d = (struct linux_dirent64 *)(chunk + off);
+      off += d->d_reclen;
+      if (strcmp(d->d_name, ".") == 0 || strcmp(d->d_name, "..") == 0) {
+        continue;
+      }
+      size_t need = strlen(d->d_name) + 2;
+      if (used + need > capacity) {
+        capacity = (capacity + need) * 2;
+        char *grown = realloc(names, capacity);
+        if (grown == NULL) {
+          free(names);
+          return NULL;
+        }
+        names = grown;
+      }
+      names[used] = d->d_type;
+      memcpy(names + used + 1, d->d_name, need - 1);
+      used += need;
+    }
+  }
+  *len = used;
+  return names;
+}
+
+int entry_is_dir(int dirfd, const char *name, unsigned char type) {
+  struct stat st;
+  if (type == DT_DIR) {
+    return 1;
+  }
+  if (type != DT_UNKNOWN && type != DT_LNK) {
+    return 0;
+  }
+  return fstatat(dirfd, name, &st, 0) == 0 && S_ISDIR(st.st_mode);
+}
+
+// ---- PATH executables -------------------------------------------------------
+
+#define MAX_PATH_DIRS 64
+
+typedef struct {
+  char path[256];
+  struct timespec mtime; // when the names were read; zero = never
+  char *names;           // packed entries provided to the trie
+  size_t names_len;
+} PathDir;
+
+PathDir path_dirs[MAX_PATH_DIRS];
+int path_dir_count = 0;
+char path_cached[4096] = "";
+int completion_builtins_loaded = 0;
+
+void path_dir_release(PathDir *dir) {
+  for (size_t off = 0; off < dir->names_len;) {
+    char *name = dir->names + off + 1;
+    trie_adjust(name, -1);
+    off += strlen(name) + 2;
+  }
+  free(dir->names);
+  dir->names = NULL;
+  dir->names_len = 0;
+}
+
+// (Re)read one PATH directory, keeping only executable files
+void path_dir_scan(PathDir *dir, struct timespec *mtime) {
+  path_dir_release(dir);
+  dir->mtime = *mtime;
+
+  int fd = open(dir->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0) {
+    return;
+  }
+  size_t len = 0;
+  char *entries = read_dir_entries(fd, &len);
+  size_t keep = 0;
+
+  for (size_t off = 0; entries != NULL && off < len;) {
+    unsigned char type = entries[off];
+    char *name = entries + off + 1;
+    size_t reclen = strlen(name) + 2;
+    struct stat st;
+
+    if (type != DT_DIR && fstatat(fd, name, &st, 0) == 0 &&
+        S_ISREG(st.st_mode) && (st.st_mode & 0111)) {
+      memmove(entries + keep, entries + off, reclen);
+      trie_adjust(entries + keep + 1, 1);
+      keep += reclen;
+    }
+    off += reclen;
+  }
+  close(fd);
+  dir->names = entries;
+  dir->names_len = keep;
+}
+
+// Bring the trie up to date: built-ins once, PATH directories whenever
+// PATH or a directory's mtime changes
+void completion_refresh() {
+  if (!completion_builtins_loaded) {
+    for (Builtin *b = builtins; b->name != NULL; b++) {
+      trie_adjust(b->name, 1);
+    }
+    completion_builtins_loaded = 1;
+  }
+
+  const char *path = var_get("PATH");
+  if (path == NULL) {
+    path = "";
+  }
+  if (strcmp(path, path_cached) != 0) {
+    for (int i = 0; i < path_dir_count; i++) {
+      path_dir_release(&path_dirs[i]);
+    }
+    path_dir_count = 0;
+    snprintf(path_cached, sizeof(path_cached), "%s", path);
+
+    char copy[4096];
+    snprintf(copy, sizeof(copy), "%s", path);
+    for (char *save = NULL, *dir = strtok_r(copy, ":", &save);
+         dir != NULL && path_dir_count < MAX_PATH_DIRS;
+         dir = strtok_r(NULL, ":", &save)) {
+      PathDir *pd = &path_dirs[path_dir_count++];
+      memset(pd, 0, sizeof(*pd));
+      snprintf(pd->path, sizeof(pd->path), "%s", dir);
+    }
+  }
+
+  for (int i = 0; i < path_dir_count; i++) {
+    struct stat st;
+    if (stat(path_dirs[i].path, &st) < 0) {
+      continue;
+    }
+    if (st.st_mtim.tv_sec != path_dirs[i].mtime.tv_sec ||
+        st.st_mtim.tv_nsec != path_dirs[i].mtime.tv_nsec) {
+      path_dir_scan(&path_dirs[i], &st.st_mtim);
+    }
+  }
+}
+
+// ---- Completion -------------------------------------------------------------
+
+void completion_add(Completion *comp, const char *item, int is_dir) {
+  size_t n = strlen(item);
+
+  if (comp->total == 0) {
+    snprintf(comp->common, sizeof(comp->common), "%s", item);
+  } else {
+    size_t i = 0;
+    while (comp->common[i] != '\0' && comp->common[i] == item[i]) {
+      i++;
+    }
+    comp->common[i] = '\0';
+  }
+  comp->total++;
+  comp->single_dir = comp->total == 1 && is_dir;
+  if (comp->count < MAX_COMPLETIONS) {
+    char *copy = malloc(n + 2);
+    if (copy != NULL) {
+      memcpy(copy, item, n);
+      copy[n] = is_dir ? '/' : '\0';
+      copy[n + 1] = '\0';
+      comp->items[comp->count++] = copy;
+    }
+  }
+}
+
+// Complete file names for word (which may contain a directory part)
+void file_complete(const char *word, Completion *comp) {
+  char dir[MAX_LINE];
+  const char *base = strrchr(word, '/');
+  size_t dir_len = base != NULL ? (size_t)(base - word) + 1 : 0;
+
+  base = base != NULL ? base + 1 : word;
+  if (dir_len == 0) {
+    strcpy(dir, ".");
+  } else if (word[0] == '~' && word[1] == '/' && var_get("HOME") != NULL) {
+    snprintf(dir, sizeof(dir), "%s%.*s", var_get("HOME"), (int)dir_len - 1,
+             word + 1);
+  } else {
+    snprintf(dir, sizeof(dir), "%.*s", (int)dir_len, word);
+  }
+
+  size_t base_len = strlen(base);
+  if (dircache_enabled()) {
+    DirListing *listing = dir_list(dir);
+    for (int i = 0; listing != NULL && i < listing->count; i++) {
+      const char *name = listing->entries[i].name;
+      if (strncmp(name, base, base_len) == 0 &&
+          (name[0] != '.' || base[0] == '.')) {
+        completion_add(comp, name, S_ISDIR(listing->entries[i].mode));
+      }
+    }
+    if (listing != NULL) {
+      dir_release(listing);
+    }
+    return;
+  }
+
+  int fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0) {
+    return;
+  }
+  size_t len = 0;
+  char *entries = read_dir_entries(fd, &len);
+
+  for (size_t off = 0; entries != NULL && off < len;) {
+    unsigned char type = entries[off];
+    char *name = entries + off + 1;
+    off += strlen(name) + 2;
+
+    if (strncmp(name, base, base_len) != 0 ||
+        (name[0] == '.' && base[0] != '.')) {
+      continue;
+    }
+    completion_add(comp, name, entry_is_dir(fd, name, type));
+  }
+  free(entries);
+  close(fd);
+}
+
+int compare_strings(const void *a, const void *b) {
+  return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+void editor_list_completions(LineEditor *ed, Completion *comp) {
+  int width = 0;
+  int cols = terminal_columns();
+
+  qsort(comp->items, comp->count, sizeof(char *), compare_strings);
+  for (int i = 0; i < comp->count; i++) {
+    int n = strlen(comp->items[i]);
+    if (n > width) {
+      width = n;
+    }
+  }
+  width += 2;
+  int per_row = cols / width > 0 ? cols / width : 1;
+
+  editor_finish_line(ed);
+  for (int i = 0; i < comp->count; i++) {
+    printf("%-*s", width, comp->items[i]);
+    if ((i + 1) % per_row == 0 || i == comp->count - 1) {
+      printf("\r\n");
+    }
+  }
+  if (comp->total > comp->count) {
+    printf("%s... and %d more%s\r\n", COLOR_YELLOW,
+           comp->total - comp->count, COLOR_RESET);
+  }
+  fflush(stdout);
+}
+
+// Tab: complete the word before the cursor. Commands (first word, or
+// after |) come from the trie, everything else from the file system.
+// A second Tab with several matches lists them.
+void editor_complete(LineEditor *ed, int repeated) {
+  Completion comp;
+  char word[MAX_LINE];
+  size_t start = ed->pos;
+
+  while (start > 0 && ed->buf[start - 1] != ' ') {
+    start--;
+  }
+  size_t word_len = ed->pos - start;
+  memcpy(word, ed->buf + start, word_len);
+  word[word_len] = '\0';
+
+  size_t before = start;
+  while (before > 0 && ed->buf[before - 1] == ' ') {
+    before--;
+  }
+  int command_pos = before == 0 || ed->buf[before - 1] == '|';
+
+  comp.count = 0;
+  comp.total = 0;
+  comp.common[0] = '\0';
+  comp.single_dir = 0;
+
+  if (command_pos && strchr(word, '/') == NULL) {
+    completion_refresh();
+    trie_complete(word, &comp);
+  } else {
+    file_complete(word, &comp);
+  }
+
+  // Only the part after the directory is matched for files
+  const char *base = strrchr(word, '/');
+  size_t base_len = (command_pos && base == NULL)
+                        ? word_len
+                        : (base != NULL ? strlen(base + 1) : word_len);
+
+  if (comp.total == 0) {
+    if (write(STDOUT_FILENO, "\a", 1) < 0) {
+      return;
+    }
+  } else if (comp.total == 1) {
+    size_t common_len = strlen(comp.common);
+    editor_insert(ed, comp.common + base_len, common_len - base_len);
+    editor_insert(ed, comp.single_dir ? "/" : " ", 1);
+  } else if (strlen(comp.common) > base_len) {
+    editor_insert(ed, comp.common + base_len,
+                  strlen(comp.common) - base_len);
+  } else if (repeated) {
+    editor_list_completions(ed, &comp);
+  } else if (write(STDOUT_FILENO, "\a", 1) < 0) {
+    return;
+  }
+
+  for (int i = 0; i < comp.count; i++) {
+    free(comp.items[i]);
+  }
+}
+
+// ---- Main editing loop ------------------------------------------------------
+
+// Read one line from the terminal with editing, history and completion.
+// Returns 0 on EOF (Ctrl-D on an empty line).
+int line_edit(char *line, size_t size) {
+  char prompt[8192];
+  size_t prompt_len = prompt_render(prompt, sizeof(prompt));
+  LineEditor ed;
+  int last_key = 0;
+  int result = 1;
+
+  // Only the last line of a multi-line prompt is redrawn
+  const char *last_line = memrchr(prompt, '\n', prompt_len);
+  last_line = last_line != NULL ? last_line + 1 : prompt;
+
+  memset(&ed, 0, sizeof(ed));
+  ed.buf = line;
+  ed.size = size;
+  ed.prompt = last_line;
+  ed.prompt_len = prompt_len - (last_line - prompt);
+  ed.prompt_cols = display_width(ed.prompt, ed.prompt_len);
+  ed.max_rows = 1;
+  ed.history_index = history_count;
+  line[0] = '\0';
+
+  editor_raw_mode();
+  editor_refresh(&ed);
+
+  while (1) {
+    int key = editor_read_key();
+
+    if (key == '\t') {
+      editor_complete(&ed, last_key == '\t');
+      editor_refresh(&ed);
+      last_key = key;
+      continue;
+    }
+    last_key = key;
+
+    switch (key) {
+    case -2: // EOF on the terminal
+      result = 0;
+      goto done;
+    case '\r':
+    case '\n':
+      goto done;
+    case CTRL_KEY('c'):
+      // Abandon the line
+      if (write(STDOUT_FILENO, "^C", 2) < 0) {
+        break;
+      }
+      line[0] = '\0';
+      ed.len = ed.pos = 0;
+      sigint_received = 1; // also drops a half-typed if/while/...
+      goto done;
+    case CTRL_KEY('d'):
+      if (ed.len == 0) {
+        result = 0;
+        goto done;
+      }
+      editor_delete(&ed, ed.pos, editor_char_right(&ed, ed.pos));
+      break;
+    case 127:
+    case CTRL_KEY('h'):
+      editor_delete(&ed, editor_char_left(&ed, ed.pos), ed.pos);
+      break;
+    case KEY_DELETE:
+      editor_delete(&ed, ed.pos, editor_char_right(&ed, ed.pos));
+      break;
+    case KEY_LEFT:
+    case CTRL_KEY('b'):
+      ed.pos = editor_char_left(&ed, ed.pos);
+      break;
+    case KEY_RIGHT:
+    case CTRL_KEY('f'):
+      ed.pos = editor_char_right(&ed, ed.pos);
+      break;
+    case KEY_WORD_LEFT:
+      ed.pos = editor_word_left(&ed);
+      break;
+    case KEY_WORD_RIGHT:
+      ed.pos = editor_word_right(&ed);
+      break;
+    case KEY_HOME:
+    case CTRL_KEY('a'):
+      ed.pos = 0;
+      break;
+    case KEY_END:
+    case CTRL_KEY('e'):
+      ed.pos = ed.len;
+      break;
+    case KEY_UP:
+    case CTRL_KEY('p'):
+      editor_history(&ed, -1);
+      break;
+    case KEY_DOWN:
+    case CTRL_KEY('n'):
+      editor_history(&ed, 1);
+      break;
+    case CTRL_KEY('k'):
+      editor_delete(&ed, ed.pos, ed.len);
+      break;
+    case CTRL_KEY('u'):
+      editor_delete(&ed, 0, ed.pos);
+      break;
+    case CTRL_KEY('w'):
+      editor_delete(&ed, editor_word_left(&ed), ed.pos);
+      break;
+    case CTRL_KEY('l'):
+      if (write(STDOUT_FILENO, "\033[H\033[2J", 7) < 0) {
+        break;
+      }
+      ed.max_rows = 1;
+      ed.old_row = 0;
+      if (write(STDOUT_FILENO, prompt, last_line - prompt) < 0) {
+        break;
+      }
+      break;
+    case CTRL_KEY('r'):
+      if (editor_search(&ed)) {
+        goto done;
+      }
+      break;
+    default:
+      if (key >= 32 && key < 256) {
+        char c = key;
+        editor_insert(&ed, &c, 1);
+      }
+      break;
+    }
+    editor_refresh(&ed);
+  }
+
+done:
+  ed.pos = ed.len;
+  editor_refresh(&ed);
+  editor_finish_line(&ed);
+  editor_cooked_mode();
+  return result;
+}
+
+// ============================================================================
+// GLOB EXPANSION
+// ============================================================================
+
+char *arena_strndup(Arena *arena, const char *s, size_t n) {
+  ArenaBlock *block = arena->head;
+
+  if (block == NULL || block->size - block->used < n + 1) {
+    size_t size = n + 1 > 16384 ? n + 1 : 16384;
+    block = malloc(sizeof(ArenaBlock) + size);
+    if (block == NULL) {
+      return NULL;
+    }
+    block->next = arena->head;
+    block->used = 0;
+    block->size = size;
+    arena->head = block;
+  }
+  char *copy = block->data + block->used;
+  memcpy(copy, s, n);
+  copy[n] = '\0';
+  block->used += n + 1;
+  return copy;
+}
+
+void arena_free(Arena *arena) {
+  while (arena->head != NULL) {
+    ArenaBlock *next = arena->head->next;
+    free(arena->head);
+    arena->head = next;
+  }
+}
+
+// Free everything but the newest block, which is kept for reuse
+void arena_reset(Arena *arena) {
+  ArenaBlock *keep = arena->head;
+  if (keep == NULL) {
+    return;
+  }
+  arena->head = keep->next;
+  arena_free(arena);
+  keep->next = NULL;
+  keep->used = 0;
+  arena->head = keep;
+}
+
+// '[' only starts a pattern when a ']' follows, so "[" and "]" (the test
+// built-in) never cost a directory listing
+int has_glob_chars(const char *word) {
+  if (strpbrk(word, "*?") != NULL) {
+    return 1;
+  }
+  const char *open = strchr(word, '[');
+  return open != NULL && strchr(open + 1, ']') != NULL;
+}
+
+// Match one bracket expression at p against c. Sets *len to the length of
+// the expression, or 0 if it is unterminated (then '[' is literal).
+int glob_class_match(const char *p, char c, int *len) {
+  const char *q = p + 1;
+  int negate = 0;
+  int matched = 0;
+
+  if (*q == '!' || *q == '^') {
+    negate = 1;
+    q++;
+  }
+  // A ']' right after the opening bracket is a member
+  if (*q == ']') {
+    matched |= c == ']';
+    q++;
+  }
+  while (*q != '\0' && *q != ']') {
+    if (q[1] == '-' && q[2] != '\0' && q[2] != ']') {
+      matched |= (unsigned char)c >= (unsigned char)q[0] &&
+                 (unsigned char)c <= (unsigned char)q[2];
+      q += 3;
+    } else {
+      matched |= c == *q;
+      q++;
+    }
+  }
+  if (*q != ']') {
+    *len = 0;
+    return 0;
+  }
+  *len = q - p + 1;
+  return matched != negate;
+}
+
+// Match name against one path segment pattern (*, ?, [...], \x). Stars
+// backtrack to the most recent one only, so this is O(len(p) * len(s)) in
+// the worst case rather than exponential.
+int glob_match(const char *p, const char *s) {
+  const char *star_p = NULL;
+  const char *star_s = NULL;
+
+  while (*s != '\0') {
+    int ok = 0;
+    int step = 1;
+
+    if (*p == '*') {
+      while (*p == '*') {
+        p++;
+      }
+      star_p = p;
+      star_s = s;
+      continue;
+    }
+    if (*p == '?') {
+      ok = 1;
+    } else if (*p == '[' && (ok = glob_class_match(p, *s, &step), step > 0)) {
+      // ok set by the class
+    } else {
+      step = 1;
+      if (*p == '\\' && p[1] != '\0') {
+        p++;
+      }
+      ok = *p != '\0' && *p == *s;
+    }
+
+    if (ok) {
+      p += step;
+      s++;
+    } else if (star_p != NULL) {
+      p = star_p;
+      s = ++star_s;
+    } else {
+      return 0;
+    }
+  }
+  while (*p == '*') {
+    p++;
+  }
+  return *p == '\0';
+}
+
+// ---- Per-command directory cache ------------------------------------------
+
+// Entries use read_dir_entries' [type][name]\0 layout. DT_UNKNOWN is
+// resolved with lstat, and symlinks to directories get GLOB_LINK_DIR so
+// "*/" follows them while "**" does not.
+#define GLOB_LINK_DIR 0x80
+
+typedef struct {
+  char *path; // NULL = free slot
+  char *entries;
+  size_t len;
+} GlobDir;
+
+GlobDir *glob_cache = NULL;
+int glob_cache_capacity = 0;
+int glob_cache_count = 0;
+
+unsigned int glob_hash(const char *s) {
+  unsigned int hash = 2166136261u;
+  for (; *s != '\0'; s++) {
+    hash = (hash ^ (unsigned char)*s) * 16777619u;
+  }
+  return hash;
+}
+
+void glob_cache_clear() {
+  for (int i = 0; i < glob_cache_capacity; i++) {
+    free(glob_cache[i].path);
+    free(glob_cache[i].entries);
+  }
+  free(glob_cache);
+  glob_cache = NULL;
+  glob_cache_capacity = 0;
+  glob_cache_count = 0;
+}
+
+GlobDir *glob_cache_slot(const char *path) {
+  unsigned int mask = glob_cache_capacity - 1;
+  unsigned int i = glob_hash(path) & mask;
+  while (glob_cache[i].path != NULL && strcmp(glob_cache[i].path, path) != 0) {
+    i = (i + 1) & mask;
+  }
+  return &glob_cache[i];
+}
+
+// Listing of path ("" = current directory), read at most once per command
+GlobDir *glob_list_dir(const char *path) {
+  if (glob_cache_count * 2 >= glob_cache_capacity) {
+    GlobDir *old = glob_cache;
+    int old_capacity = glob_cache_capacity;
+    int capacity = old_capacity ? old_capacity * 2 : 64;
+    GlobDir *grown = calloc(capacity, sizeof(GlobDir));
+    if (grown == NULL) {
+      return NULL;
+    }
+    glob_cache = grown;
+    glob_cache_capacity = capacity;
+    for (int i = 0; i < old_capacity; i++) {
+      if (old[i].path != NULL) {
+        *glob_cache_slot(old[i].path) = old[i];
+      }
+    }
+    free(old);
+  }
+
+  GlobDir *dir = glob_cache_slot(path);
+  if (dir->path != NULL) {
+    return dir;
+  }
+  dir->path = strdup(path);
+  dir->entries = NULL;
+  dir->len = 0;
+  glob_cache_count++;
+
+  int fd = open(path[0] != '\0' ? path : ".",
+                O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0) {
+    return dir;
+  }
+  dir->entries = read_dir_entries(fd, &dir->len);
+  for (size_t off = 0; dir->entries != NULL && off < dir->len;) {
+    unsigned char *type = (unsigned char *)dir->entries + off;
+    char *name = dir->entries + off + 1;
+    struct stat st;
+
+    if (*type == DT_UNKNOWN && fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) == 0) {
+      *type = S_ISDIR(st.st_mode) ? DT_DIR
+              : S_ISLNK(st.st_mode) ? DT_LNK
+                                    : DT_REG;
+    }
+    if (*type == DT_LNK && fstatat(fd, name, &st, 0) == 0 &&
+        S_ISDIR(st.st_mode)) {
+      *type |= GLOB_LINK_DIR;
+    }
+    off += strlen(name) + 2;
+  }
+  close(fd);
+  return dir;
+}
+
+// ---- Matcher ------------------------------------------------------------------
+
+typedef struct {
+  char *segments[MAX_ARGS];
+  int nsegs;
+  int dir_only; // pattern ended in '/'
+  char **matches;
+  int count;
+  int capacity;
+  Arena *arena;
+} GlobSearch;
+
+void glob_add_match(GlobSearch *gs, const char *path, size_t len) {
+  if (gs->count == gs->capacity) {
+    int capacity = gs->capacity ? gs->capacity * 2 : 64;
+    char **grown = realloc(gs->matches, capacity * sizeof(char *));
+    if (grown == NULL) {
+      return;
+    }
+    gs->matches = grown;
+    gs->capacity = capacity;
+  }
+  char *copy = arena_strndup(gs->arena, path, len);
+  if (copy != NULL) {
+    gs->matches[gs->count++] = copy;
+  }
+}
+
+// Walk the pattern one segment at a time from path (which ends in '/' or
+// is empty). Only directories that can still match are descended into,
+// and literal segments are appended without listing anything.
+void glob_walk(GlobSearch *gs, char *path, size_t len, int seg) {
+  const char *pat = gs->segments[seg];
+  int last = seg == gs->nsegs - 1;
+  size_t pat_len = strlen(pat);
+
+  if (!has_glob_chars(pat)) {
+    if (len + pat_len + 2 >= 4096) {
+      return;
+    }
+    memcpy(path + len, pat, pat_len);
+    path[len + pat_len] = '\0';
+    if (last) {
+      struct stat st;
+      if (lstat(path, &st) == 0 && (!gs->dir_only || S_ISDIR(st.st_mode))) {
+        glob_add_match(gs, path, len + pat_len);
+      }
+    } else {
+      path[len + pat_len] = '/';
+      glob_walk(gs, path, len + pat_len + 1, seg + 1);
+    }
+    return;
+  }
+
+  int globstar = strcmp(pat, "**") == 0;
+  if (globstar && !last) {
+    // ** matching zero directories
+    glob_walk(gs, path, len, seg + 1);
+  }
+
+  path[len] = '\0';
+  GlobDir *dir = glob_list_dir(path);
+  if (dir == NULL || dir->entries == NULL) {
+    return;
+  }
+
+  for (size_t off = 0; off < dir->len;) {
+    unsigned char type = dir->entries[off];
+    char *name = dir->entries + off + 1;
+    size_t name_len = strlen(name);
+    int is_dir = (type & ~GLOB_LINK_DIR) == DT_DIR || (type & GLOB_LINK_DIR);
+    off += name_len + 2;
+
+    // Leading dots must be matched explicitly
+    if (name[0] == '.' && pat[0] != '.') {
+      continue;
+    }
+    if (!globstar && !glob_match(pat, name)) {
+      continue;
+    }
+    if (len + name_len + 2 >= 4096) {
+      continue;
+    }
+    memcpy(path + len, name, name_len);
+
+    if (globstar) {
+      // ** matches every name below here; recurse through real
+      // directories only, so symlink loops cannot trap it
+      if (last && (!gs->dir_only || is_dir)) {
+        glob_add_match(gs, path, len + name_len);
+      }
+      if (type == DT_DIR) {
+        path[len + name_len] = '/';
+        if (!last) {
+          glob_walk(gs, path, len + name_len + 1, seg + 1);
+        }
+        glob_walk(gs, path, len + name_len + 1, seg);
+      }
+    } else if (last) {
+      if (!gs->dir_only || is_dir) {
+        glob_add_match(gs, path, len + name_len);
+      }
+    } else if (is_dir) {
+      path[len + name_len] = '/';
+      glob_walk(gs, path, len + name_len + 1, seg + 1);
+    }
+  }
+}
+
+int glob_compare(const void *a, const void *b) {
+  return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// Expand pattern into cmd's argv (sorted). Returns the number of matches;
+// 0 leaves the caller to pass the word through unchanged.
+int glob_expand(const char *pattern, Command *cmd, Arena *arena) {
+  GlobSearch gs;
+  char copy[4096];
+  char path[4096];
+  size_t len = 0;
+
+  memset(&gs, 0, sizeof(gs));
+  gs.arena = arena;
+  snprintf(copy, sizeof(copy), "%s", pattern);
+
+  if (copy[0] == '/') {
+    path[len++] = '/';
+  }
+  size_t copy_len = strlen(copy);
+  gs.dir_only = copy_len > 1 && copy[copy_len - 1] == '/';
+
+  for (char *save = NULL, *seg = strtok_r(copy, "/", &save);
+       seg != NULL && gs.nsegs < MAX_ARGS; seg = strtok_r(NULL, "/", &save)) {
+    gs.segments[gs.nsegs++] = seg;
+  }
+  if (gs.nsegs == 0) {
+    return 0;
+  }
+
+  glob_walk(&gs, path, len, 0);
+
+  qsort(gs.matches, gs.count, sizeof(char *), glob_compare);
+  for (int i = 0; i < gs.count; i++) {
+    char *match = gs.matches[i];
+
+    // Drop duplicates (e.g. from a/**/**/b)
+    if (i > 0 && strcmp(match, gs.matches[i - 1]) == 0) {
+      continue;
+    }
+    if (gs.dir_only) {
+      size_t n = strlen(match);
+      char *with_slash = arena_strndup(arena, match, n + 1);
+      if (with_slash != NULL) {
+        with_slash[n] = '/';
+        match = with_slash;
+      }
+    }
+    command_add_arg(cmd, match);
+  }
+  int count = gs.count;
+  free(gs.matches);
+  return count;
+}
+
+// ============================================================================
+// VARIABLES & ENVIRONMENT
+// ============================================================================
+
+// Each variable is stored as one "NAME=value" string so exported ones can
+// go straight into envp. The envp array is only rebuilt when the exported
+// set changes (env_generation), and is reused by every spawn in between.
+typedef struct {
+  char *entry; // "NAME=value", NULL = empty bucket
+  size_t name_len;
+  unsigned int hash;
+  int exported;
+} ShellVar;
+
+ShellVar *var_table = NULL;
+int var_capacity = 0;
+int var_count = 0;
+int var_exported_count = 0;
+
+unsigned long env_generation = 1;
+unsigned long env_cache_generation = 0;
+char **env_cache = NULL;
+int env_cache_capacity = 0;
+
+// $1... of the innermost function call
+char **positional = NULL;
+int positional_count = 0;
+
+unsigned int var_hash(const char *name, size_t len) {
+  unsigned int hash = 2166136261u;
+  for (size_t i = 0; i < len; i++) {
+    hash = (hash ^ (unsigned char)name[i]) * 16777619u;
+  }
+  return hash;
+}
+
+// Length of the identifier at the start of s (0 if there is none)
+size_t var_name_len(const char *s) {
+  size_t len = 0;
+  if (!(s[0] == '_' || (s[0] >= 'A' && s[0] <= 'Z') ||
+        (s[0] >= 'a' && s[0] <= 'z'))) {
+    return 0;
+  }
+  while (s[len] == '_' || (s[len] >= 'A' && s[len] <= 'Z') ||
+         (s[len] >= 'a' && s[len] <= 'z') || (s[len] >= '0' && s[len] <= '9')) {
+    len++;
+  }
+  return len;
+}
+
+// Bucket holding name, or the empty bucket where it would go
+ShellVar *var_bucket(const char *name, size_t len, unsigned int hash) {
+  unsigned mask = var_capacity - 1;
+  for (unsigned i = hash & mask;; i = (i + 1) & mask) {
+    ShellVar *var = &var_table[i];
+    if (var->entry == NULL ||
+        (var->hash == hash && var->name_len == len &&
+         memcmp(var->entry, name, len) == 0)) {
+      return var;
+    }
+  }
+}
+
+ShellVar *var_find(const char *name, size_t len) {
+  if (var_count == 0) {
+    return NULL;
+  }
+  ShellVar *var = var_bucket(name, len, var_hash(name, len));
+  return var->entry != NULL ? var : NULL;
+}
+
+// Double the table; on failure the old one stays and -1 is returned
+int var_grow() {
+  ShellVar *old = var_table;
+  int old_capacity = var_capacity;
+  int capacity = old_capacity ? old_capacity * 2 : 128;
+  ShellVar *grown = calloc(capacity, sizeof(ShellVar));
+
+  if (grown == NULL) {
+    printf("%sError: out of memory for variables%s\n", COLOR_RED,
+           COLOR_RESET);
+    return -1;
+  }
+  var_table = grown;
+  var_capacity = capacity;
+  for (int i = 0; i < old_capacity; i++) {
+    if (old[i].entry != NULL) {
+      *var_bucket(old[i].entry, old[i].name_len, old[i].hash) = old[i];
+    }
+  }
+  free(old);
+  return 0;
+}
+
+const char *var_getn(const char *name, size_t len) {
+  ShellVar *var = var_find(name, len);
+  return var != NULL ? var->entry + var->name_len + 1 : NULL;
+}
+
+const char *var_get(const char *name) {
+  return var_getn(name, strlen(name));
+}
+
+// Set NAME to value; export marks it exported (an existing export flag is
+// never cleared)
+int var_set(const char *name, size_t len, const char *value, int export) {
+  // Past half full is only a slowdown, but probing needs a free slot
+  if ((var_count + 1) * 2 > var_capacity && var_grow() < 0 &&
+      var_count + 1 >= var_capacity) {
+    return -1;
+  }
+  unsigned int hash = var_hash(name, len);
+  ShellVar *var = var_bucket(name, len, hash);
+  size_t value_len = strlen(value);
+  char *entry = malloc(len + value_len + 2);
+  if (entry == NULL) {
+    return -1;
+  }
+  memcpy(entry, name, len);
+  entry[len] = '=';
+  memcpy(entry + len + 1, value, value_len + 1);
+
+  if (var->entry == NULL) {
+    var_count++;
+    var->name_len = len;
+    var->hash = hash;
+    var->exported = 0;
+  }
+  free(var->entry);
+  var->entry = entry;
+  if (export && !var->exported) {
+    var->exported = 1;
+    var_exported_count++;
+  }
+  if (var->exported) {
+    env_generation++;
+  }
+  return 0;
+}
+
+// Backward-shift deletion, as in the pid map
+void var_unset(const char *name, size_t len) {
+  ShellVar *var = var_find(name, len);
+  if (var == NULL) {
+    return;
+  }
+  if (var->exported) {
+    var_exported_count--;
+    env_generation++;
+  }
+  free(var->entry);
+  var_count--;
+
+  unsigned mask = var_capacity - 1;
+  unsigned i = var - var_table;
+  unsigned j = i;
+  while (1) {
+    var_table[i].entry = NULL;
+    do {
+      j = (j + 1) & mask;
+      if (var_table[j].entry == NULL) {
+        return;
+      }
+      unsigned home = var_table[j].hash & mask;
+      if (i <= j ? (i < home && home <= j) : (i < home || home <= j)) {
+        continue;
+      }
+      break;
+    } while (1);
+    var_table[i] = var_table[j];
+    i = j;
+  }
+}
+
+// Import the environment the shell was started with
+void env_init() {
+  extern char **environ;
+  for (int i = 0; environ[i] != NULL; i++) {
+    size_t len = var_name_len(environ[i]);
+    if (len > 0 && environ[i][len] == '=') {
+      var_set(environ[i], len, environ[i] + len + 1, 1);
+    }
+  }
+}
+
+// envp for execve: the exported variables, rebuilt only after a change.
+// NULL only if the very first build runs out of memory.
+char **env_envp() {
+  if (env_cache_generation == env_generation) {
+    return env_cache;
+  }
+  if (var_exported_count + 1 > env_cache_capacity) {
+    int capacity = (var_exported_count + 1) * 2;
+    char **grown = malloc(capacity * sizeof(char *));
+    if (grown == NULL) {
+      return env_cache; // out of memory: keep passing the last environment
+    }
+    free(env_cache);
+    env_cache = grown;
+    env_cache_capacity = capacity;
+  }
+  int n = 0;
+  for (int i = 0; i < var_capacity; i++) {
+    if (var_table[i].entry != NULL && var_table[i].exported) {
+      env_cache[n++] = var_table[i].entry;
+    }
+  }
+  env_cache[n] = NULL;
+  env_cache_generation = env_generation;
+  return env_cache;
+}
+
+// Append n bytes to a growing buffer
+int expand_append(char **buf, size_t *len, size_t *cap, const char *s,
+                  size_t n) {
+  if (*len + n + 1 > *cap) {
+    size_t cap2 = (*len + n + 1) * 2;
+    char *grown = realloc(*buf, cap2);
+    if (grown == NULL) {
+      return -1;
+    }
+    *buf = grown;
+    *cap = cap2;
+  }
+  memcpy(*buf + *len, s, n);
+  *len += n;
+  (*buf)[*len] = '\0';
+  return 0;
+}
+
+// Expand $NAME, ${NAME}, ${NAME:-default}, $1..$9, $#, $@, $?, $$,
+// $((expr)) and $(cmd) in word. Returns word itself when there is nothing to expand, otherwise a
+// copy in arena, or NULL if a substitution failed.
+char *expand_word(char *word, Arena *arena) {
+  if (strchr(word, '$') == NULL) {
+    return word;
+  }
+
+  char *buf = NULL;
+  size_t len = 0, cap = 0;
+  char num[24];
+  const char *p = word;
+
+  expand_append(&buf, &len, &cap, "", 0);
+  while (*p != '\0') {
+    const char *dollar = strchr(p, '$');
+    if (dollar == NULL) {
+      expand_append(&buf, &len, &cap, p, strlen(p));
+      break;
+    }
+    expand_append(&buf, &len, &cap, p, dollar - p);
+    p = dollar + 1;
+
+    const char *value = NULL;
+    size_t name_len;
+    if (*p == '(') {
+      value = expand_substitution(p, &p, arena);
+      if (value == NULL) {
+        free(buf);
+        return NULL;
+      }
+    } else if (*p >= '0' && *p <= '9') {
+      int n = *p++ - '0';
+      value = n == 0 ? "myshell"
+              : n <= positional_count ? positional[n - 1]
+                                      : NULL;
+    } else if (*p == '#') {
+      snprintf(num, sizeof(num), "%d", positional_count);
+      value = num;
+      p++;
+    } else if (*p == '@' || *p == '*') {
+      for (int i = 0; i < positional_count; i++) {
+        if (i > 0) {
+          expand_append(&buf, &len, &cap, " ", 1);
+        }
+        expand_append(&buf, &len, &cap, positional[i], strlen(positional[i]));
+      }
+      p++;
+    } else if (*p == '?' || *p == '$') {
+      snprintf(num, sizeof(num), "%d",
+               *p == '?' ? last_exit_status : (int)shell_pid);
+      value = num;
+      p++;
+    } else if (*p == '{' && (name_len = var_name_len(p + 1)) > 0 &&
+               (p[1 + name_len] == '}' ||
+                (p[1 + name_len] == ':' && p[2 + name_len] == '-'))) {
+      const char *name = p + 1;
+      value = var_getn(name, name_len);
+      p += 1 + name_len;
+      if (*p == ':') {
+        // ${NAME:-default}: default when unset or empty
+        const char *close = strchr(p, '}');
+        if (close == NULL) {
+          close = p + strlen(p);
+        }
+        if (value == NULL || value[0] == '\0') {
+          expand_append(&buf, &len, &cap, p + 2, close - (p + 2));
+          value = NULL;
+        }
+        p = *close == '}' ? close + 1 : close;
+      } else {
+        p++;
+      }
+    } else if ((name_len = var_name_len(p)) > 0) {
+      value = var_getn(p, name_len);
+      p += name_len;
+    } else {
+      // A lone '$' is literal
+      value = "$";
+    }
+    if (value != NULL) {
+      expand_append(&buf, &len, &cap, value, strlen(value));
+    }
+  }
+
+  char *result = buf != NULL ? arena_strndup(arena, buf, len) : NULL;
+  free(buf);
+  return result;
+}
+
+// NAME=value words at the start of a line set shell variables
+int is_assignment(const char *word) {
+  size_t len = var_name_len(word);
+  return len > 0 && word[len] == '=';
+}
+
+// Set NAME=value words; like sh, the status is that of the last command
+// substitution in the values (0 if there was none)
+int assign_variables(char **args) {
+  Arena arena = {NULL};
+  substitution_status = -1;
+  for (int i = 0; args[i] != NULL; i++) {
+    size_t len = var_name_len(args[i]);
+    char *value = expand_word(args[i] + len + 1, &arena);
+    if (value == NULL) {
+      arena_free(&arena);
+      return 1;
+    }
+    var_set(args[i], len, value, 0);
+  }
+  arena_free(&arena);
+  return substitution_status > 0 ? substitution_status : 0;
+}
+
+int var_entry_compare(const void *a, const void *b) {
+  return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+int cmd_export(char **args) {
+  if (args[1] == NULL || strcmp(args[1], "-p") == 0) {
+    char **envp = env_envp();
+    int n = 0;
+    while (envp != NULL && envp[n] != NULL) {
+      n++;
+    }
+    char **sorted = malloc((n + 1) * sizeof(char *));
+    if (sorted == NULL) {
+      printf("%sexport: out of memory%s\n", COLOR_RED, COLOR_RESET);
+      return 1;
+    }
+    memcpy(sorted, envp, n * sizeof(char *));
+    qsort(sorted, n, sizeof(char *), var_entry_compare);
+    for (int i = 0; i < n; i++) {
+      printf("export %s\n", sorted[i]);
+    }
+    free(sorted);
+    return 0;
+  }
+
+  int status = 0;
+  for (int i = 1; args[i] != NULL; i++) {
+    size_t len = var_name_len(args[i]);
+    if (len == 0 || (args[i][len] != '=' && args[i][len] != '\0')) {
+      printf("%sexport: '%s': not a valid identifier%s\n", COLOR_RED, args[i],
+             COLOR_RESET);
+      status = 1;
+      continue;
+    }
+    if (args[i][len] == '=') {
+      var_set(args[i], len, args[i] + len + 1, 1);
+      continue;
+    }
+    ShellVar *var = var_find(args[i], len);
+    if (var != NULL && !var->exported) {
+      var->exported = 1;
+      var_exported_count++;
+      env_generation++;
+    }
+  }
+  return status;
+}
+
+int cmd_unset(char **args) {
+  if (args[1] == NULL) {
+    printf("%sUsage: unset NAME...%s\n", COLOR_RED, COLOR_RESET);
+    return 1;
+  }
+  for (int i = 1; args[i] != NULL; i++) {
+    var_unset(args[i], strlen(args[i]));
+  }
+  return 0;
+}
+
+// ============================================================================
+// ARITHMETIC & COMMAND SUBSTITUTION
+// ============================================================================
+
+// Split a line into words in place. Spaces inside $(...) and $((...)) do
+// not end a word, so substitutions reach expand_word in one piece.
+int split_line(char *line, char **args, int max) {
+  int n = 0;
+  char *p = line;
+
+  while (*p != '\0' && n < max - 1) {
+    while (*p == ' ' || *p == '\t') {
+      p++;
+    }
+    if (*p == '\0') {
+      break;
+    }
+    args[n++] = p;
+    int depth = 0;
+    for (; *p != '\0'; p++) {
+      if (depth == 0 && (*p == ' ' || *p == '\t')) {
+        break;
+      }
+      if (*p == '$' && p[1] == '(') {
+        depth++;
+        p++;
+      } else if (*p == '(' && depth > 0) {
+        depth++;
+      } else if (*p == ')' && depth > 0) {
+        depth--;
+      }
+    }
+    if (*p != '\0') {
+      *p++ = '\0';
+    }
+  }
+  args[n] = NULL;
+  return n;
+}
+
+// The ')' matching the '(' at open, or NULL
+const char *match_paren(const char *open) {
+  int depth = 0;
+  for (const char *p = open; *p != '\0'; p++) {
+    if (*p == '(') {
+      depth++;
+    } else if (*p == ')' && --depth == 0) {
+      return p;
+    }
+  }
+  return NULL;
+}
+
+// ---- $((expr)) --------------------------------------------------------------
+
+typedef struct {
+  const char *p;
+  const char *error;
+  int depth;  // variable references being evaluated, to stop cycles
+  int noeval; // inside a branch that is not taken: parse only
+} ArithParser;
+
+ArithValue arith_ternary(ArithParser *ap);
+
+ArithValue arith_int(long long i) {
+  ArithValue v = {0, i, 0};
+  return v;
+}
+
+ArithValue arith_float(double f) {
+  ArithValue v = {1, 0, f};
+  return v;
+}
+
+double arith_double(ArithValue v) {
+  return v.is_float ? v.f : (double)v.i;
+}
+
+int arith_true(ArithValue v) {
+  return v.is_float ? v.f != 0 : v.i != 0;
+}
+
+// Consume op if it is next and not followed by a character in reject
+// (so "<" does not match the start of "<<" or "<=")
+int arith_accept(ArithParser *ap, const char *op, const char *reject) {
+  while (*ap->p == ' ' || *ap->p == '\t' || *ap->p == '\n') {
+    ap->p++;
+  }
+  size_t len = strlen(op);
+  if (strncmp(ap->p, op, len) != 0 ||
+      (ap->p[len] != '\0' && strchr(reject, ap->p[len]) != NULL)) {
+    return 0;
+  }
+  ap->p += len;
+  return 1;
+}
+
+void arith_fail(ArithParser *ap, const char *error) {
+  if (ap->error == NULL) {
+    ap->error = error;
+  }
+}
+
+// An error from evaluating rather than parsing, which the right side of a
+// decided && or || and the unused side of ?: never raise
+void arith_trap(ArithParser *ap, const char *error) {
+  if (ap->noeval == 0) {
+    arith_fail(ap, error);
+  }
+}
+
+// Parse a number at s; returns the end, or s if there is none
+const char *arith_number(const char *s, ArithValue *v) {
+  char *int_end, *float_end;
+  int hex = s[0] == '0' && (s[1] == 'x' || s[1] == 'X');
+  long long i = strtoll(s, &int_end, hex ? 16 : 10);
+  double f = strtod(s, &float_end);
+  if (float_end > int_end) {
+    *v = arith_float(f);
+    return float_end;
+  }
+  *v = arith_int(i);
+  return int_end;
+}
+
+ArithValue arith_primary(ArithParser *ap) {
+  ArithValue v = arith_int(0);
+
+  if (arith_accept(ap, "(", "")) {
+    v = arith_ternary(ap);
+    if (!arith_accept(ap, ")", "")) {
+      arith_fail(ap, "missing ')'");
+    }
+    return v;
+  }
+  if ((*ap->p >= '0' && *ap->p <= '9') || *ap->p == '.') {
+    const char *end = arith_number(ap->p, &v);
+    if (end == ap->p) {
+      arith_fail(ap, "bad number");
+    }
+    ap->p = end;
+    return v;
+  }
+
+  // Bare names are variables; unset or empty counts as 0
+  size_t len = var_name_len(ap->p);
+  if (len == 0) {
+    arith_fail(ap, *ap->p == '\0' ? "unexpected end of expression"
+                                  : "syntax error");
+    return v;
+  }
+  const char *value = var_getn(ap->p, len);
+  ap->p += len;
+  if (value == NULL || value[0] == '\0' || ap->noeval > 0) {
+    return v;
+  }
+  const char *end = arith_number(value, &v);
+  if (*end != '\0') {
+    // Not a plain number: evaluate the value as an expression
+    if (ap->depth >= 16) {
+      arith_trap(ap, "expression recursion too deep");
+      return v;
+    }
+    ArithParser sub = {value, NULL, ap->depth + 1, 0};
+    v = arith_ternary(&sub);
+    if (sub.error == NULL && *sub.p != '\0') {
+      sub.error = "syntax error";
+    }
+    if (sub.error != NULL) {
+      arith_fail(ap, sub.error);
+    }
+  }
+  return v;
+}
+
+ArithValue arith_unary(ArithParser *ap);
+
+// ** is right-associative and binds tighter than unary minus on its left
+ArithValue arith_power(ArithParser *ap) {
+  ArithValue base = arith_primary(ap);
+  if (!arith_accept(ap, "**", "")) {
+    return base;
+  }
+  ArithValue exp = arith_unary(ap);
+  if (exp.is_float && exp.f != (double)(long long)exp.f) {
+    arith_trap(ap, "fractional exponent");
+    return base;
+  }
+  long long n = exp.is_float ? (long long)exp.f : exp.i;
+  if (!base.is_float && n >= 0) {
+    long long r = 1, b = base.i;
+    while (n > 0) {
+      if (((n & 1) && __builtin_mul_overflow(r, b, &r)) ||
+          ((n >>= 1) > 0 && __builtin_mul_overflow(b, b, &b))) {
+        arith_trap(ap, "integer overflow");
+        return arith_int(0);
+      }
+    }
+    return arith_int(r);
+  }
+  double r = 1, b = arith_double(base);
+  int negative = n < 0;
+  for (n = negative ? -n : n; n > 0; n >>= 1, b *= b) {
+    if (n & 1) {
+      r *= b;
+    }
+  }
+  return arith_float(negative ? 1 / r : r);
+}
+
+ArithValue arith_unary(ArithParser *ap) {
+  if (arith_accept(ap, "-", "")) {
+    ArithValue v = arith_unary(ap);
+    if (!v.is_float && v.i == LLONG_MIN) {
+      arith_trap(ap, "integer overflow");
+      return v;
+    }
+    return v.is_float ? arith_float(-v.f) : arith_int(-v.i);
+  }
+  if (arith_accept(ap, "+", "")) {
+    return arith_unary(ap);
+  }
+  if (arith_accept(ap, "!", "=")) {
+    return arith_int(!arith_true(arith_unary(ap)));
+  }
+  if (arith_accept(ap, "~", "")) {
+    ArithValue v = arith_unary(ap);
+    if (v.is_float) {
+      arith_trap(ap, "'~' needs an integer");
+    }
+    return arith_int(~v.i);
+  }
+  return arith_power(ap);
+}
+
+// Apply a binary operator; ops are identified by their first two chars
+ArithValue arith_apply(ArithParser *ap, const char *op, ArithValue a,
+                       ArithValue b) {
+  int is_float = a.is_float || b.is_float;
+  double x = arith_double(a), y = arith_double(b);
+  long long r;
+
+  switch (op[0]) {
+  case '*':
+  case '+':
+  case '-':
+    if (is_float) {
+      return arith_float(op[0] == '*' ? x * y : op[0] == '+' ? x + y : x - y);
+    }
+    if (op[0] == '*' ? __builtin_mul_overflow(a.i, b.i, &r)
+        : op[0] == '+' ? __builtin_add_overflow(a.i, b.i, &r)
+                       : __builtin_sub_overflow(a.i, b.i, &r)) {
+      arith_trap(ap, "integer overflow");
+      return arith_int(0);
+    }
+    return arith_int(r);
+  case '/':
+  case '%':
+    if (is_float ? y == 0 : b.i == 0) {
+      arith_trap(ap, "division by zero");
+      return arith_int(0);
+    }
+    // The one quotient that doesn't fit (and traps, as does its remainder)
+    if (!is_float && a.i == LLONG_MIN && b.i == -1) {
+      arith_trap(ap, "integer overflow");
+      return arith_int(0);
+    }
+    if (op[0] == '/') {
+      return is_float ? arith_float(x / y) : arith_int(a.i / b.i);
+    }
+    if (is_float) {
+      return arith_float(x - y * (double)(long long)(x / y));
+    }
+    return arith_int(a.i % b.i);
+  case '=':
+    return arith_int(is_float ? x == y : a.i == b.i);
+  case '!':
+    return arith_int(is_float ? x != y : a.i != b.i);
+  case '<':
+  case '>':
+    if (op[1] == op[0]) {
+      break; // shift, below
+    }
+    if (!is_float) {
+      if (op[0] == '<') {
+        return arith_int(op[1] == '=' ? a.i <= b.i : a.i < b.i);
+      }
+      return arith_int(op[1] == '=' ? a.i >= b.i : a.i > b.i);
+    }
+    if (op[0] == '<') {
+      return arith_int(op[1] == '=' ? x <= y : x < y);
+    }
+    return arith_int(op[1] == '=' ? x >= y : x > y);
+  }
+
+  // Bitwise operators and shifts
+  if (is_float) {
+    arith_trap(ap, "bitwise operator needs integers");
+    return arith_int(0);
+  }
+  switch (op[0]) {
+  case '&':
+    return arith_int(a.i & b.i);
+  case '|':
+    return arith_int(a.i | b.i);
+  case '^':
+    return arith_int(a.i ^ b.i);
+  case '<':
+    return arith_int(b.i >= 0 && b.i < 64
+                         ? (long long)((unsigned long long)a.i << b.i)
+                         : 0);
+  default:
+    return arith_int(b.i >= 0 && b.i < 64 ? a.i >> b.i : 0);
+  }
+}
+
+// Binary operators by precedence level, loosest first. Each entry lists
+// an operator and the characters that must not follow it.
+typedef struct {
+  const char *op;
+  const char *reject;
+} ArithOp;
+
+const ArithOp arith_levels[][5] = {
+    {{"|", "|"}},
+    {{"^", ""}},
+    {{"&", "&"}},
+    {{"==", ""}, {"!=", ""}},
+    {{"<=", ""}, {">=", ""}, {"<", "<"}, {">", ">"}},
+    {{"<<", ""}, {">>", ""}},
+    {{"+", ""}, {"-", ""}},
+    {{"*", "*"}, {"/", ""}, {"%", ""}},
+};
+#define ARITH_LEVELS ((int)(sizeof(arith_levels) / sizeof(arith_levels[0])))
+
+ArithValue arith_binary(ArithParser *ap, int level) {
+  if (level == ARITH_LEVELS) {
+    return arith_unary(ap);
+  }
+  ArithValue v = arith_binary(ap, level + 1);
+  while (ap->error == NULL) {
+    const ArithOp *op = arith_levels[level];
+    while (op->op != NULL && !arith_accept(ap, op->op, op->reject)) {
+      op++;
+    }
+    if (op->op == NULL) {
+      break;
+    }
+    v = arith_apply(ap, op->op, v, arith_binary(ap, level + 1));
+  }
+  return v;
+}
+
+// && and || short-circuit: once the left side decides the result, the
+// right side is only parsed
+ArithValue arith_logical(ArithParser *ap, int is_or) {
+  ArithValue v = is_or ? arith_logical(ap, 0) : arith_binary(ap, 0);
+  while (ap->error == NULL && arith_accept(ap, is_or ? "||" : "&&", "")) {
+    int decided = arith_true(v) == is_or;
+    ap->noeval += decided;
+    ArithValue rhs = is_or ? arith_logical(ap, 0) : arith_binary(ap, 0);
+    ap->noeval -= decided;
+    v = arith_int(decided ? is_or : arith_true(rhs));
+  }
+  return v;
+}
+
+// Only the chosen side of ?: is evaluated
+ArithValue arith_ternary(ArithParser *ap) {
+  ArithValue cond = arith_logical(ap, 1);
+  if (!arith_accept(ap, "?", "")) {
+    return cond;
+  }
+  int take = arith_true(cond);
+  ap->noeval += !take;
+  ArithValue yes = arith_ternary(ap);
+  ap->noeval -= !take;
+  if (!arith_accept(ap, ":", "")) {
+    arith_fail(ap, "missing ':'");
+    return cond;
+  }
+  ap->noeval += take;
+  ArithValue no = arith_ternary(ap);
+  ap->noeval -= take;
+  return take ? yes : no;
+}
+
+// Evaluate expr, printing an error and returning -1 if it is invalid
+int arith_eval(const char *expr, ArithValue *out) {
+  ArithParser ap = {expr, NULL, 0, 0};
+  *out = arith_ternary(&ap);
+  arith_accept(&ap, "", "");
+  if (ap.error == NULL && *ap.p != '\0') {
+    ap.error = "syntax error";
+  }
+  if (ap.error != NULL) {
+    printf("%sError: %s in '%s'%s\n", COLOR_RED, ap.error, expr,
+           COLOR_RESET);
+    return -1;
+  }
+  return 0;
+}
+
+void arith_format(ArithValue v, char *buf, size_t size) {
+  if (!v.is_float) {
+    snprintf(buf, size, "%lld", v.i);
+    return;
+  }
+  snprintf(buf, size, "%.15g", v.f);
+  // Keep a float looking like one so it stays float when reused
+  if (strpbrk(buf, ".eEin") == NULL) {
+    strncat(buf, ".0", size - strlen(buf) - 1);
+  }
+}
+
+// ---- $(command) -----------------------------------------------------------
+
+// Only built-ins that just print (never read stdin, block, touch jobs,
+// timers or shell state) run in the shell; the rest run in a child, like
+// a subshell
+int substitution_in_process(Pipeline *pipeline) {
+  static const char *pure_output[] = {"echo",   "pwd",      "test",
+                                      "[",      "true",     "false",
+                                      "whoami", "hostname", "uname",
+                                      "date",   NULL};
+  if (pipeline->count != 1 || pipeline->background) {
+    return 0;
+  }
+  for (int i = 0; pure_output[i] != NULL; i++) {
+    if (strcmp(pipeline->stages[0].argv[0], pure_output[i]) == 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Run a built-in with stdout on a memfd and map the result, so nothing is
+// forked and the output is copied once, into the arena
+char *substitute_builtin(Pipeline *pipeline, Arena *arena, size_t *len,
+                         int *status) {
+  int memfd = memfd_create("substitution", MFD_CLOEXEC);
+  if (memfd < 0) {
+    return NULL;
+  }
+  fflush(stdout);
+  int saved_out = dup(STDOUT_FILENO);
+  dup2(memfd, STDOUT_FILENO);
+  *status = run_builtin_in_shell(
+      pipeline, find_builtin(pipeline->stages[0].argv[0]), monotonic_ns());
+  fflush(stdout);
+  dup2(saved_out, STDOUT_FILENO);
+  close(saved_out);
+
+  char *result;
+  off_t size = lseek(memfd, 0, SEEK_END);
+  if (size <= 0) {
+    result = arena_strndup(arena, "", 0);
+    *len = 0;
+  } else {
+    char *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, memfd, 0);
+    result = map != MAP_FAILED ? arena_strndup(arena, map, size) : NULL;
+    *len = size;
+    if (map != MAP_FAILED) {
+      munmap(map, size);
+    }
+  }
+  close(memfd);
+  return result;
+}
+
+// Anything else runs as a foreground job writing into a pipe
+char *substitute_external(Pipeline *pipeline, Arena *arena, size_t *len,
+                          int *status) {
+  int fds[2];
+  if (pipe2(fds, O_CLOEXEC) < 0) {
+    return NULL;
+  }
+  pipeline->out_fd = fds[1];
+  int slot = start_pipeline(pipeline, 1);
+  close(fds[1]);
+  if (slot < 0) {
+    close(fds[0]);
+    return NULL;
+  }
+
+  char *buf = NULL;
+  size_t used = 0, cap = 0;
+  ssize_t n;
+  do {
+    if (cap - used < 4096) {
+      cap = cap ? cap * 2 : 16384;
+      char *grown = realloc(buf, cap);
+      if (grown == NULL) {
+        break;
+      }
+      buf = grown;
+    }
+    n = read(fds[0], buf + used, cap - used);
+    if (n > 0) {
+      used += n;
+    }
+  } while (n > 0 || (n < 0 && errno == EINTR));
+  close(fds[0]);
+  *status = put_job_in_foreground(slot, 0);
+
+  char *result = arena_strndup(arena, buf != NULL ? buf : "", used);
+  *len = used;
+  free(buf);
+  return result;
+}
+
+// Run a parsed pipeline and return its output (in arena) with its length
+// and exit status
+char *capture_pipeline(Pipeline *pipeline, Arena *arena, size_t *len,
+                       int *status) {
+  if (substitution_in_process(pipeline)) {
+    return substitute_builtin(pipeline, arena, len, status);
+  }
+  return substitute_external(pipeline, arena, len, status);
+}
+
+// Capture the output of an argv that is already expanded (see
+// parse_expanded_pipeline); NULL if it could not be run
+char *capture_argv(char **args, Arena *arena, size_t *len, int *status) {
+  Pipeline pipeline;
+  char *result = NULL;
+
+  *len = 0;
+  *status = 1;
+  if (parse_expanded_pipeline(args, &pipeline) == 0) {
+    result = capture_pipeline(&pipeline, arena, len, status);
+    free_pipeline(&pipeline);
+  }
+  return result;
+}
+
+// Run the command line in text[0..n) and return its output (in arena)
+// with its length and exit status; NULL if it could not be run
+char *capture_command(const char *text, size_t n, Arena *arena, size_t *len,
+                      int *status) {
+  char *line = strndup(text, n);
+  char *args[MAX_ARGS];
+  Pipeline pipeline;
+  char *result = NULL;
+
+  *len = 0;
+  *status = 1;
+  if (line == NULL) {
+    return NULL;
+  }
+  if (split_line(line, args, MAX_ARGS) == 0) {
+    free(line);
+    *status = 0;
+    return arena_strndup(arena, "", 0);
+  }
+  if (parse_pipeline(args, &pipeline) == 0) {
+    result = capture_pipeline(&pipeline, arena, len, status);
+    free_pipeline(&pipeline);
+  }
+  free(line);
+  return result;
+}
+
+// Output of the command line in text[0..n), trailing newlines removed. Its
+// exit status becomes $? (and the status of a plain assignment).
+char *command_substitute(const char *text, size_t n, Arena *arena) {
+  size_t len;
+  int status;
+  char *result = capture_command(text, n, arena, &len, &status);
+
+  last_exit_status = status;
+  substitution_status = status;
+
+  while (result != NULL && len > 0 && result[len - 1] == '\n') {
+    result[--len] = '\0';
+  }
+  return result;
+}
+
+// Words with a command substitution or $@ / $* are split on whitespace
+// after expansion
+int word_needs_splitting(const char *word) {
+  for (const char *p = strchr(word, '$'); p != NULL; p = strchr(p + 1, '$')) {
+    if ((p[1] == '(' && p[2] != '(') || p[1] == '@' || p[1] == '*') {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Expand the $(...) or $((...)) whose '(' is at open; *end is set past it.
+// Returns NULL (after printing why) on error.
+char *expand_substitution(const char *open, const char **end, Arena *arena) {
+  const char *close = match_paren(open);
+  if (close == NULL) {
+    printf("%sError: Unterminated '$('%s\n", COLOR_RED, COLOR_RESET);
+    return NULL;
+  }
+  *end = close + 1;
+
+  if (open[1] == '(' && close[-1] == ')' && match_paren(open + 1) == close - 1) {
+    // $((expr)): variables and substitutions inside expand first
+    char *expr = arena_strndup(arena, open + 2, close - 1 - (open + 2));
+    if (expr == NULL || (expr = expand_word(expr, arena)) == NULL) {
+      return NULL;
+    }
+    ArithValue v;
+    char num[64];
+    if (arith_eval(expr, &v) < 0) {
+      return NULL;
+    }
+    arith_format(v, num, sizeof(num));
+    return arena_strndup(arena, num, strlen(num));
+  }
+  return command_substitute(open + 1, close - (open + 1), arena);
+}
+
+// ============================================================================
+// CONTROL FLOW (if/while/for/functions, && and ||)
+// ============================================================================
+
+// Input is lexed and parsed once into bytecode, so loop bodies run without
+// being parsed again. Commands made of a literal built-in name (no pipes,
+// redirections or prefixes) are resolved when compiled and called
+// directly; everything else goes through execute_command.
+enum {
+  OP_RUN,        // words[arg..] through execute_command
+  OP_BUILTIN,    // words[arg..] expanded and passed to builtins[aux]
+  OP_ASSIGN,     // words[arg..] are all NAME=value
+  OP_NOT,        // invert the status
+  OP_STATUS,     // status = arg
+  OP_JUMP,       // pc = arg
+  OP_JUMP_FALSE, // pc = arg if status != 0
+  OP_JUMP_TRUE,  // pc = arg if status == 0
+  OP_FOR_INIT,   // expand words[arg..] into a new iteration frame
+  OP_FOR_NEXT,   // set words[arg] to the next item, or pc = aux when done
+  OP_FOR_POP,    // drop the iteration frame
+  OP_DEFUN,      // define function words[arg] as chunks[aux]
+  OP_RETURN,     // leave the function, status = words[arg] if count
+  OP_LOOP_ENTER, // push a while/until loop status of 0 and pc = arg
+  OP_LOOP_SAVE,  // loop status = status (end of an iteration, or break)
+  OP_LOOP_LEAVE, // status = loop status, popped
+};
+
+typedef struct {
+  unsigned char op;
+  unsigned short count; // words used by the instruction
+  int arg;
+  int aux;
+} Instr;
+
+struct Code {
+  Instr *instrs;
+  int ninstrs;
+  int instr_capacity;
+  char **words; // NULL-terminated runs, one per instruction that uses them
+  int nwords;
+  int word_capacity;
+  Code **chunks; // bodies of the functions defined here
+  int nchunks;
+  Arena strings;
+  int refs;
+  int oom; // an allocation failed while compiling; the code must not run
+};
+
+struct Function {
+  char *name;
+  Code *code;
+};
+
+Function *functions = NULL;
+int function_count = 0;
+int function_capacity = 0;
+
+int call_depth = 0;
+#define MAX_CALL_DEPTH 1000
+
+// Set when Ctrl-C interrupts a script, so every level unwinds
+int script_interrupted = 0;
+
+// ---- Bytecode -----------------------------------------------------------------
+
+void code_oom(Code *code) {
+  if (!code->oom) {
+    printf("%sError: out of memory compiling script%s\n", COLOR_RED,
+           COLOR_RESET);
+  }
+  code->oom = 1;
+}
+
+// Append an instruction; returns its index, or -1 (and marks the code
+// failed) when out of memory
+int code_emit(Code *code, int op, int arg, int count, int aux) {
+  if (code->ninstrs == code->instr_capacity) {
+    int capacity = code->instr_capacity ? code->instr_capacity * 2 : 32;
+    Instr *grown = realloc(code->instrs, capacity * sizeof(Instr));
+    if (grown == NULL) {
+      code_oom(code);
+      return -1;
+    }
+    code->instrs = grown;
+    code->instr_capacity = capacity;
+  }
+  Instr *in = &code->instrs[code->ninstrs];
+  in->op = op;
+  in->arg = arg;
+  in->count = count;
+  in->aux = aux;
+  return code->ninstrs++;
+}
+
+// Copy n words into the code as a NULL-terminated run; returns its index,
+// or -1 when out of memory
+int code_add_words(Code *code, char **words, int n) {
+  if (code->nwords + n + 1 > code->word_capacity) {
+    int capacity = (code->nwords + n + 1) * 2;
+    char **grown = realloc(code->words, capacity * sizeof(char *));
+    if (grown == NULL) {
+      code_oom(code);
+      return -1;
+    }
+    code->words = grown;
+    code->word_capacity = capacity;
+  }
+  int start = code->nwords;
+  for (int i = 0; i < n; i++) {
+    code->words[code->nwords++] =
+        arena_strndup(&code->strings, words[i], strlen(words[i]));
+  }
+  code->words[code->nwords++] = NULL;
+  return start;
+}
+
+void code_release(Code *code) {
+  if (code == NULL || --code->refs > 0) {
+    return;
+  }
+  for (int i = 0; i < code->nchunks; i++) {
+    code_release(code->chunks[i]);
+  }
+  free(code->chunks);
+  free(code->instrs);
+  free(code->words);
+  arena_free(&code->strings);
+  free(code);
+}
+
+// ---- Lexer ------------------------------------------------------------------
+
+enum { TOK_WORD, TOK_SEP, TOK_AND, TOK_OR, TOK_END };
+
+typedef struct {
+  int type;
+  char *word;
+} Token;
+
+#define MAX_LOOP_DEPTH 64
+
+// Jumps of one enclosing loop: continue goes to a known target, breaks are
+// patched once the loop's end is known
+typedef struct {
+  int continue_target;
+  int *breaks;
+  int nbreaks;
+} LoopContext;
+
+typedef struct {
+  Token *tokens;
+  int ntokens;
+  int token_capacity;
+  int pos;
+  Arena strings;
+  Code *code; // chunk being compiled
+  LoopContext loops[MAX_LOOP_DEPTH];
+  int loop_depth;
+  int in_function;
+  int incomplete; // input ended inside a construct
+  int error;
+} ScriptParser;
+
+int script_add_token(ScriptParser *ps, int type, const char *s, size_t n) {
+  if (ps->ntokens == ps->token_capacity) {
+    int capacity = ps->token_capacity ? ps->token_capacity * 2 : 64;
+    Token *grown = realloc(ps->tokens, capacity * sizeof(Token));
+    if (grown == NULL) {
+      printf("%sError: out of memory reading script%s\n", COLOR_RED,
+             COLOR_RESET);
+      ps->error = 1;
+      return -1;
+    }
+    ps->tokens = grown;
+    ps->token_capacity = capacity;
+  }
+  Token *tok = &ps->tokens[ps->ntokens++];
+  tok->type = type;
+  tok->word = s != NULL ? arena_strndup(&ps->strings, s, n) : NULL;
+  return 0;
+}
+
+// Words end at blanks, newlines, ';', '&&' and '||', except inside $(...).
+// '#' at the start of a word comments out the rest of the line.
+void script_lex(ScriptParser *ps, const char *text) {
+  const char *p = text;
+
+  while (1) {
+    while (*p == ' ' || *p == '\t' || *p == '\r') {
+      p++;
+    }
+    if (*p == '\0') {
+      break;
+    }
+    if (*p == '#') {
+      while (*p != '\0' && *p != '\n') {
+        p++;
+      }
+    } else if (*p == '\n' || *p == ';') {
+      if (script_add_token(ps, TOK_SEP, NULL, 0) < 0) {
+        return;
+      }
+      p++;
+    } else if ((p[0] == '&' && p[1] == '&') || (p[0] == '|' && p[1] == '|')) {
+      if (script_add_token(ps, p[0] == '&' ? TOK_AND : TOK_OR, NULL, 0) < 0) {
+        return;
+      }
+      p += 2;
+    } else {
+      const char *start = p;
+      int depth = 0;
+      for (; *p != '\0'; p++) {
+        if (depth == 0 &&
+            (strchr(" \t\r\n;", *p) != NULL || (p[0] == '&' && p[1] == '&') ||
+             (p[0] == '|' && p[1] == '|'))) {
+          break;
+        }
+        if (*p == '$' && p[1] == '(') {
+          depth++;
+          p++;
+        } else if (*p == '(' && depth > 0) {
+          depth++;
+        } else if (*p == ')' && depth > 0) {
+          depth--;
+        }
+      }
+      if (script_add_token(ps, TOK_WORD, start, p - start) < 0) {
+        return;
+      }
+    }
+  }
+  script_add_token(ps, TOK_END, NULL, 0);
+}
+
+// ---- Parser / compiler ------------------------------------------------------
+
+Token *script_peek(ScriptParser *ps) {
+  return &ps->tokens[ps->pos];
+}
+
+int script_at(ScriptParser *ps, const char *keyword) {
+  Token *tok = script_peek(ps);
+  return tok->type == TOK_WORD && strcmp(tok->word, keyword) == 0;
+}
+
+int script_at_any(ScriptParser *ps, const char **keywords) {
+  for (int i = 0; keywords[i] != NULL; i++) {
+    if (script_at(ps, keywords[i])) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+void script_skip_seps(ScriptParser *ps) {
+  while (script_peek(ps)->type == TOK_SEP) {
+    ps->pos++;
+  }
+}
+
+int script_failed(ScriptParser *ps) {
+  return ps->error || ps->incomplete || ps->code->oom;
+}
+
+void script_syntax_error(ScriptParser *ps) {
+  if (script_failed(ps)) {
+    return;
+  }
+  Token *tok = script_peek(ps);
+  if (tok->type == TOK_END) {
+    ps->incomplete = 1;
+    return;
+  }
+  const char *near = tok->type == TOK_WORD  ? tok->word
+                     : tok->type == TOK_AND ? "&&"
+                     : tok->type == TOK_OR  ? "||"
+                                            : ";";
+  printf("%sError: syntax error near '%s'%s\n", COLOR_RED, near, COLOR_RESET);
+  ps->error = 1;
+}
+
+void script_expect(ScriptParser *ps, const char *keyword) {
+  script_skip_seps(ps);
+  if (!script_at(ps, keyword)) {
+    script_syntax_error(ps);
+    return;
+  }
+  ps->pos++;
+}
+
+const char *script_reserved[] = {"then", "elif", "else", "fi", "do",
+                                 "done", "}",    "in",   NULL};
+
+void script_list(ScriptParser *ps, const char **terminators);
+void script_and_or(ScriptParser *ps);
+
+void script_patch_here(ScriptParser *ps, int instr) {
+  if (instr >= 0) {
+    ps->code->instrs[instr].arg = ps->code->ninstrs;
+  }
+}
+
+void script_simple(ScriptParser *ps) {
+  char *words[MAX_ARGS];
+  int n = 0;
+  int assignments = 1;
+  int direct = 1;
+
+  while (script_peek(ps)->type == TOK_WORD) {
+    char *word = script_peek(ps)->word;
+    if (n == MAX_ARGS - 1) {
+      printf("%sError: too many words in command%s\n", COLOR_RED,
+             COLOR_RESET);
+      ps->error = 1;
+      return;
+    }
+    words[n++] = word;
+    ps->pos++;
+    assignments = assignments && is_assignment(word);
+    if (strcmp(word, "|") == 0 || strcmp(word, "<") == 0 ||
+        strcmp(word, ">") == 0 || strcmp(word, ">>") == 0 ||
+        strcmp(word, "&") == 0) {
+      direct = 0;
+    }
+    // "cmd & next" starts a new command after the '&'
+    if (strcmp(word, "&") == 0) {
+      break;
+    }
+  }
+
+  Code *code = ps->code;
+  int start = code_add_words(code, words, n);
+  Builtin *builtin = find_builtin(words[0]);
+  if (assignments) {
+    code_emit(code, OP_ASSIGN, start, n, 0);
+  } else if (direct && builtin != NULL && strchr(words[0], '$') == NULL &&
+             strcmp(words[0], "time") != 0 &&
+             strcmp(words[0], "perfstat") != 0 &&
+             strcmp(words[0], "run") != 0) {
+    code_emit(code, OP_BUILTIN, start, n, builtin - builtins);
+  } else {
+    code_emit(code, OP_RUN, start, n, 0);
+  }
+}
+
+#define MAX_IF_BRANCHES 64
+
+// if LIST; then LIST; [elif LIST; then LIST;]... [else LIST;] fi
+void script_if(ScriptParser *ps) {
+  static const char *then_terms[] = {"then", NULL};
+  static const char *branch_terms[] = {"elif", "else", "fi", NULL};
+  static const char *fi_terms[] = {"fi", NULL};
+  int ends[MAX_IF_BRANCHES];
+  int nends = 0;
+
+  ps->pos++;
+  while (1) {
+    script_list(ps, then_terms);
+    script_expect(ps, "then");
+    if (script_failed(ps)) {
+      return;
+    }
+    int skip = code_emit(ps->code, OP_JUMP_FALSE, 0, 0, 0);
+    script_list(ps, branch_terms);
+    script_skip_seps(ps);
+    if (script_failed(ps)) {
+      return;
+    }
+    if (nends == MAX_IF_BRANCHES) {
+      printf("%sError: too many elif branches (limit %d)%s\n", COLOR_RED,
+             MAX_IF_BRANCHES, COLOR_RESET);
+      ps->error = 1;
+      return;
+    }
+    ends[nends++] = code_emit(ps->code, OP_JUMP, 0, 0, 0);
+    script_patch_here(ps, skip);
+    if (script_at(ps, "elif")) {
+      ps->pos++;
+      continue;
+    }
+    if (script_at(ps, "else")) {
+      ps->pos++;
+      script_list(ps, fi_terms);
+    } else {
+      // No branch taken: the status is 0
+      code_emit(ps->code, OP_STATUS, 0, 0, 0);
+    }
+    script_expect(ps, "fi");
+    break;
+  }
+  for (int i = 0; i < nends; i++) {
+    script_patch_here(ps, ends[i]);
+  }
+}
+
+void script_loop_push(ScriptParser *ps, int continue_target) {
+  if (ps->loop_depth == MAX_LOOP_DEPTH) {
+    printf("%sError: loops nested too deeply%s\n", COLOR_RED, COLOR_RESET);
+    ps->error = 1;
+    return;
+  }
+  LoopContext *loop = &ps->loops[ps->loop_depth++];
+  loop->continue_target = continue_target;
+  loop->breaks = NULL;
+  loop->nbreaks = 0;
+}
+
+void script_loop_pop(ScriptParser *ps) {
+  LoopContext *loop = &ps->loops[--ps->loop_depth];
+  for (int i = 0; i < loop->nbreaks; i++) {
+    script_patch_here(ps, loop->breaks[i]);
+  }
+  free(loop->breaks);
+}
+
+// while/until LIST; do LIST; done - the status is that of the last body
+// command run, or 0 if the body never ran:
+//
+//        LOOP_ENTER cond
+//   top: LOOP_SAVE          (continue jumps here)
+//  cond: LIST
+//        JUMP_FALSE/TRUE exit
+//        LIST
+//        JUMP top
+//        LOOP_SAVE          (break jumps here)
+//  exit: LOOP_LEAVE
+void script_while(ScriptParser *ps) {
+  static const char *do_terms[] = {"do", NULL};
+  static const char *done_terms[] = {"done", NULL};
+  int until = script_at(ps, "until");
+
+  ps->pos++;
+  int enter = code_emit(ps->code, OP_LOOP_ENTER, 0, 0, 0);
+  int top = code_emit(ps->code, OP_LOOP_SAVE, 0, 0, 0);
+  script_patch_here(ps, enter);
+  script_list(ps, do_terms);
+  script_expect(ps, "do");
+  if (script_failed(ps)) {
+    return;
+  }
+  int exit_jump =
+      code_emit(ps->code, until ? OP_JUMP_TRUE : OP_JUMP_FALSE, 0, 0, 0);
+  script_loop_push(ps, top);
+  if (script_failed(ps)) {
+    return;
+  }
+  script_list(ps, done_terms);
+  script_expect(ps, "done");
+  code_emit(ps->code, OP_JUMP, top, 0, 0);
+  script_loop_pop(ps);
+  code_emit(ps->code, OP_LOOP_SAVE, 0, 0, 0);
+  script_patch_here(ps, exit_jump);
+  code_emit(ps->code, OP_LOOP_LEAVE, 0, 0, 0);
+}
+
+// for NAME [in WORDS]; do LIST; done
+void script_for(ScriptParser *ps) {
+  static const char *done_terms[] = {"done", NULL};
+  static char *all_args[] = {"$@"};
+  char *words[MAX_ARGS];
+  int n = 0;
+
+  ps->pos++;
+  Token *var = script_peek(ps);
+  if (var->type != TOK_WORD || var_name_len(var->word) != strlen(var->word)) {
+    script_syntax_error(ps);
+    return;
+  }
+  ps->pos++;
+  script_skip_seps(ps);
+  if (script_at(ps, "in")) {
+    ps->pos++;
+    while (script_peek(ps)->type == TOK_WORD) {
+      if (n == MAX_ARGS - 1) {
+        printf("%sError: too many words in for list (limit %d)%s\n",
+               COLOR_RED, MAX_ARGS - 1, COLOR_RESET);
+        ps->error = 1;
+        return;
+      }
+      words[n++] = script_peek(ps)->word;
+      ps->pos++;
+    }
+  } else {
+    words[n++] = all_args[0];
+  }
+  script_expect(ps, "do");
+  if (script_failed(ps)) {
+    return;
+  }
+
+  Code *code = ps->code;
+  code_emit(code, OP_FOR_INIT, code_add_words(code, words, n), n, 0);
+  int next = code_emit(code, OP_FOR_NEXT, code_add_words(code, &var->word, 1),
+                       1, 0);
+  script_loop_push(ps, next);
+  if (script_failed(ps)) {
+    return;
+  }
+  script_list(ps, done_terms);
+  script_expect(ps, "done");
+  code_emit(code, OP_JUMP, next, 0, 0);
+  if (next >= 0) {
+    code->instrs[next].aux = code->ninstrs;
+  }
+  script_loop_pop(ps);
+  code_emit(code, OP_FOR_POP, 0, 0, 0);
+}
+
+// NAME() { LIST; } - the body is compiled into its own chunk, which the
+// function table keeps alive after this line's code is released
+void script_function(ScriptParser *ps, const char *name) {
+  static const char *brace_terms[] = {"}", NULL};
+  Code *outer = ps->code;
+  int outer_depth = ps->loop_depth;
+  int outer_in_function = ps->in_function;
+
+  script_expect(ps, "{");
+  if (script_failed(ps)) {
+    return;
+  }
+  Code *body = calloc(1, sizeof(Code));
+  if (body == NULL) {
+    code_oom(outer);
+    return;
+  }
+  body->refs = 1;
+  ps->code = body;
+  ps->loop_depth = 0;
+  ps->in_function = 1;
+  script_list(ps, brace_terms);
+  script_expect(ps, "}");
+  ps->code = outer;
+  ps->loop_depth = outer_depth;
+  ps->in_function = outer_in_function;
+  if (body->oom) {
+    ps->error = 1;
+  }
+
+  Code **chunks = realloc(outer->chunks, (outer->nchunks + 1) * sizeof(Code *));
+  if (chunks == NULL) {
+    code_release(body);
+    code_oom(outer);
+    return;
+  }
+  outer->chunks = chunks;
+  outer->chunks[outer->nchunks] = body;
+  char *words[1] = {(char *)name};
+  code_emit(outer, OP_DEFUN, code_add_words(outer, words, 1), 1,
+            outer->nchunks++);
+}
+
+void script_command(ScriptParser *ps) {
+  static const char *brace_terms[] = {"}", NULL};
+  Token *tok = script_peek(ps);
+
+  if (tok->type != TOK_WORD || script_at_any(ps, script_reserved)) {
+    script_syntax_error(ps);
+    return;
+  }
+  if (script_at(ps, "if")) {
+    script_if(ps);
+  } else if (script_at(ps, "while") || script_at(ps, "until")) {
+    script_while(ps);
+  } else if (script_at(ps, "for")) {
+    script_for(ps);
+  } else if (script_at(ps, "{")) {
+    ps->pos++;
+    script_list(ps, brace_terms);
+    script_expect(ps, "}");
+  } else if (script_at(ps, "break") || script_at(ps, "continue")) {
+    if (ps->loop_depth == 0) {
+      printf("%sError: '%s' outside a loop%s\n", COLOR_RED, tok->word,
+             COLOR_RESET);
+      ps->error = 1;
+      return;
+    }
+    LoopContext *loop = &ps->loops[ps->loop_depth - 1];
+    ps->pos++;
+    // Like any built-in, break and continue themselves succeed
+    code_emit(ps->code, OP_STATUS, 0, 0, 0);
+    if (tok->word[0] == 'c') {
+      code_emit(ps->code, OP_JUMP, loop->continue_target, 0, 0);
+      return;
+    }
+    int *breaks = realloc(loop->breaks, (loop->nbreaks + 1) * sizeof(int));
+    if (breaks == NULL) {
+      code_oom(ps->code);
+      return;
+    }
+    loop->breaks = breaks;
+    loop->breaks[loop->nbreaks++] = code_emit(ps->code, OP_JUMP, 0, 0, 0);
+  } else if (script_at(ps, "return")) {
+    if (!ps->in_function) {
+      printf("%sError: 'return' outside a function%s\n", COLOR_RED,
+             COLOR_RESET);
+      ps->error = 1;
+      return;
+    }
+    ps->pos++;
+    if (script_peek(ps)->type == TOK_WORD) {
+      int word = code_add_words(ps->code, &script_peek(ps)->word, 1);
+      ps->pos++;
+      code_emit(ps->code, OP_RETURN, word, 1, 0);
+    } else {
+      code_emit(ps->code, OP_RETURN, 0, 0, 0);
+    }
+  } else if (script_at(ps, "function")) {
+    ps->pos++;
+    tok = script_peek(ps);
+    if (tok->type != TOK_WORD) {
+      script_syntax_error(ps);
+      return;
+    }
+    ps->pos++;
+    size_t len = strlen(tok->word);
+    if (len > 2 && strcmp(tok->word + len - 2, "()") == 0) {
+      tok->word[len - 2] = '\0';
+    } else if (script_at(ps, "()")) {
+      ps->pos++;
+    }
+    script_function(ps, tok->word);
+  } else {
+    size_t len = strlen(tok->word);
+    Token *after = &ps->tokens[ps->pos + 1];
+    if (len > 2 && strcmp(tok->word + len - 2, "()") == 0 &&
+        var_name_len(tok->word) == len - 2) {
+      tok->word[len - 2] = '\0';
+      ps->pos++;
+      script_function(ps, tok->word);
+    } else if (after->type == TOK_WORD && strcmp(after->word, "()") == 0 &&
+               var_name_len(tok->word) == len) {
+      ps->pos += 2;
+      script_function(ps, tok->word);
+    } else {
+      script_simple(ps);
+    }
+  }
+}
+
+// [!] COMMAND
+void script_pipeline(ScriptParser *ps) {
+  int negate = script_at(ps, "!");
+  if (negate) {
+    ps->pos++;
+  }
+  script_command(ps);
+  if (negate) {
+    code_emit(ps->code, OP_NOT, 0, 0, 0);
+  }
+}
+
+// COMMAND [&& COMMAND | || COMMAND]... (left to right, equal precedence)
+void script_and_or(ScriptParser *ps) {
+  script_pipeline(ps);
+  while (!script_failed(ps) && (script_peek(ps)->type == TOK_AND ||
+                                script_peek(ps)->type == TOK_OR)) {
+    int op = script_peek(ps)->type == TOK_AND ? OP_JUMP_FALSE : OP_JUMP_TRUE;
+    ps->pos++;
+    script_skip_seps(ps);
+    int skip = code_emit(ps->code, op, 0, 0, 0);
+    script_pipeline(ps);
+    script_patch_here(ps, skip);
+  }
+}
+
+// Commands up to (not including) one of the terminator keywords
+void script_list(ScriptParser *ps, const char **terminators) {
+  while (!script_failed(ps)) {
+    script_skip_seps(ps);
+    if (script_peek(ps)->type == TOK_END ||
+        (terminators != NULL && script_at_any(ps, terminators))) {
+      return;
+    }
+    script_and_or(ps);
+  }
+}
+
+// Compile a complete input. Returns NULL on a syntax error, or with
+// *incomplete set when more lines are needed (an open if/while/...).
+Code *script_compile(const char *text, int *incomplete) {
+  ScriptParser ps;
+  memset(&ps, 0, sizeof(ps));
+  script_lex(&ps, text);
+
+  Code *code = ps.error ? NULL : calloc(1, sizeof(Code));
+  *incomplete = 0;
+  if (code == NULL) {
+    if (!ps.error) {
+      printf("%sError: out of memory compiling script%s\n", COLOR_RED,
+             COLOR_RESET);
+    }
+    free(ps.tokens);
+    arena_free(&ps.strings);
+    return NULL;
+  }
+  code->refs = 1;
+  ps.code = code;
+  script_list(&ps, NULL);
+  if (!script_failed(&ps) && script_peek(&ps)->type != TOK_END) {
+    script_syntax_error(&ps);
+  }
+  while (ps.loop_depth > 0) {
+    free(ps.loops[--ps.loop_depth].breaks);
+  }
+  free(ps.tokens);
+  arena_free(&ps.strings);
+
+  *incomplete = ps.incomplete;
+  if (script_failed(&ps)) {
+    code_release(code);
+    return NULL;
+  }
+  return code;
+}
+
+// ---- Interpreter ------------------------------------------------------------
+
+typedef struct {
+  Command items;
+  Arena strings;
+  int next;
+} ForFrame;
+
+Function *find_function(const char *name) {
+  for (int i = 0; i < function_count; i++) {
+    if (strcmp(functions[i].name, name) == 0) {
+      return &functions[i];
+    }
+  }
+  return NULL;
+}
+
+// Returns 0, or 1 (after printing an error) when out of memory
+int define_function(const char *name, Code *code) {
+  Function *fn = find_function(name);
+  if (fn == NULL) {
+    char *copy = strdup(name);
+    if (copy != NULL && function_count == function_capacity) {
+      int capacity = function_capacity ? function_capacity * 2 : 16;
+      Function *grown = realloc(functions, capacity * sizeof(Function));
+      if (grown == NULL) {
+        free(copy);
+        copy = NULL;
+      } else {
+        functions = grown;
+        function_capacity = capacity;
+      }
+    }
+    if (copy == NULL) {
+      printf("%sError: %s: out of memory%s\n", COLOR_RED, name, COLOR_RESET);
+      return 1;
+    }
+    fn = &functions[function_count++];
+    fn->name = copy;
+    fn->code = NULL;
+  }
+  code->refs++;
+  code_release(fn->code);
+  fn->code = code;
+  return 0;
+}
+
+// Expand words and call the built-in, skipping the pipeline machinery
+int run_builtin_direct(Builtin *builtin, char **words, Command *cmd,
+                       Arena *strings) {
+  int status = 1;
+
+  cmd->argc = 0;
+  for (int i = 0; words[i] != NULL; i++) {
+    if (expand_arg(cmd, words[i], strings) < 0) {
+      cmd->argc = 0;
+      break;
+    }
+  }
+  glob_cache_clear();
+  if (cmd->argc > 0) {
+    long long start = monotonic_ns();
+    status = builtin->fn(cmd->argv);
+    stats_command(cmd->argv[0], status, monotonic_ns() - start);
+  }
+  arena_reset(strings);
+  return status;
+}
+
+int run_code(Code *code) {
+  Command cmd = {NULL, 0, 0, NULL, NULL, 0};
+  Arena strings = {NULL};
+  ForFrame *frames = NULL;
+  int nframes = 0;
+  int loop_status[MAX_LOOP_DEPTH];
+  int nloops = 0;
+  int status = 0;
+  int pc = 0;
+
+  while (pc < code->ninstrs && !script_interrupted) {
+    Instr *in = &code->instrs[pc++];
+    char **words = code->words + in->arg;
+
+    switch (in->op) {
+    case OP_RUN:
+      status = execute_command(words);
+      break;
+    case OP_BUILTIN:
+      if (function_count > 0 && find_function(words[0]) != NULL) {
+        status = execute_command(words);
+      } else {
+        status = run_builtin_direct(&builtins[in->aux], words, &cmd, &strings);
+      }
+      break;
+    case OP_ASSIGN:
+      status = assign_variables(words);
+      break;
+    case OP_NOT:
+      status = !status;
+      break;
+    case OP_STATUS:
+      status = in->arg;
+      break;
+    case OP_JUMP:
+      // Ctrl-C at the shell stops a loop of built-ins
+      if (in->arg < pc && sigint_received) {
+        sigint_received = 0;
+        script_interrupted = 1;
+        status = 128 + SIGINT;
+      }
+      pc = in->arg;
+      break;
+    case OP_JUMP_FALSE:
+      if (status != 0) {
+        pc = in->arg;
+      }
+      break;
+    case OP_JUMP_TRUE:
+      if (status == 0) {
+        pc = in->arg;
+      }
+      break;
+    case OP_FOR_INIT: {
+      ForFrame *grown = realloc(frames, (nframes + 1) * sizeof(ForFrame));
+      if (grown == NULL) {
+        // Skip the loop: FOR_NEXT follows, and its aux is the FOR_POP
+        printf("%sError: for: out of memory%s\n", COLOR_RED, COLOR_RESET);
+        status = 1;
+        pc = code->instrs[pc].aux + 1;
+        break;
+      }
+      frames = grown;
+      ForFrame *frame = &frames[nframes++];
+      memset(frame, 0, sizeof(*frame));
+      status = 0;
+      for (int i = 0; i < in->count; i++) {
+        if (expand_arg(&frame->items, words[i], &frame->strings) < 0) {
+          frame->items.argc = 0;
+          status = 1;
+          break;
+        }
+      }
+      glob_cache_clear();
+      break;
+    }
+    case OP_FOR_NEXT: {
+      ForFrame *frame = &frames[nframes - 1];
+      if (frame->next < frame->items.argc) {
+        var_set(words[0], strlen(words[0]),
+                frame->items.argv[frame->next++], 0);
+      } else {
+        pc = in->aux;
+      }
+      break;
+    }
+    case OP_FOR_POP:
+      nframes--;
+      free(frames[nframes].items.argv);
+      arena_free(&frames[nframes].strings);
+      break;
+    case OP_DEFUN:
+      status = define_function(words[0], code->chunks[in->aux]);
+      break;
+    case OP_RETURN:
+      if (in->count > 0) {
+        char *value = expand_word(words[0], &strings);
+        char *end;
+        errno = 0;
+        long n = value != NULL ? strtol(value, &end, 10) : 0;
+        if (value == NULL) {
+          status = 1;
+        } else if (*value == '\0' || *end != '\0' || errno != 0) {
+          printf("%sreturn: '%s': numeric argument required%s\n", COLOR_RED,
+                 value, COLOR_RESET);
+          status = 2;
+        } else {
+          status = n & 0xff;
+        }
+      }
+      pc = code->ninstrs;
+      break;
+    case OP_LOOP_ENTER:
+      loop_status[nloops++] = 0;
+      pc = in->arg;
+      break;
+    case OP_LOOP_SAVE:
+      loop_status[nloops - 1] = status;
+      break;
+    case OP_LOOP_LEAVE:
+      status = loop_status[--nloops];
+      break;
+    }
+
+    if ((in->op == OP_RUN || in->op == OP_BUILTIN) &&
+        status == 128 + SIGINT) {
+      script_interrupted = 1;
+    }
+    last_exit_status = status;
+  }
+
+  while (nframes > 0) {
+    nframes--;
+    free(frames[nframes].items.argv);
+    arena_free(&frames[nframes].strings);
+  }
+  free(frames);
+  free(cmd.argv);
+  arena_free(&strings);
+  return status;
+}
+
+int call_function(Function *fn, char **argv) {
+  if (call_depth >= MAX_CALL_DEPTH) {
+    printf("%sError: %s: maximum function nesting exceeded%s\n", COLOR_RED,
+           fn->name, COLOR_RESET);
+    return 1;
+  }
+  Code *code = fn->code;
+  char **saved = positional;
+  int saved_count = positional_count;
+  int argc = 0;
+  while (argv[argc] != NULL) {
+    argc++;
+  }
+
+  // The table may redefine or grow while the body runs
+  code->refs++;
+  positional = argv + 1;
+  positional_count = argc - 1;
+  call_depth++;
+  int status = run_code(code);
+  call_depth--;
+  positional = saved;
+  positional_count = saved_count;
+  code_release(code);
+  return status;
+}
+
+// A lone function call runs in the shell with its redirections
+int run_function_in_shell(Pipeline *pipeline, Function *fn) {
+  Command *cmd = &pipeline->stages[0];
+  int status = 1;
+
+  fflush(stdout);
+  int saved_in = dup(STDIN_FILENO);
+  int saved_out = dup(STDOUT_FILENO);
+  if (apply_redirections(cmd) == 0) {
+    status = call_function(fn, cmd->argv);
+  }
+  fflush(stdout);
+  dup2(saved_in, STDIN_FILENO);
+  dup2(saved_out, STDOUT_FILENO);
+  close(saved_in);
+  close(saved_out);
+  return status;
+}
+
+// Compile and run one complete input
+int run_script(const char *text, int *incomplete) {
+  Code *code = script_compile(text, incomplete);
+  if (code == NULL) {
+    return *incomplete ? 0 : 2;
+  }
+  script_interrupted = 0;
+  int status = run_code(code);
+  code_release(code);
+  return status;
+}
+
+// ---- Condition built-ins ----------------------------------------------------
+
+int cmd_true(char **args) {
+  (void)args;
+  return 0;
+}
+
+int cmd_false(char **args) {
+  (void)args;
+  return 1;
+}
+
+int test_integer(const char *s, long long *value) {
+  char *end;
+  errno = 0;
+  *value = strtoll(s, &end, 10);
+  if (*s == '\0' || *end != '\0' || errno != 0) {
+    printf("%stest: '%s': integer expected%s\n", COLOR_RED, s, COLOR_RESET);
+    return -1;
+  }
+  return 0;
+}
+
+// test EXPR / [ EXPR ] - 0 if true, 1 if false, 2 on error. Supports
+// "! EXPR", STRING, -z/-n, file tests (-e -f -d -r -w -x -s),
+// string (= == !=) and integer (-eq -ne -lt -le -gt -ge) comparisons.
+int cmd_test(char **args) {
+  int argc = 0;
+  while (args[argc] != NULL) {
+    argc++;
+  }
+  if (strcmp(args[0], "[") == 0) {
+    if (strcmp(args[argc - 1], "]") != 0) {
+      printf("%s[: missing ']'%s\n", COLOR_RED, COLOR_RESET);
+      return 2;
+    }
+    argc--;
+  }
+
+  char **a = args + 1;
+  int n = argc - 1;
+  int negate = 0;
+  if (n > 0 && strcmp(a[0], "!") == 0) {
+    negate = 1;
+    a++;
+    n--;
+  }
+
+  int result;
+  if (n == 0) {
+    result = 0;
+  } else if (n == 1) {
+    result = a[0][0] != '\0';
+  } else if (n == 2 && a[0][0] == '-' && a[0][1] != '\0' && a[0][2] == '\0') {
+    struct stat st;
+    int exists = stat(a[1], &st) == 0;
+    switch (a[0][1]) {
+    case 'z':
+      result = a[1][0] == '\0';
+      break;
+    case 'n':
+      result = a[1][0] != '\0';
+      break;
+    case 'e':
+      result = exists;
+      break;
+    case 'f':
+      result = exists && S_ISREG(st.st_mode);
+      break;
+    case 'd':
+      result = exists && S_ISDIR(st.st_mode);
+      break;
+    case 's':
+      result = exists && st.st_size > 0;
+      break;
+    case 'r':
+      result = access(a[1], R_OK) == 0;
+      break;
+    case 'w':
+      result = access(a[1], W_OK) == 0;
+      break;
+    case 'x':
+      result = access(a[1], X_OK) == 0;
+      break;
+    default:
+      printf("%stest: unknown operator '%s'%s\n", COLOR_RED, a[0],
+             COLOR_RESET);
+      return 2;
+    }
+  } else if (n == 3) {
+    const char *op = a[1];
+    long long x, y;
+    if (strcmp(op, "=") == 0 || strcmp(op, "==") == 0) {
+      result = strcmp(a[0], a[2]) == 0;
+    } else if (strcmp(op, "!=") == 0) {
+      result = strcmp(a[0], a[2]) != 0;
+    } else if (op[0] == '-' && strlen(op) == 3 &&
+               strstr("-eq-ne-lt-le-gt-ge", op) != NULL) {
+      if (test_integer(a[0], &x) < 0 || test_integer(a[2], &y) < 0) {
+        return 2;
+      }
+      switch (op[1] * 256 + op[2]) {
+      case 'e' * 256 + 'q':
+        result = x == y;
+        break;
+      case 'n' * 256 + 'e':
+        result = x != y;
+        break;
+      case 'l' * 256 + 't':
+        result = x < y;
+        break;
+      case 'l' * 256 + 'e':
+        result = x <= y;
+        break;
+      case 'g' * 256 + 't':
+        result = x > y;
+        break;
+      default:
+        result = x >= y;
+        break;
+      }
+    } else {
+      printf("%stest: unknown operator '%s'%s\n", COLOR_RED, op, COLOR_RESET);
+      return 2;
+    }
+  } else {
+    printf("%stest: too many arguments%s\n", COLOR_RED, COLOR_RESET);
+    return 2;
+  }
+  return (result ^ negate) ? 0 : 1;
+}
+
+// ============================================================================
+// WATCH
+// ============================================================================
+
+// watch sleeps in the event loop: a timerfd for the interval, inotify for
+// --on paths and a one-shot timerfd that debounces bursts of changes, so an
+// idle watch costs no CPU
+#define MAX_WATCH_PATHS 32
+#define WATCH_DEBOUNCE_MS 100
+
+typedef struct {
+  int wd;
+  char name[256]; // file watched through its directory, "" for a directory
+  char path[512];
+} WatchPath;
+
+typedef struct {
+  int timer_fd;
+  int inotify_fd;
+  int debounce_fd;
+  int tick;    // interval elapsed
+  int changed; // a watched path changed and the debounce delay passed
+  char reason[1024];
+  WatchPath paths[MAX_WATCH_PATHS];
+  int npaths;
+  int debounce_ms;
+} WatchState;
+
+void handle_watch_timer(int fd, void *data) {
+  WatchState *ws = data;
+  uint64_t expirations;
+  if (read(fd, &expirations, sizeof(expirations)) == sizeof(expirations)) {
+    if (fd == ws->debounce_fd) {
+      ws->changed = 1;
+    } else {
+      ws->tick = 1;
+    }
+  }
+}
+
+void handle_watch_inotify(int fd, void *data) {
+  WatchState *ws = data;
+  char buf[8192] __attribute__((aligned(__alignof__(struct inotify_event))));
+  ssize_t n;
+
+  while ((n = read(fd, buf, sizeof(buf))) > 0) {
+    for (char *p = buf; p < buf + n;) {
+      struct inotify_event *ev = (struct inotify_event *)p;
+      p += sizeof(*ev) + ev->len;
+
+      WatchPath *wp = NULL;
+      for (int i = 0; i < ws->npaths; i++) {
+        if (ws->paths[i].wd == ev->wd &&
+            (ws->paths[i].name[0] == '\0' ||
+             (ev->len > 0 && strcmp(ws->paths[i].name, ev->name) == 0))) {
+          wp = &ws->paths[i];
+          break;
+        }
+      }
+      if (wp == NULL && !(ev->mask & IN_Q_OVERFLOW)) {
+        continue;
+      }
+      if (wp == NULL) {
+        snprintf(ws->reason, sizeof(ws->reason), "changed: (overflow)");
+      } else if (wp->name[0] == '\0' && ev->len > 0) {
+        snprintf(ws->reason, sizeof(ws->reason), "changed: %s/%s", wp->path,
+                 ev->name);
+      } else {
+        snprintf(ws->reason, sizeof(ws->reason), "changed: %s", wp->path);
+      }
+      // Every event restarts the quiet period
+      timerfd_arm(ws->debounce_fd, ws->debounce_ms / 1000.0, 0);
+    }
+  }
+}
+
+// Watch a directory directly, and a file through its directory so editors
+// that replace it by rename are still seen
+int watch_add_path(WatchState *ws, const char *path) {
+  struct stat st;
+  char dir[512];
+  WatchPath *wp = &ws->paths[ws->npaths];
+
+  if (ws->npaths == MAX_WATCH_PATHS) {
+    printf("%swatch: too many paths%s\n", COLOR_RED, COLOR_RESET);
+    return -1;
+  }
+  snprintf(wp->path, sizeof(wp->path), "%s", path);
+  wp->name[0] = '\0';
+  if (stat(path, &st) == 0 && S_ISDIR(st.st_mode)) {
+    snprintf(dir, sizeof(dir), "%s", path);
+  } else {
+    const char *slash = strrchr(path, '/');
+    if (slash == NULL) {
+      strcpy(dir, ".");
+      snprintf(wp->name, sizeof(wp->name), "%s", path);
+    } else {
+      snprintf(dir, sizeof(dir), "%.*s", slash == path ? 1 : (int)(slash - path),
+               path);
+      snprintf(wp->name, sizeof(wp->name), "%s", slash + 1);
+    }
+  }
+
+  wp->wd = inotify_add_watch(ws->inotify_fd, dir,
+                             IN_CLOSE_WRITE | IN_MODIFY | IN_ATTRIB |
+                                 IN_CREATE | IN_DELETE | IN_MOVED_FROM |
+                                 IN_MOVED_TO);
+  if (wp->wd < 0) {
+    printf("%swatch: cannot watch '%s': %s%s\n", COLOR_RED, path,
+           strerror(errno), COLOR_RESET);
+    return -1;
+  }
+  ws->npaths++;
+  return 0;
+}
+
+// Print output, highlighting lines that differ from the previous run
+int watch_show_diff(const char *out, size_t len, const char *prev,
+                    size_t prev_len, int have_prev) {
+  const char *p = out, *q = prev;
+  const char *end = out + len, *prev_end = prev + prev_len;
+  int changed = 0;
+
+  while (p < end) {
+    const char *nl = memchr(p, '\n', end - p);
+    size_t n = nl != NULL ? (size_t)(nl - p) : (size_t)(end - p);
+    const char *old = NULL;
+    size_t old_n = 0;
+    if (q < prev_end) {
+      const char *old_nl = memchr(q, '\n', prev_end - q);
+      old = q;
+      old_n = old_nl != NULL ? (size_t)(old_nl - q) : (size_t)(prev_end - q);
+      q += old_n + 1;
+    }
+    int differs = have_prev && (old == NULL || old_n != n ||
+                                memcmp(old, p, n) != 0);
+    changed += differs;
+    printf("%s%.*s%s\n", differs ? COLOR_YELLOW : "", (int)n, p,
+           differs ? COLOR_RESET : "");
+    p += n + 1;
+  }
+  // Lines that disappeared also count as changes
+  while (have_prev && q < prev_end) {
+    const char *old_nl = memchr(q, '\n', prev_end - q);
+    q = old_nl != NULL ? old_nl + 1 : prev_end;
+    changed++;
+  }
+  return changed;
+}
+
+// watch [-n SECS] [--on PATH[,PATH...]] [--debounce MS] [-c COUNT] CMD...
+int cmd_watch(char **args) {
+  double interval = 0;
+  int count = 0;
+  int i = 1;
+  WatchState ws;
+  char on[MAX_LINE] = "";
+  const char *bad = NULL;
+  long long number = 1;
+
+  memset(&ws, 0, sizeof(ws));
+  ws.timer_fd = ws.inotify_fd = ws.debounce_fd = -1;
+  ws.debounce_ms = WATCH_DEBOUNCE_MS;
+
+  for (; args[i] != NULL && args[i][0] == '-'; i++) {
+    if (strcmp(args[i], "--") == 0) {
+      i++;
+      break;
+    }
+    // Every option takes a value; anything else starts the command
+    if (strcmp(args[i], "-n") != 0 && strcmp(args[i], "--on") != 0 &&
+        strcmp(args[i], "--debounce") != 0 && strcmp(args[i], "-c") != 0) {
+      break;
+    }
+    if (args[i + 1] == NULL) {
+      printf("%swatch: option requires an argument -- %s%s\n", COLOR_RED,
+             args[i] + strspn(args[i], "-"), COLOR_RESET);
+      return 2;
+    }
+    if (strcmp(args[i], "-n") == 0) {
+      if (parse_duration(args[++i], &interval) < 0 || interval <= 0) {
+        bad = args[i];
+      }
+    } else if (strcmp(args[i], "--on") == 0) {
+      size_t used = strlen(on);
+      snprintf(on + used, sizeof(on) - used, "%s%s", used ? "," : "",
+               args[++i]);
+    } else if (strcmp(args[i], "--debounce") == 0) {
+      if (parse_positive(args[++i], &number) < 0 || number > 3600000) {
+        bad = args[i];
+      }
+      ws.debounce_ms = (int)number;
+    } else if (strcmp(args[i], "-c") == 0) {
+      if (parse_positive(args[++i], &number) < 0 || number > INT_MAX) {
+        bad = args[i];
+      }
+      count = (int)number;
+    }
+  }
+  if (bad != NULL) {
+    printf("%swatch: invalid value '%s' (must be a number above 0)%s\n",
+           COLOR_RED, bad, COLOR_RESET);
+    return 1;
+  }
+  if (args[i] == NULL) {
+    printf("%sUsage: watch [-n SECS] [--on PATH[,PATH...]] [--debounce MS] "
+           "[-c COUNT] CMD...%s\n",
+           COLOR_RED, COLOR_RESET);
+    return 1;
+  }
+  if (interval == 0 && on[0] == '\0') {
+    interval = 2;
+  }
+
+  // The command words were expanded with the watch command line and are
+  // run as they are; text is only for the header
+  char text[MAX_LINE] = "";
+  for (int j = i; args[j] != NULL; j++) {
+    size_t used = strlen(text);
+    snprintf(text + used, sizeof(text) - used, "%s%s", j > i ? " " : "",
+             args[j]);
+  }
+
+  int status = 0;
+  if (on[0] != '\0') {
+    ws.inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    ws.debounce_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (ws.inotify_fd < 0 || ws.debounce_fd < 0) {
+      printf("%swatch: %s%s\n", COLOR_RED, strerror(errno), COLOR_RESET);
+      status = 1;
+    }
+    for (char *save = NULL, *path = strtok_r(on, ",", &save);
+         status == 0 && path != NULL; path = strtok_r(NULL, ",", &save)) {
+      status = watch_add_path(&ws, path) < 0;
+    }
+  }
+  if (status == 0 && interval > 0) {
+    ws.timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (ws.timer_fd < 0) {
+      status = 1;
+    } else {
+      timerfd_arm(ws.timer_fd, interval, 1);
+    }
+  }
+  if (status == 0) {
+    if (ws.inotify_fd >= 0) {
+      event_add(ws.inotify_fd, handle_watch_inotify, &ws);
+      event_add(ws.debounce_fd, handle_watch_timer, &ws);
+    }
+    if (ws.timer_fd >= 0) {
+      event_add(ws.timer_fd, handle_watch_timer, &ws);
+    }
+
+    Arena outputs[2] = {{NULL}, {NULL}};
+    char *prev = NULL;
+    size_t prev_len = 0;
+    int runs = 0;
+    int tty = isatty(STDOUT_FILENO);
+
+    sigint_received = 0;
+    snprintf(ws.reason, sizeof(ws.reason), "start");
+    while (!sigint_received) {
+      // Alternate arenas so the previous output survives one more run
+      Arena *arena = &outputs[runs % 2];
+      arena_free(arena);
+      size_t len;
+      int code;
+      char *out = capture_argv(&args[i], arena, &len, &code);
+
+      char stamp[32];
+      time_t now = time(NULL);
+      strftime(stamp, sizeof(stamp), "%H:%M:%S", localtime(&now));
+      if (tty) {
+        printf("\033[H\033[2J");
+      }
+      if (interval > 0) {
+        printf("%sEvery %.1fs: %s%s", COLOR_CYAN, interval, text, COLOR_RESET);
+      } else {
+        printf("%sOn change: %s%s", COLOR_CYAN, text, COLOR_RESET);
+      }
+      printf("   %s[%s] %s", COLOR_BLUE, stamp, ws.reason);
+      if (code != 0) {
+        printf("  exit %d", code);
+      }
+      printf("%s\n\n", COLOR_RESET);
+
+      if (out != NULL) {
+        int changed = watch_show_diff(out, len, prev, prev_len, runs > 0);
+        if (runs > 0) {
+          printf("\n%s%d line%s changed%s\n", COLOR_MAGENTA, changed,
+                 changed == 1 ? "" : "s", COLOR_RESET);
+        }
+        prev = out;
+        prev_len = len;
+      }
+      fflush(stdout);
+      runs++;
+      // A command killed by Ctrl-C (it had the terminal) ends the watch
+      if ((count > 0 && runs >= count) || code == 128 + SIGINT) {
+        break;
+      }
+
+      ws.tick = ws.changed = 0;
+      while (!ws.tick && !ws.changed && !sigint_received) {
+        event_wait(-1, -1);
+      }
+      if (ws.tick && !ws.changed) {
+        snprintf(ws.reason, sizeof(ws.reason), "interval");
+      }
+    }
+    sigint_received = 0;
+    arena_free(&outputs[0]);
+    arena_free(&outputs[1]);
+  }
+
+  int fds[3] = {ws.timer_fd, ws.inotify_fd, ws.debounce_fd};
+  for (int j = 0; j < 3; j++) {
+    if (fds[j] >= 0) {
+      event_remove(fds[j]);
+      close(fds[j]);
+    }
+  }
+  return status;
+}
+
+// ============================================================================
+// SORT (in-memory parallel merge sort, external runs + k-way merge)
+// ============================================================================
+
+#define SORT_DEFAULT_MEMORY (256UL << 20)
+#define SORT_MIN_MEMORY (64UL << 10)
+#define SORT_MAX_THREADS 8
+#define SORT_PARALLEL_MIN 65536 // fewer records are sorted on one core
+#define SORT_MERGE_FANIN 64     // runs merged at once (bounds open files)
+
+typedef struct {
+  int numeric;
+  int reverse;
+  int unique;
+  int key_field;  // 1-based first field of the key, 0 = whole line
+  int key_end;    // last field of the key, 0 = to end of line
+  int separator;  // field separator, -1 = runs of blanks
+} SortSpec;
+
+// One line: the first 8 key bytes (or the ordered bits of the numeric key)
+// sit next to the pointer so most comparisons never touch the line itself
+typedef struct {
+  uint64_t prefix;
+  const char *line;
+  uint32_t len;       // without the newline
+  uint32_t key_start; // key offset within the line
+  uint32_t key_len;
+} SortRecord;
+
+// Locate the key of a line per -k/-t
+void sort_find_key(const SortSpec *spec, const char *line, size_t len,
+                   size_t *start, size_t *key_len) {
+  size_t pos = 0;
+  size_t end = len;
+
+  if (spec->key_field > 0) {
+    for (int field = 1; field < spec->key_field && pos < len; field++) {
+      if (spec->separator >= 0) {
+        const char *sep = memchr(line + pos, spec->separator, len - pos);
+        pos = sep != NULL ? (size_t)(sep - line) + 1 : len;
+      } else {
+        while (pos < len && (line[pos] == ' ' || line[pos] == '\t')) {
+          pos++;
+        }
+        while (pos < len && line[pos] != ' ' && line[pos] != '\t') {
+          pos++;
+        }
+      }
+    }
+    // Blank-separated keys skip their leading blanks (like sort -b)
+    if (spec->separator < 0) {
+      while (pos < len && (line[pos] == ' ' || line[pos] == '\t')) {
+        pos++;
+      }
+    }
+    if (spec->key_end >= spec->key_field) {
+      end = pos;
+      for (int field = spec->key_field; field <= spec->key_end && end < len;
+           field++) {
+        if (field > spec->key_field) {
+          end++; // step over the separator ending the previous field
+        }
+        if (spec->separator >= 0) {
+          const char *sep = memchr(line + end, spec->separator, len - end);
+          end = sep != NULL ? (size_t)(sep - line) : len;
+        } else {
+          while (end < len && (line[end] == ' ' || line[end] == '\t')) {
+            end++;
+          }
+          while (end < len && line[end] != ' ' && line[end] != '\t') {
+            end++;
+          }
+        }
+      }
+    }
+  }
+  *start = pos;
+  *key_len = end > pos ? end - pos : 0;
+}
+
+// Leading number of a key (blanks, sign, digits, fraction); 0 if none
+double sort_parse_number(const char *s, size_t len) {
+  size_t i = 0;
+  double value = 0, scale = 0.1;
+  int negative = 0;
+
+  while (i < len && (s[i] == ' ' || s[i] == '\t')) {
+    i++;
+  }
+  if (i < len && (s[i] == '-' || s[i] == '+')) {
+    negative = s[i] == '-';
+    i++;
+  }
+  for (; i < len && s[i] >= '0' && s[i] <= '9'; i++) {
+    value = value * 10 + (s[i] - '0');
+  }
+  if (i < len && s[i] == '.') {
+    for (i++; i < len && s[i] >= '0' && s[i] <= '9'; i++) {
+      value += (s[i] - '0') * scale;
+      scale /= 10;
+    }
+  }
+  return negative ? -value : value;
+}
+
+void sort_make_record(const SortSpec *spec, SortRecord *rec, const char *line,
+                      size_t len) {
+  size_t start, key_len;
+
+  sort_find_key(spec, line, len, &start, &key_len);
+  rec->line = line;
+  rec->len = (uint32_t)len;
+  rec->key_start = (uint32_t)start;
+  rec->key_len = (uint32_t)key_len;
+
+  if (spec->numeric) {
+    // Map the double onto an unsigned integer with the same ordering
+    double value = sort_parse_number(line + start, key_len);
+    uint64_t bits;
+    if (value == 0) {
+      value = 0; // -0 sorts with 0
+    }
+    memcpy(&bits, &value, sizeof(bits));
+    rec->prefix = (bits >> 63) ? ~bits : bits | (1ULL << 63);
+  } else {
+    uint64_t prefix = 0;
+    for (size_t i = 0; i < 8; i++) {
+      prefix = (prefix << 8) |
+               (i < key_len ? (unsigned char)line[start + i] : 0);
+    }
+    rec->prefix = prefix;
+  }
+}
+
+// Key comparison only (what -u uses to decide duplicates)
+int sort_compare_keys(const SortSpec *spec, const SortRecord *a,
+                      const SortRecord *b) {
+  int result = 0;
+
+  if (a->prefix != b->prefix) {
+    result = a->prefix < b->prefix ? -1 : 1;
+  } else if (!spec->numeric && (a->key_len > 8 || b->key_len > 8)) {
+    uint32_t n = a->key_len < b->key_len ? a->key_len : b->key_len;
+    result = n > 8 ? memcmp(a->line + a->key_start + 8,
+                            b->line + b->key_start + 8, n - 8)
+                   : 0;
+    if (result == 0 && a->key_len != b->key_len) {
+      result = a->key_len < b->key_len ? -1 : 1;
+    }
+  } else if (!spec->numeric && a->key_len != b->key_len) {
+    // Equal 8-byte prefixes padded with NUL: the shorter key sorts first
+    result = a->key_len < b->key_len ? -1 : 1;
+  }
+  return spec->reverse ? -result : result;
+}
+
+// Full ordering: keys, then the whole line as a last resort (except with
+// -u, where equal keys keep input order and the first one wins)
+int sort_compare(const SortSpec *spec, const SortRecord *a,
+                 const SortRecord *b) {
+  int result = sort_compare_keys(spec, a, b);
+
+  if (result != 0 || spec->unique ||
+      (spec->key_field == 0 && !spec->numeric)) {
+    return result;
+  }
+  uint32_t n = a->len < b->len ? a->len : b->len;
+  result = memcmp(a->line, b->line, n);
+  if (result == 0 && a->len != b->len) {
+    result = a->len < b->len ? -1 : 1;
+  }
+  return spec->reverse ? -result : result;
+}
+
+// Merge src[lo, mid) and src[mid, hi) into dst[lo, hi), stably
+void sort_merge(const SortSpec *spec, const SortRecord *src, SortRecord *dst,
+                size_t lo, size_t mid, size_t hi) {
+  size_t i = lo, j = mid, k = lo;
+
+  while (i < mid && j < hi) {
+    dst[k++] = sort_compare(spec, &src[j], &src[i]) < 0 ? src[j++] : src[i++];
+  }
+  memcpy(&dst[k], &src[i], (mid - i) * sizeof(SortRecord));
+  k += mid - i;
+  memcpy(&dst[k], &src[j], (hi - j) * sizeof(SortRecord));
+}
+
+// Top-down merge sort of a[lo, hi) using tmp[lo, hi) as scratch; short
+// ranges use insertion sort
+void sort_records(const SortSpec *spec, SortRecord *a, SortRecord *tmp,
+                  size_t lo, size_t hi) {
+  if (hi - lo <= 16) {
+    for (size_t i = lo + 1; i < hi; i++) {
+      SortRecord rec = a[i];
+      size_t j = i;
+      while (j > lo && sort_compare(spec, &rec, &a[j - 1]) < 0) {
+        a[j] = a[j - 1];
+        j--;
+      }
+      a[j] = rec;
+    }
+    return;
+  }
+
+  size_t mid = lo + (hi - lo) / 2;
+  sort_records(spec, a, tmp, lo, mid);
+  sort_records(spec, a, tmp, mid, hi);
+  if (sort_compare(spec, &a[mid], &a[mid - 1]) >= 0) {
+    return; // already in order
+  }
+  sort_merge(spec, a, tmp, lo, mid, hi);
+  memcpy(&a[lo], &tmp[lo], (hi - lo) * sizeof(SortRecord));
+}
+
+// Work for one sorting thread: sort a chunk, or merge two adjacent ones
+typedef struct {
+  const SortSpec *spec;
+  SortRecord *src;
+  SortRecord *dst;
+  size_t lo, mid, hi;
+  int merge;
+} SortTask;
+
+void *sort_thread(void *data) {
+  SortTask *task = data;
+
+  if (task->merge) {
+    sort_merge(task->spec, task->src, task->dst, task->lo, task->mid,
+               task->hi);
+  } else {
+    sort_records(task->spec, task->src, task->dst, task->lo, task->hi);
+  }
+  return NULL;
+}
+
+// Run tasks on threads (the last one on the calling thread)
+void sort_run_tasks(SortTask *tasks, int count) {
+  pthread_t threads[SORT_MAX_THREADS];
+  int started[SORT_MAX_THREADS] = {0};
+
+  for (int i = 0; i < count - 1; i++) {
+    started[i] = pthread_create(&threads[i], NULL, sort_thread, &tasks[i]) == 0;
+    if (!started[i]) {
+      sort_thread(&tasks[i]);
+    }
+  }
+  sort_thread(&tasks[count - 1]);
+  for (int i = 0; i < count - 1; i++) {
+    if (started[i]) {
+      pthread_join(threads[i], NULL);
+    }
+  }
+}
+
+// Sort n records: each core sorts a chunk, then pairs of chunks are merged
+// in parallel rounds until one remains
+int sort_parallel(const SortSpec *spec, SortRecord *recs, size_t n) {
+  SortRecord *tmp = malloc(n * sizeof(SortRecord) + 1);
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  int chunks = cpus < 1 ? 1 : cpus > SORT_MAX_THREADS ? SORT_MAX_THREADS
+                                                      : (int)cpus;
+  size_t bounds[SORT_MAX_THREADS + 1];
+  SortTask tasks[SORT_MAX_THREADS];
+
+  if (tmp == NULL) {
+    return -1;
+  }
+  if (n < SORT_PARALLEL_MIN) {
+    chunks = 1;
+  }
+  for (int i = 0; i <= chunks; i++) {
+    bounds[i] = n * i / chunks;
+  }
+  for (int i = 0; i < chunks; i++) {
+    tasks[i] = (SortTask){spec, recs, tmp, bounds[i], 0, bounds[i + 1], 0};
+  }
+  sort_run_tasks(tasks, chunks);
+
+  SortRecord *src = recs, *dst = tmp;
+  for (int width = 1; width < chunks; width *= 2) {
+    int count = 0;
+    for (int i = 0; i < chunks; i += 2 * width) {
+      int mid = i + width < chunks ? i + width : chunks;
+      int hi = i + 2 * width < chunks ? i + 2 * width : chunks;
+      tasks[count++] = (SortTask){spec,       src,         dst, bounds[i],
+                                  bounds[mid], bounds[hi], 1};
+    }
+    sort_run_tasks(tasks, count);
+    SortRecord *swap = src;
+    src = dst;
+    dst = swap;
+  }
+  if (src != recs) {
+    memcpy(recs, src, n * sizeof(SortRecord));
+  }
+  free(tmp);
+  return 0;
+}
+
+// Open an anonymous temporary file for a sorted run in $TMPDIR
+FILE *sort_open_run(void) {
+  const char *dir = var_get("TMPDIR");
+  if (dir == NULL || dir[0] == '\0') {
+    dir = "/tmp";
+  }
+
+  int fd = open(dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+  if (fd < 0) {
+    char path[MAX_LINE];
+    snprintf(path, sizeof(path), "%s/myshell-sort-XXXXXX", dir);
+    fd = mkstemp(path);
+    if (fd < 0) {
+      return NULL;
+    }
+    unlink(path);
+  }
+  FILE *fp = fdopen(fd, "w+");
+  if (fp == NULL) {
+    close(fd);
+  }
+  return fp;
+}
+
+// Write sorted records, dropping key duplicates with -u
+int sort_write_records(const SortSpec *spec, SortRecord *recs, size_t n,
+                       FILE *out) {
+  for (size_t i = 0; i < n; i++) {
+    if (spec->unique && i > 0 &&
+        sort_compare_keys(spec, &recs[i - 1], &recs[i]) == 0) {
+      continue;
+    }
+    fwrite(recs[i].line, 1, recs[i].len, out);
+    putc('\n', out);
+  }
+  return ferror(out) ? -1 : 0;
+}
+
+// A run being merged: its current line and record
+typedef struct {
+  FILE *fp;
+  char *line;
+  size_t cap;
+  SortRecord rec;
+} SortRun;
+
+int sort_run_next(const SortSpec *spec, SortRun *run) {
+  ssize_t n = getline(&run->line, &run->cap, run->fp);
+  if (n <= 0) {
+    return 0;
+  }
+  if (run->line[n - 1] == '\n') {
+    n--;
+  }
+  sort_make_record(spec, &run->rec, run->line, n);
+  return 1;
+}
+
+// Heap order: smaller record first, earlier run on ties (keeps -u stable)
+int sort_run_less(const SortSpec *spec, SortRun *runs, int a, int b) {
+  int cmp = sort_compare(spec, &runs[a].rec, &runs[b].rec);
+  return cmp < 0 || (cmp == 0 && a < b);
+}
+
+void sort_heap_down(const SortSpec *spec, SortRun *runs, int *heap, int size,
+                    int i) {
+  while (1) {
+    int smallest = i;
+    int left = 2 * i + 1, right = 2 * i + 2;
+    if (left < size && sort_run_less(spec, runs, heap[left], heap[smallest])) {
+      smallest = left;
+    }
+    if (right < size &&
+        sort_run_less(spec, runs, heap[right], heap[smallest])) {
+      smallest = right;
+    }
+    if (smallest == i) {
+      return;
+    }
+    int swap = heap[i];
+    heap[i] = heap[smallest];
+    heap[smallest] = swap;
+    i = smallest;
+  }
+}
+
+// k-way merge of sorted run files into out using a min-heap of runs
+int sort_merge_runs(const SortSpec *spec, FILE **files, int count, FILE *out) {
+  SortRun *runs = calloc(count, sizeof(SortRun));
+  int *heap = malloc(count * sizeof(int));
+  char *last = NULL;
+  size_t last_cap = 0;
+  SortRecord last_rec;
+  int have_last = 0, size = 0, status = 0;
+
+  if (runs == NULL || heap == NULL) {
+    free(runs);
+    free(heap);
+    return -1;
+  }
+  for (int i = 0; i < count; i++) {
+    runs[i].fp = files[i];
+    rewind(files[i]);
+    if (sort_run_next(spec, &runs[i])) {
+      heap[size++] = i;
+    }
+  }
+  for (int i = size / 2 - 1; i >= 0; i--) {
+    sort_heap_down(spec, runs, heap, size, i);
+  }
+
+  while (size > 0) {
+    SortRun *run = &runs[heap[0]];
+    if (!spec->unique || !have_last ||
+        sort_compare_keys(spec, &last_rec, &run->rec) != 0) {
+      fwrite(run->line, 1, run->rec.len, out);
+      putc('\n', out);
+      if (spec->unique) {
+        // Keep a copy: the run's buffer is reused by the next getline
+        if (last_cap < run->rec.len + 1) {
+          char *grown = realloc(last, run->rec.len + 1);
+          if (grown == NULL) {
+            status = -1;
+            break;
+          }
+          last = grown;
+          last_cap = run->rec.len + 1;
+        }
+        memcpy(last, run->line, run->rec.len);
+        sort_make_record(spec, &last_rec, last, run->rec.len);
+        have_last = 1;
+      }
+    }
+    if (!sort_run_next(spec, run)) {
+      heap[0] = heap[--size];
+    }
+    sort_heap_down(spec, runs, heap, size, 0);
+  }
+
+  for (int i = 0; i < count; i++) {
+    free(runs[i].line);
+  }
+  free(runs);
+  free(heap);
+  free(last);
+  return status < 0 || ferror(out) ? -1 : 0;
+}
+
+// Sort the buffered lines and append them to the list of runs
+int sort_spill_run(const SortSpec *spec, SortRecord *recs, size_t n,
+                   FILE ***runs, int *run_count) {
+  FILE *fp = sort_open_run();
+  if (fp == NULL) {
+    return -1;
+  }
+  if (sort_parallel(spec, recs, n) < 0 ||
+      sort_write_records(spec, recs, n, fp) < 0 || fflush(fp) != 0) {
+    fclose(fp);
+    return -1;
+  }
+
+  // Too many open runs: merge the oldest group into one
+  if (*run_count == SORT_MERGE_FANIN) {
+    FILE *merged = sort_open_run();
+    if (merged == NULL ||
+        sort_merge_runs(spec, *runs, *run_count, merged) < 0 ||
+        fflush(merged) != 0) {
+      if (merged != NULL) {
+        fclose(merged);
+      }
+      fclose(fp);
+      return -1;
+    }
+    for (int i = 0; i < *run_count; i++) {
+      fclose((*runs)[i]);
+    }
+    (*runs)[0] = merged;
+    *run_count = 1;
+  }
+  (*runs)[(*run_count)++] = fp;
+  return 0;
+}
+
+// Parse -S SIZE: a byte count with an optional K, M or G suffix
+int sort_parse_size(const char *s, size_t *bytes) {
+  char *end;
+  double value = strtod(s, &end);
+
+  if (end == s || value <= 0) {
+    return -1;
+  }
+  switch (*end) {
+  case 'k':
+  case 'K':
+    value *= 1024;
+    break;
+  case 'm':
+  case 'M':
+    value *= 1024 * 1024;
+    break;
+  case 'g':
+  case 'G':
+    value *= 1024.0 * 1024 * 1024;
+    break;
+  case 'b':
+  case '\0':
+    break;
+  default:
+    return -1;
+  }
+  *bytes = (size_t)value;
+  return 0;
+}
+
+// Parse -k N[,M] (character positions are not supported)
+int sort_parse_key(const char *s, SortSpec *spec) {
+  char *end;
+  long start = strtol(s, &end, 10);
+  long stop = 0;
+
+  if (end == s || start < 1) {
+    return -1;
+  }
+  if (*end == ',') {
+    const char *rest = end + 1;
+    stop = strtol(rest, &end, 10);
+    if (end == rest || stop < start) {
+      return -1;
+    }
+  }
+  if (*end != '\0') {
+    return -1;
+  }
+  spec->key_field = (int)start;
+  spec->key_end = (int)stop;
+  return 0;
+}
+
+// sort [-n] [-r] [-u] [-k N[,M]] [-t C] [-S SIZE] [FILE...]
+// Lines are collected until the memory budget (-S, default 256M) is used,
+// sorted in parallel and, if the input did not fit, written out as sorted
+// runs that are merged at the end.
+int cmd_sort(char **args) {
+  const char *usage = "sort [-nru] [-k N[,M]] [-t C] [-S SIZE] [file...]";
+  SortSpec spec = {0, 0, 0, 0, 0, -1};
+  size_t budget = SORT_DEFAULT_MEMORY;
+  int i = 1;
+
+  for (; args[i] != NULL && args[i][0] == '-' && args[i][1] != '\0'; i++) {
+    if (strcmp(args[i], "--") == 0) {
+      i++;
+      break;
+    }
+    for (const char *opt = args[i] + 1; *opt != '\0'; opt++) {
+      if (*opt == 'n') {
+        spec.numeric = 1;
+      } else if (*opt == 'r') {
+        spec.reverse = 1;
+      } else if (*opt == 'u') {
+        spec.unique = 1;
+      } else if (*opt == 'k' || *opt == 't' || *opt == 'S') {
+        // The value is the rest of this word or the next argument
+        const char *value = opt[1] != '\0' ? opt + 1 : args[++i];
+        int bad = value == NULL;
+        if (!bad && *opt == 'k') {
+          bad = sort_parse_key(value, &spec) < 0;
+        } else if (!bad && *opt == 't') {
+          bad = value[0] == '\0' || value[1] != '\0';
+          spec.separator = (unsigned char)value[0];
+        } else if (!bad) {
+          bad = sort_parse_size(value, &budget) < 0;
+        }
+        if (bad) {
+          printf("%sUsage: %s%s\n", COLOR_RED, usage, COLOR_RESET);
+          return 1;
+        }
+        break;
+      } else {
+        printf("%sUsage: %s%s\n", COLOR_RED, usage, COLOR_RESET);
+        return 1;
+      }
+    }
+  }
+  if (budget < SORT_MIN_MEMORY) {
+    budget = SORT_MIN_MEMORY;
+  }
+  if (args[i] == NULL && isatty(STDIN_FILENO)) {
+    printf("%sUsage: %s%s\n", COLOR_RED, usage, COLOR_RESET);
+    return 1;
+  }
+
+  // The text buffer and record array share the budget
+  size_t cap = budget / 2 < (1 << 20) ? budget / 2 : (1 << 20);
+  size_t len = 0, scanned = 0, rec_cap = 0, n = 0;
+  char *data = malloc(cap);
+  SortRecord *recs = NULL;
+  FILE **runs = malloc((SORT_MERGE_FANIN + 1) * sizeof(FILE *));
+  int run_count = 0, status = 0;
+  int file_index = i;
+
+  if (data == NULL || runs == NULL) {
+    free(data);
+    free(runs);
+    printf("%ssort: out of memory%s\n", COLOR_RED, COLOR_RESET);
+    return 1;
+  }
+
+  do {
+    const char *path = args[file_index];
+    int fd = STDIN_FILENO;
+    if (path != NULL && strcmp(path, "-") != 0) {
+      fd = open(path, O_RDONLY | O_CLOEXEC);
+      if (fd < 0) {
+        printf("%sError: Cannot open file '%s'%s\n", COLOR_RED, path,
+               COLOR_RESET);
+        status = 1;
+        continue;
+      }
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    ssize_t got = 1;
+    while (status == 0 && got > 0) {
+      if (len == cap) {
+        size_t used = len + n * sizeof(SortRecord);
+        if (used >= budget && n > 0) {
+          // Budget reached: sort what is complete and spill it as a run
+          for (size_t r = 0; r < n; r++) {
+            size_t off = (size_t)(uintptr_t)recs[r].line;
+            sort_make_record(&spec, &recs[r], data + off, recs[r].len);
+          }
+          if (sort_spill_run(&spec, recs, n, &runs, &run_count) < 0) {
+            printf("%ssort: cannot write temporary run: %s%s\n", COLOR_RED,
+                   strerror(errno), COLOR_RESET);
+            status = 1;
+            break;
+          }
+          memmove(data, data + scanned, len - scanned);
+          len -= scanned;
+          scanned = 0;
+          n = 0;
+        }
+        if (len == cap) {
+          // Grow (a single line longer than the budget still fits)
+          size_t grown = cap * 2;
+          char *bigger = realloc(data, grown);
+          if (bigger == NULL) {
+            printf("%ssort: out of memory%s\n", COLOR_RED, COLOR_RESET);
+            status = 1;
+            break;
+          }
+          data = bigger;
+          cap = grown;
+        }
+      }
+
+      got = read(fd, data + len, cap - len);
+      if (got < 0 && errno == EINTR) {
+        got = 1;
+        continue;
+      }
+      if (got < 0) {
+        printf("%ssort: read error: %s%s\n", COLOR_RED, strerror(errno),
+               COLOR_RESET);
+        status = 1;
+      } else if (got > 0) {
+        len += got;
+      } else if (len > scanned && data[len - 1] != '\n') {
+        // A file that does not end in a newline: end its last line here
+        if (len == cap) {
+          got = 1; // grow first
+          continue;
+        }
+        data[len++] = '\n';
+      }
+
+      // Index complete lines by offset (the buffer may still move)
+      char *nl;
+      while (scanned < len &&
+             (nl = memchr(data + scanned, '\n', len - scanned)) != NULL) {
+        if (n == rec_cap) {
+          rec_cap = rec_cap ? rec_cap * 2 : 4096;
+          SortRecord *grown = realloc(recs, rec_cap * sizeof(SortRecord));
+          if (grown == NULL) {
+            printf("%ssort: out of memory%s\n", COLOR_RED, COLOR_RESET);
+            status = 1;
+            break;
+          }
+          recs = grown;
+        }
+        recs[n].line = (const char *)(uintptr_t)scanned;
+        recs[n].len = (uint32_t)(nl - (data + scanned));
+        n++;
+        scanned = nl - data + 1;
+      }
+    }
+    if (fd != STDIN_FILENO) {
+      close(fd);
+    }
+  } while (status == 0 && args[file_index] != NULL && args[++file_index] != NULL);
+
+  if (status == 0) {
+    for (size_t r = 0; r < n; r++) {
+      size_t off = (size_t)(uintptr_t)recs[r].line;
+      sort_make_record(&spec, &recs[r], data + off, recs[r].len);
+    }
+    if (run_count == 0) {
+      if (sort_parallel(&spec, recs, n) < 0) {
+        printf("%ssort: out of memory%s\n", COLOR_RED, COLOR_RESET);
+        status = 1;
+      } else {
+        sort_write_records(&spec, recs, n, stdout);
+      }
+    } else if (n > 0 && sort_spill_run(&spec, recs, n, &runs, &run_count) < 0) {
+      printf("%ssort: cannot write temporary run: %s%s\n", COLOR_RED,
+             strerror(errno), COLOR_RESET);
+      status = 1;
+    } else {
+      free(data);
+      data = NULL;
+      free(recs);
+      recs = NULL;
+      // A failed write to stdout has nowhere to be reported
+      if (sort_merge_runs(&spec, runs, run_count, stdout) < 0 &&
+          !ferror(stdout)) {
+        printf("%ssort: out of memory%s\n", COLOR_RED, COLOR_RESET);
+        status = 1;
+      }
+    }
+  }
+  fflush(stdout);
+
+  for (int r = 0; r < run_count; r++) {
+    fclose(runs[r]);
+  }
+  free(runs);
+  free(recs);
+  free(data);
+  return status;
+}
+
+// ============================================================================
+// COUNT & UNIQ
+// ============================================================================
+
+#define COUNT_MAX_THREADS 16
+#define COUNT_CHUNK (1 << 20) // read size for streamed (non-mmap) input
+
+typedef struct {
+  const char *key; // in the table's arena, NULL = empty slot
+  uint32_t len;
+  unsigned int hash;
+  unsigned long long count;
+} CountEntry;
+
+// Open-addressing table of distinct keys; keys are copied into the arena
+typedef struct {
+  CountEntry *slots;
+  size_t capacity;
+  size_t used;
+  Arena arena;
+  int failed; // allocation failure
+} CountTable;
+
+void count_table_init(CountTable *table) {
+  table->capacity = 1024;
+  table->slots = calloc(table->capacity, sizeof(CountEntry));
+  table->used = 0;
+  table->arena.head = NULL;
+  table->failed = table->slots == NULL;
+}
+
+void count_table_free(CountTable *table) {
+  free(table->slots);
+  arena_free(&table->arena);
+  table->slots = NULL;
+}
+
+CountEntry *count_slot(CountTable *table, const char *key, size_t len,
+                       unsigned int hash) {
+  size_t mask = table->capacity - 1;
+  for (size_t i = hash & mask;; i = (i + 1) & mask) {
+    CountEntry *entry = &table->slots[i];
+    if (entry->key == NULL ||
+        (entry->hash == hash && entry->len == len &&
+         memcmp(entry->key, key, len) == 0)) {
+      return entry;
+    }
+  }
+}
+
+void count_grow(CountTable *table) {
+  CountEntry *old = table->slots;
+  size_t old_capacity = table->capacity;
+  CountEntry *slots = calloc(old_capacity * 2, sizeof(CountEntry));
+
+  if (slots == NULL) {
+    table->failed = 1;
+    return;
+  }
+  table->slots = slots;
+  table->capacity = old_capacity * 2;
+  for (size_t i = 0; i < old_capacity; i++) {
+    if (old[i].key != NULL) {
+      *count_slot(table, old[i].key, old[i].len, old[i].hash) = old[i];
+    }
+  }
+  free(old);
+}
+
+// Add amount to key; a key new to the table is copied into its arena
+void count_add(CountTable *table, const char *key, size_t len,
+               unsigned int hash, unsigned long long amount) {
+  CountEntry *entry = count_slot(table, key, len, hash);
+
+  if (entry->key == NULL) {
+    if ((table->used + 1) * 2 > table->capacity) {
+      count_grow(table);
+      if (table->failed) {
+        return;
+      }
+      entry = count_slot(table, key, len, hash);
+    }
+    entry->key = arena_strndup(&table->arena, key, len);
+    if (entry->key == NULL) {
+      table->failed = 1;
+      return;
+    }
+    entry->len = (uint32_t)len;
+    entry->hash = hash;
+    table->used++;
+  }
+  entry->count += amount;
+}
+
+// Count every complete line in data[0, len); returns the bytes consumed
+size_t count_lines(CountTable *table, const SortSpec *spec, const char *data,
+                   size_t len) {
+  size_t pos = 0;
+  const char *nl;
+
+  while (pos < len && (nl = memchr(data + pos, '\n', len - pos)) != NULL) {
+    const char *line = data + pos;
+    size_t line_len = nl - line;
+    size_t start = 0, key_len = line_len;
+    if (spec->key_field > 0) {
+      sort_find_key(spec, line, line_len, &start, &key_len);
+    }
+    count_add(table, line + start, key_len, var_hash(line + start, key_len),
+              1);
+    pos = nl - data + 1;
+  }
+  return pos;
+}
+
+// One thread's share of a mapped file
+typedef struct {
+  CountTable table;
+  const SortSpec *spec;
+  const char *data;
+  size_t len;
+} CountTask;
+
+void *count_thread(void *data) {
+  CountTask *task = data;
+  count_lines(&task->table, task->spec, task->data, task->len);
+  return NULL;
+}
+
+// Count a mapped file on threads, each with its own table over a range
+// that ends on a line boundary, then fold the tables into the first
+void count_parallel(CountTable *table, const SortSpec *spec, const char *data,
+                    size_t len, int threads) {
+  CountTask tasks[COUNT_MAX_THREADS];
+  pthread_t ids[COUNT_MAX_THREADS];
+  int started[COUNT_MAX_THREADS] = {0};
+  size_t start = 0;
+  int failed = 0;
+
+  if (threads < 2) {
+    count_lines(table, spec, data, len);
+    return;
+  }
+  for (int i = 0; i < threads; i++) {
+    size_t end = i == threads - 1 ? len : len / threads * (i + 1);
+    if (end < start) {
+      end = start;
+    }
+    const char *nl = end < len ? memchr(data + end, '\n', len - end) : NULL;
+    if (i < threads - 1) {
+      end = nl != NULL ? (size_t)(nl - data) + 1 : len;
+    }
+    tasks[i].spec = spec;
+    tasks[i].data = data + start;
+    tasks[i].len = end - start;
+    if (i > 0) {
+      count_table_init(&tasks[i].table);
+      failed |= tasks[i].table.failed;
+    }
+    start = end;
+  }
+  if (failed) {
+    // No memory for the per-thread tables: count on this thread instead
+    for (int i = 1; i < threads; i++) {
+      count_table_free(&tasks[i].table);
+    }
+    count_lines(table, spec, data, len);
+    return;
+  }
+  for (int i = 1; i < threads; i++) {
+    started[i] = pthread_create(&ids[i], NULL, count_thread, &tasks[i]) == 0;
+    if (!started[i]) {
+      count_thread(&tasks[i]);
+    }
+  }
+  count_lines(table, spec, tasks[0].data, tasks[0].len);
+
+  for (int i = 1; i < threads; i++) {
+    if (started[i]) {
+      pthread_join(ids[i], NULL);
+    }
+    CountTable *part = &tasks[i].table;
+    table->failed |= part->failed;
+    for (size_t s = 0; s < part->capacity && !table->failed; s++) {
+      CountEntry *e = &part->slots[s];
+      if (e->key != NULL) {
+        count_add(table, e->key, e->len, e->hash, e->count);
+      }
+    }
+    count_table_free(part);
+  }
+}
+
+// Output order: higher count first, then keys in byte order
+int count_before(const CountEntry *a, const CountEntry *b) {
+  if (a->count != b->count) {
+    return a->count > b->count;
+  }
+  uint32_t n = a->len < b->len ? a->len : b->len;
+  int cmp = memcmp(a->key, b->key, n);
+  return cmp < 0 || (cmp == 0 && a->len < b->len);
+}
+
+int count_entry_compare(const void *a, const void *b) {
+  const CountEntry *x = *(CountEntry *const *)a;
+  const CountEntry *y = *(CountEntry *const *)b;
+  return count_before(x, y) ? -1 : count_before(y, x) ? 1 : 0;
+}
+
+// Keep the top entries in a min-heap whose root is the weakest kept one
+void count_heap_down(CountEntry **heap, size_t size, size_t i) {
+  while (1) {
+    size_t weakest = i;
+    size_t left = 2 * i + 1, right = 2 * i + 2;
+    if (left < size && count_before(heap[weakest], heap[left])) {
+      weakest = left;
+    }
+    if (right < size && count_before(heap[weakest], heap[right])) {
+      weakest = right;
+    }
+    if (weakest == i) {
+      return;
+    }
+    CountEntry *swap = heap[i];
+    heap[i] = heap[weakest];
+    heap[weakest] = swap;
+    i = weakest;
+  }
+}
+
+// Print the top (or all, when top is 0) entries, most frequent first
+int count_print(CountTable *table, size_t top) {
+  size_t limit = top > 0 && top < table->used ? top : table->used;
+  CountEntry **heap = malloc((limit + 1) * sizeof(CountEntry *));
+  size_t size = 0;
+
+  if (heap == NULL) {
+    return -1;
+  }
+  for (size_t i = 0; i < table->capacity; i++) {
+    CountEntry *entry = &table->slots[i];
+    if (entry->key == NULL) {
+      continue;
+    }
+    if (size < limit) {
+      heap[size++] = entry;
+      if (size == limit) {
+        for (size_t j = size / 2; j-- > 0;) {
+          count_heap_down(heap, size, j);
+        }
+      }
+    } else if (count_before(entry, heap[0])) {
+      heap[0] = entry;
+      count_heap_down(heap, size, 0);
+    }
+  }
+
+  qsort(heap, size, sizeof(CountEntry *), count_entry_compare);
+  for (size_t i = 0; i < size; i++) {
+    printf("%7llu %.*s\n", heap[i]->count, (int)heap[i]->len, heap[i]->key);
+  }
+  free(heap);
+  return 0;
+}
+
+// count [-f N] [-t C] [-n TOP] [-j THREADS] [FILE...]
+// Counts distinct lines (or field N) with a hash table instead of
+// sort | uniq -c and prints them most frequent first. Regular files are
+// mapped and, with -j, split between threads.
+int cmd_count(char **args) {
+  const char *usage = "count [-f N] [-t C] [-n TOP] [-j THREADS] [file...]";
+  SortSpec spec = {0, 0, 0, 0, 0, -1};
+  long top = 0, threads = 1;
+  int i = 1;
+
+  for (; args[i] != NULL && args[i][0] == '-' && args[i][1] != '\0'; i += 2) {
+    const char *value = args[i + 1];
+    char *end = NULL;
+    long number = value != NULL ? strtol(value, &end, 10) : 0;
+    int numeric = value != NULL && end != value && *end == '\0';
+
+    if (strcmp(args[i], "-f") == 0 && numeric && number > 0) {
+      spec.key_field = spec.key_end = (int)number;
+    } else if (strcmp(args[i], "-t") == 0 && value != NULL &&
+               value[0] != '\0' && value[1] == '\0') {
+      spec.separator = (unsigned char)value[0];
+    } else if (strcmp(args[i], "-n") == 0 && numeric && number > 0) {
+      top = number;
+    } else if (strcmp(args[i], "-j") == 0 && numeric && number > 0) {
+      threads = number > COUNT_MAX_THREADS ? COUNT_MAX_THREADS : number;
+    } else {
+      printf("%sUsage: %s%s\n", COLOR_RED, usage, COLOR_RESET);
+      return 1;
+    }
+  }
+  if (args[i] == NULL && isatty(STDIN_FILENO)) {
+    printf("%sUsage: %s%s\n", COLOR_RED, usage, COLOR_RESET);
+    return 1;
+  }
+
+  CountTable table;
+  char *buffer = NULL;
+  int status = 0;
+
+  count_table_init(&table);
+  do {
+    const char *path = args[i];
+    int fd = STDIN_FILENO;
+    struct stat st;
+
+    if (path != NULL && strcmp(path, "-") != 0) {
+      fd = open(path, O_RDONLY | O_CLOEXEC);
+      if (fd < 0) {
+        printf("%sError: Cannot open file '%s'%s\n", COLOR_RED, path,
+               COLOR_RESET);
+        status = 1;
+        continue;
+      }
+    }
+
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+      size_t size = st.st_size;
+      char *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (map != MAP_FAILED) {
+        madvise(map, size, MADV_SEQUENTIAL);
+        // Each thread should get at least a chunk's worth of lines
+        int use = (int)(size / COUNT_CHUNK + 1 < (size_t)threads
+                            ? size / COUNT_CHUNK + 1
+                            : (size_t)threads);
+        size_t done;
+        if (use > 1) {
+          count_parallel(&table, &spec, map, size, use);
+          const char *last = memrchr(map, '\n', size);
+          done = last != NULL ? (size_t)(last - map) + 1 : 0;
+        } else {
+          done = count_lines(&table, &spec, map, size);
+        }
+        if (done < size) {
+          // Final line without a newline
+          char *tail = malloc(size - done + 1);
+          if (tail != NULL) {
+            memcpy(tail, map + done, size - done);
+            tail[size - done] = '\n';
+            count_lines(&table, &spec, tail, size - done + 1);
+            free(tail);
+          }
+        }
+        munmap(map, size);
+        if (fd != STDIN_FILENO) {
+          close(fd);
+        }
+        continue;
+      }
+    }
+
+    // Streamed input: count complete lines, carry the partial one over
+    size_t cap = COUNT_CHUNK, len = 0;
+    if (buffer == NULL) {
+      buffer = malloc(cap);
+    }
+    while (buffer != NULL) {
+      ssize_t got = read(fd, buffer + len, cap - len);
+      if (got < 0 && errno == EINTR) {
+        continue;
+      }
+      if (got <= 0) {
+        if (len > 0) {
+          buffer[len] = '\n'; // final line without a newline
+          count_lines(&table, &spec, buffer, len + 1);
+        }
+        break;
+      }
+      len += got;
+      size_t done = count_lines(&table, &spec, buffer, len);
+      memmove(buffer, buffer + done, len - done);
+      len -= done;
+      if (len == cap) {
+        char *bigger = realloc(buffer, cap * 2);
+        if (bigger == NULL) {
+          table.failed = 1;
+          break;
+        }
+        buffer = bigger;
+        cap *= 2;
+      }
+    }
+    if (fd != STDIN_FILENO) {
+      close(fd);
+    }
+  } while (status == 0 && args[i] != NULL && args[++i] != NULL);
+
+  if (table.failed) {
+    printf("%scount: out of memory%s\n", COLOR_RED, COLOR_RESET);
+    status = 1;
+  } else if (status == 0) {
+    count_print(&table, top);
+  }
+  fflush(stdout);
+  free(buffer);
+  count_table_free(&table);
+  return status;
+}
+
+// uniq [-c] [-d] [-u] [FILE] - collapse adjacent repeated lines
+int cmd_uniq(char **args) {
+  int show_count = 0, only_dups = 0, only_unique = 0;
+  int i = 1;
+
+  for (; args[i] != NULL && args[i][0] == '-' && args[i][1] != '\0'; i++) {
+    for (const char *opt = args[i] + 1; *opt != '\0'; opt++) {
+      if (*opt == 'c') {
+        show_count = 1;
+      } else if (*opt == 'd') {
+        only_dups = 1;
+      } else if (*opt == 'u') {
+        only_unique = 1;
+      } else {
+        printf("%sUsage: uniq [-c] [-d] [-u] [file]%s\n", COLOR_RED,
+               COLOR_RESET);
+        return 1;
+      }
+    }
+  }
+
+  FILE *fp = open_input_file(args[i], "uniq [-c] [-d] [-u] [file]");
+  if (fp == NULL) {
+    return 1;
+  }
+
+  char *line = NULL, *prev = NULL;
+  size_t line_cap = 0, prev_cap = 0, prev_len = 0;
+  unsigned long long repeats = 0;
+  ssize_t n;
+
+  while (1) {
+    n = getline(&line, &line_cap, fp);
+    if (n > 0 && line[n - 1] == '\n') {
+      n--;
+    }
+    if (repeats > 0 && n >= 0 && (size_t)n == prev_len &&
+        memcmp(line, prev, n) == 0) {
+      repeats++;
+      continue;
+    }
+    // A run of equal lines ended: print it per -c/-d/-u
+    if (repeats > 0 && !(only_dups && repeats == 1) &&
+        !(only_unique && repeats > 1)) {
+      if (show_count) {
+        printf("%7llu ", repeats);
+      }
+      printf("%.*s\n", (int)prev_len, prev);
+    }
+    if (n < 0) {
+      break;
+    }
+    // Swap buffers so the new line becomes the one to compare against
+    char *swap = prev;
+    size_t swap_cap = prev_cap;
+    prev = line;
+    prev_cap = line_cap;
+    prev_len = n;
+    line = swap;
+    line_cap = swap_cap;
+    repeats = 1;
+  }
+
+  free(line);
+  free(prev);
+  close_input_file(fp);
+  return 0;
+}
+
+// ============================================================================
+// CUT (vectorized field scanning, scatter-gather output)
+// ============================================================================
+
+#define CUT_MAX_FIELDS 1024  // fields selectable individually (N- covers more)
+#define CUT_IOV_BATCH 1024   // iovecs gathered before a writev
+#define CUT_CHUNK (1 << 20)  // read size for streamed input
+
+typedef struct {
+  char delim;
+  int csv;            // "quoted, fields" may hold the delimiter or newlines
+  int only_delimited; // -s: drop lines without a delimiter
+  int max_field;      // highest field selected individually
+  int open_from;      // N of a trailing "N-" range, 0 if none
+  unsigned char selected[CUT_MAX_FIELDS + 1];
+} CutSpec;
+
+// Output spans pointing into the input, written with writev
+typedef struct {
+  struct iovec *iov;
+  int count;
+  int capacity;
+  int failed;
+} CutOutput;
+
+int cut_selected(const CutSpec *spec, int field) {
+  return (spec->open_from > 0 && field >= spec->open_from) ||
+         (field <= CUT_MAX_FIELDS && spec->selected[field]);
+}
+
+// Parse LIST: N, N-M, N- and -M separated by commas
+int cut_parse_list(const char *list, CutSpec *spec) {
+  const char *p = list;
+
+  while (*p != '\0') {
+    char *end;
+    long from = 1, to;
+    if (*p != '-') {
+      from = strtol(p, &end, 10);
+      if (end == p || from < 1) {
+        return -1;
+      }
+      p = end;
+    }
+    to = from;
+    if (*p == '-') {
+      p++;
+      if (*p == ',' || *p == '\0') {
+        if (spec->open_from == 0 || from < spec->open_from) {
+          spec->open_from = (int)from;
+        }
+        to = 0;
+      } else {
+        to = strtol(p, &end, 10);
+        if (end == p || to < from) {
+          return -1;
+        }
+        p = end;
+      }
+    }
+    for (long f = from; to > 0 && f <= to && f <= CUT_MAX_FIELDS; f++) {
+      spec->selected[f] = 1;
+      if (f > spec->max_field) {
+        spec->max_field = (int)f;
+      }
+    }
+    if (to > CUT_MAX_FIELDS) {
+      return -1;
+    }
+    if (*p == ',') {
+      p++;
+    } else if (*p != '\0') {
+      return -1;
+    }
+  }
+  return spec->max_field > 0 || spec->open_from > 0 ? 0 : -1;
+}
+
+// First delim, newline or quote byte in [p, end), 16 bytes at a time
+const char *cut_scan(const char *p, const char *end, char delim, char quote) {
+#ifdef __SSE2__
+  __m128i d = _mm_set1_epi8(delim);
+  __m128i n = _mm_set1_epi8('\n');
+  __m128i q = _mm_set1_epi8(quote);
+  while (end - p >= 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)p);
+    __m128i hits = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, d),
+                                             _mm_cmpeq_epi8(v, n)),
+                                _mm_cmpeq_epi8(v, q));
+    int mask = _mm_movemask_epi8(hits);
+    if (mask != 0) {
+      return p + __builtin_ctz(mask);
+    }
+    p += 16;
+  }
+#endif
+  while (p < end && *p != delim && *p != '\n' && *p != quote) {
+    p++;
+  }
+  return p;
+}
+
+// End of the field starting at p: the delimiter or newline after it, or
+// end if the field runs off the buffer. CSV quotes hide both.
+const char *cut_field_end(const CutSpec *spec, const char *p,
+                          const char *end) {
+  int quoted = 0;
+
+  if (!spec->csv) {
+    return cut_scan(p, end, spec->delim, '\n');
+  }
+  while (1) {
+    if (quoted) {
+      p = memchr(p, '"', end - p);
+      if (p == NULL) {
+        return end;
+      }
+      if (p + 1 == end) {
+        return end; // may be a "" escape split across reads
+      }
+      if (p[1] == '"') {
+        p += 2;
+        continue;
+      }
+    } else {
+      p = cut_scan(p, end, spec->delim, '"');
+      if (p == end || *p != '"') {
+        return p;
+      }
+    }
+    quoted = !quoted;
+    p++;
+  }
+}
+
+int cut_push(CutOutput *out, const char *base, size_t len) {
+  if (out->count == out->capacity) {
+    int capacity = out->capacity ? out->capacity * 2 : CUT_IOV_BATCH;
+    struct iovec *grown = realloc(out->iov, capacity * sizeof(struct iovec));
+    if (grown == NULL) {
+      out->failed = 1;
+      return -1;
+    }
+    out->iov = grown;
+    out->capacity = capacity;
+  }
+  out->iov[out->count].iov_base = (void *)base;
+  out->iov[out->count].iov_len = len;
+  out->count++;
+  return 0;
+}
+
+// Emit a field; one that directly follows the previous emitted field in
+// the input extends its span (delimiter included) instead of adding two
+void cut_emit(const CutSpec *spec, CutOutput *out, const char *start,
+              const char *stop, int first) {
+  if (!first) {
+    struct iovec *last = &out->iov[out->count - 1];
+    if ((const char *)last->iov_base + last->iov_len == start - 1) {
+      last->iov_len = stop - (const char *)last->iov_base;
+      return;
+    }
+    cut_push(out, &spec->delim, 1);
+  }
+  cut_push(out, start, stop - start);
+}
+
+// Write out all gathered spans, at most IOV_MAX per writev
+int cut_flush(CutOutput *out) {
+  struct iovec *iov = out->iov;
+  int left = out->count;
+
+  while (left > 0 && !out->failed) {
+    int batch = left < IOV_MAX ? left : IOV_MAX;
+    ssize_t n = writev(STDOUT_FILENO, iov, batch);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      out->failed = 1;
+      break;
+    }
+    // Skip what was written, resuming inside a partly written span
+    while (batch > 0 && (size_t)n >= iov->iov_len) {
+      n -= iov->iov_len;
+      iov++;
+      left--;
+      batch--;
+    }
+    if (batch > 0) {
+      iov->iov_base = (char *)iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+  }
+  out->count = 0;
+  return out->failed ? -1 : 0;
+}
+
+// Cut every complete line of data[0, len). Without eof a trailing partial
+// line is left for the next call; returns the bytes consumed.
+size_t cut_process(const CutSpec *spec, CutOutput *out, const char *data,
+                   size_t len, int eof) {
+  const char *end = data + len;
+  const char *p = data;
+
+  while (p < end && !out->failed) {
+    const char *line = p;
+    int mark = out->count;
+    int field = 1, emitted = 0, delimited = 0;
+
+    while (1) {
+      const char *start = p;
+      if (!spec->csv && spec->open_from > 0 && field >= spec->open_from) {
+        // The rest of the line is selected: one span up to the newline
+        p = memchr(p, '\n', end - p);
+        p = p != NULL ? p : end;
+        cut_emit(spec, out, start, p, !emitted);
+        emitted = 1;
+        delimited = delimited || memchr(start, spec->delim, p - start);
+        break;
+      }
+      if (!spec->csv && field > spec->max_field && spec->open_from == 0) {
+        // Nothing further is wanted from this line
+        p = memchr(p, '\n', end - p);
+        p = p != NULL ? p : end;
+        break;
+      }
+      p = cut_field_end(spec, p, end);
+      if (cut_selected(spec, field)) {
+        cut_emit(spec, out, start, p, !emitted);
+        emitted = 1;
+      }
+      if (p == end || *p == '\n') {
+        break;
+      }
+      p++;
+      field++;
+      delimited = 1;
+    }
+
+    if (p == end && !eof) {
+      out->count = mark; // incomplete line: wait for more input
+      return line - data;
+    }
+    if (!delimited) {
+      // No delimiter: the line passes through whole unless -s
+      if (spec->only_delimited) {
+        out->count = mark;
+        p = p < end ? p + 1 : end;
+        continue;
+      }
+      if (!emitted) {
+        cut_push(out, line, p - line);
+      }
+    }
+
+    struct iovec *last = out->count > 0 ? &out->iov[out->count - 1] : NULL;
+    if (p < end && last != NULL &&
+        (const char *)last->iov_base + last->iov_len == p) {
+      last->iov_len++; // take the input's own newline
+    } else {
+      cut_push(out, "\n", 1);
+    }
+    p = p < end ? p + 1 : end;
+    if (out->count >= CUT_IOV_BATCH) {
+      cut_flush(out);
+    }
+  }
+  return p - data;
+}
+
+// cut [-d C] -f LIST [-s] [--csv] [FILE...]
+// Prints the selected fields of each line. Regular files are mapped and
+// the output is written straight from the input buffer with writev.
+int cmd_cut(char **args) {
+  const char *usage = "cut [-d C] -f LIST [-s] [--csv] [file...]";
+  CutSpec spec;
+  int delim_set = 0, have_list = 0;
+  int i = 1;
+
+  memset(&spec, 0, sizeof(spec));
+  spec.delim = '\t';
+  for (; args[i] != NULL && args[i][0] == '-' && args[i][1] != '\0'; i++) {
+    const char *arg = args[i];
+    const char *value = NULL;
+
+    if (strcmp(arg, "--") == 0) {
+      i++;
+      break;
+    } else if (strcmp(arg, "--csv") == 0) {
+      spec.csv = 1;
+      continue;
+    } else if (strcmp(arg, "-s") == 0) {
+      spec.only_delimited = 1;
+      continue;
+    }
+    if ((arg[1] == 'd' || arg[1] == 'f') && arg[2] == '\0') {
+      value = args[++i];
+    } else if (arg[1] == 'd' || arg[1] == 'f') {
+      value = arg + 2;
+    }
+    if (value == NULL) {
+      printf("%sUsage: %s%s\n", COLOR_RED, usage, COLOR_RESET);
+      return 1;
+    }
+    if (arg[1] == 'd') {
+      if (value[0] == '\0' || value[1] != '\0') {
+        printf("%scut: the delimiter must be a single character%s\n",
+               COLOR_RED, COLOR_RESET);
+        return 1;
+      }
+      spec.delim = value[0];
+      delim_set = 1;
+    } else if (cut_parse_list(value, &spec) < 0) {
+      printf("%scut: invalid field list '%s'%s\n", COLOR_RED, value,
+             COLOR_RESET);
+      return 1;
+    } else {
+      have_list = 1;
+    }
+  }
+  if (spec.csv && !delim_set) {
+    spec.delim = ',';
+  }
+  if (!have_list || (args[i] == NULL && isatty(STDIN_FILENO))) {
+    printf("%sUsage: %s%s\n", COLOR_RED, usage, COLOR_RESET);
+    return 1;
+  }
+
+  CutOutput out = {NULL, 0, 0, 0};
+  char *buffer = NULL;
+  int status = 0;
+
+  fflush(stdout);
+  do {
+    const char *path = args[i];
+    int fd = STDIN_FILENO;
+    struct stat st;
+
+    if (path != NULL && strcmp(path, "-") != 0) {
+      fd = open(path, O_RDONLY | O_CLOEXEC);
+      if (fd < 0) {
+        printf("%sError: Cannot open file '%s'%s\n", COLOR_RED, path,
+               COLOR_RESET);
+        status = 1;
+        continue;
+      }
+    }
+
+    char *map = MAP_FAILED;
+    size_t size = 0;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+      size = st.st_size;
+      map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    if (map != MAP_FAILED) {
+      madvise(map, size, MADV_SEQUENTIAL);
+      cut_process(&spec, &out, map, size, 1);
+      cut_flush(&out);
+      munmap(map, size);
+    } else {
+      // Streamed input: the partial last line moves to the buffer front
+      size_t cap = CUT_CHUNK, len = 0;
+      free(buffer);
+      buffer = malloc(cap);
+      while (buffer != NULL && !out.failed) {
+        ssize_t got = read(fd, buffer + len, cap - len);
+        if (got < 0 && errno == EINTR) {
+          continue;
+        }
+        if (got <= 0) {
+          cut_process(&spec, &out, buffer, len, 1);
+          cut_flush(&out);
+          break;
+        }
+        len += got;
+        size_t done = cut_process(&spec, &out, buffer, len, 0);
+        cut_flush(&out);
+        memmove(buffer, buffer + done, len - done);
+        len -= done;
+        if (len == cap) {
+          char *bigger = realloc(buffer, cap * 2);
+          if (bigger == NULL) {
+            out.failed = 1;
+            break;
+          }
+          buffer = bigger;
+          cap *= 2;
+        }
+      }
+    }
+    if (fd != STDIN_FILENO) {
+      close(fd);
+    }
+  } while (status == 0 && !out.failed && args[i] != NULL &&
+           args[++i] != NULL);
+
+  if (out.failed && status == 0) {
+    printf("%scut: write error: %s%s\n", COLOR_RED, strerror(errno),
+           COLOR_RESET);
+    status = 1;
+  }
+  free(out.iov);
+  free(buffer);
+  return status;
+}
+
+// ============================================================================
+// LINE INDEX (index, lines; used by head, tail and grep)
+// ============================================================================
+
+#define LINE_INDEX_MAGIC "MSHLIDX1"
+#define LINE_INDEX_STRIDE 64            // every 64th line start is stored
+#define LINE_INDEX_MIN_CHUNK (4 << 20)  // bytes per indexing thread, at least
+#define LINE_INDEX_MAX_THREADS 16
+
+// Newlines in p[0, n), counted 16 bytes at a time
+uint64_t count_newlines(const char *p, size_t n) {
+  uint64_t count = 0;
+  size_t i = 0;
+#ifdef __SSE2__
+  __m128i nl = _mm_set1_epi8('\n');
+  for (; i + 16 <= n; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+    count += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(v, nl)));
+  }
+#endif
+  for (; i < n; i++) {
+    count += p[i] == '\n';
+  }
+  return count;
+}
+
+// Step over *count newlines from pos, stopping at end. Returns the offset
+// just past the last newline taken and leaves in *count how many were
+// not found.
+size_t skip_lines(const char *data, size_t end, size_t pos, uint64_t *count) {
+  if (*count == 0) {
+    return pos;
+  }
+#ifdef __SSE2__
+  __m128i nl = _mm_set1_epi8('\n');
+  while (pos + 16 <= end) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(data + pos));
+    unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, nl));
+    uint64_t hits = __builtin_popcount(mask);
+    if (hits < *count) {
+      *count -= hits;
+      pos += 16;
+      continue;
+    }
+    // The wanted newline is in this block: drop the ones before it
+    for (uint64_t i = 1; i < *count; i++) {
+      mask &= mask - 1;
+    }
+    *count = 0;
+    return pos + __builtin_ctz(mask) + 1;
+  }
+#endif
+  while (pos < end && *count > 0) {
+    const char *nl_at = memchr(data + pos, '\n', end - pos);
+    if (nl_at == NULL) {
+      return end;
+    }
+    pos = nl_at - data + 1;
+    (*count)--;
+  }
+  return pos;
+}
+
+// $XDG_CACHE_HOME/myshell/NAME (or ~/.cache/...), created on demand
+int cache_subdir(const char *name, char *dir, size_t size, int create) {
+  const char *cache = var_get("XDG_CACHE_HOME");
+  char base[MAX_LINE];
+
+  if (cache != NULL && cache[0] != '\0') {
+    snprintf(base, sizeof(base), "%s", cache);
+  } else if (var_get("HOME") != NULL) {
+    snprintf(base, sizeof(base), "%s/.cache", var_get("HOME"));
+  } else {
+    return -1;
+  }
+  int len = snprintf(dir, size, "%s/myshell/%s", base, name);
+  if (len < 0 || (size_t)len >= size) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  if (create) {
+    char path[MAX_LINE + 16];
+    mkdir(base, 0755);
+    snprintf(path, sizeof(path), "%s/myshell", base);
+    mkdir(path, 0755);
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+// The sidecar is named after the file's device and inode, so renames and
+// other names of the same file share it
+int line_index_path(const struct stat *st, char *path, size_t size,
+                    int create) {
+  char dir[MAX_LINE];
+  if (cache_subdir("lines", dir, sizeof(dir), create) < 0) {
+    return -1;
+  }
+  int len = snprintf(path, size, "%s/%llx-%llx.idx", dir,
+                     (unsigned long long)st->st_dev,
+                     (unsigned long long)st->st_ino);
+  if (len < 0 || (size_t)len >= size) {
+    errno = ENAMETOOLONG; // never use a truncated sidecar name
+    return -1;
+  }
+  return 0;
+}
+
+int line_index_matches(const LineIndexHeader *header, const struct stat *st) {
+  return memcmp(header->magic, LINE_INDEX_MAGIC, 8) == 0 &&
+         header->ino == (uint64_t)st->st_ino &&
+         header->size == (uint64_t)st->st_size &&
+         header->mtime_sec == (int64_t)st->st_mtim.tv_sec &&
+         header->mtime_nsec == (int64_t)st->st_mtim.tv_nsec &&
+         header->stride > 0;
+}
+
+// Map the index of an open file; fails if there is none or the file has
+// changed since it was built
+int line_index_open(const struct stat *st, LineIndex *index) {
+  char path[MAX_LINE];
+  struct stat ist;
+
+  index->map = NULL;
+  if (!S_ISREG(st->st_mode) || line_index_path(st, path, sizeof(path), 0) < 0) {
+    return -1;
+  }
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return -1;
+  }
+  if (fstat(fd, &ist) < 0 || (size_t)ist.st_size < sizeof(LineIndexHeader)) {
+    close(fd);
+    return -1;
+  }
+  void *map = mmap(NULL, ist.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    return -1;
+  }
+
+  const LineIndexHeader *header = map;
+  if (!line_index_matches(header, st) ||
+      (size_t)ist.st_size <
+          sizeof(LineIndexHeader) + header->samples * sizeof(uint64_t)) {
+    munmap(map, ist.st_size);
+    return -1;
+  }
+  index->map = map;
+  index->map_size = ist.st_size;
+  index->header = header;
+  index->offsets = (const uint64_t *)(header + 1);
+  return 0;
+}
+
+void line_index_close(LineIndex *index) {
+  if (index->map != NULL) {
+    munmap(index->map, index->map_size);
+    index->map = NULL;
+  }
+}
+
+// Byte offset where line (1-based) starts; size when past the end
+size_t line_index_offset(const LineIndex *index, const char *data,
+                         size_t size, uint64_t line) {
+  uint64_t k = (line - 1) / index->header->stride;
+  uint64_t skip = (line - 1) % index->header->stride;
+
+  if (line == 0 || k >= index->header->samples) {
+    return line == 0 ? 0 : size;
+  }
+  size_t pos = skip_lines(data, size, index->offsets[k], &skip);
+  return skip > 0 ? size : pos;
+}
+
+// Line number (1-based) of the line holding byte pos
+uint64_t line_index_line_of(const LineIndex *index, const char *data,
+                            size_t pos) {
+  uint64_t lo = 0, hi = index->header->samples;
+
+  while (hi - lo > 1) {
+    uint64_t mid = lo + (hi - lo) / 2;
+    if (index->offsets[mid] <= pos) {
+      lo = mid;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo * index->header->stride + 1 +
+         count_newlines(data + index->offsets[lo], pos - index->offsets[lo]);
+}
+
+// One indexing thread's chunk: first counts its newlines, then (knowing
+// how many come before it) records the sampled line starts inside it
+typedef struct {
+  const char *data;
+  size_t start, end;
+  uint64_t newlines; // in the chunk
+  uint64_t before;   // in earlier chunks
+  uint64_t stride;
+  uint64_t *offsets;
+  int pass;
+} LineIndexTask;
+
+void *line_index_thread(void *data) {
+  LineIndexTask *task = data;
+
+  if (task->pass == 0) {
+    task->newlines =
+        count_newlines(task->data + task->start, task->end - task->start);
+    return NULL;
+  }
+  // Newline number m ends line m, so line m*stride + 1 starts after it
+  uint64_t seen = task->before;
+  uint64_t next = (seen / task->stride + 1) * task->stride;
+  size_t pos = task->start;
+  while (pos < task->end) {
+    uint64_t want = next - seen;
+    pos = skip_lines(task->data, task->end, pos, &want);
+    if (want > 0) {
+      break;
+    }
+    task->offsets[next / task->stride] = pos;
+    seen = next;
+    next += task->stride;
+  }
+  return NULL;
+}
+
+void line_index_run(LineIndexTask *tasks, int count) {
+  pthread_t ids[LINE_INDEX_MAX_THREADS];
+  int started[LINE_INDEX_MAX_THREADS] = {0};
+
+  for (int i = 1; i < count; i++) {
+    started[i] =
+        pthread_create(&ids[i], NULL, line_index_thread, &tasks[i]) == 0;
+    if (!started[i]) {
+      line_index_thread(&tasks[i]);
+    }
+  }
+  line_index_thread(&tasks[0]);
+  for (int i = 1; i < count; i++) {
+    if (started[i]) {
+      pthread_join(ids[i], NULL);
+    }
+  }
+}
+
+// Build and atomically install the index for an open file
+int line_index_build(int fd, const struct stat *st, uint64_t *lines_out,
+                     size_t *bytes_out, int *threads_out) {
+  char path[MAX_LINE], tmp[MAX_LINE + 16];
+  size_t size = st->st_size;
+  const char *data = NULL;
+
+  if (line_index_path(st, path, sizeof(path), 1) < 0) {
+    return -1;
+  }
+  if (size > 0) {
+    data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+      return -1;
+    }
+    madvise((void *)data, size, MADV_SEQUENTIAL);
+  }
+
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  int threads = (int)(size / LINE_INDEX_MIN_CHUNK) + 1;
+  if (threads > cpus) {
+    threads = cpus < 1 ? 1 : (int)cpus;
+  }
+  if (threads > LINE_INDEX_MAX_THREADS) {
+    threads = LINE_INDEX_MAX_THREADS;
+  }
+
+  LineIndexTask tasks[LINE_INDEX_MAX_THREADS];
+  for (int i = 0; i < threads; i++) {
+    tasks[i] = (LineIndexTask){data, size / threads * i,
+                               i == threads - 1 ? size : size / threads * (i + 1),
+                               0, 0, LINE_INDEX_STRIDE, NULL, 0};
+  }
+  line_index_run(tasks, threads);
+
+  uint64_t newlines = 0;
+  for (int i = 0; i < threads; i++) {
+    tasks[i].before = newlines;
+    newlines += tasks[i].newlines;
+  }
+  uint64_t samples = newlines / LINE_INDEX_STRIDE + 1;
+  size_t bytes = sizeof(LineIndexHeader) + samples * sizeof(uint64_t);
+  LineIndexHeader *header = calloc(1, bytes);
+  if (header == NULL) {
+    if (data != NULL) {
+      munmap((void *)data, size);
+    }
+    return -1;
+  }
+  uint64_t *offsets = (uint64_t *)(header + 1);
+  for (int i = 0; i < threads; i++) {
+    tasks[i].offsets = offsets;
+    tasks[i].pass = 1;
+  }
+  line_index_run(tasks, threads);
+  int partial = size > 0 && data[size - 1] != '\n';
+  if (data != NULL) {
+    munmap((void *)data, size);
+  }
+
+  memcpy(header->magic, LINE_INDEX_MAGIC, 8);
+  header->dev = st->st_dev;
+  header->ino = st->st_ino;
+  header->size = size;
+  header->mtime_sec = st->st_mtim.tv_sec;
+  header->mtime_nsec = st->st_mtim.tv_nsec;
+  header->lines = newlines + partial;
+  header->stride = LINE_INDEX_STRIDE;
+  header->samples = samples;
+
+  // Write to a temporary name and rename, so readers never see half of it
+  snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+  int out = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  int ok = out >= 0 && write(out, header, bytes) == (ssize_t)bytes;
+  if (out >= 0) {
+    close(out);
+  }
+  if (!ok || rename(tmp, path) < 0) {
+    unlink(tmp);
+    free(header);
+    return -1;
+  }
+  *lines_out = header->lines;
+  free(header);
+  *bytes_out = bytes;
+  *threads_out = threads;
+  return 0;
+}
+
+// index [-f] FILE... - build (or refresh) the line index of each file
+int cmd_index(char **args) {
+  int force = 0, status = 0;
+  int i = 1;
+
+  if (args[i] != NULL && strcmp(args[i], "-f") == 0) {
+    force = 1;
+    i++;
+  }
+  if (args[i] == NULL) {
+    printf("%sUsage: index [-f] file...%s\n", COLOR_RED, COLOR_RESET);
+    return 1;
+  }
+
+  for (; args[i] != NULL; i++) {
+    struct stat st;
+    LineIndex index;
+    int fd = open(args[i], O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0 || fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+      printf("%sError: Cannot index '%s'%s\n", COLOR_RED, args[i],
+             COLOR_RESET);
+      if (fd >= 0) {
+        close(fd);
+      }
+      status = 1;
+      continue;
+    }
+    if (!force && line_index_open(&st, &index) == 0) {
+      printf("%s%s%s: %llu lines, index up to date\n", COLOR_GREEN, args[i],
+             COLOR_RESET, (unsigned long long)index.header->lines);
+      line_index_close(&index);
+      close(fd);
+      continue;
+    }
+
+    struct timespec start, end;
+    uint64_t lines;
+    size_t bytes;
+    int threads;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (line_index_build(fd, &st, &lines, &bytes, &threads) < 0) {
+      printf("%sindex: cannot write index for '%s': %s%s\n", COLOR_RED,
+             args[i], strerror(errno), COLOR_RESET);
+      status = 1;
+    } else {
+      clock_gettime(CLOCK_MONOTONIC, &end);
+      printf("%s%s%s: %llu lines, %.1f KB index (%.3fs, %d thread%s)\n",
+             COLOR_GREEN, args[i], COLOR_RESET, (unsigned long long)lines,
+             bytes / 1024.0, timespec_diff(&start, &end), threads,
+             threads == 1 ? "" : "s");
+    }
+    close(fd);
+  }
+  return status;
+}
+
+// Write data[from, to) to stdout
+int write_range(const char *data, size_t from, size_t to) {
+  fflush(stdout);
+  while (from < to) {
+    ssize_t n = write(STDOUT_FILENO, data + from, to - from);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    from += n;
+  }
+  return 0;
+}
+
+// Map a regular file for random access: 1 if mapped, 0 if it is empty,
+// compressed or not a regular file, -1 on error
+int map_input(int fd, struct stat *st, const char **data) {
+  if (fstat(fd, st) < 0) {
+    return -1;
+  }
+  if (!S_ISREG(st->st_mode) || st->st_size == 0 ||
+      compression_format(fd) != COMPRESS_NONE) {
+    return 0;
+  }
+  *data = mmap(NULL, st->st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  return *data == MAP_FAILED ? -1 : 1;
+}
+
+// lines START[,END] FILE - print a range of lines; with an index the start
+// is found without reading what comes before it
+int cmd_lines(char **args) {
+  const char *usage = "lines START[,END] file   (END may be $)";
+  char *end;
+  unsigned long long first, last;
+  int bad;
+
+  if (args[1] == NULL || args[2] == NULL) {
+    printf("%sUsage: %s%s\n", COLOR_RED, usage, COLOR_RESET);
+    return 1;
+  }
+  first = strtoull(args[1], &end, 10);
+  last = first;
+  bad = end == args[1];
+  if (!bad && *end == ',') {
+    char *rest = end + 1;
+    if (strcmp(rest, "$") == 0) {
+      last = ULLONG_MAX;
+      end = rest + 1;
+    } else {
+      last = strtoull(rest, &end, 10);
+      bad = end == rest;
+    }
+  }
+  if (bad || *end != '\0' || first == 0 || last < first) {
+    printf("%sUsage: %s%s\n", COLOR_RED, usage, COLOR_RESET);
+    return 1;
+  }
+
+  int fd = open(args[2], O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  const char *data = NULL;
+  int mapped = fd >= 0 ? map_input(fd, &st, &data) : -1;
+  if (mapped < 0 || (mapped == 0 && !S_ISREG(st.st_mode))) {
+    printf("%sError: Cannot open file '%s'%s\n", COLOR_RED, args[2],
+           COLOR_RESET);
+    if (fd >= 0) {
+      close(fd);
+    }
+    return 1;
+  }
+  close(fd);
+  if (mapped == 0 && st.st_size > 0) {
+    printf("%slines: '%s' is compressed; decompress it to seek by line%s\n",
+           COLOR_RED, args[2], COLOR_RESET);
+    return 1;
+  }
+  if (mapped == 0) {
+    return 0; // empty file
+  }
+
+  size_t size = st.st_size, from, to;
+  LineIndex index;
+  if (line_index_open(&st, &index) == 0) {
+    from = line_index_offset(&index, data, size, first);
+    to = last == ULLONG_MAX ? size
+                            : line_index_offset(&index, data, size, last + 1);
+    line_index_close(&index);
+  } else {
+    uint64_t skip = first - 1;
+    from = skip_lines(data, size, 0, &skip);
+    from = skip > 0 ? size : from;
+    skip = last == ULLONG_MAX ? ULLONG_MAX : last - first + 1;
+    to = skip_lines(data, size, from, &skip);
+  }
+
+  int status = write_range(data, from, to) < 0 ? 1 : 0;
+  munmap((void *)data, size);
+  return status;
+}
+
+// ============================================================================
+// DECOMPRESSION (gzip input for the file built-ins)
+// ============================================================================
+
+#define DECOMP_BLOCK (256 << 10) // decoded bytes handed over at a time
+#define DECOMP_BLOCKS 4          // blocks in flight between the threads
+#define DECOMP_INPUT (128 << 10) // compressed bytes read at a time
+
+// Compression format of an open file by its magic bytes (the file offset
+// is not moved)
+int compression_format(int fd) {
+  unsigned char magic[4];
+
+  if (pread(fd, magic, sizeof(magic), 0) < 2) {
+    return COMPRESS_NONE;
+  }
+  if (magic[0] == 0x1f && magic[1] == 0x8b) {
+    return COMPRESS_GZIP;
+  }
+  if (magic[0] == 0x28 && magic[1] == 0xb5 && magic[2] == 0x2f &&
+      magic[3] == 0xfd) {
+    return COMPRESS_ZSTD;
+  }
+  return COMPRESS_NONE;
+}
+
+int compression_supported(int format) {
+#ifdef HAVE_ZLIB
+  if (format == COMPRESS_GZIP) {
+    return 1;
+  }
+#endif
+  return format == COMPRESS_NONE;
+}
+
+#ifdef HAVE_ZLIB
+
+// A decoder thread fills a ring of blocks while the built-in reads them
+// through a stdio cookie stream, so decoding overlaps the scan
+typedef struct {
+  int fd;
+  int format;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+  char *blocks[DECOMP_BLOCKS];
+  size_t lengths[DECOMP_BLOCKS];
+  int head;    // next block the decoder fills
+  int tail;    // block the reader is on
+  int count;   // filled blocks
+  int done;    // decoder finished
+  int error;   // corrupt or unreadable input
+  int closing; // reader went away; decoder should stop
+  size_t pos;  // read position in blocks[tail]
+} Decompressor;
+
+// Wait for a free block; NULL when the reader has closed the stream
+char *decomp_claim(Decompressor *d) {
+  pthread_mutex_lock(&d->lock);
+  while (d->count == DECOMP_BLOCKS && !d->closing) {
+    pthread_cond_wait(&d->changed, &d->lock);
+  }
+  char *block = d->closing ? NULL : d->blocks[d->head];
+  pthread_mutex_unlock(&d->lock);
+  return block;
+}
+
+void decomp_publish(Decompressor *d, size_t len) {
+  pthread_mutex_lock(&d->lock);
+  d->lengths[d->head] = len;
+  d->head = (d->head + 1) % DECOMP_BLOCKS;
+  d->count++;
+  pthread_cond_broadcast(&d->changed);
+  pthread_mutex_unlock(&d->lock);
+}
+
+// Inflate gzip members (concatenated ones too) into blocks
+int decomp_gzip(Decompressor *d, unsigned char *in) {
+  z_stream zs;
+  int status = Z_OK;
+
+  memset(&zs, 0, sizeof(zs));
+  if (inflateInit2(&zs, 15 + 32) != Z_OK) {
+    return -1;
+  }
+  char *block;
+  while ((block = decomp_claim(d)) != NULL) {
+    zs.next_out = (unsigned char *)block;
+    zs.avail_out = DECOMP_BLOCK;
+    while (zs.avail_out > 0) {
+      if (zs.avail_in == 0) {
+        ssize_t n = read(d->fd, in, DECOMP_INPUT);
+        if (n < 0 && errno == EINTR) {
+          continue;
+        }
+        if (n <= 0) {
+          status = n < 0 || status != Z_STREAM_END ? Z_DATA_ERROR : status;
+          break;
+        }
+        zs.next_in = in;
+        zs.avail_in = n;
+      }
+      if (status == Z_STREAM_END) {
+        // Like gzip, stop at zero padding or other data that is not a
+        // further member rather than failing the whole read
+        if (zs.next_in[0] != 0x1f ||
+            (zs.avail_in > 1 && zs.next_in[1] != 0x8b)) {
+          break;
+        }
+        inflateReset(&zs); // another member follows
+      }
+      status = inflate(&zs, Z_NO_FLUSH);
+      if (status != Z_OK && status != Z_STREAM_END) {
+        break;
+      }
+    }
+    size_t len = DECOMP_BLOCK - zs.avail_out;
+    if (len > 0) {
+      decomp_publish(d, len);
+    }
+    if (zs.avail_out > 0) {
+      break; // end of input or an error
+    }
+  }
+  inflateEnd(&zs);
+  return status == Z_STREAM_END || block == NULL ? 0 : -1;
+}
+
+void *decomp_thread(void *data) {
+  Decompressor *d = data;
+  unsigned char *in = malloc(DECOMP_INPUT);
+  int result = -1;
+
+  if (in != NULL) {
+    if (d->format == COMPRESS_GZIP) {
+      result = decomp_gzip(d, in);
+    }
+    free(in);
+  }
+  pthread_mutex_lock(&d->lock);
+  d->done = 1;
+  d->error = result < 0;
+  pthread_cond_broadcast(&d->changed);
+  pthread_mutex_unlock(&d->lock);
+  return NULL;
+}
+
+ssize_t decomp_read(void *cookie, char *buf, size_t size) {
+  Decompressor *d = cookie;
+
+  pthread_mutex_lock(&d->lock);
+  while (d->count == 0 && !d->done) {
+    pthread_cond_wait(&d->changed, &d->lock);
+  }
+  if (d->count == 0) {
+    int error = d->error;
+    pthread_mutex_unlock(&d->lock);
+    if (error) {
+      errno = EIO;
+      return -1;
+    }
+    return 0;
+  }
+  // The tail block belongs to the reader until it is released
+  char *block = d->blocks[d->tail];
+  size_t avail = d->lengths[d->tail] - d->pos;
+  pthread_mutex_unlock(&d->lock);
+
+  size_t n = size < avail ? size : avail;
+  memcpy(buf, block + d->pos, n);
+  d->pos += n;
+  if (n == avail) {
+    pthread_mutex_lock(&d->lock);
+    d->tail = (d->tail + 1) % DECOMP_BLOCKS;
+    d->count--;
+    d->pos = 0;
+    pthread_cond_broadcast(&d->changed);
+    pthread_mutex_unlock(&d->lock);
+  }
+  return n;
+}
+
+int decomp_close(void *cookie) {
+  Decompressor *d = cookie;
+
+  pthread_mutex_lock(&d->lock);
+  d->closing = 1;
+  pthread_cond_broadcast(&d->changed);
+  pthread_mutex_unlock(&d->lock);
+  pthread_join(d->thread, NULL);
+
+  for (int i = 0; i < DECOMP_BLOCKS; i++) {
+    free(d->blocks[i]);
+  }
+  pthread_mutex_destroy(&d->lock);
+  pthread_cond_destroy(&d->changed);
+  close(d->fd);
+  free(d);
+  return 0;
+}
+
+// Wrap a compressed file as a stream of its decoded bytes; takes fd
+FILE *open_decompressed(int fd, int format) {
+  Decompressor *d = calloc(1, sizeof(Decompressor));
+  if (d == NULL) {
+    close(fd);
+    return NULL;
+  }
+  d->fd = fd;
+  d->format = format;
+  for (int i = 0; i < DECOMP_BLOCKS; i++) {
+    d->blocks[i] = malloc(DECOMP_BLOCK);
+    if (d->blocks[i] == NULL) {
+      for (int j = 0; j < i; j++) {
+        free(d->blocks[j]);
+      }
+      free(d);
+      close(fd);
+      return NULL;
+    }
+  }
+  pthread_mutex_init(&d->lock, NULL);
+  pthread_cond_init(&d->changed, NULL);
+  posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  if (pthread_create(&d->thread, NULL, decomp_thread, d) != 0) {
+    d->done = 1;
+    pthread_mutex_destroy(&d->lock);
+    pthread_cond_destroy(&d->changed);
+    for (int i = 0; i < DECOMP_BLOCKS; i++) {
+      free(d->blocks[i]);
+    }
+    free(d);
+    close(fd);
+    return NULL;
+  }
+
+  cookie_io_functions_t io = {decomp_read, NULL, NULL, decomp_close};
+  FILE *fp = fopencookie(d, "r", io);
+  if (fp == NULL) {
+    decomp_close(d);
+    return NULL;
+  }
+  setvbuf(fp, NULL, _IOFBF, 64 << 10);
+  return fp;
+}
+
+#else
+
+FILE *open_decompressed(int fd, int format) {
+  (void)format;
+  close(fd);
+  errno = ENOTSUP;
+  return NULL;
+}
+
+#endif
+
+// ============================================================================
+// CHECKSUM (CRC32C, XXH64, SHA-256 on a thread pool)
+// ============================================================================
+
+#define HASH_CRC32C 0
+#define HASH_XXH64 1
+#define HASH_SHA256 2
+#define HASH_READ_BLOCK (1 << 20) // for files that cannot be mapped
+#define CHECKSUM_MAX_THREADS 16
+
+// Streaming state for one file
+typedef struct {
+  int algo;
+  uint32_t crc;
+  // XXH64
+  uint64_t v[4];
+  uint64_t total;
+  unsigned char mem[64]; // partial stripe (XXH64) or block (SHA-256)
+  size_t mem_len;
+  // SHA-256
+  uint32_t h[8];
+} HashState;
+
+const char *hash_names[] = {"crc32c", "xxh64", "sha256"};
+
+// ---- CRC32C (Castagnoli): SSE4.2 instruction, else slice-by-8 tables
+
+uint32_t crc32c_table[8][256];
+pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+void crc32c_init_tables(void) {
+  for (uint32_t i = 0; i < 256; i++) {
+    uint32_t crc = i;
+    for (int k = 0; k < 8; k++) {
+      crc = crc & 1 ? (crc >> 1) ^ 0x82F63B78u : crc >> 1;
+    }
+    crc32c_table[0][i] = crc;
+  }
+  for (uint32_t i = 0; i < 256; i++) {
+    for (int t = 1; t < 8; t++) {
+      uint32_t prev = crc32c_table[t - 1][i];
+      crc32c_table[t][i] = (prev >> 8) ^ crc32c_table[0][prev & 0xff];
+    }
+  }
+}
+
+uint32_t crc32c_software(uint32_t crc, const unsigned char *p, size_t n) {
+  pthread_once(&crc32c_once, crc32c_init_tables);
+  while (n >= 8) {
+    uint64_t word;
+    memcpy(&word, p, 8);
+    word ^= crc;
+    crc = crc32c_table[7][word & 0xff] ^ crc32c_table[6][(word >> 8) & 0xff] ^
+          crc32c_table[5][(word >> 16) & 0xff] ^
+          crc32c_table[4][(word >> 24) & 0xff] ^
+          crc32c_table[3][(word >> 32) & 0xff] ^
+          crc32c_table[2][(word >> 40) & 0xff] ^
+          crc32c_table[1][(word >> 48) & 0xff] ^ crc32c_table[0][word >> 56];
+    p += 8;
+    n -= 8;
+  }
+  while (n-- > 0) {
+    crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *p++) & 0xff];
+  }
+  return crc;
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <nmmintrin.h>
+
+__attribute__((target("sse4.2"))) uint32_t
+crc32c_hardware(uint32_t crc, const unsigned char *p, size_t n) {
+  uint64_t crc64 = crc;
+  while (n >= 8) {
+    uint64_t word;
+    memcpy(&word, p, 8);
+    crc64 = _mm_crc32_u64(crc64, word);
+    p += 8;
+    n -= 8;
+  }
+  crc = (uint32_t)crc64;
+  while (n-- > 0) {
+    crc = _mm_crc32_u8(crc, *p++);
+  }
+  return crc;
+}
+
+int crc32c_has_hardware(void) {
+  return __builtin_cpu_supports("sse4.2");
+}
+#else
+uint32_t crc32c_hardware(uint32_t crc, const unsigned char *p, size_t n) {
+  return crc32c_software(crc, p, n);
+}
+
+int crc32c_has_hardware(void) { return 0; }
+#endif
+
+// ---- XXH64
+
+#define XXH_PRIME1 0x9E3779B185EBCA87ULL
+#define XXH_PRIME2 0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME3 0x165667B19E3779F9ULL
+#define XXH_PRIME4 0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME5 0x27D4EB2F165667C5ULL
+
+uint64_t xxh_rotl(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+
+uint64_t xxh_round(uint64_t acc, uint64_t input) {
+  acc += input * XXH_PRIME2;
+  return xxh_rotl(acc, 31) * XXH_PRIME1;
+}
+
+uint64_t xxh_read64(const unsigned char *p) {
+  uint64_t v;
+  memcpy(&v, p, 8);
+  return v; // little-endian host assumed, as on x86 and arm64
+}
+
+// Consume whole 32-byte stripes; returns the bytes used
+size_t xxh64_stripes(HashState *st, const unsigned char *p, size_t n) {
+  size_t done = 0;
+  uint64_t v1 = st->v[0], v2 = st->v[1], v3 = st->v[2], v4 = st->v[3];
+  for (; done + 32 <= n; done += 32) {
+    v1 = xxh_round(v1, xxh_read64(p + done));
+    v2 = xxh_round(v2, xxh_read64(p + done + 8));
+    v3 = xxh_round(v3, xxh_read64(p + done + 16));
+    v4 = xxh_round(v4, xxh_read64(p + done + 24));
+  }
+  st->v[0] = v1;
+  st->v[1] = v2;
+  st->v[2] = v3;
+  st->v[3] = v4;
+  return done;
+}
+
+uint64_t xxh64_final(HashState *st) {
+  uint64_t h;
+  const unsigned char *p = st->mem;
+  size_t n = st->mem_len;
+
+  if (st->total >= 32) {
+    h = xxh_rotl(st->v[0], 1) + xxh_rotl(st->v[1], 7) +
+        xxh_rotl(st->v[2], 12) + xxh_rotl(st->v[3], 18);
+    for (int i = 0; i < 4; i++) {
+      h ^= xxh_round(0, st->v[i]);
+      h = h * XXH_PRIME1 + XXH_PRIME4;
+    }
+  } else {
+    h = XXH_PRIME5; // seed 0
+  }
+  h += st->total;
+
+  for (; n >= 8; p += 8, n -= 8) {
+    h ^= xxh_round(0, xxh_read64(p));
+    h = xxh_rotl(h, 27) * XXH_PRIME1 + XXH_PRIME4;
+  }
+  if (n >= 4) {
+    uint32_t word;
+    memcpy(&word, p, 4);
+    h ^= (uint64_t)word * XXH_PRIME1;
+    h = xxh_rotl(h, 23) * XXH_PRIME2 + XXH_PRIME3;
+    p += 4;
+    n -= 4;
+  }
+  for (; n > 0; p++, n--) {
+    h ^= *p * XXH_PRIME5;
+    h = xxh_rotl(h, 11) * XXH_PRIME1;
+  }
+  h ^= h >> 33;
+  h *= XXH_PRIME2;
+  h ^= h >> 29;
+  h *= XXH_PRIME3;
+  h ^= h >> 32;
+  return h;
+}
+
+// ---- SHA-256
+
+const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+    0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+    0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+    0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+    0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+    0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+uint32_t sha_rotr(uint32_t x, int r) { return (x >> r) | (x << (32 - r)); }
+
+void sha256_block(uint32_t *h, const unsigned char *p) {
+  uint32_t w[64];
+  for (int i = 0; i < 16; i++) {
+    w[i] = (uint32_t)p[4 * i] << 24 | (uint32_t)p[4 * i + 1] << 16 |
+           (uint32_t)p[4 * i + 2] << 8 | p[4 * i + 3];
+  }
+  for (int i = 16; i < 64; i++) {
+    uint32_t s0 = sha_rotr(w[i - 15], 7) ^ sha_rotr(w[i - 15], 18) ^
+                  (w[i - 15] >> 3);
+    uint32_t s1 = sha_rotr(w[i - 2], 17) ^ sha_rotr(w[i - 2], 19) ^
+                  (w[i - 2] >> 10);
+    w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+  }
+
+  uint32_t a = h[0], b = h[1], c = h[2], d = h[3];
+  uint32_t e = h[4], f = h[5], g = h[6], k = h[7];
+  for (int i = 0; i < 64; i++) {
+    uint32_t t1 = k + (sha_rotr(e, 6) ^ sha_rotr(e, 11) ^ sha_rotr(e, 25)) +
+                  ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+    uint32_t t2 = (sha_rotr(a, 2) ^ sha_rotr(a, 13) ^ sha_rotr(a, 22)) +
+                  ((a & b) ^ (a & c) ^ (b & c));
+    k = g;
+    g = f;
+    f = e;
+    e = d + t1;
+    d = c;
+    c = b;
+    b = a;
+    a = t1 + t2;
+  }
+  h[0] += a;
+  h[1] += b;
+  h[2] += c;
+  h[3] += d;
+  h[4] += e;
+  h[5] += f;
+  h[6] += g;
+  h[7] += k;
+}
+
+// ---- Common interface
+
+void hash_init(HashState *st, int algo) {
+  static const uint32_t sha256_iv[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372,
+                                        0xa54ff53a, 0x510e527f, 0x9b05688c,
+                                        0x1f83d9ab, 0x5be0cd19};
+  memset(st, 0, sizeof(*st));
+  st->algo = algo;
+  st->crc = 0xFFFFFFFFu;
+  st->v[0] = XXH_PRIME1 + XXH_PRIME2;
+  st->v[1] = XXH_PRIME2;
+  st->v[2] = 0;
+  st->v[3] = -XXH_PRIME1;
+  memcpy(st->h, sha256_iv, sizeof(st->h));
+}
+
+void hash_update(HashState *st, const unsigned char *p, size_t n) {
+  if (st->algo == HASH_CRC32C) {
+    st->crc = crc32c_has_hardware() ? crc32c_hardware(st->crc, p, n)
+                                    : crc32c_software(st->crc, p, n);
+    return;
+  }
+
+  // XXH64 works on 32-byte stripes, SHA-256 on 64-byte blocks; a partial
+  // one waits in mem
+  size_t unit = st->algo == HASH_XXH64 ? 32 : 64;
+  st->total += n;
+  if (st->mem_len > 0) {
+    size_t take = unit - st->mem_len < n ? unit - st->mem_len : n;
+    memcpy(st->mem + st->mem_len, p, take);
+    st->mem_len += take;
+    p += take;
+    n -= take;
+    if (st->mem_len < unit) {
+      return;
+    }
+    if (st->algo == HASH_XXH64) {
+      xxh64_stripes(st, st->mem, unit);
+    } else {
+      sha256_block(st->h, st->mem);
+    }
+    st->mem_len = 0;
+  }
+  size_t done;
+  if (st->algo == HASH_XXH64) {
+    done = xxh64_stripes(st, p, n);
+  } else {
+    for (done = 0; done + 64 <= n; done += 64) {
+      sha256_block(st->h, p + done);
+    }
+  }
+  memcpy(st->mem, p + done, n - done);
+  st->mem_len = n - done;
+}
+
+// Finish and format the digest as lowercase hex
+void hash_final(HashState *st, char *hex) {
+  if (st->algo == HASH_CRC32C) {
+    sprintf(hex, "%08x", st->crc ^ 0xFFFFFFFFu);
+  } else if (st->algo == HASH_XXH64) {
+    sprintf(hex, "%016llx", (unsigned long long)xxh64_final(st));
+  } else {
+    uint64_t bits = st->total * 8;
+    unsigned char pad[72] = {0x80};
+    size_t pad_len = (st->mem_len < 56 ? 56 : 120) - st->mem_len;
+    for (int i = 0; i < 8; i++) {
+      pad[pad_len + i] = (unsigned char)(bits >> (56 - 8 * i));
+    }
+    hash_update(st, pad, pad_len + 8);
+    for (int i = 0; i < 8; i++) {
+      sprintf(hex + 8 * i, "%08x", st->h[i]);
+    }
+  }
+}
+
+// One file to hash (or verify against expected)
+typedef struct {
+  const char *path;
+  const char *expected; // manifest digest, NULL when just hashing
+  int algo;
+  char digest[65];
+  int error; // errno, 0 on success
+} ChecksumJob;
+
+typedef struct {
+  ChecksumJob *jobs;
+  int count;
+  int next;
+  pthread_mutex_t lock;
+} ChecksumPool;
+
+// Hash one file: mapped when possible, else read in large blocks
+void checksum_file(ChecksumJob *job) {
+  HashState st;
+  struct stat sb;
+  int fd = open(job->path, O_RDONLY | O_CLOEXEC);
+
+  hash_init(&st, job->algo);
+  if (fd < 0 || fstat(fd, &sb) < 0) {
+    job->error = errno;
+    if (fd >= 0) {
+      close(fd);
+    }
+    return;
+  }
+  if (S_ISDIR(sb.st_mode)) {
+    job->error = EISDIR;
+    close(fd);
+    return;
+  }
+
+  void *map = MAP_FAILED;
+  if (S_ISREG(sb.st_mode) && sb.st_size > 0) {
+    map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  }
+  if (map != MAP_FAILED) {
+    madvise(map, sb.st_size, MADV_SEQUENTIAL);
+    hash_update(&st, map, sb.st_size);
+    munmap(map, sb.st_size);
+  } else {
+    unsigned char *buf = malloc(HASH_READ_BLOCK);
+    ssize_t n = 0;
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    while (buf != NULL &&
+           ((n = read(fd, buf, HASH_READ_BLOCK)) > 0 || (n < 0 && errno == EINTR))) {
+      if (n > 0) {
+        hash_update(&st, buf, n);
+      }
+    }
+    job->error = buf == NULL ? ENOMEM : n < 0 ? errno : 0;
+    free(buf);
+  }
+  close(fd);
+  if (job->error == 0) {
+    hash_final(&st, job->digest);
+  }
+}
+
+void *checksum_worker(void *data) {
+  ChecksumPool *pool = data;
+  while (1) {
+    pthread_mutex_lock(&pool->lock);
+    int i = pool->next < pool->count ? pool->next++ : -1;
+    pthread_mutex_unlock(&pool->lock);
+    if (i < 0) {
+      return NULL;
+    }
+    checksum_file(&pool->jobs[i]);
+  }
+}
+
+// Hash all jobs on up to one thread per core (the caller is one of them)
+void checksum_run(ChecksumJob *jobs, int count) {
+  ChecksumPool pool = {jobs, count, 0, PTHREAD_MUTEX_INITIALIZER};
+  pthread_t ids[CHECKSUM_MAX_THREADS];
+  int started[CHECKSUM_MAX_THREADS] = {0};
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  int threads = cpus < 1 ? 1 : cpus > CHECKSUM_MAX_THREADS ? CHECKSUM_MAX_THREADS
+                                                          : (int)cpus;
+  if (threads > count) {
+    threads = count;
+  }
+
+  for (int i = 1; i < threads; i++) {
+    started[i] = pthread_create(&ids[i], NULL, checksum_worker, &pool) == 0;
+  }
+  checksum_worker(&pool);
+  for (int i = 1; i < threads; i++) {
+    if (started[i]) {
+      pthread_join(ids[i], NULL);
+    }
+  }
+}
+
+int hash_algo_from_name(const char *name) {
+  for (int i = 0; i < 3; i++) {
+    if (strcmp(name, hash_names[i]) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+// Verify "DIGEST  PATH" lines (the sha256sum format); the algorithm
+// follows from the digest length unless -a was given
+int checksum_verify(const char *manifest, int algo) {
+  FILE *fp = fopen(manifest, "r");
+  if (fp == NULL) {
+    printf("%sError: Cannot open file '%s'%s\n", COLOR_RED, manifest,
+           COLOR_RESET);
+    return 1;
+  }
+
+  Arena arena = {NULL};
+  ChecksumJob *jobs = NULL;
+  int count = 0, capacity = 0, malformed = 0;
+  char *line = NULL;
+  size_t cap = 0;
+  ssize_t n;
+
+  while ((n = getline(&line, &cap, fp)) != -1) {
+    while (n > 0 && (line[n - 1] == '\n' || line[n - 1] == '\r')) {
+      line[--n] = '\0';
+    }
+    size_t hex = strspn(line, "0123456789abcdefABCDEF");
+    int job_algo = algo >= 0 ? algo
+                   : hex == 8 ? HASH_CRC32C
+                   : hex == 16 ? HASH_XXH64
+                   : hex == 64 ? HASH_SHA256
+                               : -1;
+    // "DIGEST  PATH", or "DIGEST *PATH" for binary mode
+    if (n == 0 || job_algo < 0 || line[hex] != ' ' ||
+        (line[hex + 1] != ' ' && line[hex + 1] != '*') ||
+        line[hex + 2] == '\0') {
+      malformed += n > 0;
+      continue;
+    }
+    if (count == capacity) {
+      capacity = capacity ? capacity * 2 : 64;
+      ChecksumJob *grown = realloc(jobs, capacity * sizeof(ChecksumJob));
+      if (grown == NULL) {
+        break;
+      }
+      jobs = grown;
+    }
+    for (size_t i = 0; i < hex; i++) {
+      line[i] = (line[i] >= 'A' && line[i] <= 'F') ? line[i] + 32 : line[i];
+    }
+    ChecksumJob *job = &jobs[count++];
+    memset(job, 0, sizeof(*job));
+    job->expected = arena_strndup(&arena, line, hex);
+    job->path = arena_strndup(&arena, line + hex + 2, n - hex - 2);
+    job->algo = job_algo;
+  }
+  free(line);
+  fclose(fp);
+
+  checksum_run(jobs, count);
+
+  int failed = 0, missing = 0;
+  for (int i = 0; i < count; i++) {
+    if (jobs[i].error != 0) {
+      printf("%s%s: FAILED open or read (%s)%s\n", COLOR_RED, jobs[i].path,
+             strerror(jobs[i].error), COLOR_RESET);
+      missing++;
+    } else if (strcmp(jobs[i].digest, jobs[i].expected) != 0) {
+      printf("%s%s: FAILED%s\n", COLOR_RED, jobs[i].path, COLOR_RESET);
+      failed++;
+    } else {
+      printf("%s: %sOK%s\n", jobs[i].path, COLOR_GREEN, COLOR_RESET);
+    }
+  }
+  if (failed > 0 || missing > 0 || malformed > 0) {
+    printf("%schecksum: %d of %d failed, %d unreadable, %d malformed line%s%s\n",
+           COLOR_YELLOW, failed, count, missing, malformed,
+           malformed == 1 ? "" : "s", COLOR_RESET);
+  }
+  free(jobs);
+  arena_free(&arena);
+  return failed > 0 || missing > 0 || malformed > 0 || count == 0 ? 1 : 0;
+}
+
+// checksum [-a crc32c|xxh64|sha256] FILE... | checksum [-a ALGO] -c MANIFEST
+// Prints "DIGEST  FILE" lines (sha256sum format), hashing the files in
+// parallel; -c checks a manifest of such lines.
+int cmd_checksum(char **args) {
+  const char *usage =
+      "checksum [-a crc32c|xxh64|sha256] file... | checksum -c manifest";
+  int algo = -1;
+  const char *manifest = NULL;
+  int i = 1;
+
+  for (; args[i] != NULL && args[i][0] == '-'; i += 2) {
+    if (strcmp(args[i], "-a") == 0 && args[i + 1] != NULL &&
+        hash_algo_from_name(args[i + 1]) >= 0) {
+      algo = hash_algo_from_name(args[i + 1]);
+    } else if (strcmp(args[i], "-c") == 0 && args[i + 1] != NULL) {
+      manifest = args[i + 1];
+    } else {
+      printf("%sUsage: %s%s\n", COLOR_RED, usage, COLOR_RESET);
+      return 1;
+    }
+  }
+  if (manifest != NULL) {
+    return checksum_verify(manifest, algo);
+  }
+  if (args[i] == NULL) {
+    printf("%sUsage: %s%s\n", COLOR_RED, usage, COLOR_RESET);
+    return 1;
+  }
+
+  int count = 0;
+  while (args[i + count] != NULL) {
+    count++;
+  }
+  ChecksumJob *jobs = calloc(count, sizeof(ChecksumJob));
+  if (jobs == NULL) {
+    return 1;
+  }
+  for (int j = 0; j < count; j++) {
+    jobs[j].path = args[i + j];
+    jobs[j].algo = algo >= 0 ? algo : HASH_CRC32C;
+  }
+  checksum_run(jobs, count);
+
+  int status = 0;
+  for (int j = 0; j < count; j++) {
+    if (jobs[j].error != 0) {
+      printf("%schecksum: %s: %s%s\n", COLOR_RED, jobs[j].path,
+             strerror(jobs[j].error), COLOR_RESET);
+      status = 1;
+    } else {
+      printf("%s  %s\n", jobs[j].digest, jobs[j].path);
+    }
+  }
+  free(jobs);
+  return status;
+}
+
+// ============================================================================
+// TEE (tee(2)/splice(2) with a read/write fallback)
+// ============================================================================
+
+#define TEE_BUFFER (128 * 1024)
+
+// One destination. Every output but the last gets its copy of each round
+// through a staging pipe filled by tee(2); the last one takes the data off
+// stdin directly with splice(2).
+typedef struct {
+  int fd;
+  const char *name;
+  int stage[2];  // staging pipe, -1 for the last output
+  size_t staged; // bytes of this round the staging pipe received
+  int copy;      // splice refused (a terminal, say): use write(2)
+  int failed;
+} TeeOutput;
+
+void tee_fail(TeeOutput *out, int err) {
+  if (!out->failed && err != EPIPE) {
+    fprintf(stderr, "%stee: %s: %s%s\n", COLOR_RED, out->name, strerror(err),
+            COLOR_RESET);
+  }
+  out->failed = 1;
+}
+
+// write(2) all of buf, or mark the output failed
+void tee_write(TeeOutput *out, const char *buf, size_t len) {
+  while (len > 0 && !out->failed) {
+    ssize_t n = write(out->fd, buf, len);
+    if (n < 0 && errno == EINTR && !sigint_received) {
+      continue;
+    }
+    if (n < 0) {
+      tee_fail(out, errno);
+      return;
+    }
+    buf += n;
+    len -= n;
+  }
+}
+
+// Move len bytes from the pipe in_fd to out with splice(2), switching the
+// output to plain writes if the kernel cannot splice to it. Returns -1 only
+// when the pipe itself could not be read.
+int tee_drain(int in_fd, TeeOutput *out, size_t len, char *buf) {
+  while (len > 0) {
+    ssize_t n;
+    if (!out->copy && !out->failed) {
+      n = splice(in_fd, NULL, out->fd, NULL, len, SPLICE_F_MOVE);
+      if (n > 0) {
+        len -= n;
+        continue;
+      }
+      if (n < 0 && errno == EINTR && !sigint_received) {
+        continue;
+      }
+      if (n < 0 && errno == EINVAL) {
+        out->copy = 1;
+      } else if (n < 0) {
+        tee_fail(out, errno);
+      }
+    }
+    // Copy through userspace, or just discard once the output has failed
+    n = read(in_fd, buf, len < TEE_BUFFER ? len : TEE_BUFFER);
+    if (n < 0 && errno == EINTR && !sigint_received) {
+      continue;
+    }
+    if (n <= 0) {
+      return -1;
+    }
+    tee_write(out, buf, n);
+    len -= n;
+  }
+  return 0;
+}
+
+// Zero-copy loop for a pipe on stdin. Returns 0 at EOF, 1 if the data
+// stopped early, or -1 if tee(2) is unsupported before anything was read.
+int tee_splice(TeeOutput *outs, int count, char *buf) {
+  int started = 0;
+
+  while (!sigint_received) {
+    ssize_t round = -1;
+    int live = 0;
+
+    for (int i = 0; i < count; i++) {
+      live += !outs[i].failed;
+    }
+    if (live == 0) {
+      return 0; // each failure has been reported already
+    }
+
+    // Duplicate what is buffered in stdin into each staging pipe. They are
+    // empty and as large as stdin's pipe, so each gets the whole round
+    for (int i = 0; i < count - 1; i++) {
+      outs[i].staged = 0;
+      if (outs[i].failed) {
+        continue;
+      }
+      ssize_t n;
+      do {
+        n = tee(STDIN_FILENO, outs[i].stage[1],
+                round < 0 ? (size_t)INT_MAX : (size_t)round, 0);
+      } while (n < 0 && errno == EINTR && !sigint_received);
+      if (n < 0) {
+        if (!started && errno == EINVAL) {
+          return -1;
+        }
+        return 1;
+      }
+      started = 1;
+      if (round < 0) {
+        round = n;
+      }
+      outs[i].staged = n;
+    }
+
+    // No staging copies, so the last output is the only live one: splice
+    // whatever arrives straight to it
+    TeeOutput *last = &outs[count - 1];
+    if (round < 0) {
+      ssize_t n = -1;
+      if (!last->copy) {
+        n = splice(STDIN_FILENO, NULL, last->fd, NULL, INT_MAX, SPLICE_F_MOVE);
+        if (n < 0 && errno == EINVAL && !started) {
+          return -1;
+        }
+        if (n < 0 && errno == EINVAL) {
+          last->copy = 1;
+        } else if (n < 0 && errno != EINTR) {
+          tee_fail(last, errno);
+        }
+      } else {
+        n = read(STDIN_FILENO, buf, TEE_BUFFER);
+        if (n < 0 && errno != EINTR) {
+          return 1;
+        }
+        tee_write(last, buf, n > 0 ? n : 0);
+      }
+      if (n == 0) {
+        return 0;
+      }
+      started |= n > 0;
+      continue;
+    }
+    if (round == 0) {
+      return 0;
+    }
+
+    // An output whose staging pipe came up short needs the rest from a
+    // userspace copy of the round, so read it instead of splicing
+    int short_copy = 0;
+    for (int i = 0; i < count - 1; i++) {
+      short_copy |= !outs[i].failed && outs[i].staged < (size_t)round;
+    }
+    if (short_copy) {
+      size_t got = 0;
+      char *round_buf = malloc(round);
+      while (round_buf != NULL && got < (size_t)round) {
+        ssize_t n = read(STDIN_FILENO, round_buf + got, round - got);
+        if (n < 0 && errno == EINTR && !sigint_received) {
+          continue;
+        }
+        if (n <= 0) {
+          break;
+        }
+        got += n;
+      }
+      if (round_buf == NULL || got < (size_t)round) {
+        free(round_buf);
+        return 1;
+      }
+      tee_write(last, round_buf, round);
+      for (int i = 0; i < count - 1; i++) {
+        if (tee_drain(outs[i].stage[0], &outs[i], outs[i].staged, buf) == 0 &&
+            outs[i].staged < (size_t)round) {
+          tee_write(&outs[i], round_buf + outs[i].staged,
+                    round - outs[i].staged);
+        }
+      }
+      free(round_buf);
+      continue;
+    }
+
+    if (tee_drain(STDIN_FILENO, last, round, buf) < 0) {
+      return 1;
+    }
+    for (int i = 0; i < count - 1; i++) {
+      if (outs[i].staged > 0 &&
+          tee_drain(outs[i].stage[0], &outs[i], outs[i].staged, buf) < 0) {
+        return 1;
+      }
+    }
+  }
+  return 1;
+}
+
+// Portable loop: one read, then a write to every output
+int tee_copy(TeeOutput *outs, int count, char *buf) {
+  while (1) {
+    ssize_t n = read(STDIN_FILENO, buf, TEE_BUFFER);
+    if (n < 0 && errno == EINTR && !sigint_received) {
+      continue;
+    }
+    if (n <= 0) {
+      return n < 0;
+    }
+    for (int i = 0; i < count; i++) {
+      tee_write(&outs[i], buf, n);
+    }
+  }
+}
+
+// tee [-a] [-p SIZE] FILE... - copy stdin to stdout and to each file.
+// With a pipe on stdin the data is duplicated in the kernel with tee(2)
+// and splice(2); -p raises the pipe buffers with F_SETPIPE_SZ.
+int cmd_tee(char **args) {
+  const char *usage = "tee [-a] [-p SIZE] [file...]";
+  int append = 0;
+  size_t pipe_size = 0;
+  int i = 1;
+
+  for (; args[i] != NULL && args[i][0] == '-' && args[i][1] != '\0'; i++) {
+    if (strcmp(args[i], "-a") == 0) {
+      append = 1;
+    } else if (strcmp(args[i], "-p") == 0 && args[i + 1] != NULL &&
+               sort_parse_size(args[i + 1], &pipe_size) == 0 &&
+               pipe_size <= INT_MAX) {
+      i++;
+    } else {
+      printf("%sUsage: %s%s\n", COLOR_RED, usage, COLOR_RESET);
+      return 1;
+    }
+  }
+
+  int files = 0;
+  while (args[i + files] != NULL) {
+    files++;
+  }
+  // Files first and stdout last: the files get tee(2) copies through
+  // staging pipes and stdout takes the original data by splice(2). Each
+  // round is written out in turn, so a slow reader on stdout still holds
+  // up the file writes of the next round.
+  TeeOutput *outs = calloc(files + 1, sizeof(TeeOutput));
+  char *buf = malloc(TEE_BUFFER);
+  if (outs == NULL || buf == NULL) {
+    free(outs);
+    free(buf);
+    return 1;
+  }
+
+  int status = 0, count = 0;
+  for (int j = 0; j < files; j++) {
+    // O_APPEND files cannot be spliced to, so append by seeking instead
+    int fd = open(args[i + j],
+                  O_WRONLY | O_CREAT | O_CLOEXEC | (append ? 0 : O_TRUNC), 0644);
+    if (fd < 0) {
+      fprintf(stderr, "%stee: %s: %s%s\n", COLOR_RED, args[i + j],
+              strerror(errno), COLOR_RESET);
+      status = 1;
+      continue;
+    }
+    if (append) {
+      lseek(fd, 0, SEEK_END);
+    }
+    outs[count].fd = fd;
+    outs[count++].name = args[i + j];
+  }
+  fflush(stdout);
+  outs[count].fd = STDOUT_FILENO;
+  outs[count++].name = "stdout";
+
+  struct stat in_st, out_st;
+  int in_pipe = fstat(STDIN_FILENO, &in_st) == 0 && S_ISFIFO(in_st.st_mode);
+  int out_pipe = fstat(STDOUT_FILENO, &out_st) == 0 && S_ISFIFO(out_st.st_mode);
+  if (pipe_size > 0 &&
+      ((in_pipe && fcntl(STDIN_FILENO, F_SETPIPE_SZ, (int)pipe_size) < 0) ||
+       (out_pipe && fcntl(STDOUT_FILENO, F_SETPIPE_SZ, (int)pipe_size) < 0))) {
+    // Unprivileged users are capped at /proc/sys/fs/pipe-max-size
+    fprintf(stderr, "%stee: cannot resize pipe to %zu bytes: %s%s\n",
+            COLOR_YELLOW, pipe_size, strerror(errno), COLOR_RESET);
+  }
+
+  int result = -1;
+  if (in_pipe) {
+    int in_size = fcntl(STDIN_FILENO, F_GETPIPE_SZ);
+    int ok = 1;
+    for (int j = 0; j < count; j++) {
+      outs[j].stage[0] = outs[j].stage[1] = -1;
+      if (j < count - 1) {
+        ok = ok && pipe2(outs[j].stage, O_CLOEXEC) == 0;
+        if (ok && in_size > 0 &&
+            fcntl(outs[j].stage[1], F_SETPIPE_SZ, in_size) < in_size) {
+          ok = 0; // a smaller staging pipe would cut rounds short
+        }
+      }
+    }
+    if (ok) {
+      result = tee_splice(outs, count, buf);
+    }
+    for (int j = 0; j < count - 1; j++) {
+      if (outs[j].stage[0] >= 0) {
+        close(outs[j].stage[0]);
+        close(outs[j].stage[1]);
+      }
+    }
+  }
+  if (result < 0) {
+    result = tee_copy(outs, count, buf);
+  }
+
+  for (int j = 0; j < count; j++) {
+    if (outs[j].fd != STDOUT_FILENO && close(outs[j].fd) < 0) {
+      tee_fail(&outs[j], errno);
+    }
+    status |= outs[j].failed;
+  }
+  if (sigint_received) {
+    sigint_received = 0;
+    fprintf(stderr, "\nInterrupted\n");
+    status = 130;
+  } else if (result > 0) {
+    fprintf(stderr, "%stee: read error: %s%s\n", COLOR_RED, strerror(errno),
+            COLOR_RESET);
+    status = 1;
+  }
+  free(outs);
+  free(buf);
+  return status;
+}
+
+// ============================================================================
+// METADATA CACHE (opt-in directory listings for ls, tree, du, completion)
+// ============================================================================
+
+// Listings are keyed by the directory's device and inode, so every path to
+// a directory shares one entry. Each cached directory has an inotify watch
+// and any event drops it; pending events are drained before every lookup,
+// so changes made by the previous command are always seen. The directory's
+// mtime and ctime are compared as well, for file systems whose remote
+// changes inotify does not report.
+#define DIRCACHE_BUCKETS 4096
+#define DIRCACHE_DEFAULT_CAP (64 << 20)
+#define DIRCACHE_EVENTS                                                       \
+  (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB |          \
+   IN_MODIFY | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR | IN_EXCL_UNLINK)
+
+int dircache_fd = -1;  // inotify instance, -1 while the cache is off
+pid_t dircache_pid;    // forked stages must not consume the shell's events
+size_t dircache_cap = DIRCACHE_DEFAULT_CAP;
+size_t dircache_bytes = 0;
+int dircache_count = 0;
+DirListing *dircache_by_inode[DIRCACHE_BUCKETS];
+DirListing *dircache_by_wd[DIRCACHE_BUCKETS];
+DirListing *dircache_lru_head = NULL; // most recently used
+DirListing *dircache_lru_tail = NULL;
+unsigned long long dircache_hits, dircache_misses, dircache_drops,
+    dircache_evictions;
+
+int dircache_enabled(void) {
+  return dircache_fd >= 0 && getpid() == dircache_pid;
+}
+
+unsigned int dircache_inode_bucket(dev_t dev, ino_t ino) {
+  unsigned long long h = (unsigned long long)ino * 0x9E3779B97F4A7C15ULL ^ dev;
+  return (unsigned int)(h >> 32) % DIRCACHE_BUCKETS;
+}
+
+void dir_free(DirListing *dir) {
+  free(dir->entries);
+  free(dir->names);
+  free(dir);
+}
+
+// Read an open directory and lstat each entry (stat as well for symlinks)
+DirListing *dir_read(int fd, struct stat *dir_st) {
+  DirListing *dir = calloc(1, sizeof(DirListing));
+  if (dir == NULL) {
+    return NULL;
+  }
+  size_t len = 0;
+  int capacity = 0;
+  dir->names = read_dir_entries(fd, &len);
+  dir->dev = dir_st->st_dev;
+  dir->ino = dir_st->st_ino;
+  dir->mtime = dir_st->st_mtim;
+  dir->ctime = dir_st->st_ctim;
+  dir->wd = -1;
+
+  for (size_t off = 0; dir->names != NULL && off < len;) {
+    char *name = dir->names + off + 1;
+    off += strlen(name) + 2;
+
+    if (dir->count == capacity) {
+      capacity = capacity ? capacity * 2 : 64;
+      DirEntryInfo *grown = realloc(dir->entries, capacity * sizeof(*grown));
+      if (grown == NULL) {
+        dir_free(dir);
+        return NULL;
+      }
+      dir->entries = grown;
+    }
+    DirEntryInfo *e = &dir->entries[dir->count];
+    if (fstatat(fd, name, &e->st, AT_SYMLINK_NOFOLLOW) < 0) {
+      continue; // removed since getdents
+    }
+    struct stat target;
+    e->name = name;
+    e->mode = e->st.st_mode;
+    e->size = e->st.st_size;
+    if (S_ISLNK(e->st.st_mode)) {
+      int ok = fstatat(fd, name, &target, 0) == 0;
+      e->mode = ok ? target.st_mode : 0;
+      e->size = ok ? target.st_size : e->st.st_size;
+    }
+    dir->count++;
+  }
+  dir->bytes = sizeof(DirListing) + capacity * sizeof(DirEntryInfo) + len;
+  return dir;
+}
+
+// Take dir out of the cache; it is freed now or, if someone is still
+// iterating it, at their dir_release
+void dircache_drop(DirListing *dir, int remove_watch) {
+  DirListing **link = &dircache_by_inode[dircache_inode_bucket(dir->dev,
+                                                               dir->ino)];
+  while (*link != dir) {
+    link = &(*link)->hash_next;
+  }
+  *link = dir->hash_next;
+  link = &dircache_by_wd[dir->wd % DIRCACHE_BUCKETS];
+  while (*link != dir) {
+    link = &(*link)->wd_next;
+  }
+  *link = dir->wd_next;
+
+  if (dir->lru_prev != NULL) {
+    dir->lru_prev->lru_next = dir->lru_next;
+  } else {
+    dircache_lru_head = dir->lru_next;
+  }
+  if (dir->lru_next != NULL) {
+    dir->lru_next->lru_prev = dir->lru_prev;
+  } else {
+    dircache_lru_tail = dir->lru_prev;
+  }
+
+  if (remove_watch) {
+    inotify_rm_watch(dircache_fd, dir->wd);
+  }
+  dircache_bytes -= dir->bytes;
+  dircache_count--;
+  dir->wd = -1;
+  dir->stale = 1;
+  if (dir->pins == 0) {
+    dir_free(dir);
+  }
+}
+
+void dircache_clear(void) {
+  while (dircache_lru_head != NULL) {
+    dircache_drop(dircache_lru_head, 1);
+  }
+}
+
+DirListing *dircache_find_wd(int wd) {
+  DirListing *dir = dircache_by_wd[wd % DIRCACHE_BUCKETS];
+  while (dir != NULL && dir->wd != wd) {
+    dir = dir->wd_next;
+  }
+  return dir;
+}
+
+// Drop every directory inotify has reported a change in
+void dircache_sync(void) {
+  char buf[8192] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+  while (1) {
+    ssize_t n = read(dircache_fd, buf, sizeof(buf));
+    if (n <= 0) {
+      return;
+    }
+    for (char *p = buf; p < buf + n;) {
+      struct inotify_event *ev = (struct inotify_event *)p;
+      p += sizeof(struct inotify_event) + ev->len;
+      if (ev->mask & IN_Q_OVERFLOW) {
+        dircache_clear(); // events were lost, so nothing can be trusted
+        continue;
+      }
+      DirListing *dir = dircache_find_wd(ev->wd);
+      if (dir != NULL) {
+        dircache_drops++;
+        dircache_drop(dir, !(ev->mask & IN_IGNORED));
+      }
+    }
+  }
+}
+
+void handle_dircache_inotify(int fd, void *data) {
+  (void)fd;
+  (void)data;
+  dircache_sync();
+}
+
+// Evict least recently used listings until the cache fits its cap
+void dircache_trim(void) {
+  DirListing *dir = dircache_lru_tail;
+  while (dir != NULL && dircache_bytes > dircache_cap) {
+    DirListing *prev = dir->lru_prev;
+    if (dir->pins == 0) {
+      dircache_evictions++;
+      dircache_drop(dir, 1);
+    }
+    dir = prev;
+  }
+}
+
+// Listing of path, from the cache when possible. NULL (with errno set) if
+// it cannot be read. Every listing must be handed back to dir_release.
+DirListing *dir_list(const char *path) {
+  int cached = dircache_enabled();
+  struct stat st;
+
+  if (cached) {
+    dircache_sync();
+    if (stat(path, &st) == 0 && S_ISDIR(st.st_mode)) {
+      DirListing *dir =
+          dircache_by_inode[dircache_inode_bucket(st.st_dev, st.st_ino)];
+      while (dir != NULL && (dir->dev != st.st_dev || dir->ino != st.st_ino)) {
+        dir = dir->hash_next;
+      }
+      if (dir != NULL && timespec_diff(&dir->mtime, &st.st_mtim) == 0 &&
+          timespec_diff(&dir->ctime, &st.st_ctim) == 0) {
+        if (dir != dircache_lru_head) {
+          dir->lru_prev->lru_next = dir->lru_next;
+          if (dir->lru_next != NULL) {
+            dir->lru_next->lru_prev = dir->lru_prev;
+          } else {
+            dircache_lru_tail = dir->lru_prev;
+          }
+          dir->lru_prev = NULL;
+          dir->lru_next = dircache_lru_head;
+          dircache_lru_head->lru_prev = dir;
+          dircache_lru_head = dir;
+        }
+        dircache_hits++;
+        dir->pins++;
+        return dir;
+      }
+      if (dir != NULL) {
+        dircache_drops++;
+        dircache_drop(dir, 1);
+      }
+    }
+    dircache_misses++;
+  }
+
+  int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0) {
+    return NULL;
+  }
+  // Watch before reading, so a change during the read is not missed; the
+  // /proc path pins the watch to the directory that was actually opened
+  int wd = -1;
+  if (fstat(fd, &st) < 0) {
+    int saved = errno;
+    close(fd);
+    errno = saved;
+    return NULL;
+  }
+  if (cached) {
+    char proc_path[64];
+    snprintf(proc_path, sizeof(proc_path), "/proc/self/fd/%d", fd);
+    wd = inotify_add_watch(dircache_fd, proc_path, DIRCACHE_EVENTS);
+  }
+  DirListing *dir = dir_read(fd, &st);
+  int saved = errno;
+  close(fd);
+  if (dir == NULL) {
+    errno = saved;
+    return NULL;
+  }
+  dir->pins = 1;
+  if (wd < 0) {
+    return dir; // cache off, or out of inotify watches
+  }
+
+  // A watch descriptor is per inode, so a listing of the same directory
+  // under a stale key would share it
+  DirListing *old = dircache_find_wd(wd);
+  if (old != NULL) {
+    dircache_drop(old, 0);
+  }
+  if (dir->bytes > dircache_cap) {
+    inotify_rm_watch(dircache_fd, wd);
+    return dir;
+  }
+  unsigned int bucket = dircache_inode_bucket(dir->dev, dir->ino);
+  dir->wd = wd;
+  dir->hash_next = dircache_by_inode[bucket];
+  dircache_by_inode[bucket] = dir;
+  dir->wd_next = dircache_by_wd[wd % DIRCACHE_BUCKETS];
+  dircache_by_wd[wd % DIRCACHE_BUCKETS] = dir;
+  dir->lru_next = dircache_lru_head;
+  if (dircache_lru_head != NULL) {
+    dircache_lru_head->lru_prev = dir;
+  } else {
+    dircache_lru_tail = dir;
+  }
+  dircache_lru_head = dir;
+  dircache_bytes += dir->bytes;
+  dircache_count++;
+  dircache_trim();
+  return dir;
+}
+
+void dir_release(DirListing *dir) {
+  if (--dir->pins == 0 && (dir->wd < 0 || dir->stale)) {
+    dir_free(dir);
+  }
+}
+
+// dircache [on [-m SIZE] | off | clear | status]
+int cmd_dircache(char **args) {
+  const char *usage = "dircache [on [-m SIZE] | off | clear | status]";
+  const char *action = args[1] != NULL ? args[1] : "status";
+
+  if (strcmp(action, "on") == 0) {
+    size_t cap = DIRCACHE_DEFAULT_CAP;
+    if (args[2] != NULL &&
+        (strcmp(args[2], "-m") != 0 || args[3] == NULL ||
+         sort_parse_size(args[3], &cap) < 0)) {
+      printf("%sUsage: %s%s\n", COLOR_RED, usage, COLOR_RESET);
+      return 1;
+    }
+    if (dircache_fd < 0) {
+      dircache_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+      if (dircache_fd < 0) {
+        printf("%sError: inotify: %s%s\n", COLOR_RED, strerror(errno),
+               COLOR_RESET);
+        return 1;
+      }
+      event_add(dircache_fd, handle_dircache_inotify, NULL);
+      dircache_pid = getpid();
+    }
+    dircache_cap = cap;
+    dircache_trim();
+    return 0;
+  }
+  if (strcmp(action, "off") == 0 || strcmp(action, "clear") == 0) {
+    if (dircache_fd >= 0) {
+      dircache_clear();
+    }
+    if (strcmp(action, "off") == 0 && dircache_fd >= 0) {
+      event_remove(dircache_fd);
+      close(dircache_fd);
+      dircache_fd = -1;
+    }
+    return 0;
+  }
+  if (strcmp(action, "status") != 0) {
+    printf("%sUsage: %s%s\n", COLOR_RED, usage, COLOR_RESET);
+    return 1;
+  }
+
+  if (dircache_fd < 0) {
+    printf("Directory cache: %soff%s\n", COLOR_YELLOW, COLOR_RESET);
+    return 0;
+  }
+  unsigned long long lookups = dircache_hits + dircache_misses;
+  printf("Directory cache: %son%s\n", COLOR_GREEN, COLOR_RESET);
+  printf("  Directories: %d (%.1f of %.1f MB)\n", dircache_count,
+         dircache_bytes / 1048576.0, dircache_cap / 1048576.0);
+  printf("  Lookups:     %llu (%llu hits, %.0f%%)\n", lookups, dircache_hits,
+         lookups ? 100.0 * dircache_hits / lookups : 0.0);
+  printf("  Dropped:     %llu changed, %llu evicted\n", dircache_drops,
+         dircache_evictions);
+  return 0;
+}
+
+// ---- du ----------------------------------------------------------------------
+
+typedef struct {
+  dev_t dev;
+  ino_t ino; // 0 = free slot
+} DuInode;
+
+typedef struct {
+  int summary;
+  int human;
+  int status;
+  DuInode *seen; // inodes with several links, counted the first time only
+  size_t seen_count;
+  size_t seen_capacity;
+} DuState;
+
+// Has this inode been counted already? Records it if not.
+int du_seen(DuState *du, struct stat *st) {
+  if (du->seen_count * 2 >= du->seen_capacity) {
+    size_t capacity = du->seen_capacity ? du->seen_capacity * 2 : 1024;
+    DuInode *grown = calloc(capacity, sizeof(DuInode));
+    if (grown == NULL) {
+      return 0;
+    }
+    DuInode *old = du->seen;
+    size_t old_capacity = du->seen_capacity;
+    du->seen = grown;
+    du->seen_capacity = capacity;
+    du->seen_count = 0;
+    for (size_t i = 0; i < old_capacity; i++) {
+      if (old[i].ino != 0) {
+        struct stat moved = {0};
+        moved.st_dev = old[i].dev;
+        moved.st_ino = old[i].ino;
+        du_seen(du, &moved);
+      }
+    }
+    free(old);
+  }
+  // Full-width hash: the table outgrows any fixed bucket count
+  uint64_t h = ((uint64_t)st->st_ino * 0x9E3779B97F4A7C15ULL) ^
+               (uint64_t)st->st_dev;
+  size_t mask = du->seen_capacity - 1;
+  size_t i = (size_t)(h ^ (h >> 32)) & mask;
+  while (du->seen[i].ino != 0) {
+    if (du->seen[i].ino == st->st_ino && du->seen[i].dev == st->st_dev) {
+      return 1;
+    }
+    i = (i + 1) & mask;
+  }
+  du->seen[i].dev = st->st_dev;
+  du->seen[i].ino = st->st_ino;
+  du->seen_count++;
+  return 0;
+}
+
+// Round up, as du -h does, so a size is never understated
+double du_round_up(double value) {
+  double whole = (double)(unsigned long long)value;
+  return whole < value ? whole + 1 : whole;
+}
+
+void du_print(DuState *du, unsigned long long bytes, const char *path) {
+  if (!du->human) {
+    printf("%llu\t%s\n", (bytes + 1023) / 1024, path);
+    return;
+  }
+  const char *units = "KMGTPE";
+  double value = bytes;
+  int unit = -1;
+  while (value >= 1024 && unit < 5) {
+    value /= 1024;
+    unit++;
+  }
+  if (unit < 0) {
+    printf("%llu\t%s\n", bytes, path);
+  } else if (du_round_up(value * 10) < 100) {
+    printf("%.1f%c\t%s\n", du_round_up(value * 10) / 10, units[unit], path);
+  } else {
+    printf("%.0f%c\t%s\n", du_round_up(value), units[unit], path);
+  }
+}
+
+// Disk usage of the directory at path (a buffer of PATH_MAX bytes that is
+// extended in place), whose own lstat is st. Prints each directory after
+// its contents, as du does.
+unsigned long long du_walk(DuState *du, char *path, size_t len,
+                           struct stat *st) {
+  unsigned long long total = (unsigned long long)st->st_blocks * 512;
+  DirListing *dir = dir_list(path);
+
+  if (dir == NULL) {
+    printf("%sdu: cannot read directory '%s': %s%s\n", COLOR_RED, path,
+           strerror(errno), COLOR_RESET);
+    du->status = 1;
+  }
+  for (int i = 0; dir != NULL && i < dir->count && !sigint_received; i++) {
+    DirEntryInfo *e = &dir->entries[i];
+    if (e->st.st_nlink > 1 && !S_ISDIR(e->st.st_mode) && du_seen(du, &e->st)) {
+      continue;
+    }
+    if (!S_ISDIR(e->st.st_mode)) {
+      total += (unsigned long long)e->st.st_blocks * 512;
+      continue;
+    }
+    size_t name_len = strlen(e->name);
+    if (len + name_len + 2 > PATH_MAX) {
+      continue;
+    }
+    size_t sub_len = len;
+    if (path[len - 1] != '/') {
+      path[sub_len++] = '/';
+    }
+    memcpy(path + sub_len, e->name, name_len + 1);
+    total += du_walk(du, path, sub_len + name_len, &e->st);
+    path[len] = '\0';
+  }
+  if (dir != NULL) {
+    dir_release(dir);
+  }
+  if (!du->summary) {
+    du_print(du, total, path);
+  }
+  return total;
+}
+
+// du [-s] [-h] [path...] - disk usage in 1K blocks; symlinks are not
+// followed and hard-linked files are counted once
+int cmd_du(char **args) {
+  DuState du = {0};
+  int i = 1;
+
+  for (; args[i] != NULL && args[i][0] == '-' && args[i][1] != '\0'; i++) {
+    for (char *opt = args[i] + 1; *opt != '\0'; opt++) {
+      if (*opt == 's') {
+        du.summary = 1;
+      } else if (*opt == 'h') {
+        du.human = 1;
+      } else {
+        printf("%sUsage: du [-s] [-h] [path...]%s\n", COLOR_RED, COLOR_RESET);
+        return 1;
+      }
+    }
+  }
+  char *dot[] = {".", NULL};
+  char **paths = args[i] != NULL ? args + i : dot;
+
+  sigint_received = 0;
+  for (int p = 0; paths[p] != NULL && !sigint_received; p++) {
+    char path[PATH_MAX];
+    struct stat st;
+    size_t len = strlen(paths[p]);
+
+    if (len >= sizeof(path) || lstat(paths[p], &st) < 0) {
+      printf("%sdu: cannot access '%s': %s%s\n", COLOR_RED, paths[p],
+             len >= sizeof(path) ? strerror(ENAMETOOLONG) : strerror(errno),
+             COLOR_RESET);
+      du.status = 1;
+      continue;
+    }
+    memcpy(path, paths[p], len + 1);
+    if (!S_ISDIR(st.st_mode)) {
+      if (st.st_nlink < 2 || !du_seen(&du, &st)) {
+        du_print(&du, (unsigned long long)st.st_blocks * 512, path);
+      }
+      continue;
+    }
+    unsigned long long total = du_walk(&du, path, len, &st);
+    if (du.summary) {
+      du_print(&du, total, path);
+    }
+  }
+  free(du.seen);
+  if (sigint_received) {
+    sigint_received = 0;
+    printf("\nInterrupted\n");
+    return 130;
+  }
+  return du.status;
+}
+
+// ============================================================================
+// LOCATE (persistent path index with trigram search)
+// ============================================================================
+
+// One index per root directory, in $XDG_CACHE_HOME/myshell/locate/. After
+// the header and the root path come:
+//   paths     each directory's children, sorted by name, for the
+//             directories in depth-first order. An entry is
+//             [varint shared prefix][varint suffix_len << 1 | is_dir]
+//             [suffix] against the previous entry, restarting every
+//             LOCATE_BLOCK entries.
+//   blocks    file offset of each restart
+//   dirs      one LocateDir per directory, in visit order, so updateindex
+//             can reuse the children of directories whose mtime is unchanged
+//   trigrams  sorted (trigram, block count, offset) table; each list of
+//             blocks whose paths contain the trigram (ASCII lowercased) is
+//             delta-encoded as varints in postings
+#define LOCATE_MAGIC "MSHLOC01"
+#define LOCATE_BLOCK 64
+
+typedef struct {
+  char magic[8];
+  uint64_t root_len;
+  uint64_t path_count;
+  uint64_t block_count;
+  uint64_t dir_count;
+  uint64_t trigram_count;
+  uint64_t paths_offset;
+  uint64_t blocks_offset;
+  uint64_t dirs_offset;
+  uint64_t trigrams_offset;
+  uint64_t postings_offset;
+  uint64_t file_size;
+} LocateHeader;
+
+typedef struct {
+  uint64_t path_id; // the directory's own entry, UINT64_MAX for the root
+  uint64_t first_child;
+  uint64_t child_count;
+  uint64_t ino;
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+} LocateDir;
+
+typedef struct {
+  uint32_t trigram;
+  uint32_t count;
+  uint64_t offset; // from postings_offset
+} LocateTrigram;
+
+typedef struct {
+  unsigned char *data;
+  size_t size;
+  const LocateHeader *header;
+  char root[PATH_MAX];
+  const uint64_t *blocks;
+  const LocateDir *dirs;
+  const LocateTrigram *trigrams;
+} LocateIndex;
+
+// Sequential decoder over the front-coded paths
+typedef struct {
+  const LocateIndex *index;
+  uint64_t id; // next entry to decode
+  uint64_t pos;
+  char path[PATH_MAX];
+  size_t len;
+  int is_dir;
+} LocateCursor;
+
+// Building state for updateindex
+typedef struct {
+  uint32_t trigram; // 0 = free slot (paths hold no NUL bytes)
+  uint32_t count;
+  uint64_t last_block; // + 1, so 0 means none yet
+  unsigned char *postings;
+  size_t len;
+  size_t capacity;
+} LocateGram;
+
+typedef struct {
+  FILE *out;
+  uint64_t written;
+  char prefix[PATH_MAX]; // root, without a trailing slash
+  size_t prefix_len;
+  char prev[PATH_MAX];
+  size_t prev_len;
+  uint64_t path_count;
+  uint64_t *blocks;
+  size_t block_capacity;
+  uint64_t block_count;
+  LocateDir *dirs;
+  uint64_t dir_count;
+  size_t dir_capacity;
+  LocateGram *grams;
+  size_t gram_count;
+  size_t gram_capacity;
+  // The previous index, merged with the walk (both are in path order)
+  LocateIndex *old;
+  uint64_t old_dir;
+  LocateCursor old_dirs;
+  LocateCursor old_children;
+  uint64_t reused;
+  int failed;
+} LocateBuilder;
+
+// Order in which the walk visits directories: bytewise, but '/' sorts
+// before every other byte, so a directory's subtree comes before its
+// next sibling
+int locate_path_cmp(const char *a, const char *b) {
+  for (;; a++, b++) {
+    int x = *a == '/' ? 1 : *a == '\0' ? 0 : (unsigned char)*a + 1;
+    int y = *b == '/' ? 1 : *b == '\0' ? 0 : (unsigned char)*b + 1;
+    if (x != y || x == 0) {
+      return x - y;
+    }
+  }
+}
+
+int locate_index_path(const char *root, char *path, size_t size, int create) {
+  char dir[MAX_LINE];
+  uint64_t hash = 14695981039346656037ULL;
+  if (cache_subdir("locate", dir, sizeof(dir), create) < 0) {
+    return -1;
+  }
+  for (const char *p = root; *p != '\0'; p++) {
+    hash = (hash ^ (unsigned char)*p) * 1099511628211ULL;
+  }
+  snprintf(path, size, "%s/%016llx.db", dir, (unsigned long long)hash);
+  return 0;
+}
+
+// Map an index and check that every section lies inside the file
+int locate_open(const char *path, LocateIndex *index) {
+  struct stat st;
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+  memset(index, 0, sizeof(*index));
+  if (fd < 0) {
+    return -1;
+  }
+  if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(LocateHeader)) {
+    close(fd);
+    return -1;
+  }
+  void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    return -1;
+  }
+
+  const LocateHeader *h = data;
+  uint64_t size = st.st_size;
+  int ok =
+      memcmp(h->magic, LOCATE_MAGIC, 8) == 0 && h->file_size == size &&
+      h->root_len < PATH_MAX &&
+      sizeof(LocateHeader) + h->root_len <= h->paths_offset &&
+      h->paths_offset <= h->blocks_offset &&
+      h->block_count == (h->path_count + LOCATE_BLOCK - 1) / LOCATE_BLOCK &&
+      h->block_count <= (size - h->blocks_offset) / sizeof(uint64_t) &&
+      h->blocks_offset % 8 == 0 && h->dirs_offset % 8 == 0 &&
+      h->trigrams_offset % 8 == 0 &&
+      h->blocks_offset + h->block_count * sizeof(uint64_t) <= h->dirs_offset &&
+      h->dirs_offset <= size &&
+      h->dir_count <= (size - h->dirs_offset) / sizeof(LocateDir) &&
+      h->dirs_offset + h->dir_count * sizeof(LocateDir) <= h->trigrams_offset &&
+      h->trigrams_offset <= size &&
+      h->trigram_count <= (size - h->trigrams_offset) / sizeof(LocateTrigram) &&
+      h->trigrams_offset + h->trigram_count * sizeof(LocateTrigram) <=
+          h->postings_offset &&
+      h->postings_offset <= size;
+  if (!ok) {
+    munmap(data, st.st_size);
+    return -1;
+  }
+  index->data = data;
+  index->size = st.st_size;
+  index->header = h;
+  memcpy(index->root, index->data + sizeof(LocateHeader), h->root_len);
+  index->root[h->root_len] = '\0';
+  index->blocks = (const uint64_t *)(index->data + h->blocks_offset);
+  index->dirs = (const LocateDir *)(index->data + h->dirs_offset);
+  index->trigrams = (const LocateTrigram *)(index->data + h->trigrams_offset);
+  return 0;
+}
+
+void locate_close(LocateIndex *index) {
+  if (index->data != NULL) {
+    munmap(index->data, index->size);
+    index->data = NULL;
+  }
+}
+
+// Read a varint at *pos, staying below end; returns 0 if it runs over
+int locate_varint(const unsigned char *data, uint64_t *pos, uint64_t end,
+                  uint64_t *value) {
+  *value = 0;
+  for (int shift = 0; shift < 64 && *pos < end; shift += 7) {
+    unsigned char byte = data[(*pos)++];
+    *value |= (uint64_t)(byte & 0x7f) << shift;
+    if (!(byte & 0x80)) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Decode the next entry; 0 at the end, -1 if the index is corrupt
+int locate_cursor_next(LocateCursor *c) {
+  const LocateIndex *index = c->index;
+  const LocateHeader *h = index->header;
+  uint64_t shared, tag;
+
+  if (c->id >= h->path_count) {
+    return 0;
+  }
+  if (c->id % LOCATE_BLOCK == 0) {
+    c->pos = index->blocks[c->id / LOCATE_BLOCK];
+    c->len = 0;
+  }
+  if (c->pos < h->paths_offset ||
+      !locate_varint(index->data, &c->pos, h->blocks_offset, &shared) ||
+      !locate_varint(index->data, &c->pos, h->blocks_offset, &tag) ||
+      shared > c->len || shared + (tag >> 1) >= PATH_MAX ||
+      (tag >> 1) > h->blocks_offset - c->pos) {
+    return -1;
+  }
+  memcpy(c->path + shared, index->data + c->pos, tag >> 1);
+  c->len = shared + (tag >> 1);
+  c->path[c->len] = '\0';
+  c->is_dir = tag & 1;
+  c->pos += tag >> 1;
+  c->id++;
+  return 1;
+}
+
+// Position the cursor on entry id (decoded into c->path)
+int locate_cursor_seek(LocateCursor *c, uint64_t id) {
+  if (id < c->id || id / LOCATE_BLOCK != c->id / LOCATE_BLOCK) {
+    c->id = id / LOCATE_BLOCK * LOCATE_BLOCK;
+  }
+  while (c->id <= id) {
+    if (locate_cursor_next(c) != 1) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+void locate_put_varint(unsigned char *buf, size_t *len, uint64_t value) {
+  while (value >= 0x80) {
+    buf[(*len)++] = (unsigned char)(value | 0x80);
+    value >>= 7;
+  }
+  buf[(*len)++] = (unsigned char)value;
+}
+
+uint32_t locate_trigram(const char *p) {
+  return (uint32_t)tolower((unsigned char)p[0]) << 16 |
+         (uint32_t)tolower((unsigned char)p[1]) << 8 |
+         (uint32_t)tolower((unsigned char)p[2]);
+}
+
+LocateGram *locate_gram_slot(LocateGram *grams, size_t capacity,
+                             uint32_t trigram) {
+  size_t i = (trigram * 2654435761u) & (capacity - 1);
+  while (grams[i].trigram != 0 && grams[i].trigram != trigram) {
+    i = (i + 1) & (capacity - 1);
+  }
+  return &grams[i];
+}
+
+// Note that the current block contains trigram
+void locate_add_gram(LocateBuilder *b, uint32_t trigram) {
+  if (b->gram_count * 2 >= b->gram_capacity) {
+    size_t capacity = b->gram_capacity ? b->gram_capacity * 2 : 65536;
+    LocateGram *grown = calloc(capacity, sizeof(LocateGram));
+    if (grown == NULL) {
+      b->failed = 1;
+      return;
+    }
+    for (size_t i = 0; i < b->gram_capacity; i++) {
+      if (b->grams[i].trigram != 0) {
+        *locate_gram_slot(grown, capacity, b->grams[i].trigram) = b->grams[i];
+      }
+    }
+    free(b->grams);
+    b->grams = grown;
+    b->gram_capacity = capacity;
+  }
+
+  uint64_t block = b->path_count / LOCATE_BLOCK;
+  LocateGram *g = locate_gram_slot(b->grams, b->gram_capacity, trigram);
+  if (g->trigram == 0) {
+    g->trigram = trigram;
+    b->gram_count++;
+  } else if (g->last_block == block + 1) {
+    return;
+  }
+  if (g->len + 10 > g->capacity) {
+    size_t capacity = g->capacity ? g->capacity * 2 : 16;
+    unsigned char *grown = realloc(g->postings, capacity);
+    if (grown == NULL) {
+      b->failed = 1;
+      return;
+    }
+    g->postings = grown;
+    g->capacity = capacity;
+  }
+  locate_put_varint(g->postings, &g->len,
+                    g->last_block ? block - (g->last_block - 1) : block);
+  g->last_block = block + 1;
+  g->count++;
+}
+
+void locate_write(LocateBuilder *b, const void *data, size_t len) {
+  if (len > 0 && fwrite(data, 1, len, b->out) != len) {
+    b->failed = 1;
+  }
+  b->written += len;
+}
+
+// Append one path (relative to the root) to the index
+void locate_emit(LocateBuilder *b, const char *rel, size_t len, int is_dir) {
+  if (b->path_count % LOCATE_BLOCK == 0) {
+    if (b->block_count == b->block_capacity) {
+      size_t capacity = b->block_capacity ? b->block_capacity * 2 : 1024;
+      uint64_t *grown = realloc(b->blocks, capacity * sizeof(uint64_t));
+      if (grown == NULL) {
+        b->failed = 1;
+        return;
+      }
+      b->blocks = grown;
+      b->block_capacity = capacity;
+    }
+    b->blocks[b->block_count++] = b->written;
+    b->prev_len = 0;
+  }
+
+  size_t shared = 0;
+  while (shared < len && shared < b->prev_len && rel[shared] == b->prev[shared]) {
+    shared++;
+  }
+  unsigned char head[20];
+  size_t head_len = 0;
+  locate_put_varint(head, &head_len, shared);
+  locate_put_varint(head, &head_len, (uint64_t)(len - shared) << 1 | is_dir);
+  locate_write(b, head, head_len);
+  locate_write(b, rel + shared, len - shared);
+
+  // Trigrams of the full path. Those inside the prefix shared with the
+  // previous entry of this block were added for it already.
+  char full[PATH_MAX * 2];
+  size_t full_len = b->prefix_len + 1 + len;
+  memcpy(full, b->prefix, b->prefix_len);
+  full[b->prefix_len] = '/';
+  memcpy(full + b->prefix_len + 1, rel, len);
+  size_t start = b->prev_len > 0 ? b->prefix_len + 1 + shared : 0;
+  start = start >= 2 ? start - 2 : 0;
+  for (size_t i = start; i + 3 <= full_len; i++) {
+    locate_add_gram(b, locate_trigram(full + i));
+  }
+
+  memcpy(b->prev, rel, len);
+  b->prev_len = len;
+  b->path_count++;
+}
+
+// The previous index's record for directory rel, if it has one
+const LocateDir *locate_old_dir(LocateBuilder *b, const char *rel) {
+  while (b->old != NULL && b->old_dir < b->old->header->dir_count) {
+    const LocateDir *dir = &b->old->dirs[b->old_dir];
+    const char *path = "";
+    if (dir->path_id != UINT64_MAX) {
+      if (locate_cursor_seek(&b->old_dirs, dir->path_id) < 0) {
+        b->old = NULL; // corrupt: rebuild the rest from scratch
+        return NULL;
+      }
+      path = b->old_dirs.path;
+    }
+    int cmp = locate_path_cmp(path, rel);
+    if (cmp > 0) {
+      return NULL;
+    }
+    b->old_dir++;
+    if (cmp == 0) {
+      return dir;
+    }
+  }
+  return NULL;
+}
+
+typedef struct {
+  char *name;
+  int is_dir;
+} LocateChild;
+
+// Kernel filesystems whose contents are not files anyone searches for
+// (updatedb's PRUNEFS); checked only where the device changes
+int locate_pruned_fs(int fd) {
+  struct statfs fs;
+  if (fstatfs(fd, &fs) < 0) {
+    return 0;
+  }
+  switch ((unsigned long)fs.f_type) {
+  case PROC_SUPER_MAGIC:
+  case SYSFS_MAGIC:
+  case DEVPTS_SUPER_MAGIC:
+  case CGROUP_SUPER_MAGIC:
+  case CGROUP2_SUPER_MAGIC:
+  case DEBUGFS_MAGIC:
+  case TRACEFS_MAGIC:
+  case SECURITYFS_MAGIC:
+  case PSTOREFS_MAGIC:
+  case BPF_FS_MAGIC:
+    return 1;
+  }
+  return 0;
+}
+
+int locate_child_cmp(const void *a, const void *b) {
+  return strcmp(((const LocateChild *)a)->name, ((const LocateChild *)b)->name);
+}
+
+// Index the directory open as fd: rel is its path from the root (len bytes,
+// empty for the root itself), self_id its own entry and parent_dev the
+// device it was reached from. An explicitly indexed root is never pruned.
+void locate_walk(LocateBuilder *b, int fd, char *rel, size_t len,
+                 uint64_t self_id, dev_t parent_dev) {
+  struct stat st;
+  LocateChild *children = NULL;
+  char *names = NULL;
+  size_t count = 0;
+
+  if (fstat(fd, &st) < 0 || b->failed || sigint_received ||
+      (self_id != UINT64_MAX && st.st_dev != parent_dev &&
+       locate_pruned_fs(fd))) {
+    return;
+  }
+
+  const LocateDir *old = locate_old_dir(b, rel);
+  if (old != NULL && old->ino == (uint64_t)st.st_ino &&
+      old->mtime_sec == (int64_t)st.st_mtim.tv_sec &&
+      old->mtime_nsec == (int64_t)st.st_mtim.tv_nsec &&
+      old->first_child + old->child_count <= b->old->header->path_count) {
+    // Unchanged since the last update: take the names from the old index
+    size_t used = 0, capacity = 0;
+    children = malloc((old->child_count + 1) * sizeof(LocateChild));
+    for (uint64_t i = 0; children != NULL && i < old->child_count; i++) {
+      if (locate_cursor_seek(&b->old_children, old->first_child + i) < 0) {
+        break;
+      }
+      const char *name = b->old_children.path + (len > 0 ? len + 1 : 0);
+      size_t name_len = strlen(name) + 1;
+      if (used + name_len > capacity) {
+        capacity = (capacity + name_len) * 2;
+        char *grown = realloc(names, capacity);
+        if (grown == NULL) {
+          break;
+        }
+        names = grown;
+      }
+      memcpy(names + used, name, name_len);
+      children[count].name = (char *)(uintptr_t)used;
+      children[count++].is_dir = b->old_children.is_dir;
+      used += name_len;
+    }
+    if (children != NULL && count == old->child_count) {
+      for (size_t i = 0; i < count; i++) {
+        children[i].name = names + (uintptr_t)children[i].name;
+      }
+      b->reused++;
+    } else {
+      free(children);
+      free(names);
+      children = NULL;
+      names = NULL;
+      count = 0;
+      old = NULL;
+    }
+  } else {
+    old = NULL;
+  }
+
+  if (old == NULL) {
+    size_t names_len = 0;
+    names = read_dir_entries(fd, &names_len);
+    size_t capacity = 0;
+    for (size_t off = 0; names != NULL && off < names_len;) {
+      unsigned char type = names[off];
+      char *name = names + off + 1;
+      struct stat entry_st;
+      off += strlen(name) + 2;
+      if (count == capacity) {
+        capacity = capacity ? capacity * 2 : 64;
+        LocateChild *grown = realloc(children, capacity * sizeof(LocateChild));
+        if (grown == NULL) {
+          break;
+        }
+        children = grown;
+      }
+      if (type == DT_UNKNOWN &&
+          fstatat(fd, name, &entry_st, AT_SYMLINK_NOFOLLOW) == 0) {
+        type = S_ISDIR(entry_st.st_mode) ? DT_DIR : DT_REG;
+      }
+      children[count].name = name;
+      children[count++].is_dir = type == DT_DIR;
+    }
+    if (count > 1) {
+      qsort(children, count, sizeof(LocateChild), locate_child_cmp);
+    }
+  }
+
+  // Record the directory, then its children, then descend
+  if (b->dir_count == b->dir_capacity) {
+    size_t capacity = b->dir_capacity ? b->dir_capacity * 2 : 1024;
+    LocateDir *grown = realloc(b->dirs, capacity * sizeof(LocateDir));
+    if (grown == NULL) {
+      b->failed = 1;
+      free(children);
+      free(names);
+      return;
+    }
+    b->dirs = grown;
+    b->dir_capacity = capacity;
+  }
+  LocateDir *dir = &b->dirs[b->dir_count++];
+  dir->path_id = self_id;
+  dir->first_child = b->path_count;
+  dir->child_count = count;
+  dir->ino = st.st_ino;
+  dir->mtime_sec = st.st_mtim.tv_sec;
+  dir->mtime_nsec = st.st_mtim.tv_nsec;
+  uint64_t first_child = b->path_count;
+
+  size_t base = len > 0 ? len + 1 : 0;
+  if (len > 0) {
+    rel[len] = '/';
+  }
+  for (size_t i = 0; i < count; i++) {
+    size_t name_len = strlen(children[i].name);
+    if (base + name_len >= PATH_MAX) {
+      children[i].is_dir = 0; // still counted as a child, but not descended
+      name_len = 0;
+    }
+    memcpy(rel + base, children[i].name, name_len);
+    locate_emit(b, rel, base + name_len, children[i].is_dir);
+  }
+  for (size_t i = 0; i < count && !b->failed && !sigint_received; i++) {
+    if (!children[i].is_dir) {
+      continue;
+    }
+    size_t name_len = strlen(children[i].name);
+    int sub = openat(fd, children[i].name,
+                     O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (sub < 0) {
+      continue; // unreadable: listed, but its contents are not
+    }
+    memcpy(rel + base, children[i].name, name_len + 1);
+    locate_walk(b, sub, rel, base + name_len, first_child + i, st.st_dev);
+    close(sub);
+  }
+  rel[len] = '\0';
+  free(children);
+  free(names);
+}
+
+int locate_gram_cmp(const void *a, const void *b) {
+  uint32_t x = ((const LocateTrigram *)a)->trigram;
+  uint32_t y = ((const LocateTrigram *)b)->trigram;
+  return x < y ? -1 : x > y;
+}
+
+void locate_pad(LocateBuilder *b) {
+  static const char zeros[8] = {0};
+  locate_write(b, zeros, (8 - b->written % 8) % 8);
+}
+
+// Build (or refresh) the index for root, reusing the previous one
+int locate_update(const char *root) {
+  char index_path[MAX_LINE + 32], tmp_path[MAX_LINE + 48];
+  struct timespec start, end;
+  LocateBuilder b;
+  LocateIndex old;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  if (locate_index_path(root, index_path, sizeof(index_path), 1) < 0) {
+    printf("%sError: No cache directory (set HOME or XDG_CACHE_HOME)%s\n",
+           COLOR_RED, COLOR_RESET);
+    return 1;
+  }
+  int fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0) {
+    printf("%sError: Cannot open directory '%s'%s\n", COLOR_RED, root,
+           COLOR_RESET);
+    return 1;
+  }
+  snprintf(tmp_path, sizeof(tmp_path), "%s.%d.tmp", index_path, (int)getpid());
+
+  memset(&b, 0, sizeof(b));
+  b.out = fopen(tmp_path, "we");
+  if (b.out == NULL) {
+    printf("%sError: Cannot create '%s': %s%s\n", COLOR_RED, tmp_path,
+           strerror(errno), COLOR_RESET);
+    close(fd);
+    return 1;
+  }
+  setvbuf(b.out, NULL, _IOFBF, 1 << 20);
+  b.prefix_len = strcmp(root, "/") == 0 ? 0 : strlen(root);
+  memcpy(b.prefix, root, b.prefix_len);
+  if (locate_open(index_path, &old) == 0 && strcmp(old.root, root) == 0) {
+    b.old = &old;
+    b.old_dirs.index = &old;
+    b.old_children.index = &old;
+  }
+
+  LocateHeader header;
+  memset(&header, 0, sizeof(header));
+  header.root_len = strlen(root);
+  locate_write(&b, &header, sizeof(header));
+  locate_write(&b, root, header.root_len);
+  header.paths_offset = b.written;
+
+  char rel[PATH_MAX] = "";
+  sigint_received = 0;
+  locate_walk(&b, fd, rel, 0, UINT64_MAX, 0);
+  close(fd);
+
+  // Trigram table (sorted) and the block lists it points into
+  LocateTrigram *table = calloc(b.gram_count + 1, sizeof(LocateTrigram));
+  uint64_t postings_len = 0;
+  size_t n = 0;
+  for (size_t i = 0; table != NULL && i < b.gram_capacity; i++) {
+    if (b.grams[i].trigram != 0) {
+      table[n].trigram = b.grams[i].trigram;
+      table[n].count = b.grams[i].count;
+      table[n++].offset = i; // slot, replaced by the offset below
+    }
+  }
+  if (table != NULL && n > 1) {
+    qsort(table, n, sizeof(LocateTrigram), locate_gram_cmp);
+  }
+
+  locate_pad(&b);
+  header.blocks_offset = b.written;
+  locate_write(&b, b.blocks, b.block_count * sizeof(uint64_t));
+  header.dirs_offset = b.written;
+  locate_write(&b, b.dirs, b.dir_count * sizeof(LocateDir));
+  header.trigrams_offset = b.written;
+  for (size_t i = 0; table != NULL && i < n; i++) {
+    size_t slot = table[i].offset;
+    table[i].offset = postings_len;
+    postings_len += b.grams[slot].len;
+  }
+  locate_write(&b, table, n * sizeof(LocateTrigram));
+  header.postings_offset = b.written;
+  for (size_t i = 0; table != NULL && i < n; i++) {
+    LocateGram *g = locate_gram_slot(b.grams, b.gram_capacity,
+                                     table[i].trigram);
+    locate_write(&b, g->postings, g->len);
+  }
+
+  memcpy(header.magic, LOCATE_MAGIC, 8);
+  header.path_count = b.path_count;
+  header.block_count = b.block_count;
+  header.dir_count = b.dir_count;
+  header.trigram_count = n;
+  header.file_size = b.written;
+  int failed = b.failed || table == NULL || sigint_received ||
+               fseek(b.out, 0, SEEK_SET) < 0 ||
+               fwrite(&header, sizeof(header), 1, b.out) != 1;
+  failed |= fclose(b.out) != 0;
+  if (!failed && rename(tmp_path, index_path) < 0) {
+    failed = 1;
+  }
+  if (failed) {
+    unlink(tmp_path);
+  }
+
+  for (size_t i = 0; i < b.gram_capacity; i++) {
+    free(b.grams[i].postings);
+  }
+  free(b.grams);
+  free(b.blocks);
+  free(b.dirs);
+  free(table);
+  if (b.old != NULL || old.data != NULL) {
+    locate_close(&old);
+  }
+
+  if (sigint_received) {
+    sigint_received = 0;
+    printf("\nInterrupted (index left unchanged)\n");
+    return 130;
+  }
+  if (failed) {
+    printf("%sError: Cannot write index for '%s'%s\n", COLOR_RED, root,
+           COLOR_RESET);
+    return 1;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  printf("%s%s%s: %llu paths, %llu directories (%llu unchanged), %.1f MB "
+         "index in %.2fs\n",
+         COLOR_CYAN, root, COLOR_RESET, (unsigned long long)b.path_count,
+         (unsigned long long)b.dir_count, (unsigned long long)b.reused,
+         b.written / 1048576.0, timespec_diff(&start, &end));
+  return 0;
+}
+
+// updateindex [DIR...] - index DIR, or refresh every existing index
+int cmd_updateindex(char **args) {
+  char resolved[PATH_MAX];
+  int status = 0;
+
+  if (args[1] != NULL) {
+    for (int i = 1; args[i] != NULL; i++) {
+      if (realpath(args[i], resolved) == NULL) {
+        printf("%sError: Cannot open directory '%s'%s\n", COLOR_RED, args[i],
+               COLOR_RESET);
+        status = 1;
+        continue;
+      }
+      status |= locate_update(resolved);
+    }
+    return status;
+  }
+
+  char dir[MAX_LINE];
+  DIR *d = cache_subdir("locate", dir, sizeof(dir), 0) == 0 ? opendir(dir)
+                                                            : NULL;
+  struct dirent *entry;
+  int found = 0;
+  while (d != NULL && (entry = readdir(d)) != NULL) {
+    char path[MAX_LINE + 300];
+    LocateIndex index;
+    size_t len = strlen(entry->d_name);
+    if (len < 3 || strcmp(entry->d_name + len - 3, ".db") != 0) {
+      continue;
+    }
+    snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+    if (locate_open(path, &index) == 0) {
+      snprintf(resolved, sizeof(resolved), "%s", index.root);
+      locate_close(&index);
+      found++;
+      status |= locate_update(resolved);
+    }
+  }
+  if (d != NULL) {
+    closedir(d);
+  }
+  if (found == 0) {
+    printf("%sUsage: updateindex DIR...  (no indexes to refresh yet)%s\n",
+           COLOR_RED, COLOR_RESET);
+    return 1;
+  }
+  return status;
+}
+
+// ---- Queries ----------------------------------------------------------------
+
+typedef struct {
+  const char *text;
+  char folded[MAX_LINE]; // lowercased for -i
+  int glob;
+} LocatePattern;
+
+typedef struct {
+  LocatePattern *patterns;
+  int count;
+  int icase;
+  int count_only;
+  long long limit; // -1 = no limit
+  unsigned long long matches;
+} LocateQuery;
+
+// Collect the trigrams of a pattern's literal runs (for a glob, the text
+// between wildcards); returns how many were found
+int locate_pattern_grams(const LocatePattern *pattern, uint32_t *grams,
+                         int max) {
+  char run[MAX_LINE];
+  size_t run_len = 0;
+  int n = 0;
+
+  for (const char *p = pattern->text;; p++) {
+    int literal = *p != '\0';
+    int class_len = 0;
+    if (pattern->glob && *p == '[') {
+      // Measure the class the way glob_match reads it; an unterminated
+      // '[' matches itself
+      glob_class_match(p, '\0', &class_len);
+    }
+    if (pattern->glob && (*p == '*' || *p == '?' || class_len > 0)) {
+      literal = 0;
+      p += class_len > 0 ? class_len - 1 : 0;
+    } else if (pattern->glob && *p == '\\' && p[1] != '\0') {
+      p++;
+    }
+    if (literal && run_len < sizeof(run)) {
+      run[run_len++] = *p;
+      continue;
+    }
+    for (size_t i = 0; i + 3 <= run_len && n < max; i++) {
+      grams[n++] = locate_trigram(run + i);
+    }
+    run_len = 0;
+    if (*p == '\0') {
+      return n;
+    }
+  }
+}
+
+const LocateTrigram *locate_find_gram(const LocateIndex *index,
+                                      uint32_t trigram) {
+  uint64_t lo = 0, hi = index->header->trigram_count;
+  while (lo < hi) {
+    uint64_t mid = lo + (hi - lo) / 2;
+    if (index->trigrams[mid].trigram < trigram) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo < index->header->trigram_count &&
+                 index->trigrams[lo].trigram == trigram
+             ? &index->trigrams[lo]
+             : NULL;
+}
+
+int locate_count_cmp(const void *a, const void *b) {
+  uint32_t x = (*(const LocateTrigram *const *)a)->count;
+  uint32_t y = (*(const LocateTrigram *const *)b)->count;
+  return x < y ? -1 : x > y;
+}
+
+// Blocks that can hold a match for one pattern: the intersection of its
+// trigram lists, rarest first. Returns the count, -1 for "every block".
+long long locate_pattern_blocks(const LocateIndex *index,
+                                const LocatePattern *pattern, uint64_t **out) {
+  uint32_t grams[256];
+  const LocateTrigram *lists[256];
+  int ngrams = locate_pattern_grams(pattern, grams, 256);
+  int nlists = 0;
+  const LocateHeader *h = index->header;
+
+  *out = NULL;
+  for (int i = 0; i < ngrams; i++) {
+    const LocateTrigram *t = locate_find_gram(index, grams[i]);
+    if (t == NULL) {
+      return 0; // a trigram no path has
+    }
+    if (t->count < h->block_count) { // one in every block filters nothing
+      lists[nlists++] = t;
+    }
+  }
+  if (nlists == 0) {
+    return -1;
+  }
+  qsort(lists, nlists, sizeof(lists[0]), locate_count_cmp);
+
+  uint64_t *cand = malloc(lists[0]->count * sizeof(uint64_t));
+  long long ncand = 0;
+  if (cand == NULL) {
+    return -1;
+  }
+  for (int l = 0; l < nlists; l++) {
+    uint64_t pos = h->postings_offset + lists[l]->offset;
+    uint64_t block = 0, delta;
+    long long keep = 0, c = 0;
+    for (uint32_t i = 0; i < lists[l]->count; i++) {
+      if (!locate_varint(index->data, &pos, h->file_size, &delta)) {
+        break;
+      }
+      block = i == 0 ? delta : block + delta;
+      if (l == 0) {
+        cand[ncand++] = block;
+        continue;
+      }
+      while (c < ncand && cand[c] < block) {
+        c++;
+      }
+      if (c < ncand && cand[c] == block) {
+        cand[keep++] = block;
+        c++;
+      }
+    }
+    if (l > 0) {
+      ncand = keep;
+    }
+    if (ncand == 0) {
+      break;
+    }
+  }
+  *out = cand;
+  return ncand;
+}
+
+// Blocks to scan for any of the patterns, in order (-1 for every block)
+long long locate_candidates(const LocateIndex *index, const LocateQuery *q,
+                            uint64_t **out) {
+  uint64_t *merged = NULL;
+  long long total = 0;
+
+  *out = NULL;
+  for (int p = 0; p < q->count; p++) {
+    uint64_t *blocks;
+    long long n = locate_pattern_blocks(index, &q->patterns[p], &blocks);
+    if (n < 0) {
+      free(merged);
+      return -1;
+    }
+    uint64_t *grown = realloc(merged, (total + n + 1) * sizeof(uint64_t));
+    if (grown == NULL) {
+      free(blocks);
+      free(merged);
+      return -1;
+    }
+    merged = grown;
+    // Merge the two sorted lists in place, from the back
+    long long i = total - 1, j = n - 1, k = total + n - 1;
+    while (j >= 0) {
+      merged[k--] = i >= 0 && merged[i] > blocks[j] ? merged[i--] : blocks[j--];
+    }
+    total += n;
+    free(blocks);
+  }
+  long long unique = 0;
+  for (long long i = 0; i < total; i++) {
+    if (unique == 0 || merged[unique - 1] != merged[i]) {
+      merged[unique++] = merged[i];
+    }
+  }
+  *out = merged;
+  return unique;
+}
+
+int locate_match(const LocateQuery *q, const char *path) {
+  char folded[PATH_MAX * 2];
+  int have_folded = 0;
+
+  for (int p = 0; p < q->count; p++) {
+    const LocatePattern *pattern = &q->patterns[p];
+    int match;
+    if (!pattern->glob) {
+      match = q->icase ? strcasestr(path, pattern->text) != NULL
+                       : strstr(path, pattern->text) != NULL;
+    } else if (!q->icase) {
+      match = glob_match(pattern->text, path);
+    } else {
+      if (!have_folded) {
+        size_t i = 0;
+        for (; path[i] != '\0' && i + 1 < sizeof(folded); i++) {
+          folded[i] = tolower((unsigned char)path[i]);
+        }
+        folded[i] = '\0';
+        have_folded = 1;
+      }
+      match = glob_match(pattern->folded, folded);
+    }
+    if (match) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Check every path of one block; returns 0 once the limit is reached
+int locate_scan_block(const LocateIndex *index, LocateCursor *c,
+                      uint64_t block, LocateQuery *q) {
+  char full[PATH_MAX * 2];
+  size_t prefix_len = strcmp(index->root, "/") == 0 ? 0 : strlen(index->root);
+  uint64_t end = (block + 1) * LOCATE_BLOCK;
+
+  memcpy(full, index->root, prefix_len);
+  full[prefix_len] = '/';
+  if (locate_cursor_seek(c, block * LOCATE_BLOCK) < 0) {
+    return 1;
+  }
+  while (1) {
+    memcpy(full + prefix_len + 1, c->path, c->len + 1);
+    if (locate_match(q, full)) {
+      q->matches++;
+      if (!q->count_only) {
+        fputs(full, stdout);
+        putchar('\n');
+      }
+      if (q->limit >= 0 && q->matches >= (unsigned long long)q->limit) {
+        return 0;
+      }
+    }
+    if (c->id >= end || locate_cursor_next(c) != 1) {
+      return 1;
+    }
+  }
+}
+
+// locate [-i] [-c] [-n LIMIT] PATTERN... - search the indexes made by
+// updateindex. A pattern is a substring of the path, or a glob matched
+// against the whole path when it has wildcards; a path is printed when it
+// matches any of them. Like every command's arguments, a wildcard pattern
+// is glob-expanded against the current directory first and only reaches
+// locate unchanged when nothing there matches.
+int cmd_locate(char **args) {
+  const char *usage = "locate [-i] [-c] [-n LIMIT] pattern...";
+  LocateQuery q;
+  int i = 1;
+
+  memset(&q, 0, sizeof(q));
+  q.limit = -1;
+  for (; args[i] != NULL && args[i][0] == '-' && args[i + 1] != NULL; i++) {
+    if (strcmp(args[i], "-i") == 0) {
+      q.icase = 1;
+    } else if (strcmp(args[i], "-c") == 0) {
+      q.count_only = 1;
+    } else if (strcmp(args[i], "-n") == 0 && args[i + 2] != NULL) {
+      long long limit;
+      if (parse_positive(args[++i], &limit) < 0) {
+        printf("%slocate: -n needs a positive number, got '%s'%s\n",
+               COLOR_RED, args[i], COLOR_RESET);
+        return 1;
+      }
+      q.limit = limit;
+    } else {
+      break;
+    }
+  }
+  while (args[i + q.count] != NULL) {
+    q.count++;
+  }
+  if (q.count == 0) {
+    printf("%sUsage: %s%s\n", COLOR_RED, usage, COLOR_RESET);
+    return 1;
+  }
+  q.patterns = calloc(q.count, sizeof(LocatePattern));
+  if (q.patterns == NULL) {
+    return 1;
+  }
+  for (int p = 0; p < q.count; p++) {
+    LocatePattern *pattern = &q.patterns[p];
+    pattern->text = args[i + p];
+    pattern->glob = has_glob_chars(pattern->text);
+    for (size_t j = 0; pattern->text[j] != '\0' && j + 1 < MAX_LINE; j++) {
+      pattern->folded[j] = tolower((unsigned char)pattern->text[j]);
+    }
+  }
+
+  char dir[MAX_LINE];
+  DIR *d = cache_subdir("locate", dir, sizeof(dir), 0) == 0 ? opendir(dir)
+                                                            : NULL;
+  struct dirent *entry;
+  int indexes = 0;
+  while (d != NULL && (entry = readdir(d)) != NULL &&
+         (q.limit < 0 || q.matches < (unsigned long long)q.limit)) {
+    char path[MAX_LINE + 300];
+    LocateIndex index;
+    size_t len = strlen(entry->d_name);
+    if (len < 3 || strcmp(entry->d_name + len - 3, ".db") != 0) {
+      continue;
+    }
+    snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+    if (locate_open(path, &index) < 0) {
+      continue;
+    }
+    indexes++;
+
+    LocateCursor cursor;
+    memset(&cursor, 0, sizeof(cursor));
+    cursor.index = &index;
+    uint64_t *cand;
+    long long ncand = locate_candidates(&index, &q, &cand);
+    long long blocks = ncand < 0 ? (long long)index.header->block_count : ncand;
+    for (long long b = 0; b < blocks; b++) {
+      if (!locate_scan_block(&index, &cursor, ncand < 0 ? (uint64_t)b : cand[b],
+                             &q)) {
+        break;
+      }
+    }
+    free(cand);
+    locate_close(&index);
+  }
+  if (d != NULL) {
+    closedir(d);
+  }
+  free(q.patterns);
+
+  if (indexes == 0) {
+    printf("%sError: No index yet; run updateindex DIR first%s\n", COLOR_RED,
+           COLOR_RESET);
+    return 1;
+  }
+  if (q.count_only) {
+    printf("%llu\n", q.matches);
+  }
+  return q.matches > 0 ? 0 : 1;
+}
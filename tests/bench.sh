@@ -0,0 +1,269 @@
+#!/bin/bash
+# Benchmark Harness for Linux Basic Shell
+# Measures built-in throughput against coreutils, fork/exec latency,
+# pipeline throughput and built-in dispatch cost, and writes JSON results
+# so runs can be compared between commits.
+#
+# Usage: make bench
+#        BENCH_SIZE_MB=64 BENCH_LINE_LEN=200 bash tests/bench.sh
+#
+# Settings (environment):
+#   BENCH_SIZE_MB   size of the synthetic text file       (default 16)
+#   BENCH_LINE_LEN  average line length in bytes          (default 80)
+#   BENCH_REPS      runs per measurement                  (default 5)
+#   BENCH_FILES     directory entries for the ls test     (default 2000)
+#   BENCH_SPAWNS    commands for the fork/exec test       (default 200)
+#   BENCH_STAGES    stages in the pipeline test           (default 8)
+#   BENCH_DISPATCH  commands for the dispatch test        (default 5000)
+#   BENCH_JSON      output file   (default $TMPDIR/myshell-bench-results.json)
+#
+# Scratch data goes to a mktemp -d directory that is removed on exit.
+
+# Color codes
+GREEN='\033[1;32m'
+RED='\033[1;31m'
+YELLOW='\033[1;33m'
+BLUE='\033[1;34m'
+CYAN='\033[1;36m'
+RESET='\033[0m'
+
+SIZE_MB=${BENCH_SIZE_MB:-16}
+LINE_LEN=${BENCH_LINE_LEN:-80}
+REPS=${BENCH_REPS:-5}
+NFILES=${BENCH_FILES:-2000}
+SPAWNS=${BENCH_SPAWNS:-200}
+STAGES=${BENCH_STAGES:-8}
+DISPATCH=${BENCH_DISPATCH:-5000}
+
+SHELL_BIN="$(pwd)/shell"
+BENCH_DIR=$(mktemp -d "${TMPDIR:-/tmp}/myshell-bench.XXXXXX") || exit 1
+trap 'rm -rf "$BENCH_DIR"' EXIT
+JSON=${BENCH_JSON:-${TMPDIR:-/tmp}/myshell-bench-results.json}
+DATA="$BENCH_DIR/data.txt"
+LSDIR="$BENCH_DIR/lsdir"
+RESULTS=()
+
+
+print_section() {
+    echo -e "\n${BLUE}► $1${RESET}"
+    echo -e "${BLUE}$(printf '═%.0s' {1..50})${RESET}"
+}
+
+now_ns() {
+    date +%s%N
+}
+
+# Floating point helper: calc "expr". The result is assigned first: in
+# "printf fmt, (a > b ? ...)" awk takes the ">" as an output redirection.
+calc() {
+    awk "BEGIN { v = ($1); printf \"%.6f\", v }"
+}
+
+# Seconds taken by the shell (or bash) to run SCRIPT
+run_script() {
+    local interp="$1"
+    local script="$2"
+    local start end
+    start=$(now_ns)
+    if [[ "$interp" == "shell" ]]; then
+        "$SHELL_BIN" < "$script" > /dev/null 2>&1
+    else
+        bash "$script" > /dev/null 2>&1
+    fi
+    end=$(now_ns)
+    calc "($end - $start) / 1e9"
+}
+
+# Write a script that runs a command COUNT times then exits
+make_script() {
+    local file="$1"
+    local count="$2"
+    local cmd="$3"
+    : > "$file"
+    for ((i = 0; i < count; i++)); do
+        echo "$cmd" >> "$file"
+    done
+    echo "exit" >> "$file"
+}
+
+# Fastest of three runs of SCRIPT (startup and noise dominate tiny runs)
+best_of_3() {
+    local best="" t
+    for ((r = 0; r < 3; r++)); do
+        t=$(run_script "$1" "$2")
+        if [[ -z "$best" ]] || (( $(awk "BEGIN { print ($t < $best) }") )); then
+            best=$t
+        fi
+    done
+    echo "$best"
+}
+
+# Startup cost of each interpreter (set before any measurement)
+declare -A BASELINE
+
+# Per-run seconds for CMD: COUNT runs in one session, startup subtracted
+measure() {
+    local interp="$1"
+    local cmd="$2"
+    local count="${3:-$REPS}"
+    local script="$BENCH_DIR/bench_$interp.sh"
+    local total
+
+    make_script "$script" "$count" "$cmd"
+    total=$(best_of_3 "$interp" "$script")
+    calc "$total > ${BASELINE[$interp]} ? ($total - ${BASELINE[$interp]}) / $count : 0"
+}
+
+add_result() {
+    RESULTS+=("$1")
+}
+
+# Throughput comparison of a built-in against the coreutils binary
+bench_throughput() {
+    local name="$1"
+    local shell_cmd="$2"
+    local core_cmd="$3"
+    local bytes="$4"
+    local t_shell t_core
+
+    t_shell=$(measure shell "$shell_cmd")
+    t_core=$(measure bash "$core_cmd")
+    local mbps_shell mbps_core
+    mbps_shell=$(calc "$t_shell > 0 ? $bytes / 1048576 / $t_shell : 0")
+    mbps_core=$(calc "$t_core > 0 ? $bytes / 1048576 / $t_core : 0")
+    printf "  %-8s shell %9.4fs %9.1f MB/s   coreutils %9.4fs %9.1f MB/s\n" \
+        "$name" "$t_shell" "$mbps_shell" "$t_core" "$mbps_core"
+    add_result "{\"name\": \"$name\", \"shell_seconds\": $t_shell, \"coreutils_seconds\": $t_core, \"shell_mb_per_s\": $mbps_shell, \"coreutils_mb_per_s\": $mbps_core}"
+}
+
+echo -e "${CYAN}╔════════════════════════════════════════════════════╗${RESET}"
+echo -e "${CYAN}║        Linux Basic Shell - Benchmarks              ║${RESET}"
+echo -e "${CYAN}╚════════════════════════════════════════════════════╝${RESET}"
+
+if [[ ! -x "$SHELL_BIN" ]]; then
+    echo -e "${RED}✗ ./shell not found - run 'make' first${RESET}"
+    exit 1
+fi
+
+# ----------------------------------------------------------------------------
+print_section "Generating data (${SIZE_MB} MB, ~${LINE_LEN}-byte lines)"
+# ----------------------------------------------------------------------------
+awk -v size=$((SIZE_MB * 1048576)) -v len="$LINE_LEN" 'BEGIN {
+    srand(42)
+    split("alpha beta gamma delta epsilon zeta theta kappa lambda sigma", w)
+    total = 0
+    n = 0
+    while (total < size) {
+        line = ""
+        target = int(len / 2 + rand() * len)
+        while (length(line) < target) {
+            line = line w[int(rand() * 10) + 1] " "
+        }
+        if (++n % 100 == 0) {
+            line = line "needle"
+        }
+        print line
+        total += length(line) + 1
+    }
+}' > "$DATA"
+BYTES=$(stat -c %s "$DATA")
+
+rm -rf "$LSDIR"
+mkdir -p "$LSDIR"
+for ((i = 0; i < NFILES; i++)); do
+    : > "$LSDIR/file_$i.txt"
+done
+echo -e "  ${GREEN}✓ $DATA ($BYTES bytes), $NFILES files in $LSDIR${RESET}"
+
+for interp in shell bash; do
+    make_script "$BENCH_DIR/bench_$interp.sh" 0 ""
+    BASELINE[$interp]=$(best_of_3 "$interp" "$BENCH_DIR/bench_$interp.sh")
+done
+
+# ----------------------------------------------------------------------------
+print_section "Built-ins vs coreutils (${REPS} runs each)"
+# ----------------------------------------------------------------------------
+bench_throughput cat "cat $DATA" "/bin/cat $DATA" "$BYTES"
+bench_throughput grep "grep needle $DATA" "grep needle $DATA" "$BYTES"
+bench_throughput wc "wc $DATA" "wc $DATA" "$BYTES"
+bench_throughput head "head $DATA" "head $DATA" "$BYTES"
+bench_throughput tail "tail $DATA" "tail $DATA" "$BYTES"
+bench_throughput reverse "reverse $DATA" "tac $DATA" "$BYTES"
+bench_throughput sort "sort $DATA" "LC_ALL=C sort $DATA" "$BYTES"
+bench_throughput cp "cp $DATA $BENCH_DIR/copy.txt" \
+    "cp $DATA $BENCH_DIR/copy.txt" "$BYTES"
+
+# ls needs to run inside the directory
+ls_script="$BENCH_DIR/bench_ls.sh"
+{ echo "cd $LSDIR"; for ((i = 0; i < REPS; i++)); do echo "ls -l"; done; echo "exit"; } > "$ls_script"
+total=$(best_of_3 shell "$ls_script")
+t_shell=$(calc "($total - ${BASELINE[shell]}) / $REPS")
+t_core=$(measure bash "ls -l $LSDIR")
+printf "  %-8s shell %9.4fs %12.0f files/s coreutils %9.4fs %9.0f files/s\n" \
+    ls "$t_shell" "$(calc "$NFILES / $t_shell")" "$t_core" "$(calc "$NFILES / $t_core")"
+add_result "{\"name\": \"ls\", \"shell_seconds\": $t_shell, \"coreutils_seconds\": $t_core, \"files\": $NFILES}"
+
+# ----------------------------------------------------------------------------
+print_section "Process creation"
+# ----------------------------------------------------------------------------
+t_shell=$(measure shell "/bin/true" "$SPAWNS")
+t_core=$(measure bash "/bin/true" "$SPAWNS")
+printf "  %-8s shell %9.1fus per command   bash %9.1fus per command\n" \
+    fork/exec "$(calc "$t_shell * 1e6")" "$(calc "$t_core * 1e6")"
+add_result "{\"name\": \"fork_exec\", \"shell_seconds\": $t_shell, \"bash_seconds\": $t_core, \"commands\": $SPAWNS}"
+
+pipeline="/bin/cat $DATA"
+for ((i = 1; i < STAGES; i++)); do
+    pipeline="$pipeline | /bin/cat"
+done
+t_shell=$(measure shell "$pipeline")
+t_core=$(measure bash "$pipeline")
+printf "  %-8s shell %9.1f MB/s             bash %9.1f MB/s  (%d stages)\n" \
+    pipeline "$(calc "$BYTES / 1048576 / $t_shell")" \
+    "$(calc "$BYTES / 1048576 / $t_core")" "$STAGES"
+add_result "{\"name\": \"pipeline\", \"stages\": $STAGES, \"shell_seconds\": $t_shell, \"bash_seconds\": $t_core, \"shell_mb_per_s\": $(calc "$BYTES / 1048576 / $t_shell"), \"bash_mb_per_s\": $(calc "$BYTES / 1048576 / $t_core")}"
+
+# ----------------------------------------------------------------------------
+print_section "Built-in dispatch"
+# ----------------------------------------------------------------------------
+# The shell's own stats give the parse + dispatch cost without the run
+dispatch_script="$BENCH_DIR/bench_dispatch.sh"
+{ for ((i = 0; i < DISPATCH; i++)); do echo "pwd"; done; echo "stats -p"; echo "exit"; } > "$dispatch_script"
+start=$(now_ns)
+"$SHELL_BIN" < "$dispatch_script" > "$BENCH_DIR/dispatch_stats.txt" 2>&1
+end=$(now_ns)
+per_cmd=$(calc "($end - $start) / 1e9 / $DISPATCH")
+phase_sum() {
+    awk -v p="$1" -F' ' '$1 == "myshell_phase_seconds_sum{phase=\"" p "\"}" { print $2 }' \
+        "$BENCH_DIR/dispatch_stats.txt"
+}
+parse_s=$(phase_sum parse)
+dispatch_s=$(phase_sum dispatch)
+parse_ns=$(calc "${parse_s:-0} / $DISPATCH * 1e9")
+dispatch_ns=$(calc "${dispatch_s:-0} / $DISPATCH * 1e9")
+printf "  %-8s %9.0fns parse  %9.0fns dispatch  %9.1fus end-to-end\n" \
+    pwd "$parse_ns" "$dispatch_ns" "$(calc "$per_cmd * 1e6")"
+add_result "{\"name\": \"dispatch\", \"commands\": $DISPATCH, \"parse_ns\": $parse_ns, \"dispatch_ns\": $dispatch_ns, \"end_to_end_seconds\": $per_cmd}"
+
+# ----------------------------------------------------------------------------
+# JSON report
+# ----------------------------------------------------------------------------
+commit=$(git rev-parse --short HEAD 2>/dev/null || echo unknown)
+{
+    echo "{"
+    echo "  \"commit\": \"$commit\","
+    echo "  \"date\": \"$(date -u +%Y-%m-%dT%H:%M:%SZ)\","
+    echo "  \"config\": {\"size_mb\": $SIZE_MB, \"line_len\": $LINE_LEN, \"reps\": $REPS, \"files\": $NFILES, \"spawns\": $SPAWNS, \"stages\": $STAGES, \"dispatch\": $DISPATCH},"
+    echo "  \"results\": ["
+    for ((i = 0; i < ${#RESULTS[@]}; i++)); do
+        sep=","
+        if ((i == ${#RESULTS[@]} - 1)); then
+            sep=""
+        fi
+        echo "    ${RESULTS[$i]}$sep"
+    done
+    echo "  ]"
+    echo "}"
+} > "$JSON"
+
+echo -e "\n${GREEN}✓ Results written to $JSON${RESET}"
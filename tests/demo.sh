@@ -240,6 +240,597 @@ else
 fi
 TOTAL_TESTS=$((TOTAL_TESTS + 1))
 
+# Test job control built-ins
+cat > "$TEST_DIR/test_jobcontrol.sh" << 'EOF'
+/bin/sleep 30 &
+kill %1
+/bin/sleep 0.2 | /bin/cat &
+wait
+jobs
+/bin/sleep 30 &
+/usr/bin/env sleep 0.1 &
+wait -n %/usr/bin/env
+echo only=$?
+kill -STOP %
+wait %/bin/sleep
+echo stopped=$?
+wait 12x
+echo garbage=$?
+kill -KILL %/bin/sleep
+EOF
+# A job reaped and reported before `wait PID` still gives its status, once
+printf 'echo $$ > %s/exit7.pid\nexit 7\n' "$TEST_DIR" > "$TEST_DIR/exit7.sh"
+cat >> "$TEST_DIR/test_jobcontrol.sh" << EOF
+/bin/sh $TEST_DIR/exit7.sh &
+/bin/sleep 0.3
+wait \$(cat $TEST_DIR/exit7.pid)
+echo remembered=\$?
+wait \$(cat $TEST_DIR/exit7.pid)
+echo again=\$?
+exit
+EOF
+
+echo "  Testing kill/wait on background jobs..."
+timeout 5 ./shell < "$TEST_DIR/test_jobcontrol.sh" > "$TEST_DIR/jobcontrol_output.txt" 2>&1
+if grep -q "Killed" "$TEST_DIR/jobcontrol_output.txt" && grep -q "No background jobs" "$TEST_DIR/jobcontrol_output.txt" && \
+   grep -q "^only=0$" "$TEST_DIR/jobcontrol_output.txt" && \
+   grep -q "^stopped=148$" "$TEST_DIR/jobcontrol_output.txt" && \
+   grep -q "^garbage=127$" "$TEST_DIR/jobcontrol_output.txt" && \
+   grep -q "^remembered=7$" "$TEST_DIR/jobcontrol_output.txt" && \
+   grep -q "^again=127$" "$TEST_DIR/jobcontrol_output.txt"; then
+    echo -e "  ${GREEN}✓ Job control working${RESET}"
+    PASSED_TESTS=$((PASSED_TESTS + 1))
+else
+    echo -e "  ${RED}✗ Job control failed${RESET}"
+    FAILED_TESTS=$((FAILED_TESTS + 1))
+fi
+TOTAL_TESTS=$((TOTAL_TESTS + 1))
+
+# Test bounded parallel fan-out; arguments are data, and only exact
+# placeholders are replaced
+echo 'unexpanded$(id) $HOME' > "$TEST_DIR/parallel_payload.txt"
+cat > "$TEST_DIR/test_parallel.sh" << EOF
+parallel -j 2 -k -q echo item ::: one two three
+parallel -k -q echo got {} ::: \$(cat $TEST_DIR/parallel_payload.txt)
+parallel -q echo {brace} ::: appended
+exit
+EOF
+
+echo "  Testing parallel built-in..."
+timeout 5 ./shell < "$TEST_DIR/test_parallel.sh" > "$TEST_DIR/parallel_output.txt" 2>&1
+if grep -A2 "item one" "$TEST_DIR/parallel_output.txt" | grep -q "item three" && \
+   grep -qF 'got unexpanded$(id)' "$TEST_DIR/parallel_output.txt" && \
+   grep -qF 'got $HOME' "$TEST_DIR/parallel_output.txt" && \
+   grep -qF '{brace} appended' "$TEST_DIR/parallel_output.txt"; then
+    echo -e "  ${GREEN}✓ Parallel execution working${RESET}"
+    PASSED_TESTS=$((PASSED_TESTS + 1))
+else
+    echo -e "  ${RED}✗ Parallel execution failed${RESET}"
+    FAILED_TESTS=$((FAILED_TESTS + 1))
+fi
+TOTAL_TESTS=$((TOTAL_TESTS + 1))
+
+# Test time prefix resource report
+cat > "$TEST_DIR/test_time.sh" << 'EOF'
+time /bin/sleep 0.1 | /bin/cat
+exit
+EOF
+
+echo "  Testing time prefix..."
+timeout 5 ./shell < "$TEST_DIR/test_time.sh" > "$TEST_DIR/time_output.txt" 2>&1
+if grep -q "real" "$TEST_DIR/time_output.txt" && grep -q "stage 2" "$TEST_DIR/time_output.txt"; then
+    echo -e "  ${GREEN}✓ Time reporting working${RESET}"
+    PASSED_TESTS=$((PASSED_TESTS + 1))
+else
+    echo -e "  ${RED}✗ Time reporting failed${RESET}"
+    FAILED_TESTS=$((FAILED_TESTS + 1))
+fi
+TOTAL_TESTS=$((TOTAL_TESTS + 1))
+
+# Test perfstat counters
+cat > "$TEST_DIR/test_perfstat.sh" << 'EOF'
+perfstat /bin/true
+exit
+EOF
+
+echo "  Testing perfstat..."
+timeout 5 ./shell < "$TEST_DIR/test_perfstat.sh" > "$TEST_DIR/perfstat_output.txt" 2>&1
+if grep -q "Counters: /bin/true" "$TEST_DIR/perfstat_output.txt"; then
+    echo -e "  ${GREEN}✓ Perf counters working${RESET}"
+    PASSED_TESTS=$((PASSED_TESTS + 1))
+else
+    echo -e "  ${RED}✗ Perf counters failed${RESET}"
+    FAILED_TESTS=$((FAILED_TESTS + 1))
+fi
+TOTAL_TESTS=$((TOTAL_TESTS + 1))
+
+# Test run rlimits (no cgroup privileges needed), the --cpu-time kill, and
+# that malformed values are rejected instead of silently becoming 0
+printf 'ulimit -v\nulimit -n\n' > "$TEST_DIR/run_limits.sh"
+printf 'while :; do :; done\n' > "$TEST_DIR/run_spin.sh"
+cat > "$TEST_DIR/test_run.sh" << EOF
+run --mem 64M --nofile 16 /bin/sh $TEST_DIR/run_limits.sh
+run --cpu-time 1 /bin/sh $TEST_DIR/run_spin.sh
+echo cpu=\$?
+run --mem abc /bin/echo unlimited
+echo mem=\$?
+run --nofile 0 /bin/echo unlimited
+run --nice 99 /bin/echo unlimited
+/bin/echo staged | run --cgroup /bin/cat
+exit
+EOF
+
+echo "  Testing run resource limits..."
+timeout 10 ./shell < "$TEST_DIR/test_run.sh" > "$TEST_DIR/run_output.txt" 2>&1
+if grep -qx "65536" "$TEST_DIR/run_output.txt" && grep -qx "16" "$TEST_DIR/run_output.txt" && \
+   grep -q "cpu=152" "$TEST_DIR/run_output.txt" && grep -q "mem=2" "$TEST_DIR/run_output.txt" && \
+   grep -q "invalid size 'abc'" "$TEST_DIR/run_output.txt" && ! grep -q "^unlimited" "$TEST_DIR/run_output.txt" && \
+   grep -q "not in a pipeline stage" "$TEST_DIR/run_output.txt"; then
+    echo -e "  ${GREEN}✓ Run resource limits working${RESET}"
+    PASSED_TESTS=$((PASSED_TESTS + 1))
+else
+    echo -e "  ${RED}✗ Run resource limits failed${RESET}"
+    FAILED_TESTS=$((FAILED_TESTS + 1))
+fi
+TOTAL_TESTS=$((TOTAL_TESTS + 1))
+
+# Test stats counters and Prometheus output
+cat > "$TEST_DIR/test_stats.sh" << 'EOF'
+/bin/true
+/bin/false
+stats -p
+exit
+EOF
+
+echo "  Testing stats..."
+timeout 5 ./shell < "$TEST_DIR/test_stats.sh" > "$TEST_DIR/stats_output.txt" 2>&1
+if grep -q 'myshell_command_seconds_count{command="/bin/true",kind="external"} 1' "$TEST_DIR/stats_output.txt" && \
+   grep -q 'myshell_command_failures_total{command="/bin/false",kind="external"} 1' "$TEST_DIR/stats_output.txt"; then
+    echo -e "  ${GREEN}✓ Statistics working${RESET}"
+    PASSED_TESTS=$((PASSED_TESTS + 1))
+else
+    echo -e "  ${RED}✗ Statistics failed${RESET}"
+    FAILED_TESTS=$((FAILED_TESTS + 1))
+fi
+TOTAL_TESTS=$((TOTAL_TESTS + 1))
+
+# Test glob expansion
+mkdir -p "$TEST_DIR/glob/sub"
+touch "$TEST_DIR/glob/b.log" "$TEST_DIR/glob/a.log" "$TEST_DIR/glob/c.txt" "$TEST_DIR/glob/sub/d.log"
+cat > "$TEST_DIR/test_glob.sh" << EOF
+echo $TEST_DIR/glob/*.log
+echo $TEST_DIR/glob/**/*.log
+exit
+EOF
+
+echo "  Testing glob expansion..."
+timeout 5 ./shell < "$TEST_DIR/test_glob.sh" > "$TEST_DIR/glob_output.txt" 2>&1
+if grep -q "^$TEST_DIR/glob/a.log $TEST_DIR/glob/b.log\$" "$TEST_DIR/glob_output.txt" && \
+   grep -q "^$TEST_DIR/glob/a.log $TEST_DIR/glob/b.log $TEST_DIR/glob/sub/d.log\$" "$TEST_DIR/glob_output.txt"; then
+    echo -e "  ${GREEN}✓ Glob expansion working${RESET}"
+    PASSED_TESTS=$((PASSED_TESTS + 1))
+else
+    echo -e "  ${RED}✗ Glob expansion failed${RESET}"
+    FAILED_TESTS=$((FAILED_TESTS + 1))
+fi
+TOTAL_TESTS=$((TOTAL_TESTS + 1))
+
+# Test variables and export
+cat > "$TEST_DIR/test_vars.sh" << 'EOF'
+GREETING=hello
+echo $GREETING ${MISSING:-fallback}
+export GREETING
+/usr/bin/printenv GREETING
+/bin/false
+echo status=$?
+exit
+EOF
+
+echo "  Testing variables and export..."
+timeout 5 ./shell < "$TEST_DIR/test_vars.sh" > "$TEST_DIR/vars_output.txt" 2>&1
+if grep -q "^hello fallback$" "$TEST_DIR/vars_output.txt" && \
+   grep -q "^hello$" "$TEST_DIR/vars_output.txt" && \
+   grep -q "^status=1$" "$TEST_DIR/vars_output.txt"; then
+    echo -e "  ${GREEN}✓ Variables and export working${RESET}"
+    PASSED_TESTS=$((PASSED_TESTS + 1))
+else
+    echo -e "  ${RED}✗ Variables and export failed${RESET}"
+    FAILED_TESTS=$((FAILED_TESTS + 1))
+fi
+TOTAL_TESTS=$((TOTAL_TESTS + 1))
+
+# Test arithmetic and command substitution
+cat > "$TEST_DIR/test_subst.sh" << 'EOF'
+N=4
+echo sum=$(( (N + 2) * 3 )) half=$((7 / 2.0))
+WORDS=$(echo one two)
+echo got $WORDS $(/bin/echo external)
+echo $(( (-9223372036854775807 - 1) / -1 ))
+echo $(( 9223372036854775807 * 2 ))
+FAILED=$(false)
+echo status=$?
+x=0
+echo short=$(( 0 && 1/0 )),$(( 1 || 1/0 )),$(( x ? 10/x : 5 ))
+exit
+EOF
+
+echo "  Testing arithmetic and command substitution..."
+timeout 5 ./shell < "$TEST_DIR/test_subst.sh" > "$TEST_DIR/subst_output.txt" 2>&1
+if grep -q "^sum=18 half=3.5$" "$TEST_DIR/subst_output.txt" && \
+   grep -q "^got one two external$" "$TEST_DIR/subst_output.txt" && \
+   [ "$(grep -c "integer overflow" "$TEST_DIR/subst_output.txt")" -eq 2 ] && \
+   grep -q "^status=1$" "$TEST_DIR/subst_output.txt" && \
+   grep -q "^short=0,1,5$" "$TEST_DIR/subst_output.txt" && \
+   ! grep -q "division by zero" "$TEST_DIR/subst_output.txt"; then
+    echo -e "  ${GREEN}✓ Arithmetic and command substitution working${RESET}"
+    PASSED_TESTS=$((PASSED_TESTS + 1))
+else
+    echo -e "  ${RED}✗ Arithmetic and command substitution failed${RESET}"
+    FAILED_TESTS=$((FAILED_TESTS + 1))
+fi
+TOTAL_TESTS=$((TOTAL_TESTS + 1))
+
+# Test control flow (a while loop keeps its last body status, bad return
+# values are rejected)
+cat > "$TEST_DIR/test_control.sh" << 'EOF'
+square() {
+  echo $(( $1 * $1 ))
+}
+total=0
+for n in 1 2 3 4; do
+  if [ $n -eq 3 ]; then
+    continue
+  fi
+  total=$((total + $(square $n)))
+done
+echo total=$total
+i=0
+while [ $i -lt 1000 ]; do i=$((i + 1)); done
+[ $i -eq 1000 ] && echo loop-done || echo loop-broken
+j=0
+while [ $j -lt 2 ]; do j=$((j + 1)); false; done
+echo while=$?
+while false; do true; done
+echo none=$?
+bad() { return abc; }
+bad
+echo return=$?
+exit
+EOF
+
+echo "  Testing control flow..."
+timeout 5 ./shell < "$TEST_DIR/test_control.sh" > "$TEST_DIR/control_output.txt" 2>&1
+if grep -q "^total=21$" "$TEST_DIR/control_output.txt" && \
+   grep -q "^loop-done$" "$TEST_DIR/control_output.txt" && \
+   grep -q "^while=1$" "$TEST_DIR/control_output.txt" && \
+   grep -q "^none=0$" "$TEST_DIR/control_output.txt" && \
+   grep -q "^return=2$" "$TEST_DIR/control_output.txt"; then
+    echo -e "  ${GREEN}✓ Control flow working${RESET}"
+    PASSED_TESTS=$((PASSED_TESTS + 1))
+else
+    echo -e "  ${RED}✗ Control flow failed${RESET}"
+    FAILED_TESTS=$((FAILED_TESTS + 1))
+fi
+TOTAL_TESTS=$((TOTAL_TESTS + 1))
+
+# Test watch (and that bad numbers and data in the command are rejected
+# or left alone)
+echo "v1" > "$TEST_DIR/watched.txt"
+echo 'watched$(id)' > "$TEST_DIR/watch_payload.txt"
+cat > "$TEST_DIR/test_watch.sh" << EOF
+watch --on $TEST_DIR/watched.txt -c 2 cat $TEST_DIR/watched.txt
+watch -n abc echo never
+watch -c 1 -n
+echo missing=\$?
+watch -c 1 echo \$(cat $TEST_DIR/watch_payload.txt)
+exit
+EOF
+
+echo "  Testing watch..."
+(sleep 0.5; echo "v2" >> "$TEST_DIR/watched.txt") &
+timeout 5 ./shell < "$TEST_DIR/test_watch.sh" > "$TEST_DIR/watch_output.txt" 2>&1
+wait
+if grep -q "changed: $TEST_DIR/watched.txt" "$TEST_DIR/watch_output.txt" && \
+   grep -q "1 line changed" "$TEST_DIR/watch_output.txt" && \
+   grep -q "invalid value 'abc'" "$TEST_DIR/watch_output.txt" && \
+   grep -q "option requires an argument -- n" "$TEST_DIR/watch_output.txt" && \
+   grep -q "missing=2" "$TEST_DIR/watch_output.txt" && \
+   grep -qxF 'watched$(id)' "$TEST_DIR/watch_output.txt"; then
+    echo -e "  ${GREEN}✓ Watch working${RESET}"
+    PASSED_TESTS=$((PASSED_TESTS + 1))
+else
+    echo -e "  ${RED}✗ Watch failed${RESET}"
+    FAILED_TESTS=$((FAILED_TESTS + 1))
+fi
+TOTAL_TESTS=$((TOTAL_TESTS + 1))
+
+# Test timeout and fractional sleep, and that timeout runs data as data
+echo 'literal $(echo injected) $HOME' > "$TEST_DIR/timeout_payload.txt"
+# A command that stops itself, as Ctrl-Z would, must not escape the deadline
+printf 'kill -STOP $$\nsleep 30\n' > "$TEST_DIR/timeout_stop.sh"
+cat > "$TEST_DIR/test_timeout.sh" << EOF
+timeout 0.3 /bin/sleep 5
+echo "timeout=\$?"
+timeout 0 /bin/sleep 5
+echo "zero=\$?"
+timeout 0.3 /bin/sh $TEST_DIR/timeout_stop.sh
+/bin/sleep 0.6
+jobs
+timeout 5 /bin/true
+echo "finished=\$?"
+timeout 5 echo payload \$(cat $TEST_DIR/timeout_payload.txt)
+sleep 0.1
+exit
+EOF
+
+echo "  Testing timeout..."
+timeout 5 ./shell < "$TEST_DIR/test_timeout.sh" > "$TEST_DIR/timeout_output.txt" 2>&1
+if grep -q "timeout=124" "$TEST_DIR/timeout_output.txt" && \
+   grep -q "finished=0" "$TEST_DIR/timeout_output.txt" && \
+   grep -q "zero=124" "$TEST_DIR/timeout_output.txt" && \
+   grep -q "Killed (Terminated) - /bin/sh" "$TEST_DIR/timeout_output.txt" && \
+   grep -qF 'payload literal $(echo injected) $HOME' "$TEST_DIR/timeout_output.txt" && \
+   grep -q "Sleeping for 0.1 seconds" "$TEST_DIR/timeout_output.txt"; then
+    echo -e "  ${GREEN}✓ Timeout working${RESET}"
+    PASSED_TESTS=$((PASSED_TESTS + 1))
+else
+    echo -e "  ${RED}✗ Timeout failed${RESET}"
+    FAILED_TESTS=$((FAILED_TESTS + 1))
+fi
+TOTAL_TESTS=$((TOTAL_TESTS + 1))
+
+# Test sort (in memory and with a budget small enough to spill runs)
+awk 'BEGIN { srand(7); for (i = 0; i < 20000; i++) printf "k%d,%d\n", int(rand() * 5000), int(rand() * 1000) - 500 }' > "$TEST_DIR/unsorted.txt"
+cat > "$TEST_DIR/test_sort.sh" << EOF
+sort -t , -k 2 -n $TEST_DIR/unsorted.txt > $TEST_DIR/sorted_n.txt
+sort -u -S 64K $TEST_DIR/unsorted.txt > $TEST_DIR/sorted_u.txt
+exit
+EOF
+
+echo "  Testing sort..."
+./shell < "$TEST_DIR/test_sort.sh" > /dev/null 2>&1
+if LC_ALL=C sort -t , -k 2,2n "$TEST_DIR/unsorted.txt" | cmp -s - "$TEST_DIR/sorted_n.txt" && \
+   LC_ALL=C sort -u "$TEST_DIR/unsorted.txt" | cmp -s - "$TEST_DIR/sorted_u.txt"; then
+    echo -e "  ${GREEN}✓ Sort working${RESET}"
+    PASSED_TESTS=$((PASSED_TESTS + 1))
+else
+    echo -e "  ${RED}✗ Sort failed${RESET}"
+    FAILED_TESTS=$((FAILED_TESTS + 1))
+fi
+TOTAL_TESTS=$((TOTAL_TESTS + 1))
+
+# Test count and uniq
+printf "GET /a\nGET /b\nPOST /a\nGET /a\nGET /c\nGET /b\n" > "$TEST_DIR/requests.log"
+cat > "$TEST_DIR/test_count.sh" << EOF
+count -f 2 -n 2 $TEST_DIR/requests.log
+count -j 2 $TEST_DIR/requests.log
+sort $TEST_DIR/requests.log | uniq -c
+exit
+EOF
+
+echo "  Testing count and uniq..."
+./shell < "$TEST_DIR/test_count.sh" > "$TEST_DIR/count_output.txt" 2>&1
+if grep -q "^      3 /a$" "$TEST_DIR/count_output.txt" && \
+   grep -q "^      2 /b$" "$TEST_DIR/count_output.txt" && \
+   ! grep -q "^      1 /c$" "$TEST_DIR/count_output.txt" && \
+   grep -q "^      2 GET /a$" "$TEST_DIR/count_output.txt" && \
+   [ "$(grep -c "GET /a$" "$TEST_DIR/count_output.txt")" -eq 2 ]; then
+    echo -e "  ${GREEN}✓ Count and uniq working${RESET}"
+    PASSED_TESTS=$((PASSED_TESTS + 1))
+else
+    echo -e "  ${RED}✗ Count and uniq failed${RESET}"
+    FAILED_TESTS=$((FAILED_TESTS + 1))
+fi
+TOTAL_TESTS=$((TOTAL_TESTS + 1))
+
+# Test cut (plain delimiters and quoted CSV)
+printf 'id,name,city\n1,"Doe, Jane",Pune\n2,Ravi,"New\nDelhi"\n' > "$TEST_DIR/people.csv"
+printf 'a:b:c\nno delimiter\nd:e:f\n' > "$TEST_DIR/colon.txt"
+cat > "$TEST_DIR/test_cut.sh" << EOF
+cut -d : -f 1,3 $TEST_DIR/colon.txt
+cut --csv -f 2 $TEST_DIR/people.csv
+cat $TEST_DIR/people.csv | cut --csv -f 3
+exit
+EOF
+
+echo "  Testing cut..."
+./shell < "$TEST_DIR/test_cut.sh" > "$TEST_DIR/cut_output.txt" 2>&1
+if grep -q "^a:c$" "$TEST_DIR/cut_output.txt" && \
+   grep -q "^no delimiter$" "$TEST_DIR/cut_output.txt" && \
+   grep -q '^"Doe, Jane"$' "$TEST_DIR/cut_output.txt" && \
+   grep -q '^"New$' "$TEST_DIR/cut_output.txt" && \
+   grep -q '^Delhi"$' "$TEST_DIR/cut_output.txt"; then
+    echo -e "  ${GREEN}✓ Cut working${RESET}"
+    PASSED_TESTS=$((PASSED_TESTS + 1))
+else
+    echo -e "  ${RED}✗ Cut failed${RESET}"
+    FAILED_TESTS=$((FAILED_TESTS + 1))
+fi
+TOTAL_TESTS=$((TOTAL_TESTS + 1))
+
+# Test line index, lines, and head/tail/grep on an indexed file
+seq 1 5000 | sed 's/^/row /' > "$TEST_DIR/rows.txt"
+cat > "$TEST_DIR/test_index.sh" << EOF
+export XDG_CACHE_HOME=$TEST_DIR/cache
+index $TEST_DIR/rows.txt
+lines 4321,4322 $TEST_DIR/rows.txt
+tail -n 1 $TEST_DIR/rows.txt
+grep -n 2500 $TEST_DIR/rows.txt
+exit
+EOF
+
+echo "  Testing line index..."
+./shell < "$TEST_DIR/test_index.sh" > "$TEST_DIR/index_output.txt" 2>&1
+if grep -q "5000 lines" "$TEST_DIR/index_output.txt" && \
+   ls "$TEST_DIR"/cache/myshell/lines/*.idx > /dev/null 2>&1 && \
+   grep -q "^row 4321$" "$TEST_DIR/index_output.txt" && \
+   grep -q "^row 4322$" "$TEST_DIR/index_output.txt" && \
+   ! grep -q "^row 4323$" "$TEST_DIR/index_output.txt" && \
+   grep -q "^row 5000$" "$TEST_DIR/index_output.txt" && \
+   grep -q "2500:.* row 2500$" "$TEST_DIR/index_output.txt"; then
+    echo -e "  ${GREEN}✓ Line index working${RESET}"
+    PASSED_TESTS=$((PASSED_TESTS + 1))
+else
+    echo -e "  ${RED}✗ Line index failed${RESET}"
+    FAILED_TESTS=$((FAILED_TESTS + 1))
+fi
+TOTAL_TESTS=$((TOTAL_TESTS + 1))
+
+# Test transparent gzip decompression
+seq 1 3000 | sed 's/^/entry /' > "$TEST_DIR/rotated.log"
+gzip -c "$TEST_DIR/rotated.log" > "$TEST_DIR/rotated.log.gz"
+# Zero padding after the last member (as tape or block copies leave) is
+# ignored, as gzip -d does
+{ cat "$TEST_DIR/rotated.log.gz"; head -c 512 /dev/zero; } > "$TEST_DIR/padded.log.gz"
+# zstd is recognized by its magic bytes but not decoded
+printf '\050\265\057\375rest' > "$TEST_DIR/rotated.log.zst"
+cat > "$TEST_DIR/test_gzip.sh" << EOF
+grep 2999 $TEST_DIR/rotated.log.gz
+wc $TEST_DIR/rotated.log.gz
+cat $TEST_DIR/rotated.log.gz > $TEST_DIR/gunzipped.log
+cat $TEST_DIR/padded.log.gz > $TEST_DIR/unpadded.log
+echo padded=\$?
+cat $TEST_DIR/rotated.log.zst
+exit
+EOF
+
+echo "  Testing compressed input..."
+./shell < "$TEST_DIR/test_gzip.sh" > "$TEST_DIR/gzip_output.txt" 2>&1
+if grep -q "built without zlib" "$TEST_DIR/gzip_output.txt"; then
+    echo -e "  ${YELLOW}⚠ Built without zlib, skipping compressed input${RESET}"
+    PASSED_TESTS=$((PASSED_TESTS + 1))
+elif grep -q "2999:.* entry 2999" "$TEST_DIR/gzip_output.txt" && \
+     grep -q "3000.* lines" "$TEST_DIR/gzip_output.txt" && \
+     cmp -s "$TEST_DIR/rotated.log" "$TEST_DIR/gunzipped.log" && \
+     cmp -s "$TEST_DIR/rotated.log" "$TEST_DIR/unpadded.log" && \
+     grep -q "padded=0" "$TEST_DIR/gzip_output.txt" && \
+     grep -q "zstd-compressed (not supported)" "$TEST_DIR/gzip_output.txt"; then
+    echo -e "  ${GREEN}✓ Compressed input working${RESET}"
+    PASSED_TESTS=$((PASSED_TESTS + 1))
+else
+    echo -e "  ${RED}✗ Compressed input failed${RESET}"
+    FAILED_TESTS=$((FAILED_TESTS + 1))
+fi
+TOTAL_TESTS=$((TOTAL_TESTS + 1))
+
+# Test checksum against sha256sum, then verify a manifest and a tampered file
+seq 1 5000 > "$TEST_DIR/sum_a.txt"
+printf 'abc' > "$TEST_DIR/sum_b.txt"
+cat > "$TEST_DIR/test_checksum.sh" << EOF
+checksum -a sha256 $TEST_DIR/sum_a.txt $TEST_DIR/sum_b.txt > $TEST_DIR/sums.sha256
+checksum $TEST_DIR/sum_a.txt $TEST_DIR/sum_b.txt > $TEST_DIR/sums.crc
+checksum -c $TEST_DIR/sums.crc
+cp $TEST_DIR/sum_b.txt $TEST_DIR/sum_a.txt
+checksum -c $TEST_DIR/sums.sha256
+exit
+EOF
+
+echo "  Testing checksum..."
+sha256sum "$TEST_DIR/sum_a.txt" "$TEST_DIR/sum_b.txt" > "$TEST_DIR/expected.sha256"
+./shell < "$TEST_DIR/test_checksum.sh" > "$TEST_DIR/checksum_output.txt" 2>&1
+if cmp -s "$TEST_DIR/sums.sha256" "$TEST_DIR/expected.sha256" && \
+   [ "$(grep -c 'sum_[ab].txt: .*OK' "$TEST_DIR/checksum_output.txt")" -eq 3 ] && \
+   grep -q "sum_a.txt: FAILED" "$TEST_DIR/checksum_output.txt"; then
+    echo -e "  ${GREEN}✓ Checksum working${RESET}"
+    PASSED_TESTS=$((PASSED_TESTS + 1))
+else
+    echo -e "  ${RED}✗ Checksum failed${RESET}"
+    FAILED_TESTS=$((FAILED_TESTS + 1))
+fi
+TOTAL_TESTS=$((TOTAL_TESTS + 1))
+
+# Test tee from a pipe (tee/splice path) and from a redirected file
+seq 1 200000 > "$TEST_DIR/tee_in.txt"
+cat > "$TEST_DIR/test_tee.sh" << EOF
+cat $TEST_DIR/tee_in.txt | tee $TEST_DIR/tee_a.txt $TEST_DIR/tee_b.txt | wc
+tee -a $TEST_DIR/tee_a.txt < $TEST_DIR/tee_in.txt > $TEST_DIR/tee_c.txt
+exit
+EOF
+
+echo "  Testing tee..."
+./shell < "$TEST_DIR/test_tee.sh" > "$TEST_DIR/tee_output.txt" 2>&1
+if grep -q "200000.* lines" "$TEST_DIR/tee_output.txt" && \
+   cmp -s "$TEST_DIR/tee_in.txt" "$TEST_DIR/tee_b.txt" && \
+   cmp -s "$TEST_DIR/tee_in.txt" "$TEST_DIR/tee_c.txt" && \
+   cat "$TEST_DIR/tee_in.txt" "$TEST_DIR/tee_in.txt" | cmp -s - "$TEST_DIR/tee_a.txt"; then
+    echo -e "  ${GREEN}✓ Tee working${RESET}"
+    PASSED_TESTS=$((PASSED_TESTS + 1))
+else
+    echo -e "  ${RED}✗ Tee failed${RESET}"
+    FAILED_TESTS=$((FAILED_TESTS + 1))
+fi
+TOTAL_TESTS=$((TOTAL_TESTS + 1))
+
+# Test du against the system du, and that the directory cache sees changes
+mkdir -p "$TEST_DIR/du_tree/sub/deeper"
+seq 1 20000 > "$TEST_DIR/du_tree/sub/numbers.txt"
+seq 1 10 > "$TEST_DIR/du_tree/small.txt"
+rm -f "$TEST_DIR/du_tree/cache_probe.txt"
+cat > "$TEST_DIR/test_dircache.sh" << EOF
+du $TEST_DIR/du_tree
+dircache on
+cd $TEST_DIR/du_tree
+ls
+touch cache_probe.txt
+ls
+dircache status
+exit
+EOF
+
+echo "  Testing du and directory cache..."
+./shell < "$TEST_DIR/test_dircache.sh" > "$TEST_DIR/dircache_output.txt" 2>&1
+du "$TEST_DIR/du_tree" | sort > "$TEST_DIR/du_expected.txt"
+grep -a "du_tree" "$TEST_DIR/dircache_output.txt" | grep -v "^du " | sort > "$TEST_DIR/du_actual.txt"
+if cmp -s "$TEST_DIR/du_expected.txt" "$TEST_DIR/du_actual.txt" && \
+   grep -q "cache_probe.txt" "$TEST_DIR/dircache_output.txt" && \
+   grep -q "Directory cache: .*on" "$TEST_DIR/dircache_output.txt"; then
+    echo -e "  ${GREEN}✓ Du and directory cache working${RESET}"
+    PASSED_TESTS=$((PASSED_TESTS + 1))
+else
+    echo -e "  ${RED}✗ Du and directory cache failed${RESET}"
+    FAILED_TESTS=$((FAILED_TESTS + 1))
+fi
+TOTAL_TESTS=$((TOTAL_TESTS + 1))
+
+# Test locate against find, including an incremental updateindex. A glob
+# matching nothing here reaches locate as a pattern; *.c is expanded to
+# shell.c by the shell first, as the help text says.
+LOC_TREE="$(pwd)/$TEST_DIR/loc_tree"
+rm -rf "$LOC_TREE" "$TEST_DIR/loc_cache"
+mkdir -p "$LOC_TREE/src/lib" "$LOC_TREE/docs"
+for i in $(seq 1 300); do touch "$LOC_TREE/src/lib/mod_$i.c"; done
+touch "$LOC_TREE/docs/README" "$LOC_TREE/src/main.c"
+cat > "$TEST_DIR/test_locate.sh" << EOF
+updateindex $LOC_TREE
+touch $LOC_TREE/docs/added_later.txt
+updateindex $LOC_TREE
+locate loc_tree/
+locate -c -i readme
+locate -n 0 mod_
+locate -c -n 2 mod_
+locate -c *mod_1?.c
+locate -c *.c
+exit
+EOF
+
+echo "  Testing updateindex and locate..."
+XDG_CACHE_HOME="$TEST_DIR/loc_cache" ./shell < "$TEST_DIR/test_locate.sh" > "$TEST_DIR/locate_output.txt" 2>&1
+find "$LOC_TREE" -mindepth 1 | sort > "$TEST_DIR/locate_expected.txt"
+grep -a "^$LOC_TREE/" "$TEST_DIR/locate_output.txt" | sort > "$TEST_DIR/locate_actual.txt"
+if cmp -s "$TEST_DIR/locate_expected.txt" "$TEST_DIR/locate_actual.txt" && \
+   grep -q "added_later.txt" "$TEST_DIR/locate_actual.txt" && \
+   grep -q "(3 unchanged)" "$TEST_DIR/locate_output.txt" && \
+   grep -qx "1" "$TEST_DIR/locate_output.txt" && grep -qx "2" "$TEST_DIR/locate_output.txt" && \
+   grep -q "needs a positive number, got '0'" "$TEST_DIR/locate_output.txt" && \
+   grep -qx "10" "$TEST_DIR/locate_output.txt" && grep -qx "0" "$TEST_DIR/locate_output.txt"; then
+    echo -e "  ${GREEN}✓ Updateindex and locate working${RESET}"
+    PASSED_TESTS=$((PASSED_TESTS + 1))
+else
+    echo -e "  ${RED}✗ Updateindex and locate failed${RESET}"
+    FAILED_TESTS=$((FAILED_TESTS + 1))
+fi
+TOTAL_TESTS=$((TOTAL_TESTS + 1))
+
 print_section "6. Error Handling (Component 9)"
 
 # Test invalid command